@@ -14,6 +14,53 @@
 //      Then check a second detached signature to verify
 //      that the first key was signed by the Offline Master 
 //      Key that has the known sha384 supplied by the user.
+//   2) With --replay-cache=<file>, reject a nonce that has already
+//      been accepted within --replay-ttl=<seconds> (default one day).
+//      The cache has a fixed size and is shared by every process
+//      that names the same file (see nm_replay.c).
+//   3) With --keyring=<file>, the PUBLIC.KEY and OfflinePubKey
+//      arguments may be id:<ID>, fp:<hex> or ip:<addr>, and the keys
+//      come from a keyring built by nm_keyring --build (newest key
+//      that has not expired) instead of from key files.
+//   4) With --revoked=<file>, the online and offline keys are looked
+//      up in a revocation list (nm_revoke --build) before any
+//      public-key work, and the list must be signed by the offline key
+//      (by the threshold of its keys for a key set, see point 5).
+//   5) OfflinePubKey may be an offline key set (nm_multisig
+//      --make-set), and KeySig then a multi-signature (nm_multisig
+//      --combine) that k of its n keys must have signed.  The
+//      signatures are checked in parallel (see nm_multisig.c).
+//   6) KeySig may be a key chain (nm_chain --link) from the offline
+//      key through intermediate keys down to the online key.  Every
+//      key in it is checked for expiry and revocation before its
+//      signature (see nm_chain.c).  The chain must fit in
+//      MAX_KEY_BUFF.
+//   7) With --servers=<file>, check several servers in one run: the
+//      file has one line per server with its InputDataFname, SIG,
+//      PUBLIC.KEY and KeySig, and only OfflinePubKey and Fingerprint
+//      are given on the command line.  The offline key (and the
+//      revocation list) are read and checked once, the servers are
+//      checked at the same time on --server-threads=<n> threads (one
+//      per CPU by default), and there is one verdict per server.
+//   8) With --parallel-verify, every file is read first, and then the
+//      signature on the nonce and the signature on the online key are
+//      checked at the same time on two cores; the run fails as soon
+//      as either check fails (see nm_pverify.c).
+//   9) Before any public-key operation, the checks that cost only a
+//      parse or a hash run first (see nm_precheck.c): the shape and
+//      size of the signatures, the expiry of the online and offline
+//      keys, the SHA-384 of the offline key against Fingerprint, and
+//      the revocation list.  A request that fails one is rejected
+//      with the code of that stage, which nm_stat counts.
+//  10) OfflinePubKey may be anchor:<name>, a key built into the
+//      program with make ANCHOR_KEYS=... (see nm_anchor.c).  Its
+//      fingerprint was computed at build time, so there is no file
+//      to read and nothing to hash; Fingerprint is compared with it
+//      in constant time, or may be - to trust the built-in key.
+//  11) In the --servers mode libgcrypt's memory for each check comes
+//      from a per-thread arena that is emptied when the check is done,
+//      with secret objects in a separate locked region that is wiped
+//      (see nm_arena.c; NM_ARENA=off turns it off).
 //
 //     READ THIS FILE ABOUT S-EXPRESSIONS (DONT' CUT CORNERS): 
 //        http://people.csail.mit.edu/rivest/Sexp.txt
@@ -57,8 +104,8 @@
 // [root@99lenovohd libg]# cd /usr/lib64
 // [root@99lenovohd lib64]# ln -s /usr/local/lib/libgcrypt.so.20 ./libgcrypt.so.20
 //
-// Compile to an executable:
-//   gcc -Wall -g -D_FILE_OFFSET_BITS=64 `libgcrypt-config --cflags -o NMVerifyServer --libs` NMVerifyServer.c
+// Compile to an executable (it needs nm_timing.o for --timings):
+//   make NMVerifyServer
 //
 // Compile to an object file:
 //    gcc -o libgVerifyNM01.o libgVerifyNM01.c `libgcrypt-config --cflags --libs`
@@ -73,10 +120,28 @@
 #include <time.h>
 #include <ctype.h>
 
+#include "nm_timing.h"
+#include "nm_stats.h"
+#include "nm_probes.h"
+#include "nm_replay.h"
+#include "nm_keyring.h"
+#include "nm_revoke.h"
+#include "nm_multisig.h"
+#include "nm_chain.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "nm_pverify.h"
+#include "nm_precheck.h"
+#include "nm_anchor.h"
+#include "nm_arena.h"
+
 #define MAX_ENTRY_LEN 500
 #define MAX_KEY_BUFF 10000
 #define MAX_CMDLINE_BUFF 500
 #define debug_lvl 4
+#define MAX_SERVERS 64
 
 char save_name[MAX_ENTRY_LEN];
 char output_fname[MAX_ENTRY_LEN];
@@ -126,9 +191,10 @@ int read_sexp_file(FILE *fp, gcry_sexp_t *sexp_r, char *txt, int ascii_only){
 	int ch;
 	//int txt_len;
 
+	NM_PROBE1(read_sexp_file__entry, ascii_only);
 	idx = 0;
 	if(ascii_only){
-		while ((ch=fgetc(fp)) != EOF){  /* read/print characters including newline */
+		while ((ch=fgetc(fp)) != EOF && idx < MAX_KEY_BUFF - 1){  /* read/print characters including newline */
 			if(ch < 0){
 				if (debug_lvl > 0)
 					printf("Ignoring non-ASCII character: %c", ch);
@@ -137,10 +203,15 @@ int read_sexp_file(FILE *fp, gcry_sexp_t *sexp_r, char *txt, int ascii_only){
 			}
 		}
 	}else{
-		while ((ch=fgetc(fp)) != EOF){  /* read/print characters including newline */
+		while ((ch=fgetc(fp)) != EOF && idx < MAX_KEY_BUFF - 1){  /* read/print characters including newline */
 			*(txt + idx++) = ch;
  		}
 	}
+	if (idx == MAX_KEY_BUFF - 1 && fgetc(fp) != EOF){
+		fprintf(stderr, "Error. The input file is larger than %d bytes.\n", MAX_KEY_BUFF - 1);
+		NM_PROBE2(read_sexp_file__return, idx, 932);
+		return 932;
+	}
 	
 	//if !(feof(fp)) 
 	if (ferror(fp))
@@ -150,6 +221,9 @@ int read_sexp_file(FILE *fp, gcry_sexp_t *sexp_r, char *txt, int ascii_only){
 		exit(EXIT_FAILURE);
 	}
 	//fclose(fp);
+	// gcry_sexp_new() below, and the fingerprint of a key, take the
+	// length from the terminator.
+	*(txt + idx) = 0x00;
 	if(debug_lvl > 3){
 		printf("In read_sexp_file I read %d chars.\n", idx);
 		printf("In read_sexp_file I read this: %s\n", txt);
@@ -161,6 +235,7 @@ int read_sexp_file(FILE *fp, gcry_sexp_t *sexp_r, char *txt, int ascii_only){
 		fprintf (stderr, "Error. In read_sexp_file, could not create the new s-exp : %s/%s\n",
 			gcry_strsource (err),
 			gcry_strerror (err));
+		NM_PROBE2(read_sexp_file__return, idx, 999);
 		return 999;
 	}else{
 		if(debug_lvl > 5){
@@ -173,8 +248,605 @@ int read_sexp_file(FILE *fp, gcry_sexp_t *sexp_r, char *txt, int ascii_only){
 		gcry_sexp_dump(*(sexp_r));
 	}	
 
+	NM_PROBE2(read_sexp_file__return, idx, 0);
+	return 0;
+}
+
+int read_key_sexp(struct nm_keyring_t *kr, const char *name, gcry_sexp_t *sexp_r,
+  char *txt){
+	// Read a NaturalMessage key like read_sexp_file().  With a
+	// keyring, name may be id:<ID>, fp:<hex> or ip:<addr> (the newest
+	// unexpired signing key), and the key file text is taken from the
+	// keyring instead of a file.
+	const struct nm_keyring_rec_t *rec;
+	const char *key_txt;
+	FILE *fp;
+	int rc;
+
+	if(kr && (!strncmp(name, "id:", 3) || !strncmp(name, "fp:", 3)
+	  || !strncmp(name, "ip:", 3))){
+		rc = nm_keyring_lookup(kr, name, 's', &rec);
+		if(rc){
+			fprintf (stderr, "Error. Could not find the key %s in the keyring.\n", name);
+			return rc;
+		}
+		key_txt = nm_keyring_text(kr, rec);
+		if(strlen(key_txt) >= MAX_KEY_BUFF){
+			fprintf (stderr, "Error. The key %s is too big.\n", name);
+			return 999;
+		}
+		strcpy(txt, key_txt);
+		return gcry_sexp_new(sexp_r, txt, 0, 1) ? 999 : 0;
+	}
+	fp = fopen(name, "r");
+	if(!fp){
+		perror("Error. Failed to open a key file");
+		return 438;
+	}
+	rc = read_sexp_file(fp, sexp_r, txt, 0);
+	fclose(fp);
+	return rc;
+}
+
+static int read_offline_key(struct nm_keyring_t *kr, const char *name,
+  gcry_sexp_t *sexp_r, char *txt, const struct nm_anchor_t **anchor_r){
+	// The offline key: a built-in anchor for anchor:<name> (txt is
+	// left empty), otherwise as read_key_sexp().  Returns 0, 984 (no
+	// such anchor), 989 or a code from read_key_sexp().
+	*anchor_r = NULL;
+	if(strncmp(name, "anchor:", 7))
+		return read_key_sexp(kr, name, sexp_r, txt);
+	*anchor_r = nm_anchor_find(name + 7);
+	if(!*anchor_r){
+		fprintf (stderr, "Error. No offline key %s is built into this program.\n", name);
+		return 984;
+	}
+	txt[0] = 0x00;
+	return nm_anchor_key(*anchor_r, sexp_r);
+}
+
+static int pin_offline_key(const struct nm_anchor_t *anchor, const char *txt,
+  const char *fp_hex, unsigned char *fp){
+	// The pin stage for the offline key, leaving its fingerprint in
+	// fp.  An anchor's was computed when it was built, and with
+	// Fingerprint - the anchor itself is the pin.  Returns
+	// NM_PRECHECK_OK or NM_PRECHECK_PIN.
+	if(anchor){
+		memcpy(fp, anchor->fp, NM_ANCHOR_FP_LEN);
+		if(!strcmp(fp_hex, "-"))
+			return NM_PRECHECK_OK;
+	}else{
+		gcry_md_hash_buffer(GCRY_MD_SHA384, fp, txt, strlen(txt));
+	}
+	return nm_precheck_pin_fp(fp, fp_hex);
+}
+
+static int verify_revoked(const struct nm_revoke_t *rl, const struct nm_keyset_t *set,
+  gcry_sexp_t sexp_offline_pub_key){
+	// The list is signed like an online key: by the offline key, or
+	// with a multi-signature from the threshold of an offline key set
+	// (nm_revoke --cosign), so that one lost key of a set can neither
+	// empty the list nor revoke every key.  Returns 0 or 983.
+	gcry_sexp_t sexp_data, sexp_sig;
+	int rc;
+
+	if(!set->n)
+		return nm_revoke_verify(rl, sexp_offline_pub_key);
+	rc = nm_revoke_signed_data(rl, &sexp_data, &sexp_sig);
+	if(rc)
+		return rc;
+	rc = (!sexp_sig || nm_multisig_verify(set, sexp_sig, sexp_data, 0, NULL)) ? 983 : 0;
+	gcry_sexp_release(sexp_data);
+	gcry_sexp_release(sexp_sig);
+	return rc;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+//  The two signature checks of a request, Part IV and Part VII, with
+//  their inputs in a struct so that --parallel-verify can run them at
+//  the same time.
+struct nonce_check_t
+{
+	gcry_sexp_t sexp_signature;
+	gcry_sexp_t sexp_input_data;
+	gcry_sexp_t sexp_pub_key;
+	size_t data_len;
+	gcry_error_t err;
+};
+
+struct keysig_check_t
+{
+	gcry_sexp_t sexp_keysig;
+	gcry_sexp_t sexp_online_key_data;
+	gcry_sexp_t sexp_offline_pub_key;     // NULL with a key set
+	gcry_sexp_t sexp_nm_offline_key;
+	const struct nm_keyset_t *offline_set;
+	const char *nm_key_txt;
+	const struct nm_revoke_t *revoked;    // may be NULL
+	struct nm_chain_cache_t *chain_cache; // may be NULL
+	int msig_threads;                     // see nm_multisig_verify()
+	// Results
+	int is_chain;
+	gcry_error_t err;
+	struct nm_multisig_result_t msig_res;
+};
+
+static int check_nonce(void *arg){
+	// Part IV: the online key's signature of the nonce.  Returns 0
+	// or 903.
+	struct nonce_check_t *c = arg;
+	unsigned long long t0;
+
+	NM_PROBE2(verify__entry, NM_PROBE_SITE_SERVER_NONCE, c->data_len);
+	t0 = nm_stats_now_us();
+	c->err = gcry_pk_verify(c->sexp_signature, c->sexp_input_data, c->sexp_pub_key);
+	NM_PROBE3(verify__return, NM_PROBE_SITE_SERVER_NONCE, c->data_len, c->err);
+	nm_stats_latency(NM_HIST_VERIFY, nm_stats_now_us() - t0);
+	nm_stats_add(c->err ? NM_STAT_VERIFY_FAILS : NM_STAT_VERIFY_OK, 1);
+	return c->err ? 903 : 0;
+}
+
+static int check_keysig(void *arg){
+	// Part VII: the offline key's signature of the online key, which
+	// may also be a k-of-n multi-signature or a key chain.  Returns
+	// 0, 903, 987 or a code from nm_chain_verify().
+	struct keysig_check_t *c = arg;
+	unsigned long long t0;
+	int rc;
+
+	c->err = 0;
+	c->is_chain = nm_chain_is_chain(c->sexp_keysig);
+	t0 = nm_stats_now_us();
+	if(c->is_chain){
+		//  offline key -> intermediate keys -> online key.  Expiry
+		//  and revocation of every key are checked before any
+		//  signature.
+		if(c->offline_set->n)
+			return 990;
+		rc = nm_chain_verify(c->chain_cache, c->sexp_offline_pub_key,
+			nm_chain_key_expire(c->sexp_nm_offline_key), c->sexp_keysig, c->nm_key_txt,
+			strlen(c->nm_key_txt), nm_keyring_today(), c->revoked, NULL);
+	}else if(c->offline_set->n){
+		//  k of n: the verifications run at once and stop as soon
+		//  as the outcome is known.
+		rc = nm_multisig_verify(c->offline_set, c->sexp_keysig, c->sexp_online_key_data,
+			c->msig_threads, &c->msig_res);
+	}else{
+		NM_PROBE2(verify__entry, NM_PROBE_SITE_SERVER_KEYSIG, strlen(c->nm_key_txt));
+		c->err = gcry_pk_verify(c->sexp_keysig, c->sexp_online_key_data,
+			c->sexp_offline_pub_key);
+		NM_PROBE3(verify__return, NM_PROBE_SITE_SERVER_KEYSIG, strlen(c->nm_key_txt),
+			c->err);
+		rc = c->err ? 903 : 0;
+	}
+	nm_stats_latency(NM_HIST_VERIFY, nm_stats_now_us() - t0);
+	nm_stats_add(rc ? NM_STAT_VERIFY_FAILS : NM_STAT_VERIFY_OK, 1);
+	return rc;
+}
+
+static void report_keysig_failure(const struct keysig_check_t *c, int rc){
+	if(c->is_chain && c->offline_set->n)
+		fprintf (stderr, "Error. A key chain must start at one offline key, not a key set.\n");
+	else if(c->is_chain)
+		fprintf (stderr, "Error. The key chain does not lead from the offline key to the online key (code %d).\n",
+			rc);
+	else if(c->offline_set->n)
+		fprintf (stderr, "Error. %d valid signatures on the online key by the offline keys, %d are needed.\n",
+			c->msig_res.nvalid, c->offline_set->threshold);
+	else
+		fprintf (stderr, "Error. Verification failed: %s/%s\n",
+			gcry_strsource (c->err),
+			gcry_strerror (c->err));
+}
+
+int flag_arg(int *argc, char **argv, const char *flag){
+	// Take a flag with no value out of argv (updating *argc).
+	// Returns 1 if it was given.
+	int j, k, found = 0;
+
+	for(j = 1; j < *argc; ){
+		if(strcmp(argv[j], flag)){
+			j++;
+			continue;
+		}
+		found = 1;
+		for(k = j; k < *argc - 1; k++)
+			argv[k] = argv[k + 1];
+		argv[--(*argc)] = NULL;
+	}
+	return found;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+//  --servers=<file>: several servers checked against one offline key.
+struct server_check_t
+{
+	char fname[4][MAX_CMDLINE_BUFF];   // nonce, SIG, PUBLIC.KEY, KeySig
+	int rc;
+	unsigned long long usec;
+};
+
+struct server_list_t
+{
+	struct server_check_t srv[MAX_SERVERS];
+	int n;
+	int next;                        // taken with an atomic add
+	// Read and checked once, then only read by the workers.
+	gcry_sexp_t sexp_nm_offline_key;
+	gcry_sexp_t sexp_offline_pub_key;    // NULL with a key set
+	struct nm_keyset_t offline_set;
+	struct nm_keyring_t *keyring;
+	struct nm_revoke_t *revoked;
+	struct nm_replay_t *replay;
+	struct nm_chain_cache_t *chain_cache;
+};
+
+int servers_args(int *argc, char **argv, const char **fname_r, int *nthreads_r){
+	// Take --servers=<file> and --server-threads=<n> out of argv
+	// (updating *argc).  Returns 1 if --servers was given.
+	int j, k;
+
+	*fname_r = NULL;
+	*nthreads_r = 0;
+	for(j = 1; j < *argc; ){
+		if(!strncmp(argv[j], "--servers=", 10)){
+			*fname_r = argv[j] + 10;
+		}else if(!strncmp(argv[j], "--server-threads=", 17)){
+			*nthreads_r = atoi(argv[j] + 17);
+		}else{
+			j++;
+			continue;
+		}
+		for(k = j; k < *argc - 1; k++)
+			argv[k] = argv[k + 1];
+		argv[--(*argc)] = NULL;
+	}
+	return *fname_r != NULL;
+}
+
+static int read_server_list(const char *fname, struct server_list_t *list){
+	// One server per line: four names separated by blanks.  Blank
+	// lines and lines that start with # are skipped.  Returns 0, 438
+	// or 994 (a line without four names, or more than MAX_SERVERS).
+	char line[4 * MAX_CMDLINE_BUFF + 16];
+	struct server_check_t *srv;
+	FILE *fp;
+	int lineno = 0;
+
+	fp = fopen(fname, "r");
+	if(!fp){
+		perror("Error. Failed to open the server list");
+		return 438;
+	}
+	while(get_line(line, sizeof(line), fp)){
+		lineno++;
+		if(line[strspn(line, " \t\r")] == 0x00 || line[strspn(line, " \t")] == '#')
+			continue;
+		if(list->n == MAX_SERVERS){
+			fprintf(stderr, "Error. More than %d servers in %s.\n", MAX_SERVERS, fname);
+			fclose(fp);
+			return 994;
+		}
+		srv = &list->srv[list->n];
+		if(sscanf(line, "%499s %499s %499s %499s", srv->fname[0], srv->fname[1],
+		  srv->fname[2], srv->fname[3]) != 4){
+			fprintf(stderr, "Error. %s line %d does not name a nonce, its signature, "
+				"the online key and its signature.\n", fname, lineno);
+			fclose(fp);
+			return 994;
+		}
+		srv->rc = 843;    // until a worker has checked it
+		list->n++;
+	}
+	fclose(fp);
+	if(list->n == 0){
+		fprintf(stderr, "Error. No servers in %s.\n", fname);
+		return 994;
+	}
 	return 0;
 }
+
+static int read_text(const char *fname, char *txt){
+	// A file of up to MAX_KEY_BUFF - 1 bytes, null-terminated, like
+	// read_sexp_file() but without the debug output.  Returns 0, 438
+	// or 932.
+	FILE *fp;
+	size_t len;
+
+	fp = fopen(fname, "r");
+	if(!fp)
+		return 438;
+	len = fread(txt, 1, MAX_KEY_BUFF - 1, fp);
+	txt[len] = 0x00;
+	if(ferror(fp) || fgetc(fp) != EOF){
+		fclose(fp);
+		return 932;
+	}
+	fclose(fp);
+	return 0;
+}
+
+static int load_key(struct server_list_t *list, const char *name, char *txt,
+  gcry_sexp_t *sexp_r){
+	// A key by file name, or from the keyring (see read_key_sexp).
+	int rc;
+
+	if(list->keyring && (!strncmp(name, "id:", 3) || !strncmp(name, "fp:", 3)
+	  || !strncmp(name, "ip:", 3)))
+		return read_key_sexp(list->keyring, name, sexp_r, txt);
+	rc = read_text(name, txt);
+	if(!rc && gcry_sexp_new(sexp_r, txt, 0, 1))
+		rc = 999;
+	return rc;
+}
+
+static int check_server(struct server_list_t *list, struct server_check_t *srv,
+  char *buf){
+	// Parts I to VII of the single-server check for one server of
+	// the list.  buf has room for four files of MAX_KEY_BUFF.
+	// Returns 0 or the exit code the single-server check would give.
+	char *nonce_txt = buf;
+	char *sig_txt = buf + MAX_KEY_BUFF;
+	char *key_txt = buf + 2 * MAX_KEY_BUFF;
+	char *keysig_txt = buf + 3 * MAX_KEY_BUFF;
+	gcry_sexp_t sexp_data = NULL, sexp_sig = NULL, sexp_nm_key = NULL;
+	gcry_sexp_t sexp_pub = NULL, sexp_keysig = NULL, sexp_key_data = NULL;
+	unsigned char key_fp[NM_REVOKE_FP_LEN];
+	unsigned char keygrip[20];
+	unsigned char nonce_digest[NM_REPLAY_DIGEST_LEN];
+	struct nonce_check_t nonce_chk;
+	struct keysig_check_t keysig_chk;
+	int rc, stage;
+
+	rc = read_text(srv->fname[0], nonce_txt);
+	if(!rc && gcry_sexp_build(&sexp_data, NULL, "(data (flags raw) (hash sha384 %s))",
+	  nonce_txt))
+		rc = 902;
+	if(!rc)
+		rc = read_text(srv->fname[1], sig_txt);
+	if(!rc && gcry_sexp_new(&sexp_sig, sig_txt, 0, 1))
+		rc = 543;
+	if(!rc)
+		rc = load_key(list, srv->fname[2], key_txt, &sexp_nm_key);
+	if(!rc && !(sexp_pub = gcry_sexp_find_token(sexp_nm_key, "public-key", 0)))
+		rc = 901;
+	if(!rc)
+		rc = read_text(srv->fname[3], keysig_txt);
+	if(!rc && gcry_sexp_new(&sexp_keysig, keysig_txt, 0, 1))
+		rc = 999;
+	// The cheap checks (the offline key was pinned and checked for
+	// expiry once, in verify_server_list()).
+	if(!rc){
+		stage = nonce_txt[0] ? nm_precheck_sig(sexp_sig, sexp_pub) : NM_PRECHECK_STRUCTURE;
+		if(!stage && !list->offline_set.n && !nm_chain_is_chain(sexp_keysig))
+			stage = nm_precheck_sig(sexp_keysig, list->sexp_offline_pub_key);
+		if(!stage)
+			stage = nm_precheck_expiry(sexp_nm_key, nm_keyring_today());
+		if(!stage && list->revoked){
+			gcry_md_hash_buffer(GCRY_MD_SHA384, key_fp, key_txt, strlen(key_txt));
+			if(nm_revoke_check(list->revoked, key_fp))
+				stage = NM_PRECHECK_REVOKED;
+		}
+		rc = nm_precheck_reject(stage);
+	}
+	if(!rc && list->replay){
+		if(!gcry_pk_get_keygrip(sexp_pub, keygrip))
+			rc = 901;
+		else{
+			nm_replay_digest(keygrip, nonce_txt, strlen(nonce_txt), nonce_digest);
+			if(nm_replay_seen(list->replay, nonce_digest)){
+				nm_stats_add(NM_STAT_REPLAYS, 1);
+				rc = 962;
+			}
+		}
+	}
+	// Part IV
+	if(!rc){
+		nonce_chk.sexp_signature = sexp_sig;
+		nonce_chk.sexp_input_data = sexp_data;
+		nonce_chk.sexp_pub_key = sexp_pub;
+		nonce_chk.data_len = strlen(nonce_txt);
+		rc = check_nonce(&nonce_chk);
+	}
+	// Parts VI-B and VII
+	if(!rc && gcry_sexp_build(&sexp_key_data, NULL, "(data (flags raw) (hash sha384 %s))",
+	  key_txt))
+		rc = 902;
+	if(!rc){
+		memset(&keysig_chk, 0, sizeof(keysig_chk));
+		keysig_chk.sexp_keysig = sexp_keysig;
+		keysig_chk.sexp_online_key_data = sexp_key_data;
+		keysig_chk.sexp_offline_pub_key = list->sexp_offline_pub_key;
+		keysig_chk.sexp_nm_offline_key = list->sexp_nm_offline_key;
+		keysig_chk.offline_set = &list->offline_set;
+		keysig_chk.nm_key_txt = key_txt;
+		keysig_chk.revoked = list->revoked;
+		keysig_chk.chain_cache = list->chain_cache;
+		// The servers already keep the CPUs busy.
+		keysig_chk.msig_threads = 1;
+		rc = check_keysig(&keysig_chk);
+	}
+	if(!rc && list->replay && nm_replay_insert(list->replay, nonce_digest)){
+		nm_stats_add(NM_STAT_REPLAYS, 1);
+		rc = 962;
+	}
+
+	gcry_sexp_release(sexp_data);
+	gcry_sexp_release(sexp_sig);
+	gcry_sexp_release(sexp_nm_key);
+	gcry_sexp_release(sexp_pub);
+	gcry_sexp_release(sexp_keysig);
+	gcry_sexp_release(sexp_key_data);
+	return rc;
+}
+
+static void *server_worker(void *arg){
+	// Take servers from the list until there are none left.
+	// Each check allocates from this thread's arena (see nm_arena.c),
+	// which is emptied when it is done.
+	struct server_list_t *list = arg;
+	struct nm_arena_t *arena;
+	unsigned long long t0;
+	char *buf;
+	int j;
+
+	buf = malloc(4 * MAX_KEY_BUFF);
+	arena = nm_arena_open();
+	if(!buf || !arena){
+		free(buf);
+		nm_arena_close(arena);
+		return NULL;
+	}
+	while((j = __atomic_fetch_add(&list->next, 1, __ATOMIC_RELAXED)) < list->n){
+		t0 = nm_stats_now_us();
+		nm_arena_begin(arena);
+		list->srv[j].rc = check_server(list, &list->srv[j], buf);
+		nm_arena_end(arena);
+		list->srv[j].usec = nm_stats_now_us() - t0;
+	}
+	nm_arena_close(arena);
+	free(buf);
+	return NULL;
+}
+
+int verify_server_list(const char *servers_fname, int nthreads,
+  const char *offline_name, const char *fingerprint, const char *keyring_fname,
+  const char *revoked_fname, const char *replay_fname, unsigned int replay_ttl){
+	// The --servers mode.  Prints one verdict per server and returns
+	// 0 if every server checked out, otherwise the code of the first
+	// server in the list that did not.
+	struct server_list_t *list;
+	pthread_t threads[MAX_SERVERS];
+	char *offline_txt;
+	unsigned char offline_fp[NM_REVOKE_FP_LEN];
+	const struct nm_anchor_t *anchor = NULL;
+	unsigned long long t0;
+	int j, nstarted, nok = 0, rc = 0, stage;
+
+	list = calloc(1, sizeof(*list));
+	offline_txt = malloc(MAX_KEY_BUFF);
+	if(!list || !offline_txt){
+		fprintf (stderr, "Error. Out of memory.\n");
+		return 843;
+	}
+	t0 = nm_stats_now_us();
+	nm_timing_phase("servers_read");
+	rc = read_server_list(servers_fname, list);
+	if(rc)
+		return rc;
+	if (keyring_fname){
+		list->keyring = nm_keyring_open(keyring_fname, &rc);
+		if(!list->keyring){
+			fprintf (stderr, "Error. Could not open the keyring %s.\n", keyring_fname);
+			return rc;
+		}
+	}
+
+	//  The offline key (or key set), once for every server.
+	nm_timing_phase("servers_offline_key");
+	if(!strncmp(offline_name, "anchor:", 7))
+		rc = read_offline_key(NULL, offline_name, &list->sexp_nm_offline_key, offline_txt,
+			&anchor);
+	else
+		rc = load_key(list, offline_name, offline_txt, &list->sexp_nm_offline_key);
+	if(rc){
+		fprintf (stderr, "Error. Could not read the offline key %s.\n", offline_name);
+		return rc;
+	}
+	stage = pin_offline_key(anchor, offline_txt, fingerprint, offline_fp);
+	if(!stage)
+		stage = nm_precheck_expiry(list->sexp_nm_offline_key, nm_keyring_today());
+	if(stage){
+		fprintf (stderr, "Error. The offline key was rejected (%s).\n",
+			nm_precheck_stage_name(stage));
+		return nm_precheck_reject(stage);
+	}
+	if(nm_keyset_is_set(list->sexp_nm_offline_key)){
+		rc = nm_keyset_load(list->sexp_nm_offline_key, &list->offline_set);
+		if(rc){
+			fprintf (stderr, "Error. The offline key set is not valid.\n");
+			return rc;
+		}
+	}else{
+		list->sexp_offline_pub_key = gcry_sexp_find_token(list->sexp_nm_offline_key,
+			"public-key", 0);
+		if(!list->sexp_offline_pub_key){
+			fprintf (stderr, "Error. Could not get the offline public-key from the input s-expression.\n");
+			return 901;
+		}
+	}
+	if (revoked_fname){
+		list->revoked = nm_revoke_open(revoked_fname, &rc);
+		if(!list->revoked){
+			fprintf (stderr, "Error. Could not open the revocation list %s.\n", revoked_fname);
+			return rc;
+		}
+		if(nm_revoke_check(list->revoked, offline_fp)){
+			fprintf (stderr, "Error. The offline key has been revoked.\n");
+			return nm_precheck_reject(NM_PRECHECK_REVOKED);
+		}
+		rc = verify_revoked(list->revoked, &list->offline_set, list->sexp_offline_pub_key);
+		if(rc){
+			fprintf (stderr, "Error. The revocation list %s is not signed by the offline key.\n",
+				revoked_fname);
+			return rc;
+		}
+	}
+	if (replay_fname){
+		list->replay = nm_replay_open(replay_fname, 0, replay_ttl, &rc);
+		if(!list->replay){
+			fprintf (stderr, "Error. Could not open the replay cache %s.\n", replay_fname);
+			return rc;
+		}
+	}
+	// Servers that share intermediate keys share their links.
+	list->chain_cache = nm_chain_cache_new(0);
+
+	//  The servers, at the same time.  This thread is one of the
+	//  workers.
+	nm_timing_phase("servers_verify");
+	if(nthreads <= 0)
+		nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	if(nthreads > list->n)
+		nthreads = list->n;
+	nstarted = 0;
+	for(j = 1; j < nthreads; j++)
+		if(!pthread_create(&threads[nstarted], NULL, server_worker, list))
+			nstarted++;
+	server_worker(list);
+	for(j = 0; j < nstarted; j++)
+		pthread_join(threads[j], NULL);
+
+	rc = 0;
+	for(j = 0; j < list->n; j++){
+		if(list->srv[j].rc){
+			printf("server %d %s: FAILED (code %d, %llu us)\n", j + 1,
+				list->srv[j].fname[2], list->srv[j].rc, list->srv[j].usec);
+			if(!rc)
+				rc = list->srv[j].rc;
+		}else{
+			printf("server %d %s: confirmed (%llu us)\n", j + 1, list->srv[j].fname[2],
+				list->srv[j].usec);
+			nok++;
+		}
+	}
+	printf("%d of %d servers confirmed in %llu us (%d threads)\n", nok, list->n,
+		nm_stats_now_us() - t0, nstarted + 1);
+
+	nm_chain_cache_free(list->chain_cache);
+	nm_replay_close(list->replay);
+	if(list->revoked)
+		nm_revoke_close(list->revoked);
+	nm_keyring_close(list->keyring);
+	nm_keyset_release(&list->offline_set);
+	gcry_sexp_release(list->sexp_offline_pub_key);
+	gcry_sexp_release(list->sexp_nm_offline_key);
+	free(offline_txt);
+	free(list);
+	return rc;
+}
 //-------------------------------------------------------------------------------
 //-------------------------------------------------------------------------------
 //-------------------------------------------------------------------------------
@@ -199,18 +871,52 @@ int main (int argc, char **argv) {
 	char input_keysig_txt[MAX_KEY_BUFF];
 	char nm_key_txt[MAX_KEY_BUFF];
 	char nm_offline_pub_key_txt[MAX_KEY_BUFF];
-	gcry_sexp_t sexp_nm_key, sexp_nm_offline_key, sexp_offline_pub_key;
+	gcry_sexp_t sexp_nm_key, sexp_offline_pub_key;
+	gcry_sexp_t sexp_nm_offline_key = NULL;
 	gcry_sexp_t sexp_pub_key;
 	gcry_sexp_t sexp_online_key_data;
 	gcry_sexp_t sexp_input_data, sexp_keysig;
 	gcry_sexp_t sexp_signature ;
 	int idx;
-	char ch;
+	const char *replay_fname;
+	unsigned int replay_ttl;
+	struct nm_replay_t *replay = NULL;
+	const char *keyring_fname;
+	struct nm_keyring_t *keyring = NULL;
+	const char *revoked_fname;
+	struct nm_revoke_t *revoked = NULL;
+	const char *servers_fname;
+	int server_threads;
+	unsigned char key_fp[NM_REVOKE_FP_LEN];
+	unsigned char offline_fp[NM_REVOKE_FP_LEN];
+	const struct nm_anchor_t *anchor;
+	struct nm_keyset_t offline_set;
+	struct nonce_check_t nonce_chk;
+	struct keysig_check_t keysig_chk;
+	struct nm_pverify_task_t tasks[2];
+	struct nm_pverify_t pv;
+	int parallel_verify;
+	int stage;
+	unsigned char keygrip[20];
+	unsigned char nonce_digest[NM_REPLAY_DIGEST_LEN];
 
 
 	FILE *fp;
 
-	if (argc == 7){
+	// --timings may be anywhere on the command line.
+	nm_timing_start("NMVerifyServer");
+	nm_stats_init("NMVerifyServer");
+	nm_timing_args(&argc, argv);
+	nm_replay_args(&argc, argv, &replay_fname, &replay_ttl);
+	nm_keyring_args(&argc, argv, &keyring_fname);
+	nm_revoke_args(&argc, argv, &revoked_fname);
+	servers_args(&argc, argv, &servers_fname, &server_threads);
+	parallel_verify = flag_arg(&argc, argv, "--parallel-verify");
+
+	if (servers_fname && argc == 3){
+		strncpy(input_offline_pub_key_fname, (char *) argv[1], MAX_CMDLINE_BUFF);
+		strncpy(input_server_fingerprint, (char *) argv[2], MAX_CMDLINE_BUFF);
+	}else if (!servers_fname && argc == 7){
 		strncpy(input_fname, (char *) argv[1], MAX_CMDLINE_BUFF);
 		strncpy(input_sig_fname, (char *) argv[2], MAX_CMDLINE_BUFF);
 		strncpy(input_pub_key_fname, (char *) argv[3], MAX_CMDLINE_BUFF);
@@ -220,7 +926,14 @@ int main (int argc, char **argv) {
 		if(debug_lvl > 0)
 			printf("Reading input file: %s\n", input_fname);
 	}else{
-		printf("Usage: %s InputDataFname SIG PUBLIC.KEY KeySig OfflinePubKey Fingerprint\n", argv[0]);
+		printf("Usage: %s InputDataFname SIG PUBLIC.KEY KeySig OfflinePubKey Fingerprint [--timings[=<file>]]\n", argv[0]);
+		printf("       [--replay-cache=<file> [--replay-ttl=<seconds>]] [--keyring=<file>]\n");
+		printf("       [--revoked=<file>] [--parallel-verify]\n");
+		printf("       %s --servers=<file> OfflinePubKey Fingerprint [--server-threads=<n>] [...]\n",
+			argv[0]);
+		printf("       (each line of the --servers file: InputDataFname SIG PUBLIC.KEY KeySig)\n");
+		printf("       OfflinePubKey may be anchor:<name>, a key built in with make ANCHOR_KEYS=...;\n");
+		printf("       its Fingerprint may then be -\n");
 		return 876;
 	}
 
@@ -229,6 +942,12 @@ int main (int argc, char **argv) {
 															LIBGCRYPT INITIALIZATION
 	----------------------------------------------------------------------
 	*/
+	//  The --servers mode allocates each check from an arena; the
+	//  handlers must be in place before libgcrypt allocates anything.
+	if (servers_fname && nm_arena_install()){
+		fputs ("Error. Could not map the secure arena.\n", stderr);
+		return 843;
+	}
 	/* 
 		 Version check should be the very first call because it
 		 makes sure that important subsystems are initialized.
@@ -282,6 +1001,11 @@ int main (int argc, char **argv) {
 		abort ();
 	}
 
+	if (servers_fname)
+		return verify_server_list(servers_fname, server_threads,
+			input_offline_pub_key_fname, input_server_fingerprint, keyring_fname,
+			revoked_fname, replay_fname, replay_ttl);
+
 
 	/*
 		"To use a cipher algorithm, you must first allocate an
@@ -297,17 +1021,22 @@ int main (int argc, char **argv) {
 	//------------------------------------------------------------
 	//------------------------------------------------------------
 	//   IMPORT THE FILE TO verify AND MAKE IT AN S-EXP
+	nm_timing_phase("part_i");
 	if (debug_lvl > 0)
 		printf("\n--------------------------------- Part I\n");
 
-	//fp = stdin;
-	fp = fopen(input_fname, "r");
-	////read_sexp_file(fp, &sexp_input_data, input_data_txt, 1);
-	idx = 0;
-	while (((ch=fgetc(fp)) != EOF) & (idx < MAX_KEY_BUFF)){  /* read/print characters including newline */
-		*(input_data_txt + idx++) = ch;
- 	}
-	fclose(fp);
+	//  Read as --servers reads it (read_text), so a file too big for
+	//  the buffer is refused with 932 in both modes rather than cut.
+	NM_PROBE1(file_load__entry, input_fname);
+	idx = read_text(input_fname, input_data_txt);
+	NM_PROBE3(file_load__return, input_fname, idx ? 0 : strlen(input_data_txt), idx);
+	if (idx == 438){
+		perror("Error. Failed to open the input data file");
+		return idx;
+	}else if (idx){
+		fprintf(stderr, "Error. The input file is larger than %d bytes.\n", MAX_KEY_BUFF - 1);
+		return idx;
+	}
 	if (debug_lvl > 2){
 		printf("the input data is: %s\n", input_data_txt);
 	}
@@ -330,6 +1059,7 @@ int main (int argc, char **argv) {
 	//------------------------------------------------------------
 	//------------------------------------------------------------
 	//    IMPORT THE SIGNATURE AND CONVERT IT TO AN OFFICIAL S-EXP
+	nm_timing_phase("part_ii");
 	if (debug_lvl > 0)
 		printf("\n--------------------------------- Part II\n");
 
@@ -360,13 +1090,21 @@ int main (int argc, char **argv) {
 	//------------------------------------------------------------
 	//------------------------------------------------------------
 	//  Read the NaturalMessage public key
+	nm_timing_phase("part_iii");
 	if (debug_lvl > 0)
 		printf("\n--------------------------------- Part III\n");
 
+	if (keyring_fname){
+		keyring = nm_keyring_open(keyring_fname, &idx);
+		if(!keyring){
+			fprintf (stderr, "Error. Could not open the keyring %s.\n", keyring_fname);
+			return idx;
+		}
+	}
 	printf("TEMP - reading online pub key from file: %s\n", input_pub_key_fname);
-	fp = fopen(input_pub_key_fname, "r");
-	read_sexp_file(fp, &sexp_nm_key, nm_key_txt, 0);
-	fclose(fp);
+	idx = read_key_sexp(keyring, input_pub_key_fname, &sexp_nm_key, nm_key_txt);
+	if(idx)
+		return idx;
 	if (debug_lvl > 5 ){
 		printf("Here is a dump of the s-exp for the imported full PUBLIC key:\n");
 		gcry_sexp_dump(sexp_nm_key);
@@ -384,23 +1122,42 @@ int main (int argc, char **argv) {
 		gcry_sexp_dump(sexp_pub_key);
 	}
 
+	//  A nonce that was already accepted is rejected here, before
+	//  the expensive signature checks.
+	if (replay_fname){
+		replay = nm_replay_open(replay_fname, 0, replay_ttl, &idx);
+		if(!replay){
+			fprintf (stderr, "Error. Could not open the replay cache %s.\n", replay_fname);
+			return idx;
+		}
+		if(!gcry_pk_get_keygrip(sexp_pub_key, keygrip)){
+			fprintf (stderr, "Error. Could not get the keygrip of the online key.\n");
+			return 901;
+		}
+		nm_replay_digest(keygrip, input_data_txt, strlen(input_data_txt), nonce_digest);
+		if(nm_replay_seen(replay, nonce_digest)){
+			fprintf (stderr, "Error. The nonce has already been used (replay).\n");
+			nm_stats_add(NM_STAT_REPLAYS, 1);
+			return 962;
+		}
+	}
+
 	//------------------------------------------------------------
 	//------------------------------------------------------------
 	//------------------------------------------------------------
 	//     VERIFY THE FILE
 	//
+	nm_timing_phase("part_iv");
 	if (debug_lvl > 0)
 		printf("\n--------------------------------- Part IV\n");
 
-	err = gcry_pk_verify(sexp_signature, sexp_input_data, sexp_pub_key);
-	if(err){
-		fprintf (stderr, "Error. Verification failed: %s/%s\n",
-			gcry_strsource (err),
-			gcry_strerror (err));
-		return 903;
-	}else{
-		printf("Signature is confirmed\n");
-	}
+	nonce_chk.sexp_signature = sexp_signature;
+	nonce_chk.sexp_input_data = sexp_input_data;
+	nonce_chk.sexp_pub_key = sexp_pub_key;
+	nonce_chk.data_len = strlen(input_data_txt);
+	//  The check itself runs in Part VII, after the cheap checks
+	//  (and with --parallel-verify at the same time as the check of
+	//  the online key).
 	
 	//------------------------------------------------------------
 	//------------------------------------------------------------
@@ -408,13 +1165,20 @@ int main (int argc, char **argv) {
 	//   Read the signature for the online key
 	//   (This is the second file that needs verification)
 	//
+	nm_timing_phase("part_v");
 	if (debug_lvl > 0)
 		printf("\n--------------------------------- Part V\n");
 
 	printf("TEMP NOTE, STARTING KEYSIG READ.\n");
 	fp = fopen(input_keysig_fname, "r");
-	read_sexp_file(fp, &sexp_keysig, input_keysig_txt, 0);
+	if(!fp){
+		perror("Error. Failed to open the signature for the online key");
+		return 438;
+	}
+	idx = read_sexp_file(fp, &sexp_keysig, input_keysig_txt, 0);
 	fclose(fp);
+	if(idx)
+		return idx;
 	//
 	if (debug_lvl > 2){
 		printf("Here is the dump of the signature for the online key (keysig):\n");
@@ -425,21 +1189,35 @@ int main (int argc, char **argv) {
 	//------------------------------------------------------------
 	//------------------------------------------------------------
 	//   Read the Offline public key
+	nm_timing_phase("part_vi");
 	if (debug_lvl > 0)
 		printf("\n--------------------------------- Part VI\n");
 
-	fp = fopen(input_offline_pub_key_fname, "r");
-	read_sexp_file(fp, &sexp_nm_offline_key, nm_offline_pub_key_txt, 0);
+	idx = read_offline_key(keyring, input_offline_pub_key_fname, &sexp_nm_offline_key,
+		nm_offline_pub_key_txt, &anchor);
+	if(idx)
+		return idx;
+	nm_keyring_close(keyring);
 	if (debug_lvl > 5 ){
 		printf("Here is a dump of the s-exp for the imported OFFLINE PUBLIC key:\n");
 		gcry_sexp_dump(sexp_nm_offline_key);
 	}
-	fclose(fp);
-	//  Extract the libgcrypt public key from the NaturalMessage key.
-	sexp_offline_pub_key = gcry_sexp_find_token(sexp_nm_offline_key, "public-key", 0);
-	if(!sexp_offline_pub_key){
-		fprintf (stderr, "Error. Could not get the offline public-key from the input s-expression.\n");
-		return 901;
+	//  Extract the libgcrypt public key from the NaturalMessage key,
+	//  or the keys from a k-of-n offline key set.
+	offline_set.n = 0;
+	sexp_offline_pub_key = NULL;
+	if(nm_keyset_is_set(sexp_nm_offline_key)){
+		idx = nm_keyset_load(sexp_nm_offline_key, &offline_set);
+		if(idx){
+			fprintf (stderr, "Error. The offline key set is not valid.\n");
+			return idx;
+		}
+	}else{
+		sexp_offline_pub_key = gcry_sexp_find_token(sexp_nm_offline_key, "public-key", 0);
+		if(!sexp_offline_pub_key){
+			fprintf (stderr, "Error. Could not get the offline public-key from the input s-expression.\n");
+			return 901;
+		}
 	}
 
 	if (debug_lvl > 2){
@@ -447,10 +1225,64 @@ int main (int argc, char **argv) {
 		gcry_sexp_dump(sexp_offline_pub_key);
 	}
 
+	//------------------------------------------------------------
+	//------------------------------------------------------------
+	//------------------------------------------------------------
+	//    REJECT WHAT CANNOT VERIFY, BEFORE ANY PUBLIC-KEY WORK
+	//
+	nm_timing_phase("precheck");
+	if (debug_lvl > 0)
+		printf("\n--------------------------------- Precheck\n");
+
+	//  Cheapest first.  A key set or a key chain carries several
+	//  signatures that nm_multisig and nm_chain check themselves.
+	stage = NM_PRECHECK_OK;
+	if(input_data_txt[0] == 0x00)
+		stage = NM_PRECHECK_STRUCTURE;
+	if(!stage)
+		stage = nm_precheck_sig(sexp_signature, sexp_pub_key);
+	if(!stage && !offline_set.n && !nm_chain_is_chain(sexp_keysig))
+		stage = nm_precheck_sig(sexp_keysig, sexp_offline_pub_key);
+	if(!stage)
+		stage = nm_precheck_expiry(sexp_nm_key, nm_keyring_today());
+	if(!stage)
+		stage = nm_precheck_expiry(sexp_nm_offline_key, nm_keyring_today());
+	if(!stage)
+		stage = pin_offline_key(anchor, nm_offline_pub_key_txt, input_server_fingerprint,
+			offline_fp);
+	if(!stage && revoked_fname){
+		nm_timing_phase("revoke");
+		revoked = nm_revoke_open(revoked_fname, &idx);
+		if(!revoked){
+			fprintf (stderr, "Error. Could not open the revocation list %s.\n", revoked_fname);
+			return idx;
+		}
+		gcry_md_hash_buffer(GCRY_MD_SHA384, key_fp, nm_key_txt, strlen(nm_key_txt));
+		if(nm_revoke_check(revoked, key_fp) || nm_revoke_check(revoked, offline_fp))
+			stage = NM_PRECHECK_REVOKED;
+	}
+	if(stage){
+		fprintf (stderr, "Error. Rejected before any signature check (%s).\n",
+			nm_precheck_stage_name(stage));
+		return nm_precheck_reject(stage);
+	}
+
+	//  A revocation list that the offline key did not sign could
+	//  hide a revoked key.
+	if (revoked){
+		idx = verify_revoked(revoked, &offline_set, sexp_offline_pub_key);
+		if(idx){
+			fprintf (stderr, "Error. The revocation list %s is not signed by the offline key.\n",
+				revoked_fname);
+			return idx;
+		}
+	}
+
 	//------------------------------------------------------------
 	//------------------------------------------------------------
 	//------------------------------------------------------------
 	//    CONVERT THE ONLINE PUB KEY TO A DATA S-EXP
+	nm_timing_phase("part_vi_b");
 	if (debug_lvl > 0)
 		printf("\n--------------------------------- Part VI-B\n");
 
@@ -474,23 +1306,75 @@ int main (int argc, char **argv) {
 	//------------------------------------------------------------
 	//     VERIFY THE SIGNATURE ON THE ONLINE KEY
 	//
+	nm_timing_phase("part_vii");
 	if (debug_lvl > 0)
 		printf("\n--------------------------------- Part VII\n");
 
-	err = gcry_pk_verify( sexp_keysig, sexp_online_key_data, sexp_offline_pub_key);
-	if(err){
-		fprintf (stderr, "Error. Verification failed: %s/%s\n",
-			gcry_strsource (err),
-			gcry_strerror (err));
-		return 903;
+	memset(&keysig_chk, 0, sizeof(keysig_chk));
+	keysig_chk.sexp_keysig = sexp_keysig;
+	keysig_chk.sexp_online_key_data = sexp_online_key_data;
+	keysig_chk.sexp_offline_pub_key = sexp_offline_pub_key;
+	keysig_chk.sexp_nm_offline_key = sexp_nm_offline_key;
+	keysig_chk.offline_set = &offline_set;
+	keysig_chk.nm_key_txt = nm_key_txt;
+	keysig_chk.revoked = revoked;
+	keysig_chk.msig_threads = 0;    // one per CPU
+	if(parallel_verify){
+		//  Both checks at once.  On a failure this returns without
+		//  waiting for the other check: the process is exiting.
+		tasks[0].fn = check_nonce;
+		tasks[0].arg = &nonce_chk;
+		tasks[1].fn = check_keysig;
+		tasks[1].arg = &keysig_chk;
+		nm_pverify_start(&pv, tasks, 2);
+		idx = nm_pverify_wait(&pv);
+		if(idx && pv.failed == 0){
+			fprintf (stderr, "Error. Verification failed: %s/%s\n",
+				gcry_strsource (nonce_chk.err),
+				gcry_strerror (nonce_chk.err));
+			return idx;
+		}
+		if(!idx){
+			nm_pverify_join(&pv);
+			printf("Signature is confirmed\n");
+		}
 	}else{
-		printf("Signature on the Online Key by the Offline Key is confirmed\n");
+		if(check_nonce(&nonce_chk)){
+			fprintf (stderr, "Error. Verification failed: %s/%s\n",
+				gcry_strsource (nonce_chk.err),
+				gcry_strerror (nonce_chk.err));
+			return 903;
+		}
+		printf("Signature is confirmed\n");
+		idx = check_keysig(&keysig_chk);
+	}
+	if(idx){
+		report_keysig_failure(&keysig_chk, idx);
+		return idx;
+	}
+	nm_keyset_release(&offline_set);
+	printf("Signature on the Online Key by the Offline Key is confirmed\n");
+	gcry_sexp_release(sexp_input_data);
+	gcry_sexp_release(sexp_signature);
+	gcry_sexp_release(sexp_pub_key);
+	gcry_sexp_release(sexp_nm_key);
+	gcry_sexp_release(sexp_online_key_data);
+	gcry_sexp_release(sexp_keysig);
+	gcry_sexp_release(sexp_offline_pub_key);
+	gcry_sexp_release(sexp_nm_offline_key);
+	if (revoked)
+		nm_revoke_close(revoked);
+
+	//  Remember the nonce only once everything has checked out.  If
+	//  another process accepted the same nonce in the meantime, this
+	//  one is the replay.
+	if (replay){
+		if(nm_replay_insert(replay, nonce_digest)){
+			fprintf (stderr, "Error. The nonce has already been used (replay).\n");
+			nm_stats_add(NM_STAT_REPLAYS, 1);
+			return 962;
+		}
+		nm_replay_close(replay);
 	}
-	
-	//------------------------------------------------------------
-	//------------------------------------------------------------
-	printf("**** I STILL NEED TO VERIFY THE SHA384 OF THE OFFLINE PUBLIC KEY");
-	//------------------------------------------------------------
-	//------------------------------------------------------------
 	return 0;
 }
@@ -0,0 +1,42 @@
+// nm_anchor.c
+// Purpose:
+//   1) Give NMVerifyServer offline public keys that are part of the
+//      program, for builds whose master keys are fixed:
+//          make ANCHOR_KEYS="ROfflinePUBSignKey.key" NMVerifyServer
+//      runs nm_anchorgen, which writes nm_anchors_gen.c with each key
+//      file's SHA-384 fingerprint and the key as a canonical
+//      s-expression.  OfflinePubKey anchor:<name> then needs no file,
+//      no text parse and no hash: the key comes from its canonical
+//      bytes, and Fingerprint is compared with the stored one in
+//      constant time (see nm_precheck_pin_fp).
+//   2) libgcrypt keeps no state for a public key between calls, so
+//      there is nothing else (such as a table of points) that could
+//      be computed ahead of time.
+//
+#include <stddef.h>
+#include <gcrypt.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nm_anchor.h"
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+const struct nm_anchor_t *nm_anchor_find(const char *name){
+	// The anchor made from the key file name (without directories),
+	// or NULL.
+	int j;
+
+	for(j = 0; j < nm_anchors_n; j++)
+		if(!strcmp(nm_anchors[j].name, name))
+			return &nm_anchors[j];
+	return NULL;
+}
+
+int nm_anchor_key(const struct nm_anchor_t *anchor, gcry_sexp_t *sexp_r){
+	// The whole key file of an anchor, as read_key_sexp() would give
+	// it.  Returns 0 or 989.
+	if(gcry_sexp_new(sexp_r, anchor->canon, anchor->canon_len, 0))
+		return 989;
+	return 0;
+}
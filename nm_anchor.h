@@ -0,0 +1,23 @@
+// nm_anchor.h
+//
+// Offline public keys built into the program as trust anchors.  The
+// table is generated by nm_anchorgen into nm_anchors_gen.c; see
+// nm_anchor.c.
+
+#define NM_ANCHOR_FP_LEN 48        // SHA-384
+#define NM_ANCHOR_MAX_NAME 64
+
+struct nm_anchor_t
+{
+	const char *name;                       // the key file name, without directories
+	unsigned char fp[NM_ANCHOR_FP_LEN];     // the SHA-384 of the key file
+	const unsigned char *canon;             // the key file as a canonical s-expression
+	size_t canon_len;
+};
+
+// In nm_anchors_gen.c.
+extern const struct nm_anchor_t nm_anchors[];
+extern const int nm_anchors_n;
+
+const struct nm_anchor_t *nm_anchor_find(const char *name);
+int nm_anchor_key(const struct nm_anchor_t *anchor, gcry_sexp_t *sexp_r);
@@ -0,0 +1,275 @@
+// nm_anchorgen.c
+// Purpose:
+//   1) nm_anchorgen [--output <file>] <offline_public_key> ...: write
+//      the C source of the trust anchor table (nm_anchors_gen.c) that
+//      is built into NMVerifyServer (see nm_anchor.c).  For each key
+//      file it holds the SHA-384 fingerprint and the key as a
+//      canonical s-expression.  With no key files the table is empty.
+//   2) A file that holds a private key is refused, so that a secret
+//      cannot end up in a program by mistake.
+//
+// The Makefile runs it as
+//    make ANCHOR_KEYS="ROfflinePUBSignKey.key" NMVerifyServer
+//
+#include <stddef.h>
+#include <gcrypt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "nm_anchor.h"
+
+#include <getopt.h>
+
+// A key set (nm_multisig --make-set) holds several keys.
+#define MAX_ANCHOR_FILE 65536
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+int usage(){
+	fprintf(stderr, "usage:\n");
+	fprintf(stderr, "nm_anchorgen [--output <file>] [<offline_public_key> ...]\n");
+	fprintf(stderr, "  writes the anchor table for NMVerifyServer (default: stdout)\n");
+	return 99;
+}
+
+static const char *base_name(const char *fname){
+	const char *p = strrchr(fname, '/');
+	return p ? p + 1 : fname;
+}
+
+static int read_anchor(const char *fname, unsigned char *fp, unsigned char **canon_r,
+  size_t *canon_len_r){
+	// The fingerprint of a public key file and the key as a
+	// canonical s-expression (malloc'ed).  Returns 0, 439, 843, 932
+	// (read error or too big), 999 (not an s-expression), 901 (no
+	// public key) or 989 (a private key).
+	char *txt;
+	gcry_sexp_t sexp_key = NULL, sexp_token;
+	FILE *fp_in;
+	size_t len;
+	int rc = 0;
+
+	fp_in = fopen(fname, "rb");
+	if(!fp_in)
+		return 439;
+	txt = malloc(MAX_ANCHOR_FILE);
+	if(!txt){
+		fclose(fp_in);
+		return 843;
+	}
+	len = fread(txt, 1, MAX_ANCHOR_FILE, fp_in);
+	if(ferror(fp_in) || len == MAX_ANCHOR_FILE)
+		rc = 932;
+	fclose(fp_in);
+
+	// The fingerprint is of the file as it is, like nm_fingerprint.
+	if(!rc){
+		gcry_md_hash_buffer(GCRY_MD_SHA384, fp, txt, len);
+		if(gcry_sexp_new(&sexp_key, txt, len, 1)){
+			sexp_key = NULL;
+			rc = 999;
+		}
+	}
+	if(!rc){
+		if((sexp_token = gcry_sexp_find_token(sexp_key, "private-key", 0)))
+			rc = 989;
+		else if(!(sexp_token = gcry_sexp_find_token(sexp_key, "public-key", 0)))
+			rc = 901;
+		gcry_sexp_release(sexp_token);
+	}
+	if(!rc){
+		*canon_len_r = gcry_sexp_sprint(sexp_key, GCRYSEXP_FMT_CANON, NULL, 0);
+		*canon_r = malloc(*canon_len_r);
+		if(!*canon_r)
+			rc = 843;
+		else
+			*canon_len_r = gcry_sexp_sprint(sexp_key, GCRYSEXP_FMT_CANON, *canon_r,
+				*canon_len_r);
+	}
+	gcry_sexp_release(sexp_key);
+	free(txt);
+	return rc;
+}
+
+static int same_file(const char *fname_a, const char *fname_b){
+	// 1 if both files can be read and have the same bytes.
+	FILE *fa, *fb;
+	int ca, cb;
+
+	fa = fopen(fname_a, "rb");
+	fb = fopen(fname_b, "rb");
+	ca = cb = 0;
+	if(fa && fb)
+		do{
+			ca = fgetc(fa);
+			cb = fgetc(fb);
+		}while(ca == cb && ca != EOF);
+	if(fa)
+		fclose(fa);
+	if(fb)
+		fclose(fb);
+	return fa && fb && ca == EOF && cb == EOF;
+}
+
+static void write_bytes(FILE *out, const unsigned char *data, size_t len){
+	size_t j;
+
+	for(j = 0; j < len; j++)
+		fprintf(out, "%s0x%02x,", j % 12 ? " " : "\n\t", data[j]);
+	fprintf(out, "\n");
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+int main (int argc, char **argv) {
+	const char *out_fname = NULL;
+	char tmp_fname[4096];
+	const char *name;
+	unsigned char *fps;
+	unsigned char *canon;
+	size_t canon_len;
+	FILE *out;
+	int opt_code;
+	int j, k, n, rc;
+
+	/*
+	----------------------------------------------------------------------
+															LIBGCRYPT INITIALIZATION
+	----------------------------------------------------------------------
+	*/
+	// Only public keys are read, so no secure memory is needed.
+	if (!gcry_check_version (GCRYPT_VERSION))
+	{
+		fputs ("libgcrypt version mismatch\n", stderr);
+		exit (2);
+	}
+	gcry_control (GCRYCTL_DISABLE_SECMEM, 0);
+	gcry_control (GCRYCTL_INITIALIZATION_FINISHED, 0);
+	/*
+	----------------------------------------------------------------------
+													END LIBGCRYPT INITIALIZATION
+	----------------------------------------------------------------------
+	*/
+
+	while (1){
+		static struct option long_options[] = {
+							 {"output",     required_argument, 0, 'o'},
+							 {"help",        no_argument, 0, '?'},
+							 {0, 0, 0, 0}
+		};
+		/* 'getopt_long' stores the option index here. */
+		int option_index = 0;
+		opt_code = getopt_long (argc, argv, "o:",
+										 long_options, &option_index);
+
+		/* Detect the end of the options. */
+		if (opt_code == -1)
+			break;
+
+		switch (opt_code){
+			case 'o':
+				// the generated source file
+				out_fname = optarg;
+				break;
+
+			case '?':
+				/* 'getopt_long' already printed an error message. */
+				usage();
+				return 738;
+
+			default:
+				abort ();
+		}
+	}
+
+	//  Anchors are chosen by file name (anchor:<name>), so a name
+	//  must be unique and must be safe to put in a C string.
+	n = argc - optind;
+	for(j = optind; j < argc; j++){
+		name = base_name(argv[j]);
+		if(strlen(name) == 0 || strlen(name) >= NM_ANCHOR_MAX_NAME
+		  || strspn(name, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+		    "0123456789._-") != strlen(name)){
+			fprintf(stderr, "Error. %s is not a usable anchor name (letters, digits, "
+				"'.', '_' and '-', up to %d characters).\n", name, NM_ANCHOR_MAX_NAME - 1);
+			return 989;
+		}
+		for(k = optind; k < j; k++)
+			if(!strcmp(base_name(argv[k]), name)){
+				fprintf(stderr, "Error. Two anchors are named %s.\n", name);
+				return 989;
+			}
+	}
+
+	fps = malloc(n * NM_ANCHOR_FP_LEN + 1);
+	if(!fps){
+		fprintf(stderr, "Error. Out of memory.\n");
+		return 843;
+	}
+	//  The file is replaced only if it changes, so that make does not
+	//  rebuild NMVerifyServer every time it runs this.
+	if(out_fname){
+		if(strlen(out_fname) + 5 > sizeof(tmp_fname)){
+			fprintf(stderr, "Error. The output file name is too long.\n");
+			return 438;
+		}
+		sprintf(tmp_fname, "%s.tmp", out_fname);
+	}
+	out = out_fname ? fopen(tmp_fname, "w") : stdout;
+	if(!out){
+		perror("Error. Failed to open the output file");
+		return 438;
+	}
+	fprintf(out, "// nm_anchors_gen.c\n");
+	fprintf(out, "//\n");
+	fprintf(out, "// Generated by nm_anchorgen; do not edit.  The trust anchors built\n");
+	fprintf(out, "// into NMVerifyServer (see nm_anchor.c).\n");
+	fprintf(out, "//\n");
+	fprintf(out, "#include <stddef.h>\n#include <gcrypt.h>\n\n#include \"nm_anchor.h\"\n");
+	for(j = 0; j < n; j++){
+		rc = read_anchor(argv[optind + j], fps + j * NM_ANCHOR_FP_LEN, &canon, &canon_len);
+		if(rc){
+			fprintf(stderr, "Error. Could not make an anchor of %s (code %d).\n",
+				argv[optind + j], rc);
+			if(out_fname){
+				fclose(out);
+				remove(tmp_fname);
+			}
+			return rc;
+		}
+		fprintf(out, "\nstatic const unsigned char anchor_%d[%lu] = {", j,
+			(unsigned long) canon_len);
+		write_bytes(out, canon, canon_len);
+		fprintf(out, "};\n");
+		free(canon);
+	}
+
+	// An empty table still needs one element.
+	fprintf(out, "\nconst struct nm_anchor_t nm_anchors[] = {\n");
+	for(j = 0; j < n; j++){
+		fprintf(out, "\t{\"%s\",\n\t\t{", base_name(argv[optind + j]));
+		for(k = 0; k < NM_ANCHOR_FP_LEN; k++)
+			fprintf(out, "%s0x%02x", k == 0 ? "" : k % 12 ? ", " : ",\n\t\t ",
+				fps[j * NM_ANCHOR_FP_LEN + k]);
+		fprintf(out, "},\n\t\tanchor_%d, sizeof(anchor_%d)},\n", j, j);
+	}
+	if(n == 0)
+		fprintf(out, "\t{NULL, {0}, NULL, 0}\n");
+	fprintf(out, "};\n");
+	fprintf(out, "const int nm_anchors_n = %d;\n", n);
+	free(fps);
+	if(out_fname && fclose(out)){
+		perror("Error. Failed to write the output file");
+		remove(tmp_fname);
+		return 932;
+	}
+	if(out_fname && same_file(tmp_fname, out_fname))
+		remove(tmp_fname);
+	else if(out_fname && rename(tmp_fname, out_fname)){
+		perror("Error. Failed to replace the output file");
+		return 932;
+	}
+	return 0;
+}
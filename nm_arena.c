@@ -0,0 +1,437 @@
+// nm_arena.c
+// Purpose:
+//   1) Take the many small allocations that libgcrypt makes for one
+//      request (the s-expression trees of gcry_sexp_new,
+//      gcry_sexp_build and gcry_sexp_find_token, MPIs, and secure
+//      buffers) off the general heap in processes that check many
+//      servers or stay up (NMVerifyServer --servers).  Each thread
+//      that serves requests has an arena.  Between nm_arena_begin()
+//      and nm_arena_end() libgcrypt's allocations in that thread are
+//      cut from the arena's current chunk by moving a pointer, and
+//      freeing them only counts them.  nm_arena_end() makes the whole
+//      chunk free again at once, so a request costs no malloc() or
+//      free() at all once the chunks exist, and the heap does not
+//      fragment.
+//   2) Keep secret objects apart.  Secure allocations come from
+//      separate chunks in one region that is left out of core dumps
+//      and locked in memory chunk by chunk as it is used, and each
+//      one is wiped when it is freed.  One too big for a chunk, or
+//      any once the region is used up, gets a locked mapping of its
+//      own, unmapped when it is freed, since libgcrypt treats a
+//      failed secure allocation as fatal.
+//   3) Stay safe when something outlives its request (a cache entry,
+//      or a table that libgcrypt builds the first time it needs it).
+//      A chunk counts the allocations in it that have not been freed.
+//      If that count is not zero at nm_arena_end(), the chunk is left
+//      to the objects in it and freed with the last of them, and the
+//      arena starts a new one.
+//
+// The handlers are installed with gcry_set_allocation_handler(),
+// which must come before gcry_check_version().  Outside a request,
+// public allocations go to malloc() and secure ones to a shared
+// chunk of the secure region.  gcry_is_secure() is answered by
+// whether the pointer lies in the region or in one of the separate
+// mappings, so it is right for any pointer (libgcrypt also asks it
+// about the caller's own buffers).
+//
+// NM_ARENA=off in the environment keeps libgcrypt's own allocator.
+//
+// Usage:
+//    nm_arena_install();                   // before gcry_check_version()
+//    a = nm_arena_open();                  // once per thread
+//    nm_arena_begin(a);
+//    ... parse, verify, release ...
+//    nm_arena_end(a);
+//
+#include <stddef.h>
+#include <gcrypt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "nm_arena.h"
+
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define ROUND16(n) (((n) + 15) & ~(size_t) 15)
+// Public allocations bigger than this go to malloc().
+#define BIG_ALLOC (NM_ARENA_CHUNK / 4)
+#define NSLOTS (NM_ARENA_SECURE_REGION / NM_ARENA_SECURE_CHUNK)
+
+#define STAT_ARENA 0
+#define STAT_HEAP 1
+#define STAT_SECURE 2
+#define STAT_FREES 3
+#define STAT_CHUNKS 4
+#define STAT_RESETS 5
+#define STAT_PINNED 6
+#define NSTATS 7
+
+struct arena_chunk_t
+{
+	int live;             // allocations not yet freed, plus one while an arena cuts from it
+	int secure;
+	int mapped;           // a mapping of its own for one secure allocation
+	size_t size;          // bytes of data after the header
+	size_t used;          // changed only by the arena that owns it
+	struct arena_chunk_t *next;      // the mapped chunks, under region_lock
+};
+#define CHUNK_HDR ROUND16(sizeof(struct arena_chunk_t))
+
+// In front of every allocation.
+struct alloc_hdr_t
+{
+	struct arena_chunk_t *chunk;     // NULL for malloc()
+	size_t size;
+};
+#define ALLOC_HDR ROUND16(sizeof(struct alloc_hdr_t))
+
+struct nm_arena_t
+{
+	struct arena_chunk_t *pub;
+	struct arena_chunk_t *sec;
+};
+
+static int installed;
+static __thread struct nm_arena_t *cur;
+static unsigned long long stats[NSTATS];
+
+// The secure region, cut into NSLOTS chunks.
+static unsigned char *region;
+static pthread_mutex_t region_lock = PTHREAD_MUTEX_INITIALIZER;
+static int free_slots[NSLOTS];
+static int nfree;
+static char slot_locked[NSLOTS];
+static int lock_warned;
+// Secure allocations that did not fit the region.  Few and short
+// lived; nmapped lets gcry_is_secure() skip the lock when there are
+// none.
+static struct arena_chunk_t *mapped;
+static int nmapped;
+// Secure allocations outside a request.  A lock of its own, since
+// chunk_new() takes region_lock.
+static struct nm_arena_t shared;
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+static void stat_add(int j){
+	__atomic_add_fetch(&stats[j], 1, __ATOMIC_RELAXED);
+}
+
+static void wipe(void *ptr, size_t len){
+	// As nm_wipe(): the volatile pointer keeps the stores.
+	volatile unsigned char *p = ptr;
+	while (len--)
+		*p++ = 0;
+}
+
+static void lock_secure(void *p, size_t len){
+	// As with libgcrypt's own pool, a low RLIMIT_MEMLOCK leaves secure
+	// memory unlocked, with one warning.  Called under region_lock.
+	if(mlock(p, len) && !lock_warned){
+		fprintf(stderr, "Warning: the secure arena could not be locked in memory.\n");
+		lock_warned = 1;
+	}
+}
+
+static struct arena_chunk_t *chunk_new(int secure){
+	// A chunk with one reference, for the arena.  Secure chunks
+	// take region_lock.
+	struct arena_chunk_t *c;
+	int slot;
+
+	if(secure){
+		pthread_mutex_lock(&region_lock);
+		slot = nfree > 0 ? free_slots[--nfree] : -1;
+		if(slot >= 0 && !slot_locked[slot]){
+			// Locked as it is first used, so that only the chunks in
+			// use count against RSS and RLIMIT_MEMLOCK.
+			slot_locked[slot] = 1;
+			lock_secure(region + (size_t) slot * NM_ARENA_SECURE_CHUNK, NM_ARENA_SECURE_CHUNK);
+		}
+		pthread_mutex_unlock(&region_lock);
+		if(slot < 0)
+			return NULL;
+		c = (struct arena_chunk_t *) (region + (size_t) slot * NM_ARENA_SECURE_CHUNK);
+		c->size = NM_ARENA_SECURE_CHUNK - CHUNK_HDR;
+	}else{
+		c = malloc(CHUNK_HDR + NM_ARENA_CHUNK);
+		if(!c)
+			return NULL;
+		c->size = NM_ARENA_CHUNK;
+	}
+	c->live = 1;
+	c->secure = secure;
+	c->mapped = 0;
+	c->used = 0;
+	stat_add(STAT_CHUNKS);
+	return c;
+}
+
+static void *mapped_alloc(size_t n){
+	// A secure allocation in a locked mapping of its own, left out of
+	// core dumps like the region.  Its chunk has the one reference
+	// of the allocation, so freeing it unmaps it.  NULL if out of
+	// memory.
+	struct arena_chunk_t *c;
+	struct alloc_hdr_t *h;
+	size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	size_t len = (CHUNK_HDR + ALLOC_HDR + ROUND16(n) + page - 1) & ~(page - 1);
+
+	if(n > len)
+		return NULL;
+	c = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(c == MAP_FAILED)
+		return NULL;
+#ifdef MADV_DONTDUMP
+	madvise(c, len, MADV_DONTDUMP);
+#endif
+	c->live = 1;
+	c->secure = 1;
+	c->mapped = 1;
+	c->size = len - CHUNK_HDR;
+	c->used = ALLOC_HDR + ROUND16(n);
+	pthread_mutex_lock(&region_lock);
+	lock_secure(c, len);
+	c->next = mapped;
+	mapped = c;
+	__atomic_add_fetch(&nmapped, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&region_lock);
+	stat_add(STAT_CHUNKS);
+	h = (struct alloc_hdr_t *) ((unsigned char *) c + CHUNK_HDR);
+	h->chunk = c;
+	h->size = n;
+	return (unsigned char *) h + ALLOC_HDR;
+}
+
+static void chunk_unref(struct arena_chunk_t *c){
+	// Drop one reference; the last one frees the chunk.  Secure
+	// allocations were wiped as they were freed.
+	struct arena_chunk_t **pp;
+
+	if(__atomic_sub_fetch(&c->live, 1, __ATOMIC_ACQ_REL))
+		return;
+	if(c->mapped){
+		pthread_mutex_lock(&region_lock);
+		for(pp = &mapped; *pp != c; pp = &(*pp)->next)
+			;
+		*pp = c->next;
+		__atomic_sub_fetch(&nmapped, 1, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&region_lock);
+		munmap(c, CHUNK_HDR + c->size);
+	}else if(c->secure){
+		pthread_mutex_lock(&region_lock);
+		free_slots[nfree++] = (int) (((unsigned char *) c - region) / NM_ARENA_SECURE_CHUNK);
+		pthread_mutex_unlock(&region_lock);
+	}else{
+		free(c);
+	}
+}
+
+static void *chunk_alloc(struct arena_chunk_t **cp, size_t n, int secure){
+	// Cut n bytes from *cp, starting a new chunk if it is full.
+	// NULL if n does not fit in a chunk or there is none.
+	struct arena_chunk_t *c = *cp;
+	struct alloc_hdr_t *h;
+	size_t need = ALLOC_HDR + ROUND16(n);
+
+	if(need > (secure ? NM_ARENA_SECURE_CHUNK - CHUNK_HDR : BIG_ALLOC))
+		return NULL;
+	if(!c || c->used + need > c->size){
+		if(c)
+			chunk_unref(c);
+		c = *cp = chunk_new(secure);
+		if(!c)
+			return NULL;
+	}
+	h = (struct alloc_hdr_t *) ((unsigned char *) c + CHUNK_HDR + c->used);
+	c->used += need;
+	__atomic_add_fetch(&c->live, 1, __ATOMIC_RELAXED);
+	h->chunk = c;
+	h->size = n;
+	return (unsigned char *) h + ALLOC_HDR;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+static void *h_alloc(size_t n){
+	struct alloc_hdr_t *h;
+	void *p;
+
+	if(cur && (p = chunk_alloc(&cur->pub, n, 0))){
+		stat_add(STAT_ARENA);
+		return p;
+	}
+	h = malloc(ALLOC_HDR + n);
+	if(!h)
+		return NULL;
+	stat_add(STAT_HEAP);
+	h->chunk = NULL;
+	h->size = n;
+	return (unsigned char *) h + ALLOC_HDR;
+}
+
+static void *h_alloc_secure(size_t n){
+	void *p = NULL;
+
+	stat_add(STAT_SECURE);
+	if(cur && (p = chunk_alloc(&cur->sec, n, 1))){
+		stat_add(STAT_ARENA);
+		return p;
+	}
+	pthread_mutex_lock(&shared_lock);
+	p = chunk_alloc(&shared.sec, n, 1);
+	pthread_mutex_unlock(&shared_lock);
+	// Too big for a chunk, or the region is used up.
+	return p ? p : mapped_alloc(n);
+}
+
+static int h_is_secure(const void *p){
+	const unsigned char *b = p;
+	struct arena_chunk_t *c;
+	int found = 0;
+
+	if(b >= region && b < region + NM_ARENA_SECURE_REGION)
+		return 1;
+	if(!__atomic_load_n(&nmapped, __ATOMIC_ACQUIRE))
+		return 0;
+	pthread_mutex_lock(&region_lock);
+	for(c = mapped; c && !found; c = c->next)
+		found = b >= (unsigned char *) c && b < (unsigned char *) c + CHUNK_HDR + c->size;
+	pthread_mutex_unlock(&region_lock);
+	return found;
+}
+
+static void h_free(void *p){
+	struct alloc_hdr_t *h;
+
+	if(!p)
+		return;
+	h = (struct alloc_hdr_t *) ((unsigned char *) p - ALLOC_HDR);
+	stat_add(STAT_FREES);
+	if(!h->chunk){
+		free(h);
+		return;
+	}
+	if(h->chunk->secure)
+		wipe(p, h->size);
+	chunk_unref(h->chunk);
+}
+
+static void *h_realloc(void *p, size_t n){
+	struct alloc_hdr_t *h, *nh;
+	void *q;
+
+	if(!p)
+		return h_alloc(n);
+	h = (struct alloc_hdr_t *) ((unsigned char *) p - ALLOC_HDR);
+	if(!h->chunk){
+		nh = realloc(h, ALLOC_HDR + n);
+		if(!nh)
+			return NULL;
+		nh->size = n;
+		return (unsigned char *) nh + ALLOC_HDR;
+	}
+	if(n <= h->size)
+		return p;
+	q = h->chunk->secure ? h_alloc_secure(n) : h_alloc(n);
+	if(!q)
+		return NULL;
+	memcpy(q, p, h->size);
+	h_free(p);
+	return q;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+int nm_arena_install(void){
+	// Give libgcrypt the arena allocator; call it before
+	// gcry_check_version().  Returns 0, or 843 if the secure region
+	// cannot be mapped.  With NM_ARENA=off it does nothing and
+	// returns 0, and the arenas are not used.
+	const char *env = getenv("NM_ARENA");
+	int j;
+
+	if(installed || (env && !strcmp(env, "off")))
+		return 0;
+	region = mmap(NULL, NM_ARENA_SECURE_REGION, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(region == MAP_FAILED){
+		region = NULL;
+		return 843;
+	}
+#ifdef MADV_DONTDUMP
+	madvise(region, NM_ARENA_SECURE_REGION, MADV_DONTDUMP);
+#endif
+	for(j = NSLOTS - 1; j >= 0; j--)
+		free_slots[nfree++] = j;
+	gcry_set_allocation_handler(h_alloc, h_alloc_secure, h_is_secure, h_realloc, h_free);
+	installed = 1;
+	return 0;
+}
+
+int nm_arena_installed(void){
+	return installed;
+}
+
+struct nm_arena_t *nm_arena_open(void){
+	// An arena for one thread.  Its chunks are made when first
+	// needed.  NULL if out of memory.
+	return calloc(1, sizeof(struct nm_arena_t));
+}
+
+void nm_arena_close(struct nm_arena_t *a){
+	if(!a)
+		return;
+	if(cur == a)
+		cur = NULL;
+	if(a->pub)
+		chunk_unref(a->pub);
+	if(a->sec)
+		chunk_unref(a->sec);
+	free(a);
+}
+
+void nm_arena_begin(struct nm_arena_t *a){
+	// libgcrypt's allocations in this thread now come from a.
+	cur = a;
+}
+
+void nm_arena_end(struct nm_arena_t *a){
+	// The request is over: back to malloc() in this thread, and the
+	// arena's chunks are empty again if everything in them has been
+	// freed.  A chunk that still holds something is left to it.
+	struct arena_chunk_t **cp[2];
+	int j, pinned = 0;
+
+	cur = NULL;
+	if(!installed)
+		return;
+	cp[0] = &a->pub;
+	cp[1] = &a->sec;
+	for(j = 0; j < 2; j++){
+		if(!*cp[j])
+			continue;
+		if(__atomic_load_n(&(*cp[j])->live, __ATOMIC_ACQUIRE) == 1){
+			(*cp[j])->used = 0;
+		}else{
+			chunk_unref(*cp[j]);
+			*cp[j] = NULL;
+			pinned = 1;
+		}
+	}
+	stat_add(pinned ? STAT_PINNED : STAT_RESETS);
+}
+
+void nm_arena_stats(struct nm_arena_stats_t *st){
+	st->arena_allocs = __atomic_load_n(&stats[STAT_ARENA], __ATOMIC_RELAXED);
+	st->heap_allocs = __atomic_load_n(&stats[STAT_HEAP], __ATOMIC_RELAXED);
+	st->secure_allocs = __atomic_load_n(&stats[STAT_SECURE], __ATOMIC_RELAXED);
+	st->frees = __atomic_load_n(&stats[STAT_FREES], __ATOMIC_RELAXED);
+	st->chunks = __atomic_load_n(&stats[STAT_CHUNKS], __ATOMIC_RELAXED);
+	st->resets = __atomic_load_n(&stats[STAT_RESETS], __ATOMIC_RELAXED);
+	st->pinned = __atomic_load_n(&stats[STAT_PINNED], __ATOMIC_RELAXED);
+}
@@ -0,0 +1,29 @@
+// nm_arena.h
+//
+// Per-request arenas for libgcrypt's memory, installed through its
+// allocation handlers.  See nm_arena.c.
+
+#define NM_ARENA_CHUNK 65536                   // public chunks
+#define NM_ARENA_SECURE_CHUNK 16384            // secure chunks
+#define NM_ARENA_SECURE_REGION (4 * 1024 * 1024)
+
+struct nm_arena_stats_t
+{
+	unsigned long long arena_allocs;       // from a request's arena
+	unsigned long long heap_allocs;        // malloc(), outside a request
+	unsigned long long secure_allocs;      // of either kind, in secure memory
+	unsigned long long frees;
+	unsigned long long chunks;             // chunks taken from malloc or the region
+	unsigned long long resets;             // requests whose arena was reused at once
+	unsigned long long pinned;             // requests that left an object behind
+};
+
+struct nm_arena_t;
+
+int nm_arena_install(void);
+int nm_arena_installed(void);
+struct nm_arena_t *nm_arena_open(void);
+void nm_arena_close(struct nm_arena_t *a);
+void nm_arena_begin(struct nm_arena_t *a);
+void nm_arena_end(struct nm_arena_t *a);
+void nm_arena_stats(struct nm_arena_stats_t *st);
@@ -0,0 +1,434 @@
+// nm_async.c
+// Purpose:
+//   1) Let a server that runs an epoll (or poll) event loop sign and
+//      verify without blocking the loop.  The loop submits a job and
+//      goes on; a pool of worker threads runs gcry_pk_sign() or
+//      gcry_pk_verify(); finished jobs are queued and the file
+//      descriptor from nm_async_fd() becomes readable.  The loop then
+//      collects them with nm_async_complete().  Throughput grows with
+//      the number of workers, up to the number of cores.
+//   2) Bound the work that can pile up.  At most max_jobs jobs may be
+//      outstanding (submitted and not yet collected); past that a
+//      submit returns 979 at once, so the server can shed load
+//      instead of queueing without end.
+//   3) Let a job be cancelled (the client went away).  A job that has
+//      not started is taken off the queue and completes at once with
+//      998.  A job that is running cannot be interrupted, so it
+//      finishes and its result is thrown away (also 998).
+//
+// Every submitted job completes exactly once, so the caller can free
+// what it gave a job (the data, the keys, the signature, and the
+// user pointer) when the completion arrives, and not before.
+//
+// On Linux the descriptor is an eventfd; elsewhere it is the read
+// end of a pipe.  It is readable while completions are waiting; it
+// is written once when the first completion arrives, and cleared when
+// nm_async_complete() takes the last one.
+//
+// Usage:
+//    as = nm_async_open(0, 1024, &rc);
+//    add nm_async_fd(as) to the epoll set, for reading
+//    rc = nm_async_submit_sign(as, &ctx, nonce, nonce_len, conn, &id);
+//    ... when the descriptor is readable:
+//    n = nm_async_complete(as, done, 64);
+//    for each done[j]: reply to done[j].user; release done[j].sexp_sig
+//
+#include <stddef.h>
+#include <gcrypt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "nm_keys.h"
+#include "nm_async.h"
+#include "nm_stats.h"
+#include "nm_probes.h"
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#define NM_ASYNC_SIGN 1
+#define NM_ASYNC_VERIFY 2
+
+#define JOB_FREE 0
+#define JOB_QUEUED 1
+#define JOB_RUNNING 2
+#define JOB_DONE 3
+
+struct async_job_t
+{
+	unsigned long long id;
+	int state;
+	int kind;
+	int cancelled;
+	// Input, owned by the caller
+	struct nm_sign_ctx_t *ctx;
+	gcry_sexp_t sexp_pub_key;
+	gcry_sexp_t sexp_sig_in;
+	const char *data;
+	size_t data_len;
+	void *user;
+	// Result
+	int rc;
+	gcry_sexp_t sexp_sig;
+	// The free list, the queue (both ways) or the done list
+	struct async_job_t *prev, *next;
+};
+
+struct nm_async_t
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t threads[NM_ASYNC_MAX_WORKERS];
+	int nthreads;
+	struct async_job_t *jobs;
+	int max_jobs;
+	struct async_job_t *free_list;
+	struct async_job_t *queue_head, *queue_tail;
+	struct async_job_t *done_head, *done_tail;
+	int outstanding;
+	int armed;       // write the descriptor on the next completion
+	int stop;
+	int fd[2];       // read and write ends (the same eventfd on Linux)
+};
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+static void signal_fd(struct nm_async_t *as){
+	// eventfd wants 8 bytes; a pipe takes them as well.
+	uint64_t one = 1;
+
+	if(write(as->fd[1], &one, sizeof(one)) != sizeof(one)){
+		// It is full, so it is readable already.
+	}
+}
+
+static void clear_fd(struct nm_async_t *as){
+	char buff[64];
+
+	while(read(as->fd[0], buff, sizeof(buff)) > 0)
+		;
+}
+
+static void push_done(struct nm_async_t *as, struct async_job_t *job){
+	// Under the lock.
+	job->state = JOB_DONE;
+	job->next = NULL;
+	if(as->done_tail)
+		as->done_tail->next = job;
+	else
+		as->done_head = job;
+	as->done_tail = job;
+	if(as->armed){
+		as->armed = 0;
+		signal_fd(as);
+	}
+}
+
+static void unqueue(struct nm_async_t *as, struct async_job_t *job){
+	// Under the lock.
+	if(job->prev)
+		job->prev->next = job->next;
+	else
+		as->queue_head = job->next;
+	if(job->next)
+		job->next->prev = job->prev;
+	else
+		as->queue_tail = job->prev;
+	job->prev = job->next = NULL;
+}
+
+static int run_verify(struct async_job_t *job){
+	// The same check as nm_verify.  Returns 0, 902 or 903.
+	gcry_sexp_t sexp_data;
+	gcry_error_t err;
+	unsigned long long t0;
+
+	if(gcry_sexp_build(&sexp_data, NULL, "(data (flags raw) (hash sha384 %b))",
+	  (int) job->data_len, job->data))
+		return 902;
+	NM_PROBE2(verify__entry, NM_PROBE_SITE_ASYNC, job->data_len);
+	t0 = nm_stats_now_us();
+	err = gcry_pk_verify(job->sexp_sig_in, sexp_data, job->sexp_pub_key);
+	NM_PROBE3(verify__return, NM_PROBE_SITE_ASYNC, job->data_len, err);
+	nm_stats_latency(NM_HIST_VERIFY, nm_stats_now_us() - t0);
+	nm_stats_add(err ? NM_STAT_VERIFY_FAILS : NM_STAT_VERIFY_OK, 1);
+	gcry_sexp_release(sexp_data);
+	return err ? 903 : 0;
+}
+
+static void *async_worker(void *arg){
+	struct nm_async_t *as = arg;
+	struct async_job_t *job;
+	gcry_sexp_t sexp_sig;
+	int rc;
+
+	pthread_mutex_lock(&as->lock);
+	while(1){
+		while(!as->stop && !as->queue_head)
+			pthread_cond_wait(&as->cond, &as->lock);
+		if(as->stop)
+			break;
+		job = as->queue_head;
+		unqueue(as, job);
+		job->state = JOB_RUNNING;
+		pthread_mutex_unlock(&as->lock);
+
+		sexp_sig = NULL;
+		if(job->kind == NM_ASYNC_SIGN)
+			rc = nm_sign_ctx_sign(job->ctx, job->data, job->data_len, &sexp_sig, 0);
+		else
+			rc = run_verify(job);
+
+		pthread_mutex_lock(&as->lock);
+		if(job->cancelled){
+			gcry_sexp_release(sexp_sig);
+			sexp_sig = NULL;
+			rc = 998;
+		}
+		job->rc = rc;
+		job->sexp_sig = sexp_sig;
+		push_done(as, job);
+	}
+	pthread_mutex_unlock(&as->lock);
+	return NULL;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+struct nm_async_t *nm_async_open(int nworkers, int max_jobs, int *err_r){
+	// Start nworkers threads (0 for one per online CPU) that take up
+	// to max_jobs outstanding jobs.  Returns the handle, or NULL with
+	// *err_r 843.
+	struct nm_async_t *as;
+	int j;
+
+	if(nworkers <= 0)
+		nworkers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	if(nworkers <= 0)
+		nworkers = 1;
+	if(nworkers > NM_ASYNC_MAX_WORKERS)
+		nworkers = NM_ASYNC_MAX_WORKERS;
+	*err_r = 843;
+	if(max_jobs < 1 || max_jobs > NM_ASYNC_MAX_JOBS)
+		return NULL;
+	as = calloc(1, sizeof(*as));
+	if(!as)
+		return NULL;
+	as->jobs = calloc(max_jobs, sizeof(*as->jobs));
+	if(!as->jobs){
+		free(as);
+		return NULL;
+	}
+#ifdef __linux__
+	as->fd[0] = as->fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#else
+	if(pipe(as->fd))
+		as->fd[0] = -1;
+	else
+		for(j = 0; j < 2; j++){
+			int flags = fcntl(as->fd[j], F_GETFL);
+			fcntl(as->fd[j], F_SETFL, flags | O_NONBLOCK);
+			fcntl(as->fd[j], F_SETFD, FD_CLOEXEC);
+		}
+#endif
+	if(as->fd[0] < 0){
+		free(as->jobs);
+		free(as);
+		return NULL;
+	}
+	as->max_jobs = max_jobs;
+	for(j = max_jobs - 1; j >= 0; j--){
+		as->jobs[j].id = j;
+		as->jobs[j].next = as->free_list;
+		as->free_list = &as->jobs[j];
+	}
+	as->armed = 1;
+	pthread_mutex_init(&as->lock, NULL);
+	pthread_cond_init(&as->cond, NULL);
+	for(j = 0; j < nworkers; j++)
+		if(!pthread_create(&as->threads[as->nthreads], NULL, async_worker, as))
+			as->nthreads++;
+	if(as->nthreads == 0){
+		nm_async_close(as);
+		return NULL;
+	}
+	*err_r = 0;
+	return as;
+}
+
+void nm_async_close(struct nm_async_t *as){
+	// Stop the workers (waiting for the jobs that are running) and
+	// drop every job that has not been collected.  The signatures of
+	// dropped sign jobs are released.
+	int j;
+
+	if(!as)
+		return;
+	pthread_mutex_lock(&as->lock);
+	as->stop = 1;
+	pthread_cond_broadcast(&as->cond);
+	pthread_mutex_unlock(&as->lock);
+	for(j = 0; j < as->nthreads; j++)
+		pthread_join(as->threads[j], NULL);
+	for(j = 0; j < as->max_jobs; j++)
+		if(as->jobs[j].state == JOB_DONE)
+			gcry_sexp_release(as->jobs[j].sexp_sig);
+	close(as->fd[0]);
+	if(as->fd[1] != as->fd[0])
+		close(as->fd[1]);
+	pthread_cond_destroy(&as->cond);
+	pthread_mutex_destroy(&as->lock);
+	free(as->jobs);
+	free(as);
+}
+
+int nm_async_fd(struct nm_async_t *as){
+	// The descriptor to wait on for reading.  Do not read it; call
+	// nm_async_complete().
+	return as->fd[0];
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+static int submit(struct nm_async_t *as, struct async_job_t *tmpl,
+  unsigned long long *id_r){
+	// Returns 0, or 979 if max_jobs jobs are outstanding.
+	struct async_job_t *job;
+	unsigned long long id;
+
+	pthread_mutex_lock(&as->lock);
+	job = as->free_list;
+	if(!job || as->stop){
+		pthread_mutex_unlock(&as->lock);
+		return 979;
+	}
+	as->free_list = job->next;
+	// The id names the slot (id % max_jobs) and is never reused.
+	id = job->id + as->max_jobs;
+	*job = *tmpl;
+	job->id = id;
+	job->state = JOB_QUEUED;
+	job->prev = as->queue_tail;
+	job->next = NULL;
+	if(as->queue_tail)
+		as->queue_tail->next = job;
+	else
+		as->queue_head = job;
+	as->queue_tail = job;
+	as->outstanding++;
+	pthread_cond_signal(&as->cond);
+	pthread_mutex_unlock(&as->lock);
+	if(id_r)
+		*id_r = id;
+	return 0;
+}
+
+int nm_async_submit_sign(struct nm_async_t *as, struct nm_sign_ctx_t *ctx,
+  const char *data, size_t data_len, void *user, unsigned long long *id_r){
+	// Sign data_len bytes at data with a handle from
+	// nm_sign_ctx_open(), as nm_sign_ctx_sign() does.  ctx and data
+	// must stay as they are until the job completes; one ctx can be
+	// used by any number of jobs at once.  The id (for
+	// nm_async_cancel) is put in *id_r if it is not NULL.  Returns 0
+	// or 979 (too many outstanding jobs).
+	struct async_job_t tmpl;
+
+	memset(&tmpl, 0, sizeof(tmpl));
+	tmpl.kind = NM_ASYNC_SIGN;
+	tmpl.ctx = ctx;
+	tmpl.data = data;
+	tmpl.data_len = data_len;
+	tmpl.user = user;
+	return submit(as, &tmpl, id_r);
+}
+
+int nm_async_submit_verify(struct nm_async_t *as, gcry_sexp_t sexp_pub_key,
+  gcry_sexp_t sexp_sig, const char *data, size_t data_len, void *user,
+  unsigned long long *id_r){
+	// Check that sexp_sig is sexp_pub_key's signature of data_len
+	// bytes at data, as nm_verify does.  The job completes with 0,
+	// 902 or 903 (not a valid signature).  The key, the signature and
+	// the data must stay as they are until then.  Returns 0 or 979.
+	struct async_job_t tmpl;
+
+	memset(&tmpl, 0, sizeof(tmpl));
+	tmpl.kind = NM_ASYNC_VERIFY;
+	tmpl.sexp_pub_key = sexp_pub_key;
+	tmpl.sexp_sig_in = sexp_sig;
+	tmpl.data = data;
+	tmpl.data_len = data_len;
+	tmpl.user = user;
+	return submit(as, &tmpl, id_r);
+}
+
+int nm_async_cancel(struct nm_async_t *as, unsigned long long id){
+	// Cancel a job.  Returns NM_ASYNC_CANCELLED if it will complete
+	// with 998 (at once if it had not started), or NM_ASYNC_TOO_LATE
+	// if it has already finished (or been collected), in which case
+	// its completion stands.
+	struct async_job_t *job;
+	int rc = NM_ASYNC_TOO_LATE;
+
+	job = &as->jobs[id % as->max_jobs];
+	pthread_mutex_lock(&as->lock);
+	if(job->id == id){
+		if(job->state == JOB_QUEUED){
+			unqueue(as, job);
+			job->rc = 998;
+			push_done(as, job);
+			rc = NM_ASYNC_CANCELLED;
+		}else if(job->state == JOB_RUNNING){
+			job->cancelled = 1;
+			rc = NM_ASYNC_CANCELLED;
+		}
+	}
+	pthread_mutex_unlock(&as->lock);
+	return rc;
+}
+
+int nm_async_complete(struct nm_async_t *as, struct nm_async_done_t *done, int max){
+	// Take up to max finished jobs, oldest first, without waiting.
+	// Returns how many were put in done[].  The descriptor stays
+	// readable while more are waiting.
+	struct async_job_t *job;
+	int n = 0;
+
+	pthread_mutex_lock(&as->lock);
+	while(n < max && (job = as->done_head)){
+		as->done_head = job->next;
+		if(!as->done_head)
+			as->done_tail = NULL;
+		done[n].id = job->id;
+		done[n].user = job->user;
+		done[n].rc = job->rc;
+		done[n].sexp_sig = job->sexp_sig;
+		n++;
+		job->sexp_sig = NULL;
+		job->state = JOB_FREE;
+		job->next = as->free_list;
+		as->free_list = job;
+		as->outstanding--;
+	}
+	if(!as->done_head && !as->armed){
+		clear_fd(as);
+		as->armed = 1;
+	}
+	pthread_mutex_unlock(&as->lock);
+	return n;
+}
+
+int nm_async_pending(struct nm_async_t *as){
+	// Jobs submitted and not yet collected.
+	int n;
+
+	pthread_mutex_lock(&as->lock);
+	n = as->outstanding;
+	pthread_mutex_unlock(&as->lock);
+	return n;
+}
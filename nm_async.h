@@ -0,0 +1,36 @@
+// nm_async.h
+//
+// Sign and verify jobs run by a pool of worker threads, with the
+// completions signalled on a file descriptor that an epoll or poll
+// event loop can wait on.  See nm_async.c.
+
+#define NM_ASYNC_MAX_WORKERS 256
+#define NM_ASYNC_MAX_JOBS 65536
+
+// nm_async_cancel() results
+#define NM_ASYNC_CANCELLED 0
+#define NM_ASYNC_TOO_LATE 1
+
+// One finished job, from nm_async_complete().
+struct nm_async_done_t
+{
+	unsigned long long id;       // from the submit call
+	void *user;                  // as given to the submit call
+	int rc;                      // 0, the sign or verify error, or 998 (cancelled)
+	gcry_sexp_t sexp_sig;        // a sign job's signature, for the caller to release
+};
+
+struct nm_async_t;
+
+struct nm_async_t *nm_async_open(int nworkers, int max_jobs, int *err_r);
+void nm_async_close(struct nm_async_t *as);
+int nm_async_fd(struct nm_async_t *as);
+
+int nm_async_submit_sign(struct nm_async_t *as, struct nm_sign_ctx_t *ctx,
+  const char *data, size_t data_len, void *user, unsigned long long *id_r);
+int nm_async_submit_verify(struct nm_async_t *as, gcry_sexp_t sexp_pub_key,
+  gcry_sexp_t sexp_sig, const char *data, size_t data_len, void *user,
+  unsigned long long *id_r);
+int nm_async_cancel(struct nm_async_t *as, unsigned long long id);
+int nm_async_complete(struct nm_async_t *as, struct nm_async_done_t *done, int max);
+int nm_async_pending(struct nm_async_t *as);
@@ -0,0 +1,2715 @@
+// nm_bench.c
+// Purpose:
+//   1) Time the hot paths of the Natural Message tools so that
+//      changes to them can be compared before and after.
+//      Each mode prints one line per measurement with the rate
+//      in operations per second.
+//
+// Usage:
+//   nm_bench sign [iterations]
+//   nm_bench hash [messages] [msg_len]
+//   nm_bench tree [file_MB] [file]
+//   nm_bench encrypt [MB]
+//   nm_bench enckey [rsa_keygens] [wrap_ops]
+//   nm_bench rsagen [keys] [max_threads]
+//   nm_bench stream [nonces] [threads]
+//   nm_bench replay [nonces] [cache_entries]
+//   nm_bench keyring [keys] [lookups]
+//   nm_bench keyid [keys] [signatures]
+//   nm_bench revoke [entries] [lookups]
+//   nm_bench multisig [iterations]
+//   nm_bench chain [iterations]
+//   nm_bench pverify [iterations]
+//   nm_bench reject [iterations]
+//   nm_bench anchor [iterations]
+//   nm_bench keycache [seconds] [readers]
+//   nm_bench async [jobs] [max_workers]
+//   nm_bench fileload [files] [depth]
+//   nm_bench arena [ops]
+//
+// The benchmark creates its own throw-away keys in /tmp, so it does
+// not need (and should never be given) real server keys.
+//
+#include <stddef.h>
+#include <gcrypt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+// nm_keys requires some of the things above
+#include "nm_keys.h"
+#include "nm_hash.h"
+#include "nm_treehash.h"
+#include "nm_crypt.h"
+#include "nm_rsagen.h"
+#include "nm_stream.h"
+#include "nm_replay.h"
+#include "nm_keyring.h"
+#include "nm_revoke.h"
+#include "nm_multisig.h"
+#include "nm_chain.h"
+
+#include <pthread.h>
+#include "nm_pverify.h"
+#include "nm_precheck.h"
+#include "nm_anchor.h"
+#include "nm_keycache.h"
+#include "nm_async.h"
+#include "nm_fileload.h"
+#include "nm_arena.h"
+
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <poll.h>
+
+#define MAX_ENTRY_LEN 500
+#define MAX_KEY_BUFF 10000
+#define debug_lvl 0
+
+int usage();
+
+static const char bench_sign_sexp[] = "(genkey (ecc (curve \"Ed25519\")))";
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+static double now_sec(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *mode, const char *label, long ops, double secs){
+	printf("%-10s %-28s %10ld ops %9.3f s %12.1f ops/s\n",
+		mode, label, ops, secs, secs > 0 ? ops / secs : 0.0);
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+static int bench_write_key(const char *genkey_txt, char *prv_fname,
+  char *pub_fname){
+	// Generate a key pair and write it to two temp files in the
+	// NaturalMessage-Assymetric-Key wrapper that natmsg_gen_key uses.
+	// The file names are returned in prv_fname and pub_fname
+	// (MAX_ENTRY_LEN each).
+	gcry_error_t err;
+	gcry_sexp_t sexp_parms, sexp_key, sexp_part, sexp_nm_key;
+	size_t err_offset;
+	char *txt;
+	int fd;
+	FILE *fp;
+	int j;
+	const char *token[2] = {"private-key", "public-key"};
+	char *fname[2];
+
+	fname[0] = prv_fname;
+	fname[1] = pub_fname;
+
+	err = gcry_sexp_new(&sexp_parms, genkey_txt, 0, 1);
+	if(!err)
+		err = gcry_pk_genkey(&sexp_key, sexp_parms);
+	if(err){
+		fprintf (stderr, "Error.  keygen Failed: %s/%s\n",
+			gcry_strsource (err),
+			gcry_strerror (err));
+		return 999;
+	}
+	gcry_sexp_release(sexp_parms);
+
+	txt = gcry_malloc_secure(MAX_KEY_BUFF);
+	for(j = 0; j < 2; j++){
+		if(!fname[j])
+			continue;
+		sexp_part = gcry_sexp_find_token(sexp_key, token[j], 0);
+		gcry_sexp_build(&sexp_nm_key, &err_offset,
+			"(NaturalMessage-Assymetric-Key\n"
+			"  (Owner-Info\n"
+			"    (Name \"nm_bench throw-away key\")\n"
+			"    (Key-Function s))\n"
+			"  %S)", sexp_part);
+		gcry_sexp_sprint(sexp_nm_key, GCRYSEXP_FMT_ADVANCED, txt, MAX_KEY_BUFF);
+
+		strcpy(fname[j], "/tmp/nm_bench_key_XXXXXX");
+		fd = mkstemp(fname[j]);
+		if(fd < 0 || !(fp = fdopen(fd, "w"))){
+			perror("Error. Could not create a temp key file");
+			return 345;
+		}
+		fprintf(fp, "%s", txt);
+		fclose(fp);
+		gcry_sexp_release(sexp_nm_key);
+		gcry_sexp_release(sexp_part);
+	}
+	gcry_free(txt);
+	gcry_sexp_release(sexp_key);
+	return 0;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+static int bench_sign(int argc, char **argv){
+	// Signatures per second for a 32-byte nonce, done two ways:
+	//   per-call:  what nm_sign did for every signature (read and
+	//              parse the key file, find the private-key token,
+	//              build the data s-exp, sign, print the signature).
+	//   prepared:  one nm_sign_ctx_open(), then nm_sign_ctx_sign()
+	//              and the same print of the signature.
+	//   direct:    nm_sign_ctx_sign_txt(), which writes the text
+	//              itself.
+	// Then the print alone, gcry_sexp_sprint() against nm_sig_sprint(),
+	// and a check that the text is the same, with and without a
+	// Key-ID.
+	long iterations = 2000;
+	long j, nbad = 0;
+	char prv_fname[MAX_ENTRY_LEN], pub_fname[MAX_ENTRY_LEN];
+	char *sig_txt2 = gcry_malloc_secure(MAX_KEY_BUFF);
+	size_t len, len2;
+	gcry_sexp_t sexp_tmp;
+	char nonce[] = "0123456789abcdef0123456789abcdef";
+	char *nm_key_txt = gcry_calloc_secure(MAX_KEY_BUFF, 1);
+	char *sig_txt = gcry_malloc_secure(MAX_KEY_BUFF);
+	gcry_sexp_t sexp_nm_key, sexp_prv_key, sexp_data, sexp_sig;
+	struct nm_sign_ctx_t ctx;
+	size_t err_offset;
+	double t0;
+	FILE *fp;
+
+	if(argc > 2)
+		iterations = atol(argv[2]);
+
+	if(bench_write_key(bench_sign_sexp, prv_fname, pub_fname))
+		return 1;
+
+	t0 = now_sec();
+	for(j = 0; j < iterations; j++){
+		fp = fopen(prv_fname, "r");
+		if(!fp || read_sexp_file(fp, &sexp_nm_key, nm_key_txt, 0, debug_lvl)){
+			fprintf(stderr, "Error. Could not read the bench key.\n");
+			return 1;
+		}
+		fclose(fp);
+		sexp_prv_key = gcry_sexp_find_token(sexp_nm_key, "private-key", 0);
+		gcry_sexp_build(&sexp_data, &err_offset,
+			"(data (flags raw) (hash sha384 %s))", nonce);
+		if(gcry_pk_sign(&sexp_sig, sexp_data, sexp_prv_key)){
+			fprintf(stderr, "Error. Sign failed.\n");
+			return 1;
+		}
+		gcry_sexp_sprint(sexp_sig, GCRYSEXP_FMT_ADVANCED, sig_txt, MAX_KEY_BUFF);
+		gcry_sexp_release(sexp_sig);
+		gcry_sexp_release(sexp_data);
+		gcry_sexp_release(sexp_prv_key);
+		gcry_sexp_release(sexp_nm_key);
+	}
+	report("sign", "per-call key parse", iterations, now_sec() - t0);
+
+	t0 = now_sec();
+	if(nm_sign_ctx_open(&ctx, prv_fname, debug_lvl))
+		return 1;
+	for(j = 0; j < iterations; j++){
+		if(nm_sign_ctx_sign(&ctx, nonce, strlen(nonce), &sexp_sig, debug_lvl))
+			return 1;
+		gcry_sexp_sprint(sexp_sig, GCRYSEXP_FMT_ADVANCED, sig_txt, MAX_KEY_BUFF);
+		gcry_sexp_release(sexp_sig);
+	}
+	report("sign", "prepared nm_sign_ctx", iterations, now_sec() - t0);
+
+	t0 = now_sec();
+	for(j = 0; j < iterations; j++)
+		if(nm_sign_ctx_sign_txt(&ctx, nonce, strlen(nonce), sig_txt, MAX_KEY_BUFF,
+		  &len, debug_lvl))
+			return 1;
+	report("sign", "direct nm_sign_ctx_sign_txt", iterations, now_sec() - t0);
+
+	if(nm_sign_ctx_sign(&ctx, nonce, strlen(nonce), &sexp_sig, debug_lvl))
+		return 1;
+	t0 = now_sec();
+	for(j = 0; j < 100 * iterations; j++)
+		gcry_sexp_sprint(sexp_sig, GCRYSEXP_FMT_ADVANCED, sig_txt, MAX_KEY_BUFF);
+	report("sign", "print: gcry_sexp_sprint", 100 * iterations, now_sec() - t0);
+	t0 = now_sec();
+	for(j = 0; j < 100 * iterations; j++)
+		nm_sig_sprint(sexp_sig, sig_txt, MAX_KEY_BUFF);
+	report("sign", "print: nm_sig_sprint", 100 * iterations, now_sec() - t0);
+	gcry_sexp_release(sexp_sig);
+
+	//  Every other signature with a Key-ID.  The text from
+	//  nm_sign_ctx_sign_txt() must print the same after a round
+	//  trip through libgcrypt.
+	for(j = 0; j < iterations; j++){
+		ctx.has_key_id = 0;
+		if(j % 2 && nm_sign_ctx_set_key_id(&ctx, pub_fname, debug_lvl))
+			return 1;
+		if(nm_sign_ctx_sign(&ctx, nonce, strlen(nonce), &sexp_sig, debug_lvl))
+			return 1;
+		len = gcry_sexp_sprint(sexp_sig, GCRYSEXP_FMT_ADVANCED, sig_txt, MAX_KEY_BUFF);
+		len2 = nm_sig_sprint(sexp_sig, sig_txt2, MAX_KEY_BUFF);
+		gcry_sexp_release(sexp_sig);
+		if(len == 0 || len != len2 || memcmp(sig_txt, sig_txt2, len))
+			nbad++;
+		if(nm_sign_ctx_sign_txt(&ctx, nonce, strlen(nonce), sig_txt2, MAX_KEY_BUFF,
+		  &len2, debug_lvl) || gcry_sexp_new(&sexp_tmp, sig_txt2, len2, 1))
+			return 1;
+		len = gcry_sexp_sprint(sexp_tmp, GCRYSEXP_FMT_ADVANCED, sig_txt, MAX_KEY_BUFF);
+		gcry_sexp_release(sexp_tmp);
+		if(len != len2 || memcmp(sig_txt, sig_txt2, len))
+			nbad++;
+	}
+	printf("sign       %-28s %10ld checked, %ld differ\n", "text", 2 * iterations, nbad);
+	nm_sign_ctx_close(&ctx);
+
+	unlink(prv_fname);
+	unlink(pub_fname);
+	gcry_free(nm_key_txt);
+	gcry_free(sig_txt);
+	gcry_free(sig_txt2);
+	return nbad ? 1 : 0;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+static int bench_hash(int argc, char **argv){
+	// SHA-384 of many small messages (nonces, key files):
+	//   gcry_md_open:   one handle per message, the way shatest did it
+	//   gcry_md_hash:   gcry_md_hash_buffer() per message
+	//   nm_sha384_many: the multi-buffer kernels at 1, 4 and 8 lanes
+	// Every nm_sha384_many() digest is checked against libgcrypt.
+	long nmsgs = 100000;
+	size_t msg_len = 64;
+	long j;
+	int k;
+	int lanes[3] = {1, 4, 8};
+	char label[64];
+	unsigned char *msgs, *want, *got;
+	struct nm_hash_job_t *jobs;
+	gcry_md_hd_t hd;
+	double t0;
+
+	if(argc > 2)
+		nmsgs = atol(argv[2]);
+	if(argc > 3)
+		msg_len = atol(argv[3]);
+
+	msgs = malloc(nmsgs * msg_len);
+	want = malloc(nmsgs * NM_SHA384_LEN);
+	got = malloc(nmsgs * NM_SHA384_LEN);
+	jobs = malloc(nmsgs * sizeof(*jobs));
+	if(!msgs || !want || !got || !jobs){
+		fprintf(stderr, "Error. Out of memory.\n");
+		return 1;
+	}
+	gcry_create_nonce(msgs, nmsgs * msg_len);
+
+	t0 = now_sec();
+	for(j = 0; j < nmsgs; j++){
+		gcry_md_open(&hd, GCRY_MD_SHA384, 0);
+		gcry_md_write(hd, msgs + j * msg_len, msg_len);
+		memcpy(want + j * NM_SHA384_LEN, gcry_md_read(hd, GCRY_MD_SHA384), NM_SHA384_LEN);
+		gcry_md_close(hd);
+	}
+	report("hash", "gcry_md_open per message", nmsgs, now_sec() - t0);
+
+	t0 = now_sec();
+	for(j = 0; j < nmsgs; j++)
+		gcry_md_hash_buffer(GCRY_MD_SHA384, want + j * NM_SHA384_LEN,
+			msgs + j * msg_len, msg_len);
+	report("hash", "gcry_md_hash_buffer", nmsgs, now_sec() - t0);
+
+	for(k = 0; k < 3; k++){
+		nm_hash_set_lanes(lanes[k]);
+		if(nm_hash_lanes() != lanes[k])
+			continue;
+		for(j = 0; j < nmsgs; j++){
+			jobs[j].msg = msgs + j * msg_len;
+			jobs[j].len = msg_len;
+			jobs[j].digest = got + j * NM_SHA384_LEN;
+		}
+		memset(got, 0, nmsgs * NM_SHA384_LEN);
+		t0 = now_sec();
+		nm_sha384_many(jobs, nmsgs);
+		snprintf(label, sizeof(label), "nm_sha384_many %d lane(s)", lanes[k]);
+		report("hash", label, nmsgs, now_sec() - t0);
+		if(memcmp(got, want, nmsgs * NM_SHA384_LEN)){
+			fprintf(stderr, "Error. nm_sha384_many with %d lanes does not match libgcrypt.\n", lanes[k]);
+			return 1;
+		}
+	}
+	nm_hash_set_lanes(0);
+
+	free(msgs);
+	free(want);
+	free(got);
+	free(jobs);
+	return 0;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+static int bench_tree(int argc, char **argv){
+	// Tree hash throughput against the thread count, doubling from
+	// 1 up to the number of CPUs.  The file is written first (and
+	// is then likely in the page cache; pass an existing file on a
+	// cold cache to include the disk).  Also shows one plain
+	// SHA-384 stream over the same file for comparison.
+	long file_mb = 512;
+	char fname[MAX_ENTRY_LEN];
+	unsigned char root[NM_SHA384_LEN];
+	unsigned char *buff;
+	char label[64];
+	int made_file = 0;
+	int nthreads, max_threads;
+	gcry_md_hd_t hd;
+	size_t got;
+	double t0;
+	long j;
+	FILE *fp;
+	int fd;
+
+	if(argc > 2)
+		file_mb = atol(argv[2]);
+	buff = malloc(1024 * 1024);
+	if(!buff)
+		return 1;
+
+	if(argc > 3){
+		strncpy(fname, argv[3], MAX_ENTRY_LEN - 1);
+		fname[MAX_ENTRY_LEN - 1] = 0x00;
+	}else{
+		strcpy(fname, "/tmp/nm_bench_tree_XXXXXX");
+		fd = mkstemp(fname);
+		if(fd < 0 || !(fp = fdopen(fd, "w"))){
+			perror("Error. Could not create the temp file");
+			return 1;
+		}
+		gcry_create_nonce(buff, 1024 * 1024);
+		for(j = 0; j < file_mb; j++){
+			buff[0] = j & 0xff;
+			fwrite(buff, 1, 1024 * 1024, fp);
+		}
+		fclose(fp);
+		made_file = 1;
+	}
+
+	fp = fopen(fname, "rb");
+	if(!fp || gcry_md_open(&hd, GCRY_MD_SHA384, 0))
+		return 1;
+	t0 = now_sec();
+	while((got = fread(buff, 1, 1024 * 1024, fp)) > 0)
+		gcry_md_write(hd, buff, got);
+	gcry_md_read(hd, GCRY_MD_SHA384);
+	report("tree", "one SHA-384 stream (MB)", file_mb, now_sec() - t0);
+	gcry_md_close(hd);
+	fclose(fp);
+
+	max_threads = nm_tree_default_threads();
+	for(nthreads = 1; ; nthreads *= 2){
+		if(nthreads > max_threads)
+			nthreads = max_threads;
+		t0 = now_sec();
+		if(nm_tree_hash_file(fname, NM_TREE_LEAF_SIZE, nthreads, root, 0)){
+			fprintf(stderr, "Error. Tree hash failed.\n");
+			return 1;
+		}
+		snprintf(label, sizeof(label), "tree hash %d thread(s) (MB)", nthreads);
+		report("tree", label, file_mb, now_sec() - t0);
+		if(nthreads == max_threads)
+			break;
+	}
+
+	if(made_file)
+		unlink(fname);
+	free(buff);
+	return 0;
+}
+
+static int bench_encrypt(int argc, char **argv){
+	// AES-256-GCM chunk throughput of the nm_crypt worker pool
+	// against the thread count (in memory, so the disk is not
+	// measured), then one encrypt and decrypt of a temp file with an
+	// RSA-2048 key through nm_encrypt_file/nm_decrypt_file.
+	long total_mb = 256;
+	char prv_fname[MAX_ENTRY_LEN];
+	char pub_fname[MAX_ENTRY_LEN];
+	char fname[MAX_ENTRY_LEN + 8];
+	char enc_fname[MAX_ENTRY_LEN + 8];
+	unsigned char key[NM_CRYPT_KEY_LEN];
+	unsigned char nonce[NM_CRYPT_NONCE_LEN];
+	unsigned char digest[NM_SHA384_LEN];
+	struct nm_crypt_chunk_t *chunks;
+	struct nm_crypt_pool_t *pool;
+	unsigned char *buff;
+	char label[64];
+	int nthreads, max_threads, nchunks;
+	long done_mb, j;
+	double t0;
+	FILE *fp;
+	int fd;
+
+	if(argc > 2)
+		total_mb = atol(argv[2]);
+	if(total_mb < 1)
+		total_mb = 1;
+
+	gcry_create_nonce(key, sizeof(key));
+	gcry_create_nonce(nonce, sizeof(nonce));
+	gcry_create_nonce(digest, sizeof(digest));
+
+	max_threads = nm_tree_default_threads();
+	for(nthreads = 1; ; nthreads *= 2){
+		if(nthreads > max_threads)
+			nthreads = max_threads;
+		nchunks = 2 * nthreads;
+		chunks = calloc(nchunks, sizeof(struct nm_crypt_chunk_t));
+		pool = nm_crypt_pool_new(key, nonce, digest, 0, nthreads);
+		if(!chunks || !pool)
+			return 1;
+		for(j = 0; j < nchunks; j++){
+			chunks[j].buf = calloc(1, NM_CRYPT_CHUNK_SIZE);
+			chunks[j].len = NM_CRYPT_CHUNK_SIZE;
+			if(!chunks[j].buf)
+				return 1;
+		}
+		t0 = now_sec();
+		for(done_mb = 0; done_mb < total_mb; done_mb += nchunks){
+			for(j = 0; j < nchunks; j++)
+				chunks[j].index = done_mb + j;
+			nm_crypt_pool_run(pool, chunks, nchunks);
+		}
+		snprintf(label, sizeof(label), "GCM pool %d thread(s) (MB)", nthreads);
+		report("encrypt", label, done_mb, now_sec() - t0);
+		nm_crypt_pool_free(pool);
+		for(j = 0; j < nchunks; j++)
+			free(chunks[j].buf);
+		free(chunks);
+		if(nthreads == max_threads)
+			break;
+	}
+
+	// End to end, including the key wrap and the file I/O.
+	if(bench_write_key(NM_ENC_KEY_RSA_SEXP, prv_fname, pub_fname))
+		return 1;
+	buff = malloc(1024 * 1024);
+	strcpy(fname, "/tmp/nm_bench_enc_XXXXXX");
+	fd = mkstemp(fname);
+	if(!buff || fd < 0 || !(fp = fdopen(fd, "w"))){
+		perror("Error. Could not create the temp file");
+		return 1;
+	}
+	gcry_create_nonce(buff, 1024 * 1024);
+	for(j = 0; j < total_mb; j++){
+		buff[0] = j & 0xff;
+		fwrite(buff, 1, 1024 * 1024, fp);
+	}
+	fclose(fp);
+	snprintf(enc_fname, sizeof(enc_fname), "%s.nmenc", fname);
+
+	t0 = now_sec();
+	if(nm_encrypt_file(fname, enc_fname, pub_fname, 0, 0, 0))
+		return 1;
+	report("encrypt", "nm_encrypt_file (MB)", total_mb, now_sec() - t0);
+	t0 = now_sec();
+	if(nm_decrypt_file(enc_fname, fname, prv_fname, 0, 0))
+		return 1;
+	report("encrypt", "nm_decrypt_file (MB)", total_mb, now_sec() - t0);
+
+	unlink(fname);
+	unlink(enc_fname);
+	unlink(prv_fname);
+	unlink(pub_fname);
+	free(buff);
+	return 0;
+}
+
+static int bench_enckey(int argc, char **argv){
+	// The online encryption key, RSA-2048 against X25519:
+	//   keygen:  gcry_pk_genkey() with the natmsg_gen_key s-expressions.
+	//   wrap:    the public-key step of nm_encrypt (RSA-OAEP of a
+	//            32-byte content key, or ECDH with a new scalar).
+	//   unwrap:  the private-key step of nm_decrypt (RSA-OAEP decrypt,
+	//            or ECDH with the ephemeral public key).
+	// X25519 does 100 times as many keygens as RSA.
+	long rsa_keygens = 10;
+	long ops = 500;
+	const char *genkey_txt[2] = {NM_ENC_KEY_RSA_SEXP, NM_ENC_KEY_X25519_SEXP};
+	const char *name[2] = {"rsa-2048", "x25519"};
+	gcry_sexp_t sexp_parms, sexp_key, sexp_pub, sexp_prv;
+	gcry_sexp_t sexp_data, sexp_enc, sexp_plain, sexp_e, sexp_dec;
+	unsigned char content_key[32];
+	const char *eph;
+	size_t eph_len;
+	char label[64];
+	long n, j;
+	double t0;
+	int k;
+
+	if(argc > 2)
+		rsa_keygens = atol(argv[2]);
+	if(argc > 3)
+		ops = atol(argv[3]);
+	gcry_create_nonce(content_key, sizeof(content_key));
+
+	for(k = 0; k < 2; k++){
+		n = k == 0 ? rsa_keygens : rsa_keygens * 100;
+		if(gcry_sexp_new(&sexp_parms, genkey_txt[k], 0, 1))
+			return 1;
+		t0 = now_sec();
+		for(j = 0; j < n; j++){
+			if(gcry_pk_genkey(&sexp_key, sexp_parms))
+				return 1;
+			gcry_sexp_release(sexp_key);
+		}
+		snprintf(label, sizeof(label), "%s keygen", name[k]);
+		report("enckey", label, n, now_sec() - t0);
+
+		if(gcry_pk_genkey(&sexp_key, sexp_parms))
+			return 1;
+		gcry_sexp_release(sexp_parms);
+		sexp_pub = gcry_sexp_find_token(sexp_key, "public-key", 0);
+		sexp_prv = gcry_sexp_find_token(sexp_key, "private-key", 0);
+		if(k == 0)
+			gcry_sexp_build(&sexp_data, NULL,
+				"(data (flags oaep) (hash-algo sha384) (value %b))",
+				(int) sizeof(content_key), content_key);
+		else
+			gcry_sexp_build(&sexp_data, NULL, "(data (flags raw) (value %b))",
+				(int) sizeof(content_key), content_key);
+
+		t0 = now_sec();
+		for(j = 0; j < ops; j++){
+			if(gcry_pk_encrypt(&sexp_enc, sexp_data, sexp_pub))
+				return 1;
+			gcry_sexp_release(sexp_enc);
+		}
+		snprintf(label, sizeof(label), "%s wrap", name[k]);
+		report("enckey", label, ops, now_sec() - t0);
+
+		if(gcry_pk_encrypt(&sexp_enc, sexp_data, sexp_pub))
+			return 1;
+		if(k == 0){
+			sexp_e = gcry_sexp_find_token(sexp_enc, "rsa", 0);
+			gcry_sexp_build(&sexp_dec, NULL,
+				"(enc-val (flags oaep) (hash-algo sha384) %S)", sexp_e);
+		}else{
+			sexp_e = gcry_sexp_find_token(sexp_enc, "e", 0);
+			eph = gcry_sexp_nth_data(sexp_e, 1, &eph_len);
+			gcry_sexp_build(&sexp_dec, NULL, "(enc-val (ecdh (e %b)))",
+				(int) eph_len, eph);
+		}
+		t0 = now_sec();
+		for(j = 0; j < ops; j++){
+			if(gcry_pk_decrypt(&sexp_plain, sexp_dec, sexp_prv))
+				return 1;
+			gcry_sexp_release(sexp_plain);
+		}
+		snprintf(label, sizeof(label), "%s unwrap", name[k]);
+		report("enckey", label, ops, now_sec() - t0);
+
+		gcry_sexp_release(sexp_dec);
+		gcry_sexp_release(sexp_e);
+		gcry_sexp_release(sexp_enc);
+		gcry_sexp_release(sexp_data);
+		gcry_sexp_release(sexp_pub);
+		gcry_sexp_release(sexp_prv);
+		gcry_sexp_release(sexp_key);
+	}
+	return 0;
+}
+
+static int bench_rsagen(int argc, char **argv){
+	// Wall-clock RSA-2048 keygen: gcry_pk_genkey() on one thread, then
+	// nm_rsa_genkey() with the prime search on 1, 2, 4, ... threads up
+	// to the number of CPUs (or up to max_threads if given).  Keygen
+	// time varies a lot from key to key, so several keys are averaged.
+	long keys = 8;
+	int nthreads, max_threads;
+	gcry_sexp_t sexp_parms, sexp_key;
+	char label[64];
+	double t0;
+	long j;
+
+	if(argc > 2)
+		keys = atol(argv[2]);
+	max_threads = nm_tree_default_threads();
+	if(argc > 3)
+		max_threads = atoi(argv[3]);
+	if(keys < 1 || max_threads < 1)
+		return usage();
+
+	if(gcry_sexp_new(&sexp_parms, NM_ENC_KEY_RSA_SEXP, 0, 1))
+		return 1;
+	t0 = now_sec();
+	for(j = 0; j < keys; j++){
+		if(gcry_pk_genkey(&sexp_key, sexp_parms))
+			return 1;
+		gcry_sexp_release(sexp_key);
+	}
+	report("rsagen", "gcry_pk_genkey", keys, now_sec() - t0);
+	gcry_sexp_release(sexp_parms);
+
+	for(nthreads = 1; ; nthreads *= 2){
+		if(nthreads > max_threads)
+			nthreads = max_threads;
+		t0 = now_sec();
+		for(j = 0; j < keys; j++){
+			if(nm_rsa_genkey(&sexp_key, 2048, nthreads, 0))
+				return 1;
+			gcry_sexp_release(sexp_key);
+		}
+		snprintf(label, sizeof(label), "nm_rsa_genkey %d thread(s)", nthreads);
+		report("rsagen", label, keys, now_sec() - t0);
+		if(nthreads == max_threads)
+			break;
+	}
+	return 0;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+static int bench_stream(int argc, char **argv){
+	// Nonce signatures per second for a directory server:
+	//   process per nonce: run nm_sign (from the directory of
+	//                      nm_bench, if it is there) on a nonce file
+	//                      and read back the signature file.
+	//   file per nonce:    the same work in this process: parse the
+	//                      key, sign, and write a signature file.
+	//   stream lines/len:  nm_sign_stream() with the key loaded once,
+	//                      96-char hex nonces, output to /dev/null.
+	long nonces = 4000;
+	int threads = 0;
+	long j;
+	long nproc;
+	char prv_fname[MAX_ENTRY_LEN];
+	char in_fname[] = "/tmp/nm_bench_nonces_XXXXXX";
+	char nonce_fname[] = "/tmp/nm_bench_nonce_XXXXXX";
+	char sig_fname[MAX_ENTRY_LEN];
+	char self[MAX_ENTRY_LEN];
+	char nm_sign_path[MAX_ENTRY_LEN + 16];
+	char nonce[2 * NM_SHA384_LEN + 1];
+	unsigned char raw[NM_SHA384_LEN];
+	char *sig_txt = gcry_malloc_secure(MAX_KEY_BUFF);
+	struct nm_sign_ctx_t ctx;
+	gcry_sexp_t sexp_sig;
+	unsigned long long nsigned;
+	char label[64];
+	int fd, format, nthreads, status;
+	unsigned char len_buff[4];
+	ssize_t n;
+	double t0;
+	pid_t pid;
+	FILE *fp, *null_fp;
+
+	if(argc > 2)
+		nonces = atol(argv[2]);
+	if(argc > 3)
+		threads = atoi(argv[3]);
+	if(threads <= 0)
+		threads = nm_tree_default_threads();
+
+	if(bench_write_key(bench_sign_sexp, prv_fname, NULL))
+		return 1;
+	null_fp = fopen("/dev/null", "w");
+	fd = mkstemp(nonce_fname);
+	if(!null_fp || fd < 0){
+		perror("Error. Could not create the bench files");
+		return 1;
+	}
+	gcry_randomize(raw, sizeof(raw), GCRY_WEAK_RANDOM);
+	nm_hex_encode(raw, sizeof(raw), nonce);
+	if(write(fd, nonce, strlen(nonce)) != (ssize_t) strlen(nonce)){
+		perror("Error. Could not write the nonce file");
+		return 1;
+	}
+	close(fd);
+	snprintf(sig_fname, sizeof(sig_fname), "%s.sig", nonce_fname);
+
+	// nm_sign next to nm_bench, if it was built.
+	n = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	nm_sign_path[0] = 0x00;
+	if(n > 0){
+		self[n] = 0x00;
+		if(strrchr(self, '/'))
+			*strrchr(self, '/') = 0x00;
+		snprintf(nm_sign_path, sizeof(nm_sign_path), "%s/nm_sign", self);
+	}
+	if(nm_sign_path[0] != 0x00 && access(nm_sign_path, X_OK) == 0){
+		nproc = nonces / 10 > 0 ? nonces / 10 : 1;
+		t0 = now_sec();
+		for(j = 0; j < nproc; j++){
+			pid = fork();
+			if(pid == 0){
+				fd = open("/dev/null", O_WRONLY);
+				dup2(fd, 1);
+				dup2(fd, 2);
+				execl(nm_sign_path, "nm_sign", "--in", nonce_fname, "--signature",
+					sig_fname, "--key", prv_fname, (char *) NULL);
+				_exit(127);
+			}
+			if(pid < 0 || waitpid(pid, &status, 0) != pid || status != 0){
+				fprintf(stderr, "Error. %s failed.\n", nm_sign_path);
+				return 1;
+			}
+		}
+		report("stream", "process per nonce (nm_sign)", nproc, now_sec() - t0);
+	}
+
+	t0 = now_sec();
+	for(j = 0; j < nonces; j++){
+		if(nm_sign_ctx_open(&ctx, prv_fname, debug_lvl)
+		  || nm_sign_ctx_sign(&ctx, nonce, strlen(nonce), &sexp_sig, debug_lvl))
+			return 1;
+		gcry_sexp_sprint(sexp_sig, GCRYSEXP_FMT_ADVANCED, sig_txt, MAX_KEY_BUFF);
+		gcry_sexp_release(sexp_sig);
+		nm_sign_ctx_close(&ctx);
+		fp = fopen(sig_fname, "w");
+		if(!fp)
+			return 1;
+		fprintf(fp, "%s", sig_txt);
+		fclose(fp);
+	}
+	report("stream", "file per nonce", nonces, now_sec() - t0);
+
+	if(nm_sign_ctx_open(&ctx, prv_fname, debug_lvl))
+		return 1;
+	for(format = NM_STREAM_LINES; format <= NM_STREAM_LEN; format++){
+		// A new nonce file for each format.
+		fd = mkstemp(in_fname);
+		if(fd < 0 || !(fp = fdopen(fd, "w"))){
+			perror("Error. Could not create the nonce stream file");
+			return 1;
+		}
+		for(j = 0; j < nonces; j++){
+			gcry_randomize(raw, sizeof(raw), GCRY_WEAK_RANDOM);
+			nm_hex_encode(raw, sizeof(raw), nonce);
+			if(format == NM_STREAM_LINES){
+				fprintf(fp, "%s\n", nonce);
+			}else{
+				len_buff[0] = len_buff[1] = len_buff[2] = 0;
+				len_buff[3] = strlen(nonce);
+				fwrite(len_buff, 4, 1, fp);
+				fwrite(nonce, strlen(nonce), 1, fp);
+			}
+		}
+		fclose(fp);
+
+		// One thread, then all of them.
+		for(nthreads = 1; nthreads <= threads; nthreads = nthreads < threads ? threads : threads + 1){
+			fd = open(in_fname, O_RDONLY);
+			if(fd < 0)
+				return 1;
+			t0 = now_sec();
+			if(nm_sign_stream(&ctx, fd, null_fp, format, NM_STREAM_BATCH, nthreads,
+			  &nsigned, debug_lvl) || nsigned != (unsigned long long) nonces){
+				fprintf(stderr, "Error. The stream was not signed.\n");
+				return 1;
+			}
+			snprintf(label, sizeof(label), "stream %s, %d thread(s)",
+				format == NM_STREAM_LINES ? "lines" : "len", nthreads);
+			report("stream", label, nonces, now_sec() - t0);
+			close(fd);
+		}
+		unlink(in_fname);
+		strcpy(in_fname, "/tmp/nm_bench_nonces_XXXXXX");
+	}
+	nm_sign_ctx_close(&ctx);
+
+	fclose(null_fp);
+	unlink(sig_fname);
+	unlink(nonce_fname);
+	unlink(prv_fname);
+	gcry_free(sig_txt);
+	return 0;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+static int bench_replay(int argc, char **argv){
+	// The nonce replay cache (nm_replay.c) on a throw-away file:
+	//   digest:  keygrip + nonce -> cache key
+	//   insert:  new nonces, the check NMVerifyServer does after a
+	//            signature is accepted
+	//   seen:    the unlocked check done before the signature
+	//   replay:  insert the most recent nonces again; all of them
+	//            must be rejected
+	//   race:    4 processes insert the same nonces at once; each
+	//            must be accepted exactly once.
+	long nonces = 1000000;
+	unsigned long entries = 0;
+	long j, k, recent, found, cached, nrace;
+	char cache_fname[] = "/tmp/nm_bench_replay_XXXXXX";
+	unsigned char keygrip[20];
+	unsigned char *digests;
+	unsigned char nonce[16];
+	struct nm_replay_t *rc;
+	long *accepted;
+	int fd, err, status;
+	double t0;
+	pid_t pid[4];
+
+	if(argc > 2)
+		nonces = atol(argv[2]);
+	if(argc > 3)
+		entries = strtoul(argv[3], NULL, 10);
+	if(nonces <= 0)
+		return usage();
+	if(entries == 0)
+		entries = NM_REPLAY_ENTRIES;
+
+	digests = malloc(nonces * NM_REPLAY_DIGEST_LEN);
+	fd = mkstemp(cache_fname);
+	if(!digests || fd < 0){
+		perror("Error. Could not create the bench files");
+		return 1;
+	}
+	close(fd);
+	unlink(cache_fname);    // nm_replay_open() creates it
+	rc = nm_replay_open(cache_fname, entries, 0, &err);
+	if(!rc){
+		fprintf(stderr, "Error. Could not open the replay cache (%d).\n", err);
+		return 1;
+	}
+
+	gcry_randomize(keygrip, sizeof(keygrip), GCRY_WEAK_RANDOM);
+	t0 = now_sec();
+	for(j = 0; j < nonces; j++){
+		memcpy(nonce, &j, sizeof(j));
+		memset(nonce + sizeof(j), 0x5a, sizeof(nonce) - sizeof(j));
+		nm_replay_digest(keygrip, (char *) nonce, sizeof(nonce),
+			digests + j * NM_REPLAY_DIGEST_LEN);
+	}
+	report("replay", "digest", nonces, now_sec() - t0);
+
+	t0 = now_sec();
+	found = 0;
+	for(j = 0; j < nonces; j++)
+		found += nm_replay_insert(rc, digests + j * NM_REPLAY_DIGEST_LEN);
+	report("replay", "insert new", nonces, now_sec() - t0);
+	if(found)
+		fprintf(stderr, "Warning. %ld new nonces were taken for replays.\n", found);
+
+	t0 = now_sec();
+	cached = 0;
+	for(j = 0; j < nonces; j++)
+		cached += nm_replay_seen(rc, digests + j * NM_REPLAY_DIGEST_LEN);
+	report("replay", "seen", nonces, now_sec() - t0);
+
+	// Everything the cache still holds must be rejected.  Sets fill
+	// unevenly, so a few of even the newest nonces may have been
+	// pushed out; report how many of the newest quarter survive.
+	recent = nonces < (long) (entries / 4) ? nonces : (long) (entries / 4);
+	t0 = now_sec();
+	found = k = 0;
+	for(j = nonces - recent; j < nonces; j++){
+		err = nm_replay_seen(rc, digests + j * NM_REPLAY_DIGEST_LEN);
+		if(nm_replay_insert(rc, digests + j * NM_REPLAY_DIGEST_LEN))
+			found++;
+		else if(err)
+			k++;
+	}
+	report("replay", "insert replay", recent, now_sec() - t0);
+	printf("replay     %ld of %ld nonces still cached, %ld of the newest %ld "
+		"rejected\n", cached, nonces, found, recent);
+	if(k){
+		fprintf(stderr, "Error. %ld cached nonces were accepted again.\n", k);
+		return 1;
+	}
+	nm_replay_close(rc);
+
+	// Four processes on a fresh cache, all inserting the same nonces
+	// (few enough that none are pushed out).
+	unlink(cache_fname);
+	nrace = nonces < (long) (entries / 16) ? nonces : (long) (entries / 16);
+	accepted = mmap(NULL, 4 * sizeof(long), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(accepted == MAP_FAILED)
+		return 1;
+	t0 = now_sec();
+	for(k = 0; k < 4; k++){
+		pid[k] = fork();
+		if(pid[k] == 0){
+			rc = nm_replay_open(cache_fname, entries, 0, &err);
+			if(!rc)
+				_exit(1);
+			accepted[k] = 0;
+			for(j = 0; j < nrace; j++)
+				if(nm_replay_insert(rc, digests + j * NM_REPLAY_DIGEST_LEN) == 0)
+					accepted[k]++;
+			nm_replay_close(rc);
+			_exit(0);
+		}
+	}
+	for(k = 0; k < 4; k++)
+		if(pid[k] < 0 || waitpid(pid[k], &status, 0) != pid[k] || status != 0){
+			fprintf(stderr, "Error. A replay cache process failed.\n");
+			return 1;
+		}
+	report("replay", "insert, 4 processes", 4 * nrace, now_sec() - t0);
+	found = accepted[0] + accepted[1] + accepted[2] + accepted[3];
+	printf("replay     %ld of %ld nonces accepted by 4 processes\n", found, nrace);
+	if(found != nrace){
+		fprintf(stderr, "Error. The processes accepted %ld nonces, not %ld.\n",
+			found, nrace);
+		return 1;
+	}
+
+	munmap(accepted, 4 * sizeof(long));
+	unlink(cache_fname);
+	free(digests);
+	return 0;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+static int bench_keyring(int argc, char **argv){
+	// Finding a server's key among many key files:
+	//   directory scan:  open and parse key files until the one with
+	//                    the wanted Natural-Message-ID turns up (what a
+	//                    caller without a keyring does)
+	//   build:           nm_keyring_build() on the directory
+	//   open:            map and check the keyring
+	//   by id/fp/ip:     lookups, including the parsed public key.
+	long nkeys = 500;
+	long lookups = 100000;
+	long j, k, nscan;
+	char dir[] = "/tmp/nm_bench_keys_XXXXXX";
+	char kr_fname[MAX_ENTRY_LEN];
+	char fname[MAX_ENTRY_LEN + 64];
+	char spec[2 * NM_KEYRING_FP_LEN + 8];
+	char id[64];
+	char *key_txt = malloc(MAX_KEY_BUFF);
+	char *pub_txt = malloc(MAX_KEY_BUFF);
+	gcry_sexp_t sexp_parms, sexp_key, sexp_pub, sexp_file, sexp_id;
+	struct nm_keyring_t *kr;
+	const struct nm_keyring_rec_t *rec;
+	unsigned int n;
+	const char *data;
+	size_t len;
+	double t0;
+	int err;
+	FILE *fp;
+	DIR *d;
+	struct dirent *de;
+
+	if(argc > 2)
+		nkeys = atol(argv[2]);
+	if(argc > 3)
+		lookups = atol(argv[3]);
+	if(nkeys <= 0 || lookups <= 0 || !key_txt || !pub_txt)
+		return usage();
+
+	// One key pair, written out with a different ID and address for
+	// each "server" (so the files and fingerprints all differ).
+	if(gcry_sexp_new(&sexp_parms, bench_sign_sexp, 0, 1)
+	  || gcry_pk_genkey(&sexp_key, sexp_parms))
+		return 999;
+	sexp_pub = gcry_sexp_find_token(sexp_key, "public-key", 0);
+	gcry_sexp_sprint(sexp_pub, GCRYSEXP_FMT_ADVANCED, pub_txt, MAX_KEY_BUFF);
+	if(!mkdtemp(dir)){
+		perror("Error. Could not create the bench directory");
+		return 1;
+	}
+	for(j = 0; j < nkeys; j++){
+		snprintf(fname, sizeof(fname), "%s/server%06ld_PUBSignKey.key", dir, j);
+		fp = fopen(fname, "w");
+		if(!fp)
+			return 1;
+		fprintf(fp, "(NaturalMessage-Assymetric-Key \n (Owner-Info \n"
+			"  (Name \"nm_bench server %ld\")\n  (Key-Function s)\n"
+			"  (Natural-Message-ID SRV%06ld)\n  (IPV4 \"10.%ld.%ld.%ld\")\n"
+			"  (IPV6 NA)\n  (Alternative-IPV4 NA)\n"
+			"  (Expire-Date-YYYYMMDD \"20991231\")\n  )\n %s )\n",
+			j, j, (j >> 16) & 255, (j >> 8) & 255, j & 255, pub_txt);
+		fclose(fp);
+	}
+	gcry_sexp_release(sexp_pub);
+	gcry_sexp_release(sexp_key);
+	gcry_sexp_release(sexp_parms);
+
+	// Directory scan, for a few IDs spread over the directory.
+	nscan = nkeys < 50 ? nkeys : 50;
+	t0 = now_sec();
+	for(k = 0; k < nscan; k++){
+		snprintf(id, sizeof(id), "SRV%06ld", (k * 7919) % nkeys);
+		d = opendir(dir);
+		while(d && (de = readdir(d))){
+			if(de->d_name[0] == '.')
+				continue;
+			snprintf(fname, sizeof(fname), "%s/%s", dir, de->d_name);
+			fp = fopen(fname, "r");
+			if(!fp)
+				continue;
+			len = fread(key_txt, 1, MAX_KEY_BUFF - 1, fp);
+			fclose(fp);
+			key_txt[len] = 0x00;
+			if(gcry_sexp_new(&sexp_file, key_txt, 0, 1))
+				continue;
+			sexp_id = gcry_sexp_find_token(sexp_file, "Natural-Message-ID", 0);
+			data = sexp_id ? gcry_sexp_nth_data(sexp_id, 1, &len) : NULL;
+			err = data && len == strlen(id) && !memcmp(data, id, len);
+			gcry_sexp_release(sexp_id);
+			if(err){
+				sexp_pub = gcry_sexp_find_token(sexp_file, "public-key", 0);
+				gcry_sexp_release(sexp_pub);
+				gcry_sexp_release(sexp_file);
+				break;
+			}
+			gcry_sexp_release(sexp_file);
+		}
+		if(d)
+			closedir(d);
+	}
+	report("keyring", "directory scan by id", nscan, now_sec() - t0);
+
+	snprintf(kr_fname, sizeof(kr_fname), "%s.keyring", dir);
+	t0 = now_sec();
+	if(nm_keyring_build(dir, kr_fname, &n, 0) || n != (unsigned int) nkeys){
+		fprintf(stderr, "Error. The keyring was not built.\n");
+		return 1;
+	}
+	report("keyring", "build", nkeys, now_sec() - t0);
+
+	t0 = now_sec();
+	for(j = 0; j < 1000; j++){
+		kr = nm_keyring_open(kr_fname, &err);
+		if(!kr)
+			return err;
+		nm_keyring_close(kr);
+	}
+	report("keyring", "open", 1000, now_sec() - t0);
+
+	kr = nm_keyring_open(kr_fname, &err);
+	if(!kr)
+		return err;
+	for(k = 0; k < 3; k++){
+		t0 = now_sec();
+		for(j = 0; j < lookups; j++){
+			n = (j * 7919) % nkeys;
+			if(k == 0){
+				snprintf(spec, sizeof(spec), "id:SRV%06u", n);
+			}else if(k == 1){
+				strcpy(spec, "fp:");
+				nm_hex_encode(nm_keyring_rec(kr, n)->fingerprint, 8, spec + 3);
+			}else{
+				snprintf(spec, sizeof(spec), "ip:10.%u.%u.%u", (n >> 16) & 255,
+					(n >> 8) & 255, n & 255);
+			}
+			if(nm_keyring_lookup(kr, spec, 's', &rec)
+			  || nm_keyring_pubkey(kr, rec, &sexp_pub)){
+				fprintf(stderr, "Error. %s was not found.\n", spec);
+				return 1;
+			}
+			gcry_sexp_release(sexp_pub);
+		}
+		report("keyring", k == 0 ? "by id + public key" : k == 1
+			? "by fp prefix + public key" : "by ip + public key", lookups, now_sec() - t0);
+	}
+	nm_keyring_close(kr);
+
+	unlink(kr_fname);
+	for(j = 0; j < nkeys; j++){
+		snprintf(fname, sizeof(fname), "%s/server%06ld_PUBSignKey.key", dir, j);
+		unlink(fname);
+	}
+	rmdir(dir);
+	free(key_txt);
+	free(pub_txt);
+	return 0;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+static int bench_keyid(int argc, char **argv){
+	// Verifying a signature when any of several keys might have made
+	// it (key rotation, many servers):
+	//   trial:   try each candidate key until one verifies
+	//   Key-ID:  signatures from nm_sign --key-id; take the Key-ID,
+	//            find the key in a keyring, verify once.
+	long nkeys = 8;
+	long nsigs = 200;
+	long j, k, nverify;
+	char dir[] = "/tmp/nm_bench_keyid_XXXXXX";
+	char kr_fname[MAX_ENTRY_LEN];
+	char fname[MAX_ENTRY_LEN + 64];
+	char *txt = malloc(MAX_KEY_BUFF);
+	char nonce[] = "0123456789abcdef0123456789abcdef";
+	gcry_sexp_t sexp_parms, sexp_key, sexp_nm_key, sexp_data, sexp_pub;
+	gcry_sexp_t *pub, *sig;
+	struct nm_sign_ctx_t ctx;
+	struct nm_keyring_t *kr;
+	const struct nm_keyring_rec_t *rec;
+	unsigned char key_id[NM_KEY_ID_LEN];
+	unsigned int n;
+	size_t err_offset;
+	double t0;
+	int err;
+	FILE *fp;
+
+	if(argc > 2)
+		nkeys = atol(argv[2]);
+	if(argc > 3)
+		nsigs = atol(argv[3]);
+	if(nkeys <= 0 || nsigs <= 0)
+		return usage();
+	pub = calloc(nkeys, sizeof(gcry_sexp_t));
+	sig = calloc(nkeys, sizeof(gcry_sexp_t));
+	if(!txt || !pub || !sig || !mkdtemp(dir)){
+		perror("Error. Could not set up the benchmark");
+		return 1;
+	}
+	if(gcry_sexp_build(&sexp_data, &err_offset,
+	  "(data (flags raw) (hash sha384 %s))", nonce))
+		return 902;
+
+	// Each key signs the nonce once; signature j is made by key j.
+	for(j = 0; j < nkeys; j++){
+		if(gcry_sexp_new(&sexp_parms, bench_sign_sexp, 0, 1)
+		  || gcry_pk_genkey(&sexp_key, sexp_parms))
+			return 999;
+		gcry_sexp_release(sexp_parms);
+		pub[j] = gcry_sexp_find_token(sexp_key, "public-key", 0);
+		gcry_sexp_build(&sexp_nm_key, &err_offset,
+			"(NaturalMessage-Assymetric-Key\n"
+			"  (Owner-Info\n"
+			"    (Natural-Message-ID SRV%d)\n"
+			"    (Key-Function s))\n"
+			"  %S)", (int) j, pub[j]);
+		gcry_sexp_sprint(sexp_nm_key, GCRYSEXP_FMT_ADVANCED, txt, MAX_KEY_BUFF);
+		gcry_sexp_release(sexp_nm_key);
+		snprintf(fname, sizeof(fname), "%s/server%06ld_PUBSignKey.key", dir, j);
+		fp = fopen(fname, "w");
+		if(!fp)
+			return 1;
+		fprintf(fp, "%s", txt);
+		fclose(fp);
+
+		ctx.sexp_prv_key = gcry_sexp_find_token(sexp_key, "private-key", 0);
+		ctx.has_key_id = nm_key_id_file(fname, ctx.key_id) == 0;
+		if(!ctx.has_key_id
+		  || nm_sign_ctx_sign(&ctx, nonce, strlen(nonce), &sig[j], debug_lvl))
+			return 1;
+		nm_sign_ctx_close(&ctx);
+		gcry_sexp_release(sexp_key);
+	}
+	snprintf(kr_fname, sizeof(kr_fname), "%s.keyring", dir);
+	if(nm_keyring_build(dir, kr_fname, &n, 0) || n != (unsigned int) nkeys)
+		return 1;
+
+	nverify = 0;
+	t0 = now_sec();
+	for(j = 0; j < nsigs; j++){
+		for(k = 0; k < nkeys; k++){
+			nverify++;
+			if(!gcry_pk_verify(sig[j % nkeys], sexp_data, pub[k]))
+				break;
+		}
+		if(k == nkeys)
+			return 903;
+	}
+	report("keyid", "trial verification", nsigs, now_sec() - t0);
+	printf("keyid      %.2f verifications per signature with %ld keys\n",
+		(double) nverify / nsigs, nkeys);
+
+	kr = nm_keyring_open(kr_fname, &err);
+	if(!kr)
+		return err;
+	t0 = now_sec();
+	for(j = 0; j < nsigs; j++){
+		if(!nm_sig_key_id(sig[j % nkeys], key_id)
+		  || nm_keyring_find_fp(kr, key_id, NM_KEY_ID_LEN, &rec) != 1
+		  || nm_keyring_pubkey(kr, rec, &sexp_pub))
+			return 972;
+		err = gcry_pk_verify(sig[j % nkeys], sexp_data, sexp_pub);
+		gcry_sexp_release(sexp_pub);
+		if(err)
+			return 903;
+	}
+	report("keyid", "Key-ID + keyring", nsigs, now_sec() - t0);
+	nm_keyring_close(kr);
+
+	for(j = 0; j < nkeys; j++){
+		gcry_sexp_release(pub[j]);
+		gcry_sexp_release(sig[j]);
+		snprintf(fname, sizeof(fname), "%s/server%06ld_PUBSignKey.key", dir, j);
+		unlink(fname);
+	}
+	unlink(kr_fname);
+	rmdir(dir);
+	gcry_sexp_release(sexp_data);
+	free(pub);
+	free(sig);
+	free(txt);
+	return 0;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+static int cmp_revoked(const void *a, const void *b){
+	return memcmp(a, b, NM_REVOKE_FP_LEN);
+}
+
+static int bench_revoke(int argc, char **argv){
+	// Revocation list lookups (see nm_revoke.c), a million revoked
+	// keys by default:
+	//   not revoked:   the common case, mostly answered by the Bloom
+	//                  filter
+	//   sorted only:   the same lookups as a plain binary search, for
+	//                  comparison
+	//   revoked:       Bloom filter hit plus binary search
+	long nentries = 1000000;
+	long nlookups = 1000000;
+	long j, found, maybe;
+	char fname[] = "/tmp/nm_bench_revoke_XXXXXX";
+	unsigned char *fps, *absent;
+	gcry_sexp_t sexp_parms, sexp_key, sexp_prv, sexp_pub;
+	struct nm_revoke_t *rl;
+	double t0;
+	int err, fd;
+
+	if(argc > 2)
+		nentries = atol(argv[2]);
+	if(argc > 3)
+		nlookups = atol(argv[3]);
+	if(nentries <= 0 || nlookups <= 0)
+		return usage();
+	fps = malloc(nentries * NM_REVOKE_FP_LEN);
+	absent = malloc(nlookups * NM_REVOKE_FP_LEN);
+	fd = mkstemp(fname);
+	if(!fps || !absent || fd < 0){
+		perror("Error. Could not set up the benchmark");
+		return 1;
+	}
+	close(fd);
+	// Random fingerprints look like SHA-384 output.
+	gcry_create_nonce(fps, nentries * NM_REVOKE_FP_LEN);
+	gcry_create_nonce(absent, nlookups * NM_REVOKE_FP_LEN);
+	if(gcry_sexp_new(&sexp_parms, bench_sign_sexp, 0, 1)
+	  || gcry_pk_genkey(&sexp_key, sexp_parms))
+		return 999;
+	gcry_sexp_release(sexp_parms);
+	sexp_prv = gcry_sexp_find_token(sexp_key, "private-key", 0);
+	sexp_pub = gcry_sexp_find_token(sexp_key, "public-key", 0);
+
+	t0 = now_sec();
+	err = nm_revoke_build(fps, nentries, sexp_prv, fname);
+	if(err){
+		fprintf(stderr, "Error. The revocation list was not built (code %d).\n", err);
+		return err;
+	}
+	report("revoke", "build + sign", nentries, now_sec() - t0);
+
+	t0 = now_sec();
+	for(j = 0; j < 100; j++){
+		rl = nm_revoke_open(fname, &err);
+		if(!rl)
+			return err;
+		nm_revoke_close(rl);
+	}
+	report("revoke", "open", 100, now_sec() - t0);
+	rl = nm_revoke_open(fname, &err);
+	if(!rl)
+		return err;
+	t0 = now_sec();
+	if(nm_revoke_verify(rl, sexp_pub)){
+		fprintf(stderr, "Error. The revocation list signature did not verify.\n");
+		return 983;
+	}
+	report("revoke", "signature check", 1, now_sec() - t0);
+
+	found = 0;
+	t0 = now_sec();
+	for(j = 0; j < nlookups; j++)
+		found += nm_revoke_check(rl, absent + j * NM_REVOKE_FP_LEN);
+	report("revoke", "not revoked", nlookups, now_sec() - t0);
+	if(found){
+		fprintf(stderr, "Error. %ld keys that are not on the list were found.\n", found);
+		return 1;
+	}
+	maybe = 0;
+	for(j = 0; j < nlookups; j++)
+		maybe += nm_revoke_maybe(rl, absent + j * NM_REVOKE_FP_LEN);
+	printf("revoke     Bloom filter false positives %.3f%%\n", 100.0 * maybe / nlookups);
+
+	t0 = now_sec();
+	for(j = 0; j < nlookups; j++)
+		found += bsearch(absent + j * NM_REVOKE_FP_LEN, nm_revoke_entry(rl, 0),
+			nm_revoke_count(rl), NM_REVOKE_FP_LEN, cmp_revoked) != NULL;
+	report("revoke", "not revoked, sorted only", nlookups, now_sec() - t0);
+
+	t0 = now_sec();
+	for(j = 0; j < nlookups; j++)
+		found += nm_revoke_check(rl, fps + (j * 7919 % nentries) * NM_REVOKE_FP_LEN);
+	report("revoke", "revoked", nlookups, now_sec() - t0);
+	if(found != nlookups){
+		fprintf(stderr, "Error. %ld revoked keys were missed.\n", nlookups - found);
+		return 1;
+	}
+
+	nm_revoke_close(rl);
+	unlink(fname);
+	gcry_sexp_release(sexp_prv);
+	gcry_sexp_release(sexp_pub);
+	gcry_sexp_release(sexp_key);
+	free(fps);
+	free(absent);
+	return 0;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+static int bench_multisig_case(int k, int n, long iterations){
+	// Latency of one k-of-n check of an online key signature:
+	//   all, in turn:    every signature, one after another (what n
+	//                    separate Part VII checks would cost)
+	//   early exit:      one thread, stop at k valid
+	//   per CPU:         one thread per CPU (as NMVerifyServer), stop
+	//                    at k valid
+	//   per signer:      one thread per signer, stop at k valid
+	//   fail, per CPU:   every signature is bad; stop as soon as k
+	//                    can no longer be reached
+	struct nm_keyset_t set;
+	struct nm_multisig_result_t res;
+	gcry_sexp_t sexp_parms, sexp_key, sexp_prv;
+	gcry_sexp_t sigs[NM_MULTISIG_MAX], bad_sigs[NM_MULTISIG_MAX];
+	gcry_sexp_t sexp_data, sexp_other, sexp_msig, sexp_bad;
+	char nonce[] = "0123456789abcdef0123456789abcdef";
+	char other[] = "fedcba9876543210fedcba9876543210";
+	char label[64];
+	char *txt;
+	double t0, secs;
+	long it;
+	int j, c, nchecked;
+
+	memset(&set, 0, sizeof(set));
+	set.threshold = k;
+	set.n = n;
+	if(gcry_sexp_build(&sexp_data, NULL, "(data (flags raw) (hash sha384 %s))", nonce)
+	  || gcry_sexp_build(&sexp_other, NULL, "(data (flags raw) (hash sha384 %s))", other))
+		return 902;
+	for(j = 0; j < n; j++){
+		if(gcry_sexp_new(&sexp_parms, bench_sign_sexp, 0, 1)
+		  || gcry_pk_genkey(&sexp_key, sexp_parms))
+			return 999;
+		gcry_sexp_release(sexp_parms);
+		set.pub[j] = gcry_sexp_find_token(sexp_key, "public-key", 0);
+		gcry_pk_get_keygrip(set.pub[j], set.grip[j]);
+		sexp_prv = gcry_sexp_find_token(sexp_key, "private-key", 0);
+		if(gcry_pk_sign(&sigs[j], sexp_data, sexp_prv)
+		  || gcry_pk_sign(&bad_sigs[j], sexp_other, sexp_prv))
+			return 903;
+		gcry_sexp_release(sexp_prv);
+		gcry_sexp_release(sexp_key);
+	}
+	if(nm_multisig_combine(&set, sexp_data, sigs, n, &txt)
+	  || gcry_sexp_new(&sexp_msig, txt, 0, 1))
+		return 986;
+	free(txt);
+	// Valid for the other data, so bad for sexp_data.
+	if(nm_multisig_combine(&set, sexp_other, bad_sigs, n, &txt)
+	  || gcry_sexp_new(&sexp_bad, txt, 0, 1))
+		return 986;
+	free(txt);
+
+	t0 = now_sec();
+	for(it = 0; it < iterations; it++)
+		for(j = 0; j < n; j++)
+			if(gcry_pk_verify(sigs[j], sexp_data, set.pub[j]))
+				return 903;
+	secs = now_sec() - t0;
+	snprintf(label, sizeof(label), "%d-of-%d all, in turn", k, n);
+	report("multisig", label, iterations, secs);
+	printf("multisig   %-28s %10.0f us per check, %d verifications\n", label,
+		1e6 * secs / iterations, n);
+
+	for(c = 0; c < 4; c++){
+		nchecked = 0;
+		t0 = now_sec();
+		for(it = 0; it < iterations; it++){
+			j = nm_multisig_verify(&set, c == 3 ? sexp_bad : sexp_msig, sexp_data,
+				c == 0 ? 1 : c == 2 ? n : 0, &res);
+			if(j != (c == 3 ? 987 : 0))
+				return 1;
+			nchecked += res.nchecked;
+		}
+		secs = now_sec() - t0;
+		snprintf(label, sizeof(label), "%d-of-%d %s", k, n, c == 0 ? "early exit"
+			: c == 1 ? "per CPU" : c == 2 ? "per signer" : "fail, per CPU");
+		report("multisig", label, iterations, secs);
+		printf("multisig   %-28s %10.0f us per check, %.2f verifications\n", label,
+			1e6 * secs / iterations, (double) nchecked / iterations);
+	}
+
+	for(j = 0; j < n; j++){
+		gcry_sexp_release(sigs[j]);
+		gcry_sexp_release(bad_sigs[j]);
+	}
+	nm_keyset_release(&set);
+	gcry_sexp_release(sexp_msig);
+	gcry_sexp_release(sexp_bad);
+	gcry_sexp_release(sexp_data);
+	gcry_sexp_release(sexp_other);
+	return 0;
+}
+
+static int bench_multisig(int argc, char **argv){
+	// 2-of-3 and 3-of-5 offline key sets (see nm_multisig.c).  The
+	// parallel cases need as many CPUs as signers to show their gain.
+	long iterations = 200;
+	int rc;
+
+	if(argc > 2)
+		iterations = atol(argv[2]);
+	if(iterations <= 0)
+		return usage();
+	printf("multisig   %ld CPUs\n", sysconf(_SC_NPROCESSORS_ONLN));
+	rc = bench_multisig_case(2, 3, iterations);
+	if(!rc)
+		rc = bench_multisig_case(3, 5, iterations);
+	if(rc)
+		fprintf(stderr, "Error. The multisig benchmark failed (code %d).\n", rc);
+	return rc;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+static int bench_chain_case(int depth, long iterations){
+	// A chain of depth keys: the offline key, depth - 2 intermediate
+	// keys and the online key (depth - 1 links).
+	//   no cache:          every link verified, as a one-shot
+	//                      NMVerifyServer does
+	//   cached:            every link found in the cache
+	//   nonce + no cache:  the whole check of a request (the online
+	//                      key's signature of a nonce, then the chain)
+	//   nonce + cached:    the same in the steady state of a process
+	//                      that keeps the cache
+	struct nm_chain_cache_t *cache;
+	struct nm_chain_result_t res;
+	gcry_sexp_t sexp_parms, sexp_key[NM_CHAIN_MAX_LINKS + 1];
+	gcry_sexp_t sexp_prv, sexp_pub, sexp_file, sexp_root, sexp_chain;
+	gcry_sexp_t sexp_nonce, sexp_nonce_sig, sexp_leaf_pub;
+	char nonce[] = "0123456789abcdef0123456789abcdef";
+	char key_txt[NM_CHAIN_MAX_LINKS + 1][MAX_KEY_BUFF];
+	char label[64];
+	char *chain_txt, *link_txt;
+	size_t len = 0;
+	double t0, secs;
+	long it;
+	int j, c, nverified;
+
+	chain_txt = malloc(NM_CHAIN_MAX_LINKS * 2 * MAX_KEY_BUFF);
+	if(!chain_txt)
+		return 843;
+	len = sprintf(chain_txt, "(NaturalMessage-Key-Chain\n");
+	for(j = 0; j < depth; j++){
+		if(gcry_sexp_new(&sexp_parms, bench_sign_sexp, 0, 1)
+		  || gcry_pk_genkey(&sexp_key[j], sexp_parms))
+			return 999;
+		gcry_sexp_release(sexp_parms);
+		sexp_pub = gcry_sexp_find_token(sexp_key[j], "public-key", 0);
+		if(gcry_sexp_build(&sexp_file, NULL,
+		  "(NaturalMessage-Assymetric-Key\n"
+		  "  (Owner-Info\n"
+		  "    (Name \"nm_bench chain key\")\n"
+		  "    (Key-Function %s)\n"
+		  "    (Expire-Date-YYYYMMDD \"20991231\"))\n"
+		  "  %S)", j == depth - 1 ? "s" : "c", sexp_pub))
+			return 902;
+		gcry_sexp_sprint(sexp_file, GCRYSEXP_FMT_ADVANCED, key_txt[j], MAX_KEY_BUFF);
+		gcry_sexp_release(sexp_file);
+		gcry_sexp_release(sexp_pub);
+		if(j == 0)
+			continue;
+		sexp_prv = gcry_sexp_find_token(sexp_key[j - 1], "private-key", 0);
+		if(nm_chain_link_text(sexp_prv, key_txt[j], strlen(key_txt[j]), &link_txt))
+			return 990;
+		gcry_sexp_release(sexp_prv);
+		strcpy(chain_txt + len, link_txt);
+		len += strlen(link_txt);
+		free(link_txt);
+	}
+	strcpy(chain_txt + len, ")\n");
+	if(gcry_sexp_new(&sexp_chain, chain_txt, 0, 1))
+		return 990;
+	free(chain_txt);
+	sexp_root = gcry_sexp_find_token(sexp_key[0], "public-key", 0);
+	sexp_leaf_pub = gcry_sexp_find_token(sexp_key[depth - 1], "public-key", 0);
+	sexp_prv = gcry_sexp_find_token(sexp_key[depth - 1], "private-key", 0);
+	if(gcry_sexp_build(&sexp_nonce, NULL, "(data (flags raw) (hash sha384 %s))", nonce)
+	  || gcry_pk_sign(&sexp_nonce_sig, sexp_nonce, sexp_prv))
+		return 903;
+	gcry_sexp_release(sexp_prv);
+	cache = nm_chain_cache_new(0);
+	if(!cache)
+		return 843;
+
+	for(c = 0; c < 4; c++){
+		nverified = 0;
+		t0 = now_sec();
+		for(it = 0; it < iterations; it++){
+			if(c >= 2 && gcry_pk_verify(sexp_nonce_sig, sexp_nonce, sexp_leaf_pub))
+				return 903;
+			j = nm_chain_verify(c & 1 ? cache : NULL, sexp_root, 0, sexp_chain,
+				key_txt[depth - 1], strlen(key_txt[depth - 1]), 20240101, NULL, &res);
+			if(j)
+				return j;
+			nverified += res.nverified;
+		}
+		secs = now_sec() - t0;
+		snprintf(label, sizeof(label), "depth %d %s", depth, c == 0 ? "no cache"
+			: c == 1 ? "cached" : c == 2 ? "nonce + no cache" : "nonce + cached");
+		report("chain", label, iterations, secs);
+		printf("chain      %-28s %10.0f us per check, %.2f link verifications\n", label,
+			1e6 * secs / iterations, (double) nverified / iterations);
+	}
+
+	nm_chain_cache_free(cache);
+	for(j = 0; j < depth; j++)
+		gcry_sexp_release(sexp_key[j]);
+	gcry_sexp_release(sexp_root);
+	gcry_sexp_release(sexp_leaf_pub);
+	gcry_sexp_release(sexp_chain);
+	gcry_sexp_release(sexp_nonce);
+	gcry_sexp_release(sexp_nonce_sig);
+	return 0;
+}
+
+static int bench_chain(int argc, char **argv){
+	// Key chains of depth 2 (offline key -> online key), 3 and 5
+	// (see nm_chain.c).  The first cached iteration fills the cache.
+	long iterations = 200;
+	int depth[3] = {2, 3, 5};
+	int j, rc = 0;
+
+	if(argc > 2)
+		iterations = atol(argv[2]);
+	if(iterations <= 0)
+		return usage();
+	for(j = 0; j < 3 && !rc; j++)
+		rc = bench_chain_case(depth[j], iterations);
+	if(rc)
+		fprintf(stderr, "Error. The chain benchmark failed (code %d).\n", rc);
+	return rc;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+struct bench_verify_t
+{
+	gcry_sexp_t sig, data, pub;
+};
+
+static int bench_verify_task(void *arg){
+	struct bench_verify_t *v = arg;
+	return gcry_pk_verify(v->sig, v->data, v->pub) ? 903 : 0;
+}
+
+static int bench_pverify(int argc, char **argv){
+	// Latency of the two signature checks of one NMVerifyServer
+	// request (the nonce by the online key, the online key file by
+	// the offline key):
+	//   in turn:          one after the other, as by default
+	//   parallel:         at the same time (--parallel-verify)
+	//   parallel, fail:   the nonce signature is bad; the time until
+	//                     the failure is known
+	// The parallel cases need two CPUs to show their gain.
+	struct bench_verify_t v[2], bad;
+	struct nm_pverify_task_t tasks[2];
+	struct nm_pverify_t pv;
+	gcry_sexp_t sexp_parms, sexp_key[2], sexp_prv, sexp_other;
+	char nonce[] = "0123456789abcdef0123456789abcdef";
+	char other[] = "fedcba9876543210fedcba9876543210";
+	char key_txt[] = "(NaturalMessage-Assymetric-Key (Owner-Info (Name \"nm_bench\")))";
+	long iterations = 200, it;
+	double t0, secs, wait_secs;
+	const char *label[3] = {"in turn", "parallel", "parallel, fail"};
+	int j, c, rc;
+
+	if(argc > 2)
+		iterations = atol(argv[2]);
+	if(iterations <= 0)
+		return usage();
+	for(j = 0; j < 2; j++){
+		if(gcry_sexp_new(&sexp_parms, bench_sign_sexp, 0, 1)
+		  || gcry_pk_genkey(&sexp_key[j], sexp_parms))
+			return 999;
+		gcry_sexp_release(sexp_parms);
+		v[j].pub = gcry_sexp_find_token(sexp_key[j], "public-key", 0);
+	}
+	if(gcry_sexp_build(&v[0].data, NULL, "(data (flags raw) (hash sha384 %s))", nonce)
+	  || gcry_sexp_build(&v[1].data, NULL, "(data (flags raw) (hash sha384 %s))", key_txt)
+	  || gcry_sexp_build(&sexp_other, NULL, "(data (flags raw) (hash sha384 %s))", other))
+		return 902;
+	for(j = 0; j < 2; j++){
+		sexp_prv = gcry_sexp_find_token(sexp_key[j], "private-key", 0);
+		if(gcry_pk_sign(&v[j].sig, v[j].data, sexp_prv))
+			return 903;
+		gcry_sexp_release(sexp_prv);
+	}
+	sexp_prv = gcry_sexp_find_token(sexp_key[0], "private-key", 0);
+	bad = v[0];
+	if(gcry_pk_sign(&bad.sig, sexp_other, sexp_prv))
+		return 903;
+	gcry_sexp_release(sexp_prv);
+
+	printf("pverify    %ld CPUs\n", sysconf(_SC_NPROCESSORS_ONLN));
+	for(c = 0; c < 3; c++){
+		wait_secs = 0;
+		t0 = now_sec();
+		for(it = 0; it < iterations; it++){
+			if(c == 0){
+				rc = bench_verify_task(&v[0]);
+				if(!rc)
+					rc = bench_verify_task(&v[1]);
+			}else{
+				tasks[0].fn = bench_verify_task;
+				tasks[0].arg = c == 2 ? &bad : &v[0];
+				tasks[1].fn = bench_verify_task;
+				tasks[1].arg = &v[1];
+				nm_pverify_start(&pv, tasks, 2);
+				rc = nm_pverify_wait(&pv);
+				// The time to the verdict; the join is not part of it.
+				wait_secs += now_sec() - t0;
+				nm_pverify_join(&pv);
+				t0 = now_sec();
+			}
+			if(rc != (c == 2 ? 903 : 0))
+				return 1;
+		}
+		secs = c == 0 ? now_sec() - t0 : wait_secs;
+		report("pverify", label[c], iterations, secs);
+		printf("pverify    %-28s %10.0f us per request\n", label[c],
+			1e6 * secs / iterations);
+	}
+
+	for(j = 0; j < 2; j++){
+		gcry_sexp_release(v[j].sig);
+		gcry_sexp_release(v[j].data);
+		gcry_sexp_release(v[j].pub);
+		gcry_sexp_release(sexp_key[j]);
+	}
+	gcry_sexp_release(bad.sig);
+	gcry_sexp_release(sexp_other);
+	return 0;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+struct bench_reject_t
+{
+	gcry_sexp_t pub, data;                 // online key, nonce
+	gcry_sexp_t keysig, key_data;          // its signature by the offline key
+	gcry_sexp_t offline_pub, offline_file;
+	char offline_txt[MAX_KEY_BUFF];
+};
+
+static int bench_reject_request(struct bench_reject_t *b, const char *sig_txt,
+  gcry_sexp_t sexp_key_file, const char *fp_hex, int cheap_first){
+	// One NMVerifyServer request from its nonce signature as
+	// received: the checks of nm_precheck, before the two signature
+	// checks (cheap_first) or after them.  Returns 0, 543, 903 or
+	// the code of the stage that rejected it.
+	gcry_sexp_t sexp_sig;
+	int stage = NM_PRECHECK_OK, rc = 0, pass;
+
+	if(gcry_sexp_new(&sexp_sig, sig_txt, 0, 1))
+		return 543;
+	for(pass = 0; pass < 2 && !stage && !rc; pass++){
+		if(pass == (cheap_first ? 0 : 1)){
+			stage = nm_precheck_sig(sexp_sig, b->pub);
+			if(!stage)
+				stage = nm_precheck_sig(b->keysig, b->offline_pub);
+			if(!stage)
+				stage = nm_precheck_expiry(sexp_key_file, 20240101);
+			if(!stage)
+				stage = nm_precheck_expiry(b->offline_file, 20240101);
+			if(!stage)
+				stage = nm_precheck_pin(b->offline_txt, strlen(b->offline_txt), fp_hex);
+		}else if(gcry_pk_verify(sexp_sig, b->data, b->pub)
+		  || gcry_pk_verify(b->keysig, b->key_data, b->offline_pub)){
+			rc = 903;
+		}
+	}
+	gcry_sexp_release(sexp_sig);
+	return stage ? nm_precheck_reject(stage) : rc;
+}
+
+static int bench_reject(int argc, char **argv){
+	// Requests per second that NMVerifyServer can turn away, by the
+	// stage that rejects them, against a request that passes (two
+	// signature checks).  The "checked last" cases reject the same
+	// request only after the signatures, as a server without the
+	// cheap-checks-first order would.  Revocation is timed by
+	// "nm_bench revoke".
+	struct bench_reject_t *b;
+	gcry_sexp_t sexp_parms, sexp_key[2], sexp_prv, sexp_pub, sexp_file[2];
+	gcry_sexp_t sexp_expired, sexp_sig;
+	char nonce[] = "0123456789abcdef0123456789abcdef";
+	char key_txt[MAX_KEY_BUFF], good_sig[MAX_KEY_BUFF], rsa_sig[] =
+		"(sig-val (rsa (s #0123456789abcdef#)))";
+	char long_sig[300], fp_hex[2 * NM_PRECHECK_FP_LEN + 1], bad_fp[2 * NM_PRECHECK_FP_LEN + 1];
+	unsigned char fp[NM_PRECHECK_FP_LEN];
+	long iterations = 2000, it;
+	double t0, secs;
+	int j, c, rc;
+	struct
+	{
+		const char *label;
+		const char *sig_txt;
+		int expired;
+		int wrong_pin;
+		int cheap_first;
+		int rc;
+	} cases[] = {
+		{"valid, full verify",      good_sig, 0, 0, 1, 0},
+		{"not an s-expression",     "((garbage", 0, 0, 1, 543},
+		{"structure (rsa for ecc)", rsa_sig, 0, 0, 1, 995},
+		{"siglen",                  long_sig, 0, 0, 1, 996},
+		{"expired key",             good_sig, 1, 0, 1, 992},
+		{"wrong pin",               good_sig, 0, 1, 1, 997},
+		{"expired, checked last",   good_sig, 1, 0, 0, 992},
+		{"wrong pin, checked last", good_sig, 0, 1, 0, 997}};
+
+	if(argc > 2)
+		iterations = atol(argv[2]);
+	if(iterations <= 0)
+		return usage();
+	b = calloc(1, sizeof(*b));
+	if(!b)
+		return 843;
+
+	//  [0] is the offline key, [1] the online key.
+	for(j = 0; j < 2; j++){
+		if(gcry_sexp_new(&sexp_parms, bench_sign_sexp, 0, 1)
+		  || gcry_pk_genkey(&sexp_key[j], sexp_parms))
+			return 999;
+		gcry_sexp_release(sexp_parms);
+		sexp_pub = gcry_sexp_find_token(sexp_key[j], "public-key", 0);
+		if(gcry_sexp_build(&sexp_file[j], NULL,
+		  "(NaturalMessage-Assymetric-Key\n"
+		  "  (Owner-Info\n"
+		  "    (Name \"nm_bench reject key\")\n"
+		  "    (Key-Function s)\n"
+		  "    (Expire-Date-YYYYMMDD \"20991231\"))\n"
+		  "  %S)", sexp_pub))
+			return 902;
+		gcry_sexp_release(sexp_pub);
+	}
+	b->offline_file = sexp_file[0];
+	b->offline_pub = gcry_sexp_find_token(sexp_key[0], "public-key", 0);
+	b->pub = gcry_sexp_find_token(sexp_key[1], "public-key", 0);
+	gcry_sexp_sprint(sexp_file[0], GCRYSEXP_FMT_ADVANCED, b->offline_txt, MAX_KEY_BUFF);
+	gcry_sexp_sprint(sexp_file[1], GCRYSEXP_FMT_ADVANCED, key_txt, MAX_KEY_BUFF);
+	sexp_pub = gcry_sexp_find_token(sexp_key[1], "public-key", 0);
+	if(gcry_sexp_build(&sexp_expired, NULL,
+	  "(NaturalMessage-Assymetric-Key\n"
+	  "  (Owner-Info\n"
+	  "    (Name \"nm_bench reject key\")\n"
+	  "    (Key-Function s)\n"
+	  "    (Expire-Date-YYYYMMDD \"20200101\"))\n"
+	  "  %S)", sexp_pub))
+		return 902;
+	gcry_sexp_release(sexp_pub);
+
+	if(gcry_sexp_build(&b->data, NULL, "(data (flags raw) (hash sha384 %s))", nonce)
+	  || gcry_sexp_build(&b->key_data, NULL, "(data (flags raw) (hash sha384 %s))", key_txt))
+		return 902;
+	sexp_prv = gcry_sexp_find_token(sexp_key[1], "private-key", 0);
+	if(gcry_pk_sign(&sexp_sig, b->data, sexp_prv))
+		return 903;
+	gcry_sexp_release(sexp_prv);
+	gcry_sexp_sprint(sexp_sig, GCRYSEXP_FMT_ADVANCED, good_sig, MAX_KEY_BUFF);
+	gcry_sexp_release(sexp_sig);
+	sexp_prv = gcry_sexp_find_token(sexp_key[0], "private-key", 0);
+	if(gcry_pk_sign(&b->keysig, b->key_data, sexp_prv))
+		return 903;
+	gcry_sexp_release(sexp_prv);
+
+	//  An r of 64 bytes cannot come from a 255-bit key.
+	j = sprintf(long_sig, "(sig-val (ecdsa (r #");
+	for(c = 0; c < 64; c++)
+		j += sprintf(long_sig + j, "%02x", c + 1);
+	sprintf(long_sig + j, "#) (s #01#)))");
+
+	gcry_md_hash_buffer(GCRY_MD_SHA384, fp, b->offline_txt, strlen(b->offline_txt));
+	for(j = 0; j < NM_PRECHECK_FP_LEN; j++)
+		sprintf(fp_hex + 2 * j, "%02X", fp[j]);
+	strcpy(bad_fp, fp_hex);
+	bad_fp[0] = bad_fp[0] == '0' ? '1' : '0';
+
+	for(c = 0; c < (int) (sizeof(cases) / sizeof(cases[0])); c++){
+		t0 = now_sec();
+		for(it = 0; it < iterations; it++){
+			rc = bench_reject_request(b, cases[c].sig_txt,
+				cases[c].expired ? sexp_expired : sexp_file[1],
+				cases[c].wrong_pin ? bad_fp : fp_hex, cases[c].cheap_first);
+			if(rc != cases[c].rc){
+				fprintf(stderr, "Error. %s: code %d, expected %d.\n", cases[c].label, rc,
+					cases[c].rc);
+				return 1;
+			}
+		}
+		secs = now_sec() - t0;
+		report("reject", cases[c].label, iterations, secs);
+	}
+
+	for(j = 0; j < 2; j++)
+		gcry_sexp_release(sexp_key[j]);
+	gcry_sexp_release(sexp_file[0]);
+	gcry_sexp_release(sexp_file[1]);
+	gcry_sexp_release(sexp_expired);
+	gcry_sexp_release(b->offline_pub);
+	gcry_sexp_release(b->pub);
+	gcry_sexp_release(b->data);
+	gcry_sexp_release(b->key_data);
+	gcry_sexp_release(b->keysig);
+	free(b);
+	return 0;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+static int bench_anchor(int argc, char **argv){
+	// Getting the offline key ready and pinned, as NMVerifyServer
+	// does at start-up:
+	//   key file:       read the file, parse the text, hash it and
+	//                   compare with Fingerprint
+	//   anchor:         decode the built-in canonical bytes and
+	//                   compare the stored fingerprint (nm_anchor.c)
+	struct nm_anchor_t anchor;
+	gcry_sexp_t sexp_key;
+	char pub_fname[MAX_ENTRY_LEN];
+	char fp_hex[2 * NM_ANCHOR_FP_LEN + 1];
+	char *txt;
+	unsigned char *canon;
+	FILE *fp;
+	size_t len;
+	long iterations = 20000, it;
+	double t0, secs;
+	int j, c, rc;
+
+	if(argc > 2)
+		iterations = atol(argv[2]);
+	if(iterations <= 0)
+		return usage();
+	rc = bench_write_key(bench_sign_sexp, NULL, pub_fname);
+	if(rc)
+		return rc;
+	txt = malloc(MAX_KEY_BUFF);
+	if(!txt)
+		return 843;
+	fp = fopen(pub_fname, "r");
+	if(!fp)
+		return 439;
+	len = fread(txt, 1, MAX_KEY_BUFF - 1, fp);
+	fclose(fp);
+	txt[len] = 0x00;
+
+	//  What nm_anchorgen would generate for this key.
+	memset(&anchor, 0, sizeof(anchor));
+	anchor.name = "bench";
+	gcry_md_hash_buffer(GCRY_MD_SHA384, anchor.fp, txt, len);
+	for(j = 0; j < NM_ANCHOR_FP_LEN; j++)
+		sprintf(fp_hex + 2 * j, "%02X", anchor.fp[j]);
+	if(gcry_sexp_new(&sexp_key, txt, 0, 1))
+		return 999;
+	anchor.canon_len = gcry_sexp_sprint(sexp_key, GCRYSEXP_FMT_CANON, NULL, 0);
+	canon = malloc(anchor.canon_len);
+	if(!canon)
+		return 843;
+	anchor.canon_len = gcry_sexp_sprint(sexp_key, GCRYSEXP_FMT_CANON, canon,
+		anchor.canon_len);
+	anchor.canon = canon;
+	gcry_sexp_release(sexp_key);
+
+	for(c = 0; c < 2; c++){
+		t0 = now_sec();
+		for(it = 0; it < iterations; it++){
+			if(c == 0){
+				fp = fopen(pub_fname, "r");
+				if(!fp)
+					return 439;
+				len = fread(txt, 1, MAX_KEY_BUFF - 1, fp);
+				fclose(fp);
+				txt[len] = 0x00;
+				rc = gcry_sexp_new(&sexp_key, txt, 0, 1) ? 999
+					: nm_precheck_pin(txt, len, fp_hex);
+			}else{
+				rc = nm_anchor_key(&anchor, &sexp_key);
+				if(!rc)
+					rc = nm_precheck_pin_fp(anchor.fp, fp_hex);
+			}
+			if(rc)
+				return rc;
+			gcry_sexp_release(sexp_key);
+		}
+		secs = now_sec() - t0;
+		report("anchor", c == 0 ? "key file" : "anchor", iterations, secs);
+	}
+
+	remove(pub_fname);
+	free(canon);
+	free(txt);
+	return 0;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+#define BENCH_KEYCACHE_KEYS 16
+#define BENCH_KEYCACHE_SAMPLES 200000
+
+struct bench_keycache_t
+{
+	struct nm_keycache_t *kc;
+	volatile int stop;
+	long lookups;
+	int missing;
+	int nsamples;
+	double *samples;      // lookup latencies in us
+};
+
+static void *bench_keycache_reader(void *arg){
+	// enter, find a key by name, leave, as a verify thread would
+	// around its gcry_pk_verify().
+	struct bench_keycache_t *r = arg;
+	const struct nm_keycache_snap_t *snap;
+	char name[32];
+	double t0, t1;
+	int reader, j = 0;
+
+	reader = nm_keycache_reader(r->kc);
+	if(reader < 0)
+		return NULL;
+	while(!r->stop){
+		snprintf(name, sizeof(name), "key%02d.key", j++ % BENCH_KEYCACHE_KEYS);
+		t0 = now_sec();
+		snap = nm_keycache_enter(r->kc, reader);
+		if(!nm_keycache_find(snap, name))
+			r->missing++;
+		nm_keycache_leave(r->kc, reader);
+		t1 = now_sec();
+		if(r->nsamples < BENCH_KEYCACHE_SAMPLES)
+			r->samples[r->nsamples++] = 1e6 * (t1 - t0);
+		r->lookups++;
+	}
+	nm_keycache_reader_done(r->kc, reader);
+	return NULL;
+}
+
+static int cmp_double(const void *a, const void *b){
+	double x = *(const double *) a, y = *(const double *) b;
+	return x < y ? -1 : x > y;
+}
+
+static int bench_keycache(int argc, char **argv){
+	// Key lookups by reader threads from nm_keycache while the key
+	// directory is left alone, and while its keys are being rotated
+	// (a new file renamed over an old one every 10 ms, as a rotation
+	// script would).  A rotation should not show in the lookup
+	// latency.
+	struct bench_keycache_t r[NM_KEYCACHE_MAX_READERS];
+	pthread_t threads[NM_KEYCACHE_MAX_READERS];
+	struct nm_keycache_t *kc;
+	gcry_sexp_t sexp_parms, sexp_key, sexp_pub, sexp_file;
+	char dir[] = "/tmp/nm_bench_keycache_XXXXXX";
+	char fname[MAX_ENTRY_LEN], tmp_fname[MAX_ENTRY_LEN];
+	char *key_txt[2][BENCH_KEYCACHE_KEYS];
+	double seconds = 2, t0, *all;
+	unsigned long long reloads, parsed;
+	long lookups, rotations;
+	int nreaders = 2, nstarted, j, k, v, c, n, retired, rc;
+	FILE *fp;
+
+	if(argc > 2)
+		seconds = atof(argv[2]);
+	if(argc > 3)
+		nreaders = atoi(argv[3]);
+	if(seconds <= 0 || nreaders < 1 || nreaders > NM_KEYCACHE_MAX_READERS)
+		return usage();
+	if(!mkdtemp(dir))
+		return 345;
+
+	//  Two versions of each key file: the one in the directory and
+	//  the one that replaces it.
+	for(v = 0; v < 2; v++)
+		for(k = 0; k < BENCH_KEYCACHE_KEYS; k++){
+			key_txt[v][k] = malloc(MAX_KEY_BUFF);
+			if(!key_txt[v][k])
+				return 843;
+			if(gcry_sexp_new(&sexp_parms, bench_sign_sexp, 0, 1)
+			  || gcry_pk_genkey(&sexp_key, sexp_parms))
+				return 999;
+			gcry_sexp_release(sexp_parms);
+			sexp_pub = gcry_sexp_find_token(sexp_key, "public-key", 0);
+			if(gcry_sexp_build(&sexp_file, NULL,
+			  "(NaturalMessage-Assymetric-Key\n"
+			  "  (Owner-Info\n"
+			  "    (Name \"nm_bench keycache key\")\n"
+			  "    (Key-Function s)\n"
+			  "    (Expire-Date-YYYYMMDD \"20991231\"))\n"
+			  "  %S)", sexp_pub))
+				return 902;
+			gcry_sexp_sprint(sexp_file, GCRYSEXP_FMT_ADVANCED, key_txt[v][k], MAX_KEY_BUFF);
+			gcry_sexp_release(sexp_file);
+			gcry_sexp_release(sexp_pub);
+			gcry_sexp_release(sexp_key);
+		}
+	for(k = 0; k < BENCH_KEYCACHE_KEYS; k++){
+		snprintf(fname, sizeof(fname), "%s/key%02d.key", dir, k);
+		fp = fopen(fname, "w");
+		if(!fp)
+			return 345;
+		fputs(key_txt[0][k], fp);
+		fclose(fp);
+	}
+	kc = nm_keycache_open(dir, &rc);
+	if(!kc)
+		return rc;
+
+	for(c = 0; c < 2; c++){
+		nstarted = 0;
+		for(j = 0; j < nreaders; j++){
+			memset(&r[j], 0, sizeof(r[j]));
+			r[j].kc = kc;
+			r[j].samples = malloc(BENCH_KEYCACHE_SAMPLES * sizeof(double));
+			if(!r[j].samples)
+				return 843;
+		}
+		for(j = 0; j < nreaders; j++)
+			if(!pthread_create(&threads[nstarted], NULL, bench_keycache_reader, &r[j]))
+				nstarted++;
+		t0 = now_sec();
+		rotations = 0;
+		while(now_sec() - t0 < seconds){
+			if(c == 0){
+				usleep(10000);
+				continue;
+			}
+			k = rotations % BENCH_KEYCACHE_KEYS;
+			v = (rotations / BENCH_KEYCACHE_KEYS + 1) % 2;
+			snprintf(fname, sizeof(fname), "%s/key%02d.key", dir, k);
+			snprintf(tmp_fname, sizeof(tmp_fname), "%s/.key%02d.tmp", dir, k);
+			fp = fopen(tmp_fname, "w");
+			if(!fp)
+				return 345;
+			fputs(key_txt[v][k], fp);
+			fclose(fp);
+			if(rename(tmp_fname, fname))
+				return 345;
+			rotations++;
+			usleep(10000);
+		}
+		for(j = 0; j < nstarted; j++)
+			r[j].stop = 1;
+		for(j = 0; j < nstarted; j++)
+			pthread_join(threads[j], NULL);
+
+		lookups = 0;
+		n = 0;
+		for(j = 0; j < nstarted; j++)
+			n += r[j].nsamples;
+		all = malloc((n ? n : 1) * sizeof(double));
+		if(!all)
+			return 843;
+		n = 0;
+		for(j = 0; j < nstarted; j++){
+			lookups += r[j].lookups;
+			if(r[j].missing){
+				fprintf(stderr, "Error. %d lookups found no key.\n", r[j].missing);
+				return 1;
+			}
+			memcpy(all + n, r[j].samples, r[j].nsamples * sizeof(double));
+			n += r[j].nsamples;
+			free(r[j].samples);
+		}
+		qsort(all, n, sizeof(double), cmp_double);
+		report("keycache", c == 0 ? "lookup, steady" : "lookup, rotating", lookups,
+			now_sec() - t0);
+		if(n)
+			printf("keycache   %-28s p50 %.3f us  p99 %.3f us  p99.9 %.3f us  max %.1f us"
+				"  (%ld rotations)\n", c == 0 ? "lookup, steady" : "lookup, rotating",
+				all[n / 2], all[n * 99 / 100], all[n * 999 / 1000], all[n - 1], rotations);
+		free(all);
+	}
+	// Give the watcher a moment to pick up the last change.
+	usleep(100000);
+	nm_keycache_stats(kc, &reloads, &parsed, &retired);
+	printf("keycache   %llu snapshots published, %llu key files parsed, %d not yet freed\n",
+		reloads, parsed, retired);
+
+	nm_keycache_close(kc);
+	for(k = 0; k < BENCH_KEYCACHE_KEYS; k++){
+		snprintf(fname, sizeof(fname), "%s/key%02d.key", dir, k);
+		remove(fname);
+		free(key_txt[0][k]);
+		free(key_txt[1][k]);
+	}
+	rmdir(dir);
+	return 0;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+static int bench_async_loop(struct nm_async_t *as, struct nm_sign_ctx_t *ctx,
+  gcry_sexp_t sexp_pub, gcry_sexp_t sexp_sig, const char *nonce, long jobs,
+  double *stall_r){
+	// An event loop that keeps the job table full of sign jobs (or of
+	// verify jobs, if sexp_pub is given) and waits for completions
+	// with poll().  Returns 0 or the first error of a job.  *stall_r
+	// is the longest time that one submit or complete call took.
+	struct nm_async_done_t done[64];
+	struct pollfd pfd;
+	long submitted = 0, completed = 0;
+	double t, stall = 0;
+	int j, n, full, rc = 0;
+
+	pfd.fd = nm_async_fd(as);
+	pfd.events = POLLIN;
+	while(completed < jobs){
+		full = 0;
+		while(submitted < jobs && !full){
+			t = now_sec();
+			if(sexp_pub)
+				full = nm_async_submit_verify(as, sexp_pub, sexp_sig, nonce,
+					strlen(nonce), NULL, NULL);
+			else
+				full = nm_async_submit_sign(as, ctx, nonce, strlen(nonce), NULL, NULL);
+			t = now_sec() - t;
+			if(t > stall)
+				stall = t;
+			if(!full)
+				submitted++;
+		}
+		if(poll(&pfd, 1, -1) < 0)
+			return 1;
+		t = now_sec();
+		n = nm_async_complete(as, done, 64);
+		t = now_sec() - t;
+		if(t > stall)
+			stall = t;
+		for(j = 0; j < n; j++){
+			if(done[j].rc && !rc)
+				rc = done[j].rc;
+			gcry_sexp_release(done[j].sexp_sig);
+		}
+		completed += n;
+	}
+	*stall_r = stall;
+	return rc;
+}
+
+static int bench_async(int argc, char **argv){
+	// Nonce signatures and verifications from an event loop:
+	//   sign, in the loop:   nm_sign_ctx_sign() called by the loop, so
+	//                        the loop is stalled for each signature
+	//   sign, N workers:     nm_async with N worker threads and 256
+	//                        jobs in flight
+	//   verify, N workers:   the same with verify jobs
+	//   cancel queued:       jobs cancelled before a worker took them
+	// For each, the longest time the loop spent in one call shows
+	// how long it could not serve other connections.
+	struct nm_sign_ctx_t ctx;
+	struct nm_async_t *as;
+	struct nm_async_done_t done[64];
+	unsigned long long *ids;
+	gcry_sexp_t sexp_pub, sexp_sig, sexp_tmp;
+	char prv_fname[MAX_ENTRY_LEN], pub_fname[MAX_ENTRY_LEN];
+	char nonce[2 * NM_SHA384_LEN + 1];
+	unsigned char raw[NM_SHA384_LEN];
+	char label[64];
+	long jobs = 2000, j, ncancelled, nfinished;
+	int max_workers = 0, workers, n, rc;
+	double t0, t, stall;
+
+	if(argc > 2)
+		jobs = atol(argv[2]);
+	if(argc > 3)
+		max_workers = atoi(argv[3]);
+	if(max_workers <= 0)
+		max_workers = nm_tree_default_threads();
+	if(jobs <= 0 || max_workers > NM_ASYNC_MAX_WORKERS)
+		return usage();
+
+	if(bench_write_key(bench_sign_sexp, prv_fname, pub_fname))
+		return 1;
+	rc = nm_sign_ctx_open(&ctx, prv_fname, debug_lvl);
+	if(!rc)
+		rc = nm_read_key_file(pub_fname, "public-key", &sexp_pub, debug_lvl);
+	if(rc)
+		return rc;
+	gcry_randomize(raw, sizeof(raw), GCRY_WEAK_RANDOM);
+	nm_hex_encode(raw, sizeof(raw), nonce);
+	if(nm_sign_ctx_sign(&ctx, nonce, strlen(nonce), &sexp_sig, debug_lvl))
+		return 903;
+
+	printf("async      %ld CPUs\n", sysconf(_SC_NPROCESSORS_ONLN));
+	stall = 0;
+	t0 = now_sec();
+	for(j = 0; j < jobs; j++){
+		t = now_sec();
+		if(nm_sign_ctx_sign(&ctx, nonce, strlen(nonce), &sexp_tmp, debug_lvl))
+			return 903;
+		t = now_sec() - t;
+		if(t > stall)
+			stall = t;
+		gcry_sexp_release(sexp_tmp);
+	}
+	report("async", "sign, in the loop", jobs, now_sec() - t0);
+	printf("async      %-28s longest loop stall %.1f us\n", "sign, in the loop", 1e6 * stall);
+
+	for(workers = 1; ; workers = workers * 2 < max_workers ? workers * 2 : max_workers){
+		as = nm_async_open(workers, 256, &rc);
+		if(!as)
+			return rc;
+		snprintf(label, sizeof(label), "sign, %d workers", workers);
+		t0 = now_sec();
+		rc = bench_async_loop(as, &ctx, NULL, NULL, nonce, jobs, &stall);
+		if(rc)
+			return rc;
+		report("async", label, jobs, now_sec() - t0);
+		printf("async      %-28s longest loop stall %.1f us\n", label, 1e6 * stall);
+		if(workers == max_workers){
+			snprintf(label, sizeof(label), "verify, %d workers", workers);
+			t0 = now_sec();
+			rc = bench_async_loop(as, NULL, sexp_pub, sexp_sig, nonce, jobs, &stall);
+			if(rc)
+				return rc;
+			report("async", label, jobs, now_sec() - t0);
+			printf("async      %-28s longest loop stall %.1f us\n", label, 1e6 * stall);
+		}
+		nm_async_close(as);
+		if(workers == max_workers)
+			break;
+	}
+
+	//  Cancel every job just after it is submitted.  The worker may
+	//  already have one, so a few finish anyway.
+	as = nm_async_open(1, jobs < NM_ASYNC_MAX_JOBS ? (int) jobs : NM_ASYNC_MAX_JOBS, &rc);
+	ids = malloc(jobs * sizeof(*ids));
+	if(!as || !ids)
+		return 843;
+	jobs = jobs < NM_ASYNC_MAX_JOBS ? jobs : NM_ASYNC_MAX_JOBS;
+	t0 = now_sec();
+	for(j = 0; j < jobs; j++)
+		if(nm_async_submit_sign(as, &ctx, nonce, strlen(nonce), NULL, &ids[j]))
+			return 979;
+	for(j = 0; j < jobs; j++)
+		nm_async_cancel(as, ids[j]);
+	ncancelled = nfinished = 0;
+	while(nm_async_pending(as) > 0){
+		n = nm_async_complete(as, done, 64);
+		if(n == 0)
+			usleep(100);
+		for(j = 0; j < n; j++){
+			if(done[j].rc == 998)
+				ncancelled++;
+			else
+				nfinished++;
+			gcry_sexp_release(done[j].sexp_sig);
+		}
+	}
+	report("async", "cancel queued", jobs, now_sec() - t0);
+	printf("async      %-28s %ld cancelled, %ld finished first\n", "cancel queued",
+		ncancelled, nfinished);
+	nm_async_close(as);
+	free(ids);
+
+	gcry_sexp_release(sexp_sig);
+	gcry_sexp_release(sexp_pub);
+	nm_sign_ctx_close(&ctx);
+	remove(prv_fname);
+	remove(pub_fname);
+	return 0;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+struct bench_fileload_t
+{
+	long nfiles;
+	long nbytes;
+	long nerrors;
+};
+
+static void bench_fileload_ready(struct nm_fileload_item_t *item, void *arg){
+	struct bench_fileload_t *b = arg;
+
+	b->nfiles++;
+	if(item->rc)
+		b->nerrors++;
+	else
+		b->nbytes += item->len;
+	free(item->buf);
+}
+
+static int bench_fileload_drop(struct nm_fileload_item_t *items, long n){
+	// Drop the files from the page cache, so that they are read from
+	// the device.  They were synced, so their pages are clean.
+	long j;
+	int fd;
+
+	for(j = 0; j < n; j++){
+		fd = open(items[j].fname, O_RDONLY);
+		if(fd < 0)
+			return 1;
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+	return 0;
+}
+
+static int bench_fileload(int argc, char **argv){
+	// Reading a corpus of small files (key-file sized, 600 bytes)
+	// with a cold page cache, as a bulk sign or verify job would:
+	//   fopen/fread:        one after the other, as read_sexp_file()
+	//                       and nm_verify do
+	//   threads, depth N:   nm_fileload with the thread pool
+	//   io_uring, depth N:  nm_fileload with io_uring, if the kernel
+	//                       allows it
+	// posix_fadvise() empties the cache between the cases; on a file
+	// system that ignores it (tmpfs) the reads are warm.
+	struct nm_fileload_item_t *items;
+	struct bench_fileload_t b;
+	char dir[] = "/tmp/nm_bench_fileload_XXXXXX";
+	char buff[4096];
+	char *names;
+	char txt[600];
+	char label[64];
+	long nfiles = 100000, j;
+	int depth = 64, c, mode, fd;
+	size_t len;
+	double t0, secs;
+	FILE *fp;
+
+	if(argc > 2)
+		nfiles = atol(argv[2]);
+	if(argc > 3)
+		depth = atoi(argv[3]);
+	if(nfiles <= 0 || nfiles > 0x7fffffff || depth < 1 || depth > NM_FILELOAD_MAX_DEPTH)
+		return usage();
+	if(!mkdtemp(dir))
+		return 345;
+	items = calloc(nfiles, sizeof(*items));
+	names = malloc(nfiles * (strlen(dir) + 16));
+	if(!items || !names)
+		return 843;
+	for(j = 0; j < nfiles; j++){
+		items[j].fname = names + j * (strlen(dir) + 16);
+		sprintf((char *) items[j].fname, "%s/f%07ld", dir, j);
+		gcry_create_nonce(txt, sizeof(txt));
+		fd = open(items[j].fname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if(fd < 0 || write(fd, txt, sizeof(txt)) != sizeof(txt)){
+			perror("Error. Could not write the bench files");
+			return 345;
+		}
+		close(fd);
+	}
+	sync();
+
+	for(c = 0; c < 3; c++){
+		if(bench_fileload_drop(items, nfiles))
+			return 439;
+		memset(&b, 0, sizeof(b));
+		t0 = now_sec();
+		if(c == 0){
+			strcpy(label, "fopen/fread");
+			for(j = 0; j < nfiles; j++){
+				fp = fopen(items[j].fname, "rb");
+				if(!fp)
+					return 439;
+				len = fread(buff, 1, sizeof(buff), fp);
+				fclose(fp);
+				b.nfiles++;
+				b.nbytes += len;
+			}
+		}else{
+			mode = c == 1 ? NM_FILELOAD_THREADS : NM_FILELOAD_URING;
+			if(nm_fileload(items, (int) nfiles, 4096, depth, &mode, bench_fileload_ready, &b))
+				return 843;
+			if(c == 2 && mode != NM_FILELOAD_URING){
+				printf("fileload   io_uring is not available here\n");
+				break;
+			}
+			snprintf(label, sizeof(label), "%s, depth %d",
+				c == 1 ? "threads" : "io_uring", depth);
+		}
+		secs = now_sec() - t0;
+		if(b.nfiles != nfiles || b.nerrors || b.nbytes != nfiles * (long) sizeof(txt)){
+			fprintf(stderr, "Error. %s read %ld files, %ld bytes, %ld errors.\n", label,
+				b.nfiles, b.nbytes, b.nerrors);
+			return 1;
+		}
+		report("fileload", label, nfiles, secs);
+		printf("fileload   %-28s %10.1f MB/s\n", label, b.nbytes / secs / 1e6);
+	}
+
+	for(j = 0; j < nfiles; j++)
+		remove(items[j].fname);
+	rmdir(dir);
+	free(names);
+	free(items);
+	return 0;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+static long bench_vm_kb(const char *field){
+	// A field of /proc/self/status in kB, or -1.
+	char line[256];
+	long kb = -1;
+	FILE *fp;
+
+	fp = fopen("/proc/self/status", "r");
+	if(!fp)
+		return -1;
+	while(fgets(line, sizeof(line), fp))
+		if(!strncmp(line, field, strlen(field)))
+			kb = atol(line + strlen(field) + 1);
+	fclose(fp);
+	return kb;
+}
+
+static int bench_read_txt(const char *fname, char *txt, size_t max){
+	FILE *fp;
+	size_t len;
+
+	fp = fopen(fname, "r");
+	if(!fp)
+		return 439;
+	len = fread(txt, 1, max - 1, fp);
+	fclose(fp);
+	txt[len] = 0x00;
+	return 0;
+}
+
+static int bench_arena_op(const char *nonce, const char *sig_txt, const char *pub_txt,
+  const char *prv_txt, size_t prv_len){
+	// What one request does with libgcrypt's memory, without the
+	// public-key math: the data, signature and public key
+	// s-expressions, and the private key parsed from secure memory.
+	gcry_sexp_t sexp_data, sexp_sig, sexp_nm_key, sexp_pub, sexp_nm_prv, sexp_prv;
+	char *sec;
+	int rc = 0;
+
+	if(gcry_sexp_build(&sexp_data, NULL, "(data (flags eddsa) (hash-algo sha512) (value %s))",
+	  nonce))
+		return 902;
+	if(gcry_sexp_new(&sexp_sig, sig_txt, 0, 1))
+		rc = 902;
+	if(!rc && gcry_sexp_new(&sexp_nm_key, pub_txt, 0, 1))
+		rc = 902;
+	if(!rc && !(sexp_pub = gcry_sexp_find_token(sexp_nm_key, "public-key", 0)))
+		rc = 902;
+	sec = rc ? NULL : gcry_malloc_secure(prv_len + 1);
+	if(!rc && !sec)
+		rc = 843;
+	if(!rc){
+		memcpy(sec, prv_txt, prv_len + 1);
+		if(gcry_sexp_new(&sexp_nm_prv, sec, prv_len, 1))
+			rc = 902;
+	}
+	if(!rc && !(sexp_prv = gcry_sexp_find_token(sexp_nm_prv, "private-key", 0)))
+		rc = 902;
+	if(!rc){
+		gcry_sexp_release(sexp_prv);
+		gcry_sexp_release(sexp_nm_prv);
+		gcry_sexp_release(sexp_pub);
+		gcry_sexp_release(sexp_nm_key);
+		gcry_sexp_release(sexp_sig);
+	}
+	gcry_free(sec);
+	gcry_sexp_release(sexp_data);
+	return rc;
+}
+
+static int bench_arena(int argc, char **argv){
+	// libgcrypt's allocations for a stream of requests, each case in
+	// a child process of its own so that its peak RSS is its own:
+	//   malloc:             outside a request, so every object is a
+	//                       malloc() and a free()
+	//   arena per request:  nm_arena_begin()/nm_arena_end() around
+	//                       each request
+	// Each prints the allocation counts of nm_arena_stats() and
+	// VmHWM/VmRSS.  With NM_ARENA=off both cases use libgcrypt's own
+	// allocator (and count nothing).
+	struct nm_sign_ctx_t ctx;
+	struct nm_arena_t *arena = NULL;
+	struct nm_arena_stats_t st0, st1;
+	gcry_sexp_t sexp_sig;
+	char prv_fname[MAX_ENTRY_LEN], pub_fname[MAX_ENTRY_LEN];
+	char nonce[2 * NM_SHA384_LEN + 1];
+	unsigned char raw[NM_SHA384_LEN];
+	char sig_txt[MAX_KEY_BUFF], pub_txt[MAX_KEY_BUFF], prv_txt[MAX_KEY_BUFF];
+	const char *label;
+	long ops = 10000000, j;
+	int c, rc, status;
+	double t0;
+	pid_t pid;
+
+	if(argc > 2)
+		ops = atol(argv[2]);
+	if(ops <= 0)
+		return usage();
+
+	if(bench_write_key(bench_sign_sexp, prv_fname, pub_fname))
+		return 1;
+	rc = nm_sign_ctx_open(&ctx, prv_fname, debug_lvl);
+	if(!rc)
+		rc = bench_read_txt(pub_fname, pub_txt, sizeof(pub_txt));
+	if(!rc)
+		rc = bench_read_txt(prv_fname, prv_txt, sizeof(prv_txt));
+	if(rc)
+		return rc;
+	gcry_randomize(raw, sizeof(raw), GCRY_WEAK_RANDOM);
+	nm_hex_encode(raw, sizeof(raw), nonce);
+	if(nm_sign_ctx_sign(&ctx, nonce, strlen(nonce), &sexp_sig, debug_lvl))
+		return 903;
+	gcry_sexp_sprint(sexp_sig, GCRYSEXP_FMT_ADVANCED, sig_txt, MAX_KEY_BUFF);
+	gcry_sexp_release(sexp_sig);
+	remove(prv_fname);
+	remove(pub_fname);
+
+	printf("arena      allocator: %s\n", nm_arena_installed() ? "nm_arena" : "libgcrypt");
+	fflush(stdout);
+	for(c = 0; c < 2; c++){
+		label = c == 0 ? "malloc" : "arena per request";
+		pid = fork();
+		if(pid == 0){
+			if(c == 1 && !(arena = nm_arena_open()))
+				_exit(843);
+			nm_arena_stats(&st0);
+			t0 = now_sec();
+			for(j = 0; j < ops; j++){
+				if(arena)
+					nm_arena_begin(arena);
+				rc = bench_arena_op(nonce, sig_txt, pub_txt, prv_txt, strlen(prv_txt));
+				if(arena)
+					nm_arena_end(arena);
+				if(rc)
+					_exit(rc);
+			}
+			report("arena", label, ops, now_sec() - t0);
+			nm_arena_stats(&st1);
+			printf("arena      %-28s %llu malloc, %llu from the arena, %llu secure, %llu chunks\n",
+				label, st1.heap_allocs - st0.heap_allocs, st1.arena_allocs - st0.arena_allocs,
+				st1.secure_allocs - st0.secure_allocs, st1.chunks - st0.chunks);
+			printf("arena      %-28s %llu resets, %llu pinned, VmHWM %ld kB, VmRSS %ld kB\n",
+				label, st1.resets - st0.resets, st1.pinned - st0.pinned,
+				bench_vm_kb("VmHWM"), bench_vm_kb("VmRSS"));
+			fflush(stdout);
+			nm_arena_close(arena);
+			_exit(0);
+		}
+		if(pid < 0 || waitpid(pid, &status, 0) != pid || status != 0){
+			fprintf(stderr, "Error. The %s case failed.\n", label);
+			return 1;
+		}
+	}
+	nm_sign_ctx_close(&ctx);
+	return 0;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+int usage(){
+	fprintf(stderr, "usage:\n");
+	fprintf(stderr, "nm_bench sign [iterations]\n");
+	fprintf(stderr, "nm_bench hash [messages] [msg_len]\n");
+	fprintf(stderr, "nm_bench tree [file_MB] [file]\n");
+	fprintf(stderr, "nm_bench encrypt [MB]\n");
+	fprintf(stderr, "nm_bench enckey [rsa_keygens] [wrap_ops]\n");
+	fprintf(stderr, "nm_bench rsagen [keys] [max_threads]\n");
+	fprintf(stderr, "nm_bench stream [nonces] [threads]\n");
+	fprintf(stderr, "nm_bench replay [nonces] [cache_entries]\n");
+	fprintf(stderr, "nm_bench keyring [keys] [lookups]\n");
+	fprintf(stderr, "nm_bench keyid [keys] [signatures]\n");
+	fprintf(stderr, "nm_bench revoke [entries] [lookups]\n");
+	fprintf(stderr, "nm_bench multisig [iterations]\n");
+	fprintf(stderr, "nm_bench chain [iterations]\n");
+	fprintf(stderr, "nm_bench pverify [iterations]\n");
+	fprintf(stderr, "nm_bench reject [iterations]\n");
+	fprintf(stderr, "nm_bench anchor [iterations]\n");
+	fprintf(stderr, "nm_bench keycache [seconds] [readers]\n");
+	fprintf(stderr, "nm_bench async [jobs] [max_workers]\n");
+	fprintf(stderr, "nm_bench fileload [files] [depth]\n");
+	fprintf(stderr, "nm_bench arena [ops]\n");
+	return 99;
+}
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+int main (int argc, char **argv) {
+	if (argc < 2){
+		return usage();
+	}
+
+	// The arena allocator replaces libgcrypt's, so it must be in
+	// place before libgcrypt starts, and only for its own benchmark.
+	if (!strcmp(argv[1], "arena") && nm_arena_install())
+		return 843;
+	/*
+	----------------------------------------------------------------------
+															LIBGCRYPT INITIALIZATION
+	----------------------------------------------------------------------
+	*/
+	if (!gcry_check_version (GCRYPT_VERSION))
+	{
+		fputs ("libgcrypt version mismatch\n", stderr);
+		exit (2);
+	}
+	gcry_control (GCRYCTL_SUSPEND_SECMEM_WARN);
+	gcry_control (GCRYCTL_USE_SECURE_RNDPOOL); //put random nbrs in secmem
+	gcry_control (GCRYCTL_SET_VERBOSITY, 0);
+	// Benchmarks hold more keys and buffers at once than the tools.
+	gcry_control (GCRYCTL_INIT_SECMEM, 262144, 0);
+	gcry_control (GCRYCTL_RESUME_SECMEM_WARN);
+	gcry_control (GCRYCTL_INITIALIZATION_FINISHED, 0);
+	/*
+	----------------------------------------------------------------------
+													END LIBGCRYPT INITIALIZATION
+	----------------------------------------------------------------------
+	*/
+
+	if (!strcmp(argv[1], "sign"))
+		return bench_sign(argc, argv);
+	if (!strcmp(argv[1], "hash"))
+		return bench_hash(argc, argv);
+	if (!strcmp(argv[1], "tree"))
+		return bench_tree(argc, argv);
+	if (!strcmp(argv[1], "encrypt"))
+		return bench_encrypt(argc, argv);
+	if (!strcmp(argv[1], "enckey"))
+		return bench_enckey(argc, argv);
+	if (!strcmp(argv[1], "rsagen"))
+		return bench_rsagen(argc, argv);
+	if (!strcmp(argv[1], "stream"))
+		return bench_stream(argc, argv);
+	if (!strcmp(argv[1], "replay"))
+		return bench_replay(argc, argv);
+	if (!strcmp(argv[1], "keyring"))
+		return bench_keyring(argc, argv);
+	if (!strcmp(argv[1], "keyid"))
+		return bench_keyid(argc, argv);
+	if (!strcmp(argv[1], "revoke"))
+		return bench_revoke(argc, argv);
+	if (!strcmp(argv[1], "multisig"))
+		return bench_multisig(argc, argv);
+	if (!strcmp(argv[1], "chain"))
+		return bench_chain(argc, argv);
+	if (!strcmp(argv[1], "pverify"))
+		return bench_pverify(argc, argv);
+	if (!strcmp(argv[1], "reject"))
+		return bench_reject(argc, argv);
+	if (!strcmp(argv[1], "anchor"))
+		return bench_anchor(argc, argv);
+	if (!strcmp(argv[1], "keycache"))
+		return bench_keycache(argc, argv);
+	if (!strcmp(argv[1], "async"))
+		return bench_async(argc, argv);
+	if (!strcmp(argv[1], "fileload"))
+		return bench_fileload(argc, argv);
+	if (!strcmp(argv[1], "arena"))
+		return bench_arena(argc, argv);
+
+	return usage();
+}
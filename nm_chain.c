@@ -0,0 +1,460 @@
+// nm_chain.c
+// Purpose:
+//   1) Let the offline key delegate to intermediate keys, each of which
+//      may sign the next one, down to the online key, so that the
+//      offline key can stay offline while the intermediates rotate.
+//   2) Verify such a chain from the offline key, and remember the
+//      links that have been verified so that a process that checks
+//      the same chain again does no public-key operation for them.
+//
+// A chain file lists the links from the one the offline key signed
+// down to the online key:
+//   (NaturalMessage-Key-Chain
+//     (Link (Key-Text "<key file>") (sig-val ...))
+//     (Link (Key-Text "<key file>") (sig-val ...)) ...)
+// Key-Text is the subject's public key file, exactly as written by
+// nm_create_online_key, and the sig-val is by the key above it (the
+// offline key for the first link) over the SHA-384 of NM_CHAIN_TAG
+// and that text, in the (data (flags raw) (hash sha384 ...)) layout
+// of nm_sign.
+//
+// The keys in the middle of a chain are certifying keys (Key-Function
+// c, nm_create_online_key --certify), and only the last subject is a
+// signing key (Key-Function s).  A link signature is over a 48-byte
+// value, and so is a nonce that nm_sign --stream=len signs, so an
+// online key that could issue links could be made to sign one as a
+// nonce.  Certifying keys are refused by nm_sign_ctx_open() (nm_sign
+// and every other nonce signer), and an s key never issues a link.
+// The tag keeps a link signature apart from the other things the
+// offline key signs over a SHA-384 (a revocation list, say).
+//
+// Everything that costs no public-key operation is checked first, for
+// every link: each subject must have the Key-Function for its place in
+// the chain, must not have expired and must not be on the revocation
+// list, and the last subject must be the online key the caller has.
+// Only then are the signatures checked, from the offline key down.
+//
+// The cache is keyed by the SHA-384 of (issuer keygrip, subject text,
+// signature), so a hit stands for exactly the bytes that were
+// verified; an entry lasts until the earliest Expire-Date-YYYYMMDD on
+// its path from the offline key.  The expiry and revocation checks
+// above are made on every call, cached or not.
+//
+#include <stddef.h>
+#include <gcrypt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "nm_chain.h"
+#include "nm_revoke.h"
+
+#include <pthread.h>
+
+#define CHAIN_ID_LEN 32
+// Hashed in front of the subject's key file (with its null).
+#define NM_CHAIN_TAG "NaturalMessage-Key-Chain-Link"
+#define CHAIN_NO_EXPIRE 0xffffffffU
+
+struct chain_slot_t
+{
+	unsigned char id[CHAIN_ID_LEN];
+	unsigned int expire;      // 0 if the slot is empty
+	unsigned int used;        // cache->clock when last hit, for LRU
+};
+
+struct nm_chain_cache_t
+{
+	pthread_mutex_t lock;
+	unsigned int nsets;
+	unsigned int clock;
+	struct chain_slot_t *slot;   // nsets * NM_CHAIN_CACHE_WAYS
+};
+
+struct chain_link_t
+{
+	gcry_sexp_t sexp_txt;      // (Key-Text ...), owns txt
+	gcry_sexp_t sexp_sig;      // (sig-val ...)
+	gcry_sexp_t sexp_pub;      // (public-key ...) of the subject
+	const char *txt;
+	size_t len;
+	unsigned int expire;       // earliest expiry from the offline key to here
+	char function;             // Key-Function of the subject
+};
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+struct nm_chain_cache_t *nm_chain_cache_new(unsigned int slots){
+	// A cache of about slots verified links (rounded up to a multiple
+	// of NM_CHAIN_CACHE_WAYS; 0 for NM_CHAIN_CACHE_SLOTS).  Returns
+	// NULL if out of memory.
+	struct nm_chain_cache_t *cache;
+
+	if(slots == 0)
+		slots = NM_CHAIN_CACHE_SLOTS;
+	cache = calloc(1, sizeof(*cache));
+	if(!cache)
+		return NULL;
+	cache->nsets = (slots + NM_CHAIN_CACHE_WAYS - 1) / NM_CHAIN_CACHE_WAYS;
+	cache->slot = calloc((size_t) cache->nsets * NM_CHAIN_CACHE_WAYS,
+		sizeof(struct chain_slot_t));
+	if(!cache->slot){
+		free(cache);
+		return NULL;
+	}
+	pthread_mutex_init(&cache->lock, NULL);
+	return cache;
+}
+
+void nm_chain_cache_free(struct nm_chain_cache_t *cache){
+	if(!cache)
+		return;
+	pthread_mutex_destroy(&cache->lock);
+	free(cache->slot);
+	free(cache);
+}
+
+static struct chain_slot_t *cache_set(struct nm_chain_cache_t *cache,
+  const unsigned char *id){
+	// The ids are hashes, so their first bytes pick the set.
+	unsigned int h;
+
+	memcpy(&h, id, sizeof(h));
+	return cache->slot + (size_t) (h % cache->nsets) * NM_CHAIN_CACHE_WAYS;
+}
+
+static int cache_hit(struct nm_chain_cache_t *cache, const unsigned char *id,
+  unsigned int today){
+	// 1 if the link id was verified and its path has not expired.
+	struct chain_slot_t *set;
+	int j, hit = 0;
+
+	pthread_mutex_lock(&cache->lock);
+	set = cache_set(cache, id);
+	for(j = 0; j < NM_CHAIN_CACHE_WAYS; j++){
+		if(set[j].expire && !memcmp(set[j].id, id, CHAIN_ID_LEN)){
+			if(set[j].expire >= today){
+				set[j].used = ++cache->clock;
+				hit = 1;
+			}else{
+				set[j].expire = 0;
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return hit;
+}
+
+static void cache_add(struct nm_chain_cache_t *cache, const unsigned char *id,
+  unsigned int expire){
+	// Remember a verified link, in an empty way or the least
+	// recently used one.
+	struct chain_slot_t *set;
+	int j, victim = 0;
+
+	pthread_mutex_lock(&cache->lock);
+	set = cache_set(cache, id);
+	for(j = 0; j < NM_CHAIN_CACHE_WAYS; j++){
+		if(!set[j].expire || !memcmp(set[j].id, id, CHAIN_ID_LEN)){
+			victim = j;
+			break;
+		}
+		if(set[j].used < set[victim].used)
+			victim = j;
+	}
+	memcpy(set[victim].id, id, CHAIN_ID_LEN);
+	set[victim].expire = expire;
+	set[victim].used = ++cache->clock;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+unsigned int nm_chain_key_expire(gcry_sexp_t sexp_key_file){
+	// The Expire-Date-YYYYMMDD of a key file as a number, 0 if it has
+	// none (or NA, as in the other Owner-Info fields), or
+	// NM_CHAIN_EXPIRE_BAD if it is there but not eight digits.  That
+	// is earlier than any date, so a key whose date cannot be read
+	// has expired rather than never expiring.
+	gcry_sexp_t sexp_field;
+	const char *data;
+	size_t len;
+	unsigned int expire = 0;
+	int j = 0;
+
+	sexp_field = gcry_sexp_find_token(sexp_key_file, "Expire-Date-YYYYMMDD", 0);
+	if(!sexp_field)
+		return 0;
+	data = gcry_sexp_nth_data(sexp_field, 1, &len);
+	if(data && len == 2 && !memcmp(data, "NA", 2)){
+		gcry_sexp_release(sexp_field);
+		return 0;
+	}
+	if(data && len == 8){
+		for(j = 0; j < 8 && data[j] >= '0' && data[j] <= '9'; j++)
+			expire = expire * 10 + data[j] - '0';
+	}
+	if(!data || len != 8 || j < 8 || expire < NM_CHAIN_EXPIRE_BAD)
+		expire = NM_CHAIN_EXPIRE_BAD;
+	gcry_sexp_release(sexp_field);
+	return expire;
+}
+
+char nm_chain_key_function(gcry_sexp_t sexp_key_file){
+	// The Key-Function of a key file: 's' (signing, also when there is
+	// none), 'c' (certifying), 'e' (encryption), or 0 if it is none
+	// of those.
+	gcry_sexp_t sexp_field;
+	const char *data;
+	size_t len;
+	char function = 's';
+
+	sexp_field = gcry_sexp_find_token(sexp_key_file, "Key-Function", 0);
+	if(sexp_field){
+		data = gcry_sexp_nth_data(sexp_field, 1, &len);
+		function = data && len == 1 && strchr("sce", data[0]) ? data[0] : 0;
+		gcry_sexp_release(sexp_field);
+	}
+	return function;
+}
+
+static int sig_data(const char *txt, size_t len, gcry_sexp_t *sexp_data_r){
+	// What a link signs: the SHA-384 of NM_CHAIN_TAG and the
+	// subject's key file.
+	unsigned char digest[48];
+	gcry_md_hd_t md;
+
+	if(gcry_md_open(&md, GCRY_MD_SHA384, 0))
+		return 902;
+	gcry_md_write(md, NM_CHAIN_TAG, sizeof(NM_CHAIN_TAG));
+	gcry_md_write(md, txt, len);
+	memcpy(digest, gcry_md_read(md, GCRY_MD_SHA384), sizeof(digest));
+	gcry_md_close(md);
+	return gcry_sexp_build(sexp_data_r, NULL, "(data (flags raw) (hash sha384 %b))",
+		48, digest) ? 902 : 0;
+}
+
+static int link_id(gcry_sexp_t sexp_issuer, const struct chain_link_t *link,
+  unsigned char *id){
+	// The cache key of a link.  Returns 0 or 990.
+	unsigned char grip[20];
+	unsigned char *sig;
+	size_t sig_len;
+	gcry_md_hd_t md;
+
+	if(!gcry_pk_get_keygrip(sexp_issuer, grip))
+		return 990;
+	sig_len = gcry_sexp_sprint(link->sexp_sig, GCRYSEXP_FMT_CANON, NULL, 0);
+	sig = malloc(sig_len);
+	if(!sig)
+		return 990;
+	sig_len = gcry_sexp_sprint(link->sexp_sig, GCRYSEXP_FMT_CANON, (char *) sig, sig_len);
+	if(gcry_md_open(&md, GCRY_MD_SHA384, 0)){
+		free(sig);
+		return 990;
+	}
+	gcry_md_write(md, grip, sizeof(grip));
+	gcry_md_write(md, link->txt, link->len);
+	gcry_md_write(md, sig, sig_len);
+	memcpy(id, gcry_md_read(md, GCRY_MD_SHA384), CHAIN_ID_LEN);
+	gcry_md_close(md);
+	free(sig);
+	return 0;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+int nm_chain_is_chain(gcry_sexp_t sexp){
+	// 1 if a key signature is a chain rather than one signature.
+	gcry_sexp_t s = gcry_sexp_find_token(sexp, "NaturalMessage-Key-Chain", 0);
+	gcry_sexp_release(s);
+	return s != NULL;
+}
+
+int nm_chain_link_text(gcry_sexp_t sexp_issuer_prv, const char *subject_txt,
+  size_t subject_len, char **txt_r){
+	// The text of one (Link ...): subject_txt (a public key file)
+	// signed by the issuer's private key.  The caller frees *txt_r.
+	// Returns 0, 843 (out of memory), 902/903 (cannot sign) or 990
+	// (the subject is not a public key file).
+	gcry_sexp_t sexp_subject, sexp_data, sexp_sig, sexp_link;
+	gcry_sexp_t s;
+	size_t len;
+	int rc;
+
+	*txt_r = NULL;
+	if(gcry_sexp_new(&sexp_subject, subject_txt, subject_len, 1))
+		return 990;
+	s = gcry_sexp_find_token(sexp_subject, "public-key", 0);
+	rc = s ? 0 : 990;
+	gcry_sexp_release(s);
+	if(!rc && (s = gcry_sexp_find_token(sexp_subject, "private-key", 0))){
+		gcry_sexp_release(s);
+		rc = 990;
+	}
+	gcry_sexp_release(sexp_subject);
+	if(rc)
+		return rc;
+
+	rc = sig_data(subject_txt, subject_len, &sexp_data);
+	if(rc)
+		return rc;
+	rc = gcry_pk_sign(&sexp_sig, sexp_data, sexp_issuer_prv) ? 903 : 0;
+	gcry_sexp_release(sexp_data);
+	if(rc)
+		return rc;
+	rc = gcry_sexp_build(&sexp_link, NULL, "(Link (Key-Text %b) %S)",
+		(int) subject_len, subject_txt, sexp_sig) ? 902 : 0;
+	gcry_sexp_release(sexp_sig);
+	if(rc)
+		return rc;
+	len = gcry_sexp_sprint(sexp_link, GCRYSEXP_FMT_ADVANCED, NULL, 0);
+	*txt_r = malloc(len);
+	if(!*txt_r){
+		gcry_sexp_release(sexp_link);
+		return 843;
+	}
+	gcry_sexp_sprint(sexp_link, GCRYSEXP_FMT_ADVANCED, *txt_r, len);
+	gcry_sexp_release(sexp_link);
+	return 0;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+static int load_link(gcry_sexp_t sexp_elem, struct chain_link_t *link){
+	// Take one (Link ...) apart.  Returns 0 or 990.
+	gcry_sexp_t sexp_file, s;
+
+	link->sexp_txt = gcry_sexp_find_token(sexp_elem, "Key-Text", 0);
+	link->txt = link->sexp_txt ? gcry_sexp_nth_data(link->sexp_txt, 1, &link->len)
+		: NULL;
+	link->sexp_sig = gcry_sexp_find_token(sexp_elem, "sig-val", 0);
+	if(!link->txt || !link->len || !link->sexp_sig)
+		return 990;
+	if(gcry_sexp_new(&sexp_file, link->txt, link->len, 1))
+		return 990;
+	link->sexp_pub = gcry_sexp_find_token(sexp_file, "public-key", 0);
+	s = gcry_sexp_find_token(sexp_file, "private-key", 0);
+	link->expire = nm_chain_key_expire(sexp_file);
+	link->function = nm_chain_key_function(sexp_file);
+	if(link->function != 's' && link->function != 'c'){
+		gcry_sexp_release(s);
+		gcry_sexp_release(sexp_file);
+		return 993;
+	}
+	gcry_sexp_release(sexp_file);
+	if(s){
+		gcry_sexp_release(s);
+		return 990;
+	}
+	return link->sexp_pub ? 0 : 990;
+}
+
+int nm_chain_verify(struct nm_chain_cache_t *cache, gcry_sexp_t sexp_root_pub,
+  unsigned int root_expire, gcry_sexp_t sexp_chain, const char *leaf_txt,
+  size_t leaf_len, unsigned int today, const struct nm_revoke_t *rl,
+  struct nm_chain_result_t *res){
+	// Check that sexp_chain leads from sexp_root_pub (the offline
+	// key, which expires on root_expire, 0 for never) to the key file
+	// leaf_txt (NULL to accept any leaf) on day today (YYYYMMDD).  rl
+	// (may be NULL) is a revocation list that the caller has already
+	// verified.  cache (may be NULL) holds links verified by earlier
+	// calls.  res (may be NULL) gets the counts.
+	//
+	// Returns 0, 982 (a key in the chain is revoked), 990 (not a
+	// chain, or longer than NM_CHAIN_MAX_LINKS), 991 (a signature does
+	// not verify), 992 (a key in the chain has expired) or 993 (a key
+	// in the middle is not a certifying key, the last one is not a
+	// signing key, or the chain does not end at leaf_txt).
+	struct chain_link_t links[NM_CHAIN_MAX_LINKS];
+	unsigned char fp[48];
+	unsigned char id[CHAIN_ID_LEN];
+	gcry_sexp_t sexp_list, sexp_elem, sexp_data, sexp_issuer;
+	unsigned int expire;
+	int nlinks = 0, nverified = 0, ncached = 0;
+	int j, n, rc = 0;
+
+	memset(links, 0, sizeof(links));
+	if(res)
+		memset(res, 0, sizeof(*res));
+	sexp_list = gcry_sexp_find_token(sexp_chain, "NaturalMessage-Key-Chain", 0);
+	if(!sexp_list)
+		return 990;
+	n = gcry_sexp_length(sexp_list);
+	for(j = 1; j < n && !rc; j++){
+		sexp_elem = gcry_sexp_nth(sexp_list, j);
+		if(!sexp_elem)
+			continue;
+		if(nlinks == NM_CHAIN_MAX_LINKS)
+			rc = 990;
+		else
+			rc = load_link(sexp_elem, &links[nlinks++]);
+		gcry_sexp_release(sexp_elem);
+	}
+	gcry_sexp_release(sexp_list);
+	if(!rc && nlinks == 0)
+		rc = 990;
+
+	// The checks that need no public-key operation.
+	expire = root_expire ? root_expire : CHAIN_NO_EXPIRE;
+	if(!rc && expire < today)
+		rc = 992;
+	for(j = 0; j < nlinks && !rc; j++){
+		if(links[j].expire && links[j].expire < expire)
+			expire = links[j].expire;
+		links[j].expire = expire;
+		if(expire < today)
+			rc = 992;
+		else if(rl){
+			gcry_md_hash_buffer(GCRY_MD_SHA384, fp, links[j].txt, links[j].len);
+			if(nm_revoke_check(rl, fp))
+				rc = 982;
+		}
+	}
+	// Only certifying keys issue links, and the online key is the last
+	// subject and issues none.
+	for(j = 0; j < nlinks && !rc; j++)
+		if(links[j].function != (j == nlinks - 1 ? 's' : 'c'))
+			rc = 993;
+	if(!rc && leaf_txt && (links[nlinks - 1].len != leaf_len
+	  || memcmp(links[nlinks - 1].txt, leaf_txt, leaf_len)))
+		rc = 993;
+
+	// The signatures, from the offline key down.
+	for(j = 0; j < nlinks && !rc; j++){
+		sexp_issuer = j ? links[j - 1].sexp_pub : sexp_root_pub;
+		if(cache){
+			rc = link_id(sexp_issuer, &links[j], id);
+			if(rc)
+				break;
+			if(cache_hit(cache, id, today)){
+				ncached++;
+				continue;
+			}
+		}
+		rc = sig_data(links[j].txt, links[j].len, &sexp_data);
+		if(rc)
+			break;
+		nverified++;
+		if(gcry_pk_verify(links[j].sexp_sig, sexp_data, sexp_issuer))
+			rc = 991;
+		gcry_sexp_release(sexp_data);
+		if(!rc && cache)
+			cache_add(cache, id, links[j].expire);
+	}
+
+	if(res){
+		res->links = nlinks;
+		res->nverified = nverified;
+		res->ncached = ncached;
+		res->expire = nlinks && links[nlinks - 1].expire != CHAIN_NO_EXPIRE
+			? links[nlinks - 1].expire : 0;
+	}
+	for(j = 0; j < nlinks; j++){
+		gcry_sexp_release(links[j].sexp_txt);
+		gcry_sexp_release(links[j].sexp_sig);
+		gcry_sexp_release(links[j].sexp_pub);
+	}
+	return rc;
+}
@@ -0,0 +1,36 @@
+// nm_chain.h
+//
+// Key chains of any depth from the offline key down to the online
+// key, and a cache of links that have already been verified.  See
+// nm_chain.c, and nm_chain_main.c for the nm_chain tool.
+
+#define NM_CHAIN_MAX_LINKS 8
+#define NM_CHAIN_CACHE_SLOTS 1024     // default; a multiple of NM_CHAIN_CACHE_WAYS
+#define NM_CHAIN_CACHE_WAYS 4
+// nm_chain_key_expire() of a date that is not eight digits: already
+// expired on any day.
+#define NM_CHAIN_EXPIRE_BAD 1
+
+struct nm_chain_result_t
+{
+	int links;        // links in the chain (depth - 1)
+	int nverified;    // links checked with gcry_pk_verify()
+	int ncached;      // links found in the cache
+	unsigned int expire;   // earliest Expire-Date-YYYYMMDD in the path, 0 if none
+};
+
+struct nm_chain_cache_t;
+struct nm_revoke_t;
+
+struct nm_chain_cache_t *nm_chain_cache_new(unsigned int slots);
+void nm_chain_cache_free(struct nm_chain_cache_t *cache);
+
+unsigned int nm_chain_key_expire(gcry_sexp_t sexp_key_file);
+char nm_chain_key_function(gcry_sexp_t sexp_key_file);
+int nm_chain_is_chain(gcry_sexp_t sexp);
+int nm_chain_link_text(gcry_sexp_t sexp_issuer_prv, const char *subject_txt,
+  size_t subject_len, char **txt_r);
+int nm_chain_verify(struct nm_chain_cache_t *cache, gcry_sexp_t sexp_root_pub,
+  unsigned int root_expire, gcry_sexp_t sexp_chain, const char *leaf_txt,
+  size_t leaf_len, unsigned int today, const struct nm_revoke_t *rl,
+  struct nm_chain_result_t *res);
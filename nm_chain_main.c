@@ -0,0 +1,404 @@
+// nm_chain_main.c
+// Purpose:
+//   1) nm_chain --link --issuer <private_key> --subject <public_key>
+//      [--chain <chain>] --out <chain>: sign a public key file with the
+//      key above it and append the link to a chain (see nm_chain.c).
+//      Without --chain this starts a new chain, and the issuer should
+//      be the offline key.  With --chain the issuer must be the last
+//      key in that chain, and a certifying key (nm_create_online_key
+//      --certify); the online key is always the last subject.
+//   2) nm_chain --verify --root <offline_public_key> --chain <chain>
+//      [--leaf <online_public_key>] [--revoked <list>]: check a chain
+//      the way NMVerifyServer does.  The revocation list must be
+//      signed by the root key.
+//
+// The chain file can be given to NMVerifyServer as the KeySig
+// argument, in place of a signature of the online key by the offline
+// key.
+//
+#include <stddef.h>
+#include <gcrypt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// nm_keys requires some of the things above
+#include "nm_keys.h"
+#include "nm_chain.h"
+#include "nm_revoke.h"
+#include "nm_keyring.h"
+#include "nm_timing.h"
+#include "nm_stats.h"
+
+#include <getopt.h>
+
+#define debug_lvl 0
+// A chain of NM_CHAIN_MAX_LINKS RSA keys is still far below this.
+#define NM_CHAIN_FILE_MAX (1024 * 1024)
+
+int link_flag;
+int verify_flag;
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+int usage(){
+	fprintf(stderr, "usage:\n");
+	fprintf(stderr, "nm_chain --link --issuer <private_key> --subject <public_key>\n");
+	fprintf(stderr, "         [--chain <chain>] --out <chain>\n");
+	fprintf(stderr, "nm_chain --verify --root <offline_public_key> --chain <chain>\n");
+	fprintf(stderr, "         [--leaf <online_public_key>] [--revoked <list>]\n");
+	fprintf(stderr, "  without --chain, --link starts a chain signed by the offline key\n");
+	fprintf(stderr, "  --timings[=<file>] writes the time of each phase as JSON at exit\n");
+	return 99;
+}
+
+static char *read_file(const char *fname, size_t *len_r){
+	// The whole file, null-terminated, or NULL.
+	char *txt;
+	FILE *fp;
+
+	fp = fopen(fname, "rb");
+	if(!fp)
+		return NULL;
+	txt = malloc(NM_CHAIN_FILE_MAX + 1);
+	if(txt){
+		*len_r = fread(txt, 1, NM_CHAIN_FILE_MAX + 1, fp);
+		if(*len_r == 0 || *len_r > NM_CHAIN_FILE_MAX){
+			free(txt);
+			txt = NULL;
+		}else{
+			txt[*len_r] = 0x00;
+		}
+	}
+	fclose(fp);
+	return txt;
+}
+
+static int read_sexp(const char *fname, gcry_sexp_t *sexp_r){
+	// Parse a key or chain file.  Returns 0, 438 or 902.
+	char *txt;
+	size_t len;
+	int rc;
+
+	txt = read_file(fname, &len);
+	if(!txt){
+		fprintf(stderr, "Error. Could not read %s.\n", fname);
+		return 438;
+	}
+	rc = gcry_sexp_new(sexp_r, txt, len, 1) ? 902 : 0;
+	if(rc)
+		fprintf(stderr, "Error. %s is not an s-expression.\n", fname);
+	free(txt);
+	return rc;
+}
+
+static int write_chain(const char *fname, gcry_sexp_t sexp_old,
+  const char *link_txt){
+	// The links of sexp_old (may be NULL), then link_txt.
+	gcry_sexp_t sexp_list, sexp_elem;
+	char *txt;
+	size_t len;
+	FILE *fp;
+	int j, n, rc = 0;
+
+	fp = fopen(fname, "w");
+	if(!fp){
+		fprintf(stderr, "Error. Could not write %s.\n", fname);
+		return 439;
+	}
+	fputs("(NaturalMessage-Key-Chain\n", fp);
+	sexp_list = sexp_old ? gcry_sexp_find_token(sexp_old, "NaturalMessage-Key-Chain", 0)
+		: NULL;
+	n = sexp_list ? gcry_sexp_length(sexp_list) : 0;
+	for(j = 1; j < n && !rc; j++){
+		sexp_elem = gcry_sexp_nth(sexp_list, j);
+		if(!sexp_elem)
+			continue;
+		len = gcry_sexp_sprint(sexp_elem, GCRYSEXP_FMT_ADVANCED, NULL, 0);
+		txt = malloc(len);
+		if(txt){
+			gcry_sexp_sprint(sexp_elem, GCRYSEXP_FMT_ADVANCED, txt, len);
+			fputs(txt, fp);
+			free(txt);
+		}else{
+			rc = 843;
+		}
+		gcry_sexp_release(sexp_elem);
+	}
+	gcry_sexp_release(sexp_list);
+	fputs(link_txt, fp);
+	fputs(")\n", fp);
+	if(fclose(fp) || rc){
+		fprintf(stderr, "Error. Could not write %s.\n", fname);
+		return rc ? rc : 439;
+	}
+	return 0;
+}
+
+static int last_subject_grip(gcry_sexp_t sexp_chain, unsigned char *grip){
+	// The keygrip of the last key in a chain.  Returns 0 or 990.
+	gcry_sexp_t sexp_list, sexp_link, sexp_txt, sexp_file, sexp_pub;
+	const char *txt;
+	size_t len;
+	int rc = 990;
+
+	sexp_list = gcry_sexp_find_token(sexp_chain, "NaturalMessage-Key-Chain", 0);
+	if(!sexp_list)
+		return 990;
+	sexp_link = gcry_sexp_nth(sexp_list, gcry_sexp_length(sexp_list) - 1);
+	sexp_txt = sexp_link ? gcry_sexp_find_token(sexp_link, "Key-Text", 0) : NULL;
+	txt = sexp_txt ? gcry_sexp_nth_data(sexp_txt, 1, &len) : NULL;
+	if(txt && !gcry_sexp_new(&sexp_file, txt, len, 1)){
+		sexp_pub = gcry_sexp_find_token(sexp_file, "public-key", 0);
+		if(sexp_pub && gcry_pk_get_keygrip(sexp_pub, grip))
+			rc = 0;
+		gcry_sexp_release(sexp_pub);
+		gcry_sexp_release(sexp_file);
+	}
+	gcry_sexp_release(sexp_txt);
+	gcry_sexp_release(sexp_link);
+	gcry_sexp_release(sexp_list);
+	return rc;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+int main (int argc, char **argv) {
+	const char *issuer_fname = NULL;
+	const char *subject_fname = NULL;
+	const char *chain_fname = NULL;
+	const char *out_fname = NULL;
+	const char *root_fname = NULL;
+	const char *leaf_fname = NULL;
+	const char *revoked_fname = NULL;
+	unsigned char grip_issuer[20], grip_last[20];
+	struct nm_revoke_t *rl = NULL;
+	struct nm_chain_result_t res;
+	gcry_sexp_t sexp_key, sexp_root, sexp_root_pub, sexp_chain = NULL;
+	char *txt, *leaf_txt = NULL, *link_txt;
+	size_t len, leaf_len = 0;
+	int err_int;
+	int opt_code; //encoded value from command-line args
+
+	nm_timing_start("nm_chain");
+	nm_stats_init("nm_chain");
+
+	/*
+	----------------------------------------------------------------------
+															LIBGCRYPT INITIALIZATION
+	----------------------------------------------------------------------
+	*/
+	// --link reads a private key, so set up secure memory as nm_sign
+	// does.
+	if (!gcry_check_version (GCRYPT_VERSION))
+	{
+		fputs ("libgcrypt version mismatch\n", stderr);
+		exit (2);
+	}
+	gcry_control (GCRYCTL_SUSPEND_SECMEM_WARN);
+	gcry_control (GCRYCTL_USE_SECURE_RNDPOOL);
+	gcry_control (GCRYCTL_INIT_SECMEM, 25600, 0);
+	gcry_control (GCRYCTL_RESUME_SECMEM_WARN);
+	gcry_control (GCRYCTL_INITIALIZATION_FINISHED, 0);
+	/*
+	----------------------------------------------------------------------
+													END LIBGCRYPT INITIALIZATION
+	----------------------------------------------------------------------
+	*/
+
+	nm_timing_phase("args");
+	while (1){
+		static struct option long_options[] = {
+					/* These options set a flag. */
+					{"link",    no_argument,       &link_flag, 1},
+					{"verify",  no_argument,       &verify_flag, 1},
+							 {"issuer",  required_argument, 0, 'I'},
+							 {"subject", required_argument, 0, 'S'},
+							 {"chain",   required_argument, 0, 'c'},
+							 {"out",     required_argument, 0, 'o'},
+							 {"root",    required_argument, 0, 'r'},
+							 {"leaf",    required_argument, 0, 'l'},
+							 {"revoked", required_argument, 0, 'R'},
+							 {"timings", optional_argument, 0, 'M'},
+							 {"help",        no_argument, 0, '?'},
+							 {0, 0, 0, 0}
+		};
+		/* 'getopt_long' stores the option index here. */
+		int option_index = 0;
+		opt_code = getopt_long (argc, argv, "c:o:r:l:",
+										 long_options, &option_index);
+
+		/* Detect the end of the options. */
+		if (opt_code == -1)
+			break;
+
+		switch (opt_code){
+			case 0:
+				break;
+
+			case 'I':
+				// private key that signs the new link
+				issuer_fname = optarg;
+				break;
+
+			case 'S':
+				// public key file that the new link vouches for
+				subject_fname = optarg;
+				break;
+
+			case 'c':
+				// existing chain
+				chain_fname = optarg;
+				break;
+
+			case 'o':
+				// chain to write
+				out_fname = optarg;
+				break;
+
+			case 'r':
+				// offline public key at the top of the chain
+				root_fname = optarg;
+				break;
+
+			case 'l':
+				// online public key that the chain must end at
+				leaf_fname = optarg;
+				break;
+
+			case 'R':
+				// revocation list signed by the root key
+				revoked_fname = optarg;
+				break;
+
+			case 'M':
+				// JSON phase timings at exit (to stderr or a file)
+				nm_timing_enable(optarg);
+				break;
+
+			case '?':
+				/* 'getopt_long' already printed an error message. */
+				usage();
+				return 738;
+
+			default:
+				abort ();
+		}
+	}
+	if (optind < argc || link_flag + verify_flag != 1
+	  || (link_flag && (!issuer_fname || !subject_fname || !out_fname))
+	  || (verify_flag && (!root_fname || !chain_fname))){
+		usage();
+		return 290;
+	}
+
+	if (chain_fname){
+		err_int = read_sexp(chain_fname, &sexp_chain);
+		if(err_int)
+			return err_int;
+		if(!nm_chain_is_chain(sexp_chain)){
+			fprintf(stderr, "Error. %s is not a key chain.\n", chain_fname);
+			return 990;
+		}
+	}
+
+	if (link_flag){
+		nm_timing_phase("link");
+		err_int = nm_read_key_file(issuer_fname, NULL, &sexp_root, debug_lvl);
+		if(err_int){
+			fprintf(stderr, "Error. Could not read the private key %s.\n", issuer_fname);
+			return err_int;
+		}
+		// Below the offline key, only a certifying key issues links
+		// (see nm_chain.c).
+		if(sexp_chain && nm_chain_key_function(sexp_root) != 'c'){
+			fprintf(stderr, "Error. %s is not a certifying key (nm_create_online_key --certify).\n",
+				issuer_fname);
+			gcry_sexp_release(sexp_root);
+			return 993;
+		}
+		sexp_key = gcry_sexp_find_token(sexp_root, "private-key", 0);
+		gcry_sexp_release(sexp_root);
+		if(!sexp_key){
+			fprintf(stderr, "Error. Could not read the private key %s.\n", issuer_fname);
+			return 901;
+		}
+		if(sexp_chain && (last_subject_grip(sexp_chain, grip_last)
+		  || !gcry_pk_get_keygrip(sexp_key, grip_issuer)
+		  || memcmp(grip_issuer, grip_last, sizeof(grip_last)))){
+			fprintf(stderr, "Error. %s is not the last key in %s.\n", issuer_fname,
+				chain_fname);
+			gcry_sexp_release(sexp_key);
+			return 993;
+		}
+		txt = read_file(subject_fname, &len);
+		if(!txt){
+			fprintf(stderr, "Error. Could not read %s.\n", subject_fname);
+			gcry_sexp_release(sexp_key);
+			return 438;
+		}
+		err_int = nm_chain_link_text(sexp_key, txt, len, &link_txt);
+		gcry_sexp_release(sexp_key);
+		free(txt);
+		if(err_int){
+			fprintf(stderr, "Error. Could not sign %s (code %d).\n", subject_fname,
+				err_int);
+			return err_int;
+		}
+		err_int = write_chain(out_fname, sexp_chain, link_txt);
+		free(link_txt);
+		gcry_sexp_release(sexp_chain);
+		return err_int;
+	}
+
+	nm_timing_phase("load");
+	err_int = read_sexp(root_fname, &sexp_root);
+	if(err_int)
+		return err_int;
+	sexp_root_pub = gcry_sexp_find_token(sexp_root, "NaturalMessage-Offline-Key-Set", 0);
+	if(sexp_root_pub){
+		// A chain starts at one offline key; the first key of a set
+		// would be taken for the whole set.
+		fprintf(stderr, "Error. %s is an offline key set, not one key.\n", root_fname);
+		gcry_sexp_release(sexp_root_pub);
+		return 985;
+	}
+	sexp_root_pub = gcry_sexp_find_token(sexp_root, "public-key", 0);
+	if(!sexp_root_pub){
+		fprintf(stderr, "Error. %s is not a public key file.\n", root_fname);
+		return 902;
+	}
+	if(leaf_fname){
+		leaf_txt = read_file(leaf_fname, &leaf_len);
+		if(!leaf_txt){
+			fprintf(stderr, "Error. Could not read %s.\n", leaf_fname);
+			return 438;
+		}
+	}
+	if(revoked_fname){
+		rl = nm_revoke_open(revoked_fname, &err_int);
+		if(!rl || (err_int = nm_revoke_verify(rl, sexp_root_pub))){
+			fprintf(stderr, "Error. %s is not a revocation list signed by %s "
+				"(code %d).\n", revoked_fname, root_fname, err_int);
+			return err_int;
+		}
+	}
+
+	nm_timing_phase("verify");
+	err_int = nm_chain_verify(NULL, sexp_root_pub, nm_chain_key_expire(sexp_root),
+		sexp_chain, leaf_txt, leaf_len, nm_keyring_today(), rl, &res);
+	nm_stats_add(err_int ? NM_STAT_VERIFY_FAILS : NM_STAT_VERIFY_OK, 1);
+	if(err_int)
+		printf("Chain of %d links not confirmed (code %d).\n", res.links, err_int);
+	else if(res.expire)
+		printf("Chain of %d links confirmed, valid until %u.\n", res.links, res.expire);
+	else
+		printf("Chain of %d links confirmed.\n", res.links);
+	if(rl)
+		nm_revoke_close(rl);
+	free(leaf_txt);
+	gcry_sexp_release(sexp_chain);
+	gcry_sexp_release(sexp_root_pub);
+	gcry_sexp_release(sexp_root);
+	return err_int;
+}
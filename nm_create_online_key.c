@@ -36,7 +36,10 @@
 //     the big file with AES -- but then this leads back to the
 //     compile problem of putting the correct GPGME on verious OSs).
 //  3) Create an online ECC Ed25519 signing key that expires at a date
-//     set by the user (recommeded about 30 days).
+//     set by the user (recommeded about 30 days).  With --certify it
+//     is instead a certifying key (Key-Function c) for the middle of
+//     a key chain (see nm_chain.c): it may sign keys, and nm_sign
+//     refuses it for anything else.
 //  4) The user can enter information like the name and a Natural Message
 //     user ID and other comment info to identify the owner.
 // After compiling, run:
@@ -59,6 +62,10 @@
 
 // local header file:
 #include "nm_keys.h"
+#include "nm_rsagen.h"
+#include "nm_timing.h"
+#include "nm_stats.h"
+#include "nm_probes.h"
 
 #include <time.h>
 #include <assert.h>
@@ -167,13 +174,16 @@ int natmsg_gen_key(const char * sexp_txt_in,
 
 	char *tmp_combined_sexp_txt = gcry_malloc_secure(max_rslt_txt_len);
 	char *tmp_pub_sexp_txt = gcry_malloc_secure(max_rslt_txt_len);
+	unsigned long long t0;
 
+	NM_PROBE1(keygen__entry, sexp_txt_in);
 
 	err = gcry_sexp_new(&sexp_key_parms, sexp_txt_in, 0, 1);
 	if (err){
 		fprintf (stderr, "Error. Formatting of the s-exp for keygen Failed: %s/%s\n",
 			gcry_strsource (err),
 			gcry_strerror (err));
+		NM_PROBE2(keygen__return, sexp_txt_in, 999);
 		return 999;
 	}else{
 		if(debug_lvl > 0){
@@ -183,11 +193,20 @@ int natmsg_gen_key(const char * sexp_txt_in,
 	
 	// The resulting s-expression is stored at this address
 	// sexp_key_rslt.
-	err = gcry_pk_genkey(sexp_key_rslt, sexp_key_parms);
+	// nm_pk_genkey spreads an RSA prime search over all cores
+	// (see nm_rsagen.c); other key types go to gcry_pk_genkey.
+	t0 = nm_stats_now_us();
+	err = nm_pk_genkey(sexp_key_rslt, sexp_key_parms);
+	if(!err){
+		nm_stats_latency(NM_HIST_KEYGEN, nm_stats_now_us() - t0);
+		nm_stats_add(NM_STAT_KEYGENS, 1);
+		nm_stats_secmem_sample();
+	}
 	if (err){
 		fprintf (stderr, "Error.  keygen Failed: %s/%s\n",
 			gcry_strsource (err),
 			gcry_strerror (err));
+		NM_PROBE2(keygen__return, sexp_txt_in, 999);
 		return 999;
 	}else{
 		// The keygen looks good. 
@@ -279,6 +298,7 @@ int natmsg_gen_key(const char * sexp_txt_in,
 	gcry_free(tmp_combined_sexp_txt);
 	gcry_free(tmp_pub_sexp_txt);
 	////gcry_free(tmp_prv_sexp_txt);
+	NM_PROBE2(keygen__return, sexp_txt_in, 0);
 	return 0;
 }
 //-------------------------------------------------------------------------------
@@ -290,7 +310,13 @@ int usage(){
 	printf("For any argument, you can enter two quotes with nothing between to "
 		"be prompted at run time to enter a value.\n");
 	printf("Usage: nm_create_online_key Name_of_Server Comment Webmaster_NatMsg_PUB_ID "
-		"IPV4 IPV6 ipv4_backup Expiration_YYYYMMDD output_fname_prefix\n");
+		"IPV4 IPV6 ipv4_backup Expiration_YYYYMMDD output_fname_prefix [rsa|x25519]\n");
+	printf("The last argument is the type of the online encryption key "
+		"(default rsa, or the NM_ENC_KEY_TYPE environment variable).\n");
+	printf("--timings[=<file>] anywhere on the line writes the time of each "
+		"phase as JSON at exit.\n");
+	printf("--certify anywhere on the line makes the signing key a certifying "
+		"key (Key-Function c) for a key chain.\n");
 	return 876;
 
 	return 0;
@@ -305,7 +331,10 @@ int main (int argc, char **argv) {
 	// Bob stuff
 	gcry_sexp_t sexp_online_enc_key, sexp_online_sign_key; 
 	gcry_sexp_t sexp_offline_sign_key;
-	static const char buff_online_enc_sexp[] = "(genkey (rsa (nbits 4:2048)))";
+	// RSA-2048 unless x25519 is requested (see nm_enc_genkey_sexp).
+	const char *buff_online_enc_sexp;
+	char *enc_key_type = NULL;
+	int certify = 0;
 	static const char buff_online_sign_sexp[] =  "(genkey (ecc (curve \"Ed25519\")))";
 	static const char buff_offline_sign_sexp[] = "(genkey (ecc (curve \"Ed25519\")))";
 	char *buff_online_enc_pub_sexp_result  = gcry_malloc_secure(MAX_KEY_BUFF);
@@ -322,6 +351,19 @@ int main (int argc, char **argv) {
 	FILE *fp;
 	char save_YYYYMMDD[10];
 
+	// --timings may be anywhere on the command line.
+	nm_timing_start("nm_create_online_key");
+	nm_stats_init("nm_create_online_key");
+	nm_timing_args(&argc, argv);
+	for(j = 1; j < argc; j++){
+		if(!strcmp(argv[j], "--certify")){
+			certify = 1;
+			memmove(&argv[j], &argv[j + 1], (argc - j) * sizeof(char *));
+			argc--;
+			j--;
+		}
+	}
+
 	//------------------------------------------------------------------------
 	entry_stuff.name_real[0] = '\0';
 	entry_stuff.name_comment[0] = '\0';
@@ -335,7 +377,7 @@ int main (int argc, char **argv) {
 	entry_stuff.output_fname_prefix[0] = '\0';
 
 	//------------------------------------------------------------------------
-	if (argc == 9){
+	if (argc == 9 || argc == 10){
 		////No verification -- if you want to enter lots of garbage, 
 		////that is what you will get.
 		//if len > 0:
@@ -349,6 +391,8 @@ int main (int argc, char **argv) {
 		strncpy(entry_stuff.backup_IPV4, (char *) argv[6], MAX_CMDLINE_BUFF);
 		strncpy(entry_stuff.expiration_YYYYMMDD, (char *) argv[7], MAX_CMDLINE_BUFF);
 		strncpy(entry_stuff.output_fname_prefix, (char *) argv[8], MAX_CMDLINE_BUFF);
+		if (argc == 10)
+			enc_key_type = argv[9];
 
 		printf("==== test... name real is %s\n", entry_stuff.name_real);
 	}else{
@@ -357,6 +401,11 @@ int main (int argc, char **argv) {
 			return 876;
 		}
 	}
+	buff_online_enc_sexp = nm_enc_genkey_sexp(enc_key_type);
+	if (!buff_online_enc_sexp){
+		usage();
+		return 876;
+	}
 	//------------------------------------------------------------------------
 	/*
 	----------------------------------------------------------------------
@@ -440,6 +489,7 @@ int main (int argc, char **argv) {
 	//------------------------------------------------------------
 	//------------------------------------------------------------
 	//------------------------------------------------------------
+	nm_timing_phase("prompt");
 	//    THE NEW KEYGEN IS HERE
 	//
 	
@@ -549,6 +599,7 @@ int main (int argc, char **argv) {
 	// restore the expire date for the online key
 	strncpy(entry_stuff.expiration_YYYYMMDD, save_YYYYMMDD,  9);
 
+	nm_timing_phase("keygen_online_enc");
   rslt = natmsg_gen_key(buff_online_enc_sexp, 
 		&entry_stuff,
 		buff_online_enc_pub_sexp_result, 
@@ -562,6 +613,7 @@ int main (int argc, char **argv) {
 	}
 
 	// Write the PUB key to a file:
+	nm_timing_phase("write");
 	if (strlen(buff_online_enc_pub_sexp_result) > 0){
 		strcpy(output_fname, entry_stuff.output_fname_prefix);
 		strcat(output_fname, "OnlinePUBEncKey.key");
@@ -587,15 +639,17 @@ int main (int argc, char **argv) {
 	//------------------------------------------------------------
 	printf("\n -=-=-=-=-=-=- Starting Online ECC keygen\n");
 
-	strcpy(entry_stuff.key_function, "s"); //signing key
+	// A certifying key signs only keys (see nm_chain.c).
+	strcpy(entry_stuff.key_function, certify ? "c" : "s"); //signing key
 
 	//Restore the name of the server, then append "online signing key"
 	strncpy(entry_stuff.name_real, save_name, MAX_ENTRY_LEN );
-	char *name_tmp = " ONLINE SIGNING KEY";
+	char *name_tmp = certify ? " CERTIFYING KEY" : " ONLINE SIGNING KEY";
 	printf("====== test in keygen. name_real is %s\n" , entry_stuff.name_real);
 
 	strncat(entry_stuff.name_real, name_tmp, MAX_ENTRY_LEN - strlen(name_tmp)); 
 
+	nm_timing_phase("keygen_online_sign");
   rslt = natmsg_gen_key(buff_online_sign_sexp,
 		&entry_stuff,
 		buff_online_sign_pub_sexp_result, 
@@ -610,6 +664,7 @@ int main (int argc, char **argv) {
 
 	//
 	// Write the PUB key to a file:
+	nm_timing_phase("write");
 	if (strlen(buff_online_sign_pub_sexp_result) > 0){
 		strcpy(output_fname, entry_stuff.output_fname_prefix);
 		strcat(output_fname, "OnlinePUBSignKey.key");
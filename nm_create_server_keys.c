@@ -55,6 +55,10 @@
 #include <ctype.h>
 
 #include "nm_keys.h"
+#include "nm_rsagen.h"
+#include "nm_timing.h"
+#include "nm_stats.h"
+#include "nm_probes.h"
 
 #include <time.h>
 #include <assert.h>
@@ -162,13 +166,16 @@ int natmsg_gen_key(const char * sexp_txt_in,
 
 	char *tmp_combined_sexp_txt = gcry_malloc_secure(max_rslt_txt_len);
 	char *tmp_pub_sexp_txt = gcry_malloc_secure(max_rslt_txt_len);
+	unsigned long long t0;
 
+	NM_PROBE1(keygen__entry, sexp_txt_in);
 
 	err = gcry_sexp_new(&sexp_key_parms, sexp_txt_in, 0, 1);
 	if (err){
 		fprintf (stderr, "Error. Formatting of the s-exp for keygen Failed: %s/%s\n",
 			gcry_strsource (err),
 			gcry_strerror (err));
+		NM_PROBE2(keygen__return, sexp_txt_in, 999);
 		return 999;
 	}else{
 		if(debug_lvl > 0){
@@ -178,11 +185,20 @@ int natmsg_gen_key(const char * sexp_txt_in,
 	
 	// The resulting s-expression is stored at this address
 	// sexp_key_rslt.
-	err = gcry_pk_genkey(sexp_key_rslt, sexp_key_parms);
+	// nm_pk_genkey spreads an RSA prime search over all cores
+	// (see nm_rsagen.c); other key types go to gcry_pk_genkey.
+	t0 = nm_stats_now_us();
+	err = nm_pk_genkey(sexp_key_rslt, sexp_key_parms);
+	if(!err){
+		nm_stats_latency(NM_HIST_KEYGEN, nm_stats_now_us() - t0);
+		nm_stats_add(NM_STAT_KEYGENS, 1);
+		nm_stats_secmem_sample();
+	}
 	if (err){
 		fprintf (stderr, "Error.  keygen Failed: %s/%s\n",
 			gcry_strsource (err),
 			gcry_strerror (err));
+		NM_PROBE2(keygen__return, sexp_txt_in, 999);
 		return 999;
 	}else{
 		// The keygen looks good. 
@@ -274,6 +290,7 @@ int natmsg_gen_key(const char * sexp_txt_in,
 	gcry_free(tmp_combined_sexp_txt);
 	gcry_free(tmp_pub_sexp_txt);
 	////gcry_free(tmp_prv_sexp_txt);
+	NM_PROBE2(keygen__return, sexp_txt_in, 0);
 	return 0;
 }
 //-------------------------------------------------------------------------------
@@ -281,6 +298,10 @@ int natmsg_gen_key(const char * sexp_txt_in,
 //-------------------------------------------------------------------------------
 int usage(){
 	printf("This is the usage statement...\n");
+	printf("Usage: nm_create_server_keys [rsa|x25519]\n");
+	printf("  The optional argument is the type of the online encryption key\n");
+	printf("  (default rsa, or the NM_ENC_KEY_TYPE environment variable).\n");
+	printf("  --timings[=<file>] writes the time of each phase as JSON at exit.\n");
 
 	return 0;
 }
@@ -294,7 +315,9 @@ int main (int argc, char **argv) {
 	// Bob stuff
 	gcry_sexp_t sexp_online_enc_key, sexp_online_sign_key; 
 	gcry_sexp_t sexp_offline_sign_key;
-	static const char buff_online_enc_sexp[] = "(genkey (rsa (nbits 4:2048)))";
+	// RSA-2048 unless x25519 is requested (see nm_enc_genkey_sexp).
+	const char *buff_online_enc_sexp;
+	char *enc_key_type = NULL;
 	static const char buff_online_sign_sexp[] =  "(genkey (ecc (curve \"Ed25519\")))";
 	static const char buff_offline_sign_sexp[] = "(genkey (ecc (curve \"Ed25519\")))";
 	int j;
@@ -304,6 +327,11 @@ int main (int argc, char **argv) {
 	char *time_str_now;
 	FILE *fp;
 	char save_YYYYMMDD[10];
+
+	// --timings may be anywhere on the command line.
+	nm_timing_start("nm_create_server_keys");
+	nm_stats_init("nm_create_server_keys");
+	nm_timing_args(&argc, argv);
 	/*
 	----------------------------------------------------------------------
 															LIBGCRYPT INITIALIZATION
@@ -374,6 +402,15 @@ int main (int argc, char **argv) {
 		abort ();
 	}
 
+	// Optional argument: the type of the online encryption key,
+	// rsa (the default) or x25519.
+	if (argc > 1)
+		enc_key_type = argv[1];
+	buff_online_enc_sexp = nm_enc_genkey_sexp(enc_key_type);
+	if (!buff_online_enc_sexp){
+		usage();
+		return 876;
+	}
 
 	char *buff_online_enc_pub_sexp_result  = gcry_malloc_secure(MAX_KEY_BUFF);
 	char *buff_online_enc_prv_sexp_result  = gcry_malloc_secure(MAX_KEY_BUFF);
@@ -395,6 +432,7 @@ int main (int argc, char **argv) {
 	//------------------------------------------------------------
 	//------------------------------------------------------------
 	//------------------------------------------------------------
+	nm_timing_phase("prompt");
 	//    THIE NEW KEYGEN IS HERE
 	//
 	
@@ -493,6 +531,7 @@ int main (int argc, char **argv) {
 	// and grab the online expire date from save_YYYYMMDD later.
 	strncpy(entry_stuff.expiration_YYYYMMDD, "40010101", 9);
 
+	nm_timing_phase("keygen_offline_sign");
   rslt = natmsg_gen_key(buff_offline_sign_sexp,
 		&entry_stuff,
 		buff_offline_sign_pub_sexp_result, 
@@ -506,6 +545,7 @@ int main (int argc, char **argv) {
 	}
 
 	// Write the PUB key to a file:
+	nm_timing_phase("write");
 	strcpy(output_fname, entry_stuff.output_fname_prefix);
 	strcat(output_fname, "OfflinePUBSignKey.key");
 	printf("out fname 1 is %s", output_fname);
@@ -539,6 +579,7 @@ int main (int argc, char **argv) {
 	// restore the expire date for the online key
 	strncpy(entry_stuff.expiration_YYYYMMDD, save_YYYYMMDD,  9);
 
+	nm_timing_phase("keygen_online_enc");
   rslt = natmsg_gen_key(buff_online_enc_sexp, 
 		&entry_stuff,
 		buff_online_enc_pub_sexp_result, 
@@ -552,6 +593,7 @@ int main (int argc, char **argv) {
 	}
 
 	// Write the PUB key to a file:
+	nm_timing_phase("write");
 	if (strlen(buff_online_enc_pub_sexp_result) > 0){
 		strcpy(output_fname, entry_stuff.output_fname_prefix);
 		strcat(output_fname, "OnlinePUBEncKey.key");
@@ -582,6 +624,7 @@ int main (int argc, char **argv) {
 	char *name_tmp = " ONLINE SIGNING KEY";
 	strncat(entry_stuff.name_real, name_tmp, MAX_ENTRY_LEN - strlen(name_tmp)); 
 
+	nm_timing_phase("keygen_online_sign");
   rslt = natmsg_gen_key(buff_online_sign_sexp,
 		&entry_stuff,
 		buff_online_sign_pub_sexp_result, 
@@ -596,6 +639,7 @@ int main (int argc, char **argv) {
 
 	//
 	// Write the PUB key to a file:
+	nm_timing_phase("write");
 	if (strlen(buff_online_sign_pub_sexp_result) > 0){
 		strcpy(output_fname, entry_stuff.output_fname_prefix);
 		strcat(output_fname, "OnlinePUBSignKey.key");
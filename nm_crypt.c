@@ -0,0 +1,960 @@
+// nm_crypt.c
+// Purpose:
+//   1) Encrypt a file of any size to the holder of an online
+//      encryption key (OnlinePUBEncKey.key), using all cores.
+//   2) Decrypt it again with the private key, checking every chunk
+//      before any of its plaintext is written out.
+//
+// This is hybrid encryption: a random 256-bit content key encrypts
+// the data with AES-256-GCM, and only the content key is encrypted
+// with the public key (RSA-OAEP with SHA-384, or for an X25519 key,
+// ECDH with a throw-away key and AES key wrap).  The data is cut into
+// chunks that are sealed independently, so the chunks of one batch
+// can be encrypted or decrypted in parallel and memory stays bounded
+// (2 chunks per thread) however big the file is.
+//
+// File format (all integers are big-endian):
+//   magic          8 bytes "NMENC001"
+//   chunk size     4 bytes
+//   wrapped length 4 bytes
+//   wrapped key    canonical s-expression, for an RSA key:
+//                    (NaturalMessage-Wrapped-Key
+//                      (enc-val (flags oaep) (hash-algo sha384) (rsa (a #..#))))
+//                  or for an X25519 key:
+//                    (NaturalMessage-Wrapped-Key
+//                      (enc-val (ecdh (e #..#)))
+//                      (aeswrap #..#))
+//   file nonce     4 random bytes
+//   then one or more chunks:
+//     length      4 bytes; the top bit is set on the final chunk
+//     ciphertext  length bytes (at most the chunk size)
+//     tag         16 bytes of GCM tag
+//
+// The GCM nonce of chunk i is file nonce || i (8 bytes), so no two
+// chunks share a nonce.  The additional authenticated data of each
+// chunk is SHA-384(header) || i || final flag, which ties every chunk
+// to this header and to its place in the file: chunks cannot be
+// reordered, moved to another file, or dropped from the end (the
+// last chunk must carry the final flag, or the file is truncated).
+//
+#include <stddef.h>
+#include <gcrypt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "nm_keys.h"
+#include "nm_hash.h"
+#include "nm_treehash.h"
+#include "nm_crypt.h"
+#include "nm_timing.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+#define NM_CRYPT_MAX_THREADS 256
+#define NM_CRYPT_MAX_WRAPPED 16384
+#define NM_CRYPT_FINAL_BIT 0x80000000UL
+
+struct nm_crypt_pool_t
+{
+	int nthreads;
+	int decrypt;
+	unsigned char file_nonce[NM_CRYPT_NONCE_LEN];
+	unsigned char header_digest[NM_SHA384_LEN];
+	gcry_cipher_hd_t hd[NM_CRYPT_MAX_THREADS];
+	pthread_t threads[NM_CRYPT_MAX_THREADS];
+	int started;      // worker threads, not counting the caller
+	pthread_mutex_t lock;
+	pthread_cond_t start_cond;
+	pthread_cond_t done_cond;
+	unsigned long generation;   // bumped for each batch
+	int active;       // workers still busy with this batch
+	int quit;
+	// The current batch, set by nm_crypt_pool_run().
+	struct nm_crypt_chunk_t *chunks;
+	int nchunks;
+	int next_chunk;   // taken with an atomic add by the workers
+};
+
+struct nm_crypt_worker_t
+{
+	struct nm_crypt_pool_t *pool;
+	int id;
+};
+
+static void put_u32(unsigned char *p, uint32_t v){
+	p[0] = (v >> 24) & 0xff;
+	p[1] = (v >> 16) & 0xff;
+	p[2] = (v >> 8) & 0xff;
+	p[3] = v & 0xff;
+}
+
+static uint32_t get_u32(const unsigned char *p){
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16)
+		| ((uint32_t) p[2] << 8) | p[3];
+}
+
+static void put_u64(unsigned char *p, unsigned long long v){
+	int j;
+	for(j = 0; j < 8; j++)
+		p[j] = (v >> (56 - 8 * j)) & 0xff;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+static int crypt_chunk(struct nm_crypt_pool_t *pool, gcry_cipher_hd_t hd,
+  struct nm_crypt_chunk_t *chunk){
+	// Seal or open one chunk in place.  Returns 0, or 941 if the
+	// tag does not match (the chunk was changed), or 940 for any
+	// other libgcrypt error.
+	unsigned char iv[NM_CRYPT_NONCE_LEN + 8];
+	unsigned char aad[NM_SHA384_LEN + 8 + 1];
+
+	memcpy(iv, pool->file_nonce, NM_CRYPT_NONCE_LEN);
+	put_u64(iv + NM_CRYPT_NONCE_LEN, chunk->index);
+	memcpy(aad, pool->header_digest, NM_SHA384_LEN);
+	put_u64(aad + NM_SHA384_LEN, chunk->index);
+	aad[NM_SHA384_LEN + 8] = chunk->final ? 1 : 0;
+
+	if(gcry_cipher_reset(hd)
+	  || gcry_cipher_setiv(hd, iv, sizeof(iv))
+	  || gcry_cipher_authenticate(hd, aad, sizeof(aad)))
+		return 940;
+
+	if(!pool->decrypt){
+		if(gcry_cipher_final(hd)
+		  || gcry_cipher_encrypt(hd, chunk->buf, chunk->len, NULL, 0)
+		  || gcry_cipher_gettag(hd, chunk->tag, NM_CRYPT_TAG_LEN))
+			return 940;
+		return 0;
+	}
+
+	if(gcry_cipher_final(hd)
+	  || gcry_cipher_decrypt(hd, chunk->buf, chunk->len, NULL, 0))
+		return 940;
+	if(gcry_cipher_checktag(hd, chunk->tag, NM_CRYPT_TAG_LEN)){
+		// Do not leave unauthenticated plaintext in the buffer.
+		memset(chunk->buf, 0, chunk->len);
+		return 941;
+	}
+	return 0;
+}
+
+static void crypt_batch(struct nm_crypt_pool_t *pool, int id){
+	// Take chunks of the current batch until there are none left.
+	int k;
+
+	while(1){
+		k = __atomic_fetch_add(&pool->next_chunk, 1, __ATOMIC_RELAXED);
+		if(k >= pool->nchunks)
+			break;
+		pool->chunks[k].err = crypt_chunk(pool, pool->hd[id], &pool->chunks[k]);
+	}
+}
+
+static void *crypt_worker(void *arg){
+	struct nm_crypt_worker_t *w = arg;
+	struct nm_crypt_pool_t *pool = w->pool;
+	int id = w->id;
+	unsigned long seen = 0;
+
+	free(w);
+	pthread_mutex_lock(&pool->lock);
+	while(1){
+		while(pool->generation == seen && !pool->quit)
+			pthread_cond_wait(&pool->start_cond, &pool->lock);
+		if(pool->quit)
+			break;
+		seen = pool->generation;
+		pthread_mutex_unlock(&pool->lock);
+
+		crypt_batch(pool, id);
+
+		pthread_mutex_lock(&pool->lock);
+		if(--pool->active == 0)
+			pthread_cond_signal(&pool->done_cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+struct nm_crypt_pool_t *nm_crypt_pool_new(const unsigned char *content_key,
+  const unsigned char *file_nonce, const unsigned char *header_digest,
+  int decrypt, int nthreads){
+	// Start a pool of nthreads workers (the calling thread counts as
+	// one of them) that seal or open chunks with content_key.
+	//
+	// Each worker has its own cipher handle with the key already set,
+	// so the key schedule is computed once per thread, not once per
+	// chunk.  The handles are in secure memory.
+	//
+	// nthreads <= 0 means one thread per online CPU.
+	// Returns NULL on failure.
+	struct nm_crypt_pool_t *pool;
+	struct nm_crypt_worker_t *w;
+	int j;
+
+	if(nthreads <= 0)
+		nthreads = nm_tree_default_threads();
+	if(nthreads > NM_CRYPT_MAX_THREADS)
+		nthreads = NM_CRYPT_MAX_THREADS;
+
+	pool = calloc(1, sizeof(struct nm_crypt_pool_t));
+	if(!pool)
+		return NULL;
+	pool->nthreads = nthreads;
+	pool->decrypt = decrypt;
+	memcpy(pool->file_nonce, file_nonce, NM_CRYPT_NONCE_LEN);
+	memcpy(pool->header_digest, header_digest, NM_SHA384_LEN);
+
+	for(j = 0; j < nthreads; j++){
+		if(gcry_cipher_open(&pool->hd[j], GCRY_CIPHER_AES256,
+		  GCRY_CIPHER_MODE_GCM, GCRY_CIPHER_SECURE)
+		  || gcry_cipher_setkey(pool->hd[j], content_key, NM_CRYPT_KEY_LEN)){
+			while(j >= 0){
+				gcry_cipher_close(pool->hd[j]);
+				j--;
+			}
+			free(pool);
+			return NULL;
+		}
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+	// If a thread cannot be started, run with the ones that were.
+	for(j = 1; j < nthreads; j++){
+		w = malloc(sizeof(struct nm_crypt_worker_t));
+		if(!w)
+			break;
+		w->pool = pool;
+		w->id = j;
+		if(pthread_create(&pool->threads[j], NULL, crypt_worker, w)){
+			free(w);
+			break;
+		}
+		pool->started = j;
+	}
+	return pool;
+}
+
+int nm_crypt_pool_run(struct nm_crypt_pool_t *pool,
+  struct nm_crypt_chunk_t *chunks, int nchunks){
+	// Seal or open a batch of chunks with all of the workers, and
+	// return when the whole batch is done.  Returns the error code of
+	// the first chunk that failed, or 0.
+	int k;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->chunks = chunks;
+	pool->nchunks = nchunks;
+	pool->next_chunk = 0;
+	pool->active = pool->started;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->start_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	crypt_batch(pool, 0);
+
+	pthread_mutex_lock(&pool->lock);
+	while(pool->active > 0)
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+
+	for(k = 0; k < nchunks; k++)
+		if(chunks[k].err)
+			return chunks[k].err;
+	return 0;
+}
+
+void nm_crypt_pool_free(struct nm_crypt_pool_t *pool){
+	int j;
+
+	if(!pool)
+		return;
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->start_cond);
+	pthread_mutex_unlock(&pool->lock);
+	for(j = 1; j <= pool->started; j++)
+		pthread_join(pool->threads[j], NULL);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->start_cond);
+	pthread_cond_destroy(&pool->done_cond);
+	for(j = 0; j < pool->nthreads; j++)
+		gcry_cipher_close(pool->hd[j]);
+	nm_wipe(pool, sizeof(struct nm_crypt_pool_t));
+	free(pool);
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+static int x25519_kek(const char *shared, size_t shared_len,
+  const char *eph, size_t eph_len, unsigned char *kek){
+	// The key-encryption key for an X25519 wrapped key is the first
+	// 32 bytes of SHA-384(label || shared point || ephemeral public
+	// key).  kek should be in secure memory.
+	static const char label[] = "NaturalMessage-X25519-KEK";
+	gcry_md_hd_t hd;
+
+	if(gcry_md_open(&hd, GCRY_MD_SHA384, GCRY_MD_FLAG_SECURE))
+		return 123;
+	gcry_md_write(hd, label, sizeof(label) - 1);
+	gcry_md_write(hd, shared, shared_len);
+	gcry_md_write(hd, eph, eph_len);
+	memcpy(kek, gcry_md_read(hd, GCRY_MD_SHA384), NM_CRYPT_KEY_LEN);
+	gcry_md_close(hd);
+	return 0;
+}
+
+static int x25519_aeswrap(const unsigned char *kek, int unwrap,
+  const unsigned char *in, size_t in_len, unsigned char *out, size_t out_len){
+	// AES-256 key wrap (RFC 3394) of the content key with kek.  The
+	// unwrap fails if the integrity check does not match, which is
+	// what happens with the wrong private key.
+	gcry_cipher_hd_t hd;
+	gcry_error_t err;
+
+	err = gcry_cipher_open(&hd, GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_AESWRAP,
+		GCRY_CIPHER_SECURE);
+	if(err)
+		return 940;
+	err = gcry_cipher_setkey(hd, kek, NM_CRYPT_KEY_LEN);
+	if(!err){
+		if(unwrap)
+			err = gcry_cipher_decrypt(hd, out, out_len, in, in_len);
+		else
+			err = gcry_cipher_encrypt(hd, out, out_len, in, in_len);
+	}
+	gcry_cipher_close(hd);
+	return err ? 945 : 0;
+}
+
+static int wrap_x25519(gcry_sexp_t pub_key, const unsigned char *content_key,
+  gcry_sexp_t *sexp_wrapped_r){
+	// ECDH with a fresh random scalar: libgcrypt returns the shared
+	// point (s) and the ephemeral public key (e).  Only e goes in the
+	// file; the content key is wrapped with a key derived from s.
+	gcry_sexp_t sexp_data = NULL;
+	gcry_sexp_t sexp_enc = NULL;
+	gcry_sexp_t sexp_s = NULL;
+	gcry_sexp_t sexp_e = NULL;
+	unsigned char *scalar = NULL;
+	unsigned char *kek = NULL;
+	unsigned char wrapped_key[NM_CRYPT_KEY_LEN + 8];
+	const char *shared, *eph;
+	size_t shared_len = 0, eph_len = 0;
+	gcry_error_t err;
+	int rslt = 943;
+
+	scalar = gcry_random_bytes_secure(NM_CRYPT_KEY_LEN, GCRY_STRONG_RANDOM);
+	kek = gcry_malloc_secure(NM_CRYPT_KEY_LEN);
+	if(!scalar || !kek){
+		rslt = 445;
+		goto cleanup;
+	}
+	err = gcry_sexp_build(&sexp_data, NULL, "(data (flags raw) (value %b))",
+		NM_CRYPT_KEY_LEN, scalar);
+	if(!err)
+		err = gcry_pk_encrypt(&sexp_enc, sexp_data, pub_key);
+	if(err){
+		fprintf(stderr, "Error. ECDH with the encryption key failed: %s\n",
+			gcry_strerror(err));
+		goto cleanup;
+	}
+	sexp_s = gcry_sexp_find_token(sexp_enc, "s", 0);
+	sexp_e = gcry_sexp_find_token(sexp_enc, "e", 0);
+	if(!sexp_s || !sexp_e)
+		goto cleanup;
+	shared = gcry_sexp_nth_data(sexp_s, 1, &shared_len);
+	eph = gcry_sexp_nth_data(sexp_e, 1, &eph_len);
+	if(!shared || !eph
+	  || x25519_kek(shared, shared_len, eph, eph_len, kek)
+	  || x25519_aeswrap(kek, 0, content_key, NM_CRYPT_KEY_LEN,
+		wrapped_key, sizeof(wrapped_key)))
+		goto cleanup;
+
+	if(gcry_sexp_build(sexp_wrapped_r, NULL,
+	  "(NaturalMessage-Wrapped-Key (enc-val (ecdh (e %b))) (aeswrap %b))",
+	  (int) eph_len, eph, (int) sizeof(wrapped_key), wrapped_key))
+		goto cleanup;
+	rslt = 0;
+
+cleanup:
+	if(scalar)
+		gcry_free(scalar);
+	if(kek){
+		nm_wipe(kek, NM_CRYPT_KEY_LEN);
+		gcry_free(kek);
+	}
+	gcry_sexp_release(sexp_data);
+	gcry_sexp_release(sexp_enc);
+	gcry_sexp_release(sexp_s);
+	gcry_sexp_release(sexp_e);
+	return rslt;
+}
+
+static int wrap_content_key(gcry_sexp_t pub_key, const unsigned char *content_key,
+  unsigned char **wrapped_r, size_t *wrapped_len_r){
+	// Encrypt the content key to the public key and return the
+	// canonical text of the NaturalMessage-Wrapped-Key s-expression
+	// (allocated with malloc).  The key may be RSA or X25519.
+	gcry_sexp_t sexp_data = NULL;
+	gcry_sexp_t sexp_enc = NULL;
+	gcry_sexp_t sexp_rsa = NULL;
+	gcry_sexp_t sexp_wrapped = NULL;
+	gcry_sexp_t sexp_algo;
+	gcry_error_t err;
+	size_t len;
+	int rslt = 0;
+
+	sexp_algo = gcry_sexp_find_token(pub_key, "ecc", 0);
+	if(sexp_algo){
+		gcry_sexp_release(sexp_algo);
+		rslt = wrap_x25519(pub_key, content_key, &sexp_wrapped);
+		if(rslt)
+			goto cleanup;
+		goto print;
+	}
+	sexp_algo = gcry_sexp_find_token(pub_key, "rsa", 0);
+	if(!sexp_algo){
+		fprintf(stderr, "Error. The encryption key is not an RSA or X25519 key.\n");
+		return 942;
+	}
+	gcry_sexp_release(sexp_algo);
+
+	err = gcry_sexp_build(&sexp_data, NULL,
+		"(data (flags oaep) (hash-algo sha384) (value %b))",
+		NM_CRYPT_KEY_LEN, content_key);
+	if(!err)
+		err = gcry_pk_encrypt(&sexp_enc, sexp_data, pub_key);
+	if(err){
+		fprintf(stderr, "Error. Failed to encrypt the content key: %s\n",
+			gcry_strerror(err));
+		rslt = 943;
+		goto cleanup;
+	}
+	sexp_rsa = gcry_sexp_find_token(sexp_enc, "rsa", 0);
+	if(!sexp_rsa
+	  || gcry_sexp_build(&sexp_wrapped, NULL,
+		"(NaturalMessage-Wrapped-Key (enc-val (flags oaep) (hash-algo sha384) %S))",
+		sexp_rsa)){
+		rslt = 943;
+		goto cleanup;
+	}
+
+print:
+	len = gcry_sexp_sprint(sexp_wrapped, GCRYSEXP_FMT_CANON, NULL, 0);
+	*wrapped_r = malloc(len);
+	if(!*wrapped_r){
+		rslt = 843;
+		goto cleanup;
+	}
+	*wrapped_len_r = gcry_sexp_sprint(sexp_wrapped, GCRYSEXP_FMT_CANON,
+		*wrapped_r, len);
+
+cleanup:
+	gcry_sexp_release(sexp_data);
+	gcry_sexp_release(sexp_enc);
+	gcry_sexp_release(sexp_rsa);
+	gcry_sexp_release(sexp_wrapped);
+	return rslt;
+}
+
+static int unwrap_x25519(gcry_sexp_t prv_key, gcry_sexp_t sexp_wrapped,
+  unsigned char *content_key){
+	// Redo the ECDH with the private key and the ephemeral public
+	// key from the header, then unwrap the content key.
+	gcry_sexp_t sexp_e = NULL;
+	gcry_sexp_t sexp_aeswrap = NULL;
+	gcry_sexp_t sexp_enc = NULL;
+	gcry_sexp_t sexp_plain = NULL;
+	gcry_sexp_t sexp_value = NULL;
+	unsigned char *kek = NULL;
+	const char *eph, *wrapped_key, *shared;
+	size_t eph_len = 0, wrapped_key_len = 0, shared_len = 0;
+	int rslt = 944;
+
+	sexp_e = gcry_sexp_find_token(sexp_wrapped, "e", 0);
+	sexp_aeswrap = gcry_sexp_find_token(sexp_wrapped, "aeswrap", 0);
+	if(!sexp_e || !sexp_aeswrap)
+		goto cleanup;
+	eph = gcry_sexp_nth_data(sexp_e, 1, &eph_len);
+	wrapped_key = gcry_sexp_nth_data(sexp_aeswrap, 1, &wrapped_key_len);
+	if(!eph || !wrapped_key || wrapped_key_len != NM_CRYPT_KEY_LEN + 8)
+		goto cleanup;
+
+	rslt = 945;
+	if(gcry_sexp_build(&sexp_enc, NULL, "(enc-val (ecdh (e %b)))",
+	  (int) eph_len, eph)
+	  || gcry_pk_decrypt(&sexp_plain, sexp_enc, prv_key))
+		goto cleanup;
+	sexp_value = gcry_sexp_find_token(sexp_plain, "value", 0);
+	if(!sexp_value)
+		goto cleanup;
+	shared = gcry_sexp_nth_data(sexp_value, 1, &shared_len);
+	kek = gcry_malloc_secure(NM_CRYPT_KEY_LEN);
+	if(!shared || !kek
+	  || x25519_kek(shared, shared_len, eph, eph_len, kek))
+		goto cleanup;
+	rslt = x25519_aeswrap(kek, 1, (const unsigned char *) wrapped_key,
+		wrapped_key_len, content_key, NM_CRYPT_KEY_LEN);
+
+cleanup:
+	if(kek){
+		nm_wipe(kek, NM_CRYPT_KEY_LEN);
+		gcry_free(kek);
+	}
+	gcry_sexp_release(sexp_e);
+	gcry_sexp_release(sexp_aeswrap);
+	gcry_sexp_release(sexp_enc);
+	gcry_sexp_release(sexp_plain);
+	gcry_sexp_release(sexp_value);
+	return rslt;
+}
+
+static int unwrap_content_key(gcry_sexp_t prv_key, const unsigned char *wrapped,
+  size_t wrapped_len, unsigned char *content_key){
+	// Decrypt the content key from the wrapped-key text in the file
+	// header.  content_key should be in secure memory.
+	gcry_sexp_t sexp_wrapped = NULL;
+	gcry_sexp_t sexp_enc = NULL;
+	gcry_sexp_t sexp_plain = NULL;
+	gcry_sexp_t sexp_value = NULL;
+	const char *value = NULL;
+	size_t value_len = 0;
+	int rslt = 0;
+
+	if(gcry_sexp_new(&sexp_wrapped, wrapped, wrapped_len, 0)){
+		fprintf(stderr, "Error. The wrapped key in the header is not valid.\n");
+		return 944;
+	}
+	sexp_enc = gcry_sexp_find_token(sexp_wrapped, "ecdh", 0);
+	if(sexp_enc){
+		rslt = unwrap_x25519(prv_key, sexp_wrapped, content_key);
+		if(rslt == 944)
+			fprintf(stderr, "Error. The wrapped key in the header is not valid.\n");
+		else if(rslt)
+			fprintf(stderr, "Error. Could not decrypt the content key "
+				"(wrong private key?).\n");
+		goto cleanup;
+	}
+	sexp_enc = gcry_sexp_find_token(sexp_wrapped, "enc-val", 0);
+	if(!sexp_enc){
+		fprintf(stderr, "Error. The wrapped key in the header is not valid.\n");
+		rslt = 944;
+		goto cleanup;
+	}
+	if(gcry_pk_decrypt(&sexp_plain, sexp_enc, prv_key)){
+		fprintf(stderr, "Error. Could not decrypt the content key "
+			"(wrong private key?).\n");
+		rslt = 945;
+		goto cleanup;
+	}
+	sexp_value = gcry_sexp_find_token(sexp_plain, "value", 0);
+	if(sexp_value)
+		value = gcry_sexp_nth_data(sexp_value, 1, &value_len);
+	if(!sexp_value || !value || value_len != NM_CRYPT_KEY_LEN){
+		fprintf(stderr, "Error. The content key has the wrong length.\n");
+		rslt = 945;
+		goto cleanup;
+	}
+	memcpy(content_key, value, NM_CRYPT_KEY_LEN);
+
+cleanup:
+	gcry_sexp_release(sexp_wrapped);
+	gcry_sexp_release(sexp_enc);
+	gcry_sexp_release(sexp_plain);
+	gcry_sexp_release(sexp_value);
+	return rslt;
+}
+
+static int header_hash(const unsigned char *fixed, const unsigned char *wrapped,
+  size_t wrapped_len, const unsigned char *file_nonce, unsigned char *digest){
+	// SHA-384 of the whole file header, for the per-chunk AAD.
+	gcry_md_hd_t hd;
+
+	if(gcry_md_open(&hd, GCRY_MD_SHA384, 0))
+		return 123;
+	gcry_md_write(hd, fixed, NM_CRYPT_MAGIC_LEN + 8);
+	gcry_md_write(hd, wrapped, wrapped_len);
+	gcry_md_write(hd, file_nonce, NM_CRYPT_NONCE_LEN);
+	memcpy(digest, gcry_md_read(hd, GCRY_MD_SHA384), NM_SHA384_LEN);
+	gcry_md_close(hd);
+	return 0;
+}
+
+static struct nm_crypt_chunk_t *alloc_batch(int nchunks, size_t chunk_size){
+	struct nm_crypt_chunk_t *chunks;
+	int k;
+
+	chunks = calloc(nchunks, sizeof(struct nm_crypt_chunk_t));
+	if(!chunks)
+		return NULL;
+	for(k = 0; k < nchunks; k++){
+		chunks[k].buf = malloc(chunk_size > 0 ? chunk_size : 1);
+		if(!chunks[k].buf){
+			while(k-- > 0)
+				free(chunks[k].buf);
+			free(chunks);
+			return NULL;
+		}
+	}
+	return chunks;
+}
+
+static void free_batch(struct nm_crypt_chunk_t *chunks, int nchunks,
+  size_t chunk_size){
+	int k;
+
+	if(!chunks)
+		return;
+	for(k = 0; k < nchunks; k++){
+		// The buffers held plaintext.
+		nm_wipe(chunks[k].buf, chunk_size);
+		free(chunks[k].buf);
+	}
+	free(chunks);
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+int nm_encrypt_file(const char *in_fname, const char *out_fname,
+  const char *pub_key_fname, size_t chunk_size, int nthreads, int debug_lvl){
+	// Encrypt in_fname to out_fname for the holder of the private
+	// half of pub_key_fname.  chunk_size 0 means NM_CRYPT_CHUNK_SIZE,
+	// and nthreads <= 0 means one thread per online CPU.
+	// Returns 0 or an error code; out_fname is removed on error.
+	gcry_sexp_t pub_key = NULL;
+	struct nm_crypt_pool_t *pool = NULL;
+	struct nm_crypt_chunk_t *chunks = NULL;
+	unsigned char fixed[NM_CRYPT_MAGIC_LEN + 8];
+	unsigned char file_nonce[NM_CRYPT_NONCE_LEN];
+	unsigned char header_digest[NM_SHA384_LEN];
+	unsigned char len_buf[4];
+	unsigned char *content_key = NULL;
+	unsigned char *wrapped = NULL;
+	size_t wrapped_len = 0;
+	unsigned long long index = 0;
+	FILE *fp_in = NULL;
+	FILE *fp_out = NULL;
+	int out_created = 0;
+	int nchunks = 0;
+	int done = 0;
+	int rslt;
+	int k, c;
+
+	if(chunk_size == 0)
+		chunk_size = NM_CRYPT_CHUNK_SIZE;
+	if(chunk_size > NM_CRYPT_MAX_CHUNK_SIZE){
+		fprintf(stderr, "Error. The chunk size may not be over %d bytes.\n",
+			NM_CRYPT_MAX_CHUNK_SIZE);
+		return 322;
+	}
+	if(nthreads <= 0)
+		nthreads = nm_tree_default_threads();
+	if(nthreads > NM_CRYPT_MAX_THREADS)
+		nthreads = NM_CRYPT_MAX_THREADS;
+
+	nm_timing_phase("key_load");
+	rslt = nm_read_key_file(pub_key_fname, "public-key", &pub_key, debug_lvl);
+	if(rslt)
+		return rslt;
+
+	nm_timing_phase("key_wrap");
+
+	content_key = gcry_malloc_secure(NM_CRYPT_KEY_LEN);
+	if(!content_key){
+		rslt = 445;
+		goto cleanup;
+	}
+	gcry_randomize(content_key, NM_CRYPT_KEY_LEN, GCRY_STRONG_RANDOM);
+	gcry_create_nonce(file_nonce, NM_CRYPT_NONCE_LEN);
+
+	rslt = wrap_content_key(pub_key, content_key, &wrapped, &wrapped_len);
+	if(rslt)
+		goto cleanup;
+
+	memcpy(fixed, NM_CRYPT_MAGIC, NM_CRYPT_MAGIC_LEN);
+	put_u32(fixed + NM_CRYPT_MAGIC_LEN, chunk_size);
+	put_u32(fixed + NM_CRYPT_MAGIC_LEN + 4, wrapped_len);
+	rslt = header_hash(fixed, wrapped, wrapped_len, file_nonce, header_digest);
+	if(rslt)
+		goto cleanup;
+
+	pool = nm_crypt_pool_new(content_key, file_nonce, header_digest, 0, nthreads);
+	// The cipher handles have their own copy of the key.
+	nm_wipe(content_key, NM_CRYPT_KEY_LEN);
+	if(!pool){
+		rslt = 940;
+		goto cleanup;
+	}
+	nchunks = 2 * nthreads;
+	chunks = alloc_batch(nchunks, chunk_size);
+	if(!chunks){
+		rslt = 843;
+		goto cleanup;
+	}
+
+	fp_in = fopen(in_fname, "rb");
+	if(!fp_in){
+		perror("Error. Failed open the input file");
+		rslt = 439;
+		goto cleanup;
+	}
+	fp_out = fopen(out_fname, "wb");
+	if(!fp_out){
+		perror("Error. Failed to open the output file");
+		rslt = 440;
+		goto cleanup;
+	}
+	out_created = 1;
+	if(fwrite(fixed, 1, sizeof(fixed), fp_out) != sizeof(fixed)
+	  || fwrite(wrapped, 1, wrapped_len, fp_out) != wrapped_len
+	  || fwrite(file_nonce, 1, NM_CRYPT_NONCE_LEN, fp_out) != NM_CRYPT_NONCE_LEN){
+		rslt = 441;
+		goto cleanup;
+	}
+
+	nm_timing_phase("chunks");
+	while(!done){
+		// Read a batch.  A short chunk is the final one; a full
+		// chunk is final only if nothing follows it.  An empty
+		// file is one empty final chunk.
+		for(k = 0; k < nchunks && !done; k++){
+			chunks[k].index = index++;
+			chunks[k].len = fread(chunks[k].buf, 1, chunk_size, fp_in);
+			chunks[k].final = 0;
+			if(chunks[k].len < chunk_size){
+				if(ferror(fp_in)){
+					rslt = 932;
+					goto cleanup;
+				}
+				done = 1;
+			}else if((c = getc(fp_in)) == EOF){
+				done = 1;
+			}else{
+				ungetc(c, fp_in);
+			}
+			chunks[k].final = done;
+		}
+
+		rslt = nm_crypt_pool_run(pool, chunks, k);
+		if(rslt)
+			goto cleanup;
+
+		for(c = 0; c < k; c++){
+			put_u32(len_buf, chunks[c].len
+				| (chunks[c].final ? NM_CRYPT_FINAL_BIT : 0));
+			if(fwrite(len_buf, 1, 4, fp_out) != 4
+			  || fwrite(chunks[c].buf, 1, chunks[c].len, fp_out) != chunks[c].len
+			  || fwrite(chunks[c].tag, 1, NM_CRYPT_TAG_LEN, fp_out) != NM_CRYPT_TAG_LEN){
+				rslt = 441;
+				goto cleanup;
+			}
+		}
+	}
+	if(fclose(fp_out))
+		rslt = 441;
+	fp_out = NULL;
+	if(debug_lvl > 0)
+		fprintf(stderr, "Encrypted %llu chunk(s) of up to %lu bytes with %d thread(s).\n",
+			index, (unsigned long) chunk_size, nthreads);
+
+cleanup:
+	if(fp_in)
+		fclose(fp_in);
+	if(fp_out)
+		fclose(fp_out);
+	if(rslt && out_created)
+		unlink(out_fname);
+	free_batch(chunks, nchunks, chunk_size);
+	nm_crypt_pool_free(pool);
+	free(wrapped);
+	if(content_key)
+		gcry_free(content_key);
+	gcry_sexp_release(pub_key);
+	return rslt;
+}
+
+int nm_decrypt_file(const char *in_fname, const char *out_fname,
+  const char *prv_key_fname, int nthreads, int debug_lvl){
+	// Decrypt in_fname (made by nm_encrypt_file) to out_fname.
+	// Every chunk of a batch is checked before any of the batch is
+	// written, and if any check fails (or the file was cut short) the
+	// partial out_fname is removed and an error code is returned.
+	gcry_sexp_t prv_key = NULL;
+	struct nm_crypt_pool_t *pool = NULL;
+	struct nm_crypt_chunk_t *chunks = NULL;
+	unsigned char fixed[NM_CRYPT_MAGIC_LEN + 8];
+	unsigned char file_nonce[NM_CRYPT_NONCE_LEN];
+	unsigned char header_digest[NM_SHA384_LEN];
+	unsigned char len_buf[4];
+	unsigned char *content_key = NULL;
+	unsigned char *wrapped = NULL;
+	size_t wrapped_len = 0;
+	size_t chunk_size = 0;
+	uint32_t len_field;
+	unsigned long long index = 0;
+	FILE *fp_in = NULL;
+	FILE *fp_out = NULL;
+	int out_created = 0;
+	int nchunks = 0;
+	int done = 0;
+	int rslt;
+	int k, c;
+
+	if(nthreads <= 0)
+		nthreads = nm_tree_default_threads();
+	if(nthreads > NM_CRYPT_MAX_THREADS)
+		nthreads = NM_CRYPT_MAX_THREADS;
+
+	nm_timing_phase("header");
+	fp_in = fopen(in_fname, "rb");
+	if(!fp_in){
+		perror("Error. Failed open the input file");
+		return 439;
+	}
+	if(fread(fixed, 1, sizeof(fixed), fp_in) != sizeof(fixed)
+	  || memcmp(fixed, NM_CRYPT_MAGIC, NM_CRYPT_MAGIC_LEN)){
+		fprintf(stderr, "Error. %s is not a Natural Message encrypted file.\n",
+			in_fname);
+		fclose(fp_in);
+		return 946;
+	}
+	chunk_size = get_u32(fixed + NM_CRYPT_MAGIC_LEN);
+	wrapped_len = get_u32(fixed + NM_CRYPT_MAGIC_LEN + 4);
+	if(chunk_size == 0 || chunk_size > NM_CRYPT_MAX_CHUNK_SIZE
+	  || wrapped_len == 0 || wrapped_len > NM_CRYPT_MAX_WRAPPED){
+		fprintf(stderr, "Error. The header of %s is not valid.\n", in_fname);
+		fclose(fp_in);
+		return 946;
+	}
+	wrapped = malloc(wrapped_len);
+	if(!wrapped){
+		fclose(fp_in);
+		return 843;
+	}
+	if(fread(wrapped, 1, wrapped_len, fp_in) != wrapped_len
+	  || fread(file_nonce, 1, NM_CRYPT_NONCE_LEN, fp_in) != NM_CRYPT_NONCE_LEN){
+		fprintf(stderr, "Error. The header of %s is not valid.\n", in_fname);
+		rslt = 946;
+		goto cleanup;
+	}
+	rslt = header_hash(fixed, wrapped, wrapped_len, file_nonce, header_digest);
+	if(rslt)
+		goto cleanup;
+
+	nm_timing_phase("key_load");
+	rslt = nm_read_key_file(prv_key_fname, "private-key", &prv_key, debug_lvl);
+	if(rslt)
+		goto cleanup;
+	nm_timing_phase("key_unwrap");
+	content_key = gcry_malloc_secure(NM_CRYPT_KEY_LEN);
+	if(!content_key){
+		rslt = 445;
+		goto cleanup;
+	}
+	rslt = unwrap_content_key(prv_key, wrapped, wrapped_len, content_key);
+	if(rslt)
+		goto cleanup;
+
+	pool = nm_crypt_pool_new(content_key, file_nonce, header_digest, 1, nthreads);
+	nm_wipe(content_key, NM_CRYPT_KEY_LEN);
+	if(!pool){
+		rslt = 940;
+		goto cleanup;
+	}
+	nchunks = 2 * nthreads;
+	chunks = alloc_batch(nchunks, chunk_size);
+	if(!chunks){
+		rslt = 843;
+		goto cleanup;
+	}
+
+	fp_out = fopen(out_fname, "wb");
+	if(!fp_out){
+		perror("Error. Failed to open the output file");
+		rslt = 440;
+		goto cleanup;
+	}
+	out_created = 1;
+
+	nm_timing_phase("chunks");
+	while(!done){
+		for(k = 0; k < nchunks && !done; k++){
+			if(fread(len_buf, 1, 4, fp_in) != 4){
+				fprintf(stderr, "Error. %s is truncated: the final chunk "
+					"is missing.\n", in_fname);
+				rslt = 947;
+				goto cleanup;
+			}
+			len_field = get_u32(len_buf);
+			chunks[k].index = index++;
+			chunks[k].final = (len_field & NM_CRYPT_FINAL_BIT) ? 1 : 0;
+			chunks[k].len = len_field & ~NM_CRYPT_FINAL_BIT;
+			if(chunks[k].len > chunk_size){
+				fprintf(stderr, "Error. Chunk %llu of %s is too long.\n",
+					chunks[k].index, in_fname);
+				rslt = 946;
+				goto cleanup;
+			}
+			if(fread(chunks[k].buf, 1, chunks[k].len, fp_in) != chunks[k].len
+			  || fread(chunks[k].tag, 1, NM_CRYPT_TAG_LEN, fp_in) != NM_CRYPT_TAG_LEN){
+				fprintf(stderr, "Error. %s is truncated in chunk %llu.\n",
+					in_fname, chunks[k].index);
+				rslt = 947;
+				goto cleanup;
+			}
+			done = chunks[k].final;
+		}
+		if(done && getc(fp_in) != EOF){
+			fprintf(stderr, "Error. There is data after the final chunk of %s.\n",
+				in_fname);
+			rslt = 946;
+			goto cleanup;
+		}
+
+		rslt = nm_crypt_pool_run(pool, chunks, k);
+		if(rslt){
+			for(c = 0; c < k; c++)
+				if(chunks[c].err)
+					break;
+			fprintf(stderr, "Error. Chunk %llu of %s failed authentication.\n",
+				chunks[c].index, in_fname);
+			goto cleanup;
+		}
+
+		for(c = 0; c < k; c++){
+			if(fwrite(chunks[c].buf, 1, chunks[c].len, fp_out) != chunks[c].len){
+				rslt = 441;
+				goto cleanup;
+			}
+		}
+	}
+	if(fclose(fp_out))
+		rslt = 441;
+	fp_out = NULL;
+	if(debug_lvl > 0)
+		fprintf(stderr, "Decrypted %llu chunk(s) with %d thread(s).\n",
+			index, nthreads);
+
+cleanup:
+	if(fp_in)
+		fclose(fp_in);
+	if(fp_out)
+		fclose(fp_out);
+	// Never leave the plaintext of a file that failed the checks.
+	if(rslt && out_created)
+		unlink(out_fname);
+	free_batch(chunks, nchunks, chunk_size);
+	nm_crypt_pool_free(pool);
+	free(wrapped);
+	if(content_key)
+		gcry_free(content_key);
+	gcry_sexp_release(prv_key);
+	return rslt;
+}
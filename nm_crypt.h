@@ -0,0 +1,39 @@
+// nm_crypt.h
+//
+// Hybrid, chunked, parallel file encryption with the online
+// encryption key.  See nm_crypt.c for the file format.
+
+#define NM_CRYPT_MAGIC "NMENC001"
+#define NM_CRYPT_MAGIC_LEN 8
+#define NM_CRYPT_CHUNK_SIZE (1024 * 1024)
+#define NM_CRYPT_MAX_CHUNK_SIZE (64 * 1024 * 1024)
+#define NM_CRYPT_KEY_LEN 32
+#define NM_CRYPT_TAG_LEN 16
+#define NM_CRYPT_NONCE_LEN 4
+
+// One chunk for the worker pool.  buf is encrypted or decrypted
+// in place; on encryption the pool fills in tag, on decryption it
+// checks tag and sets err to a nonzero code if the check fails.
+struct nm_crypt_chunk_t
+{
+	unsigned char *buf;
+	size_t len;
+	unsigned long long index;
+	int final;
+	unsigned char tag[NM_CRYPT_TAG_LEN];
+	int err;
+};
+
+struct nm_crypt_pool_t;
+
+struct nm_crypt_pool_t *nm_crypt_pool_new(const unsigned char *content_key,
+  const unsigned char *file_nonce, const unsigned char *header_digest,
+  int decrypt, int nthreads);
+int nm_crypt_pool_run(struct nm_crypt_pool_t *pool,
+  struct nm_crypt_chunk_t *chunks, int nchunks);
+void nm_crypt_pool_free(struct nm_crypt_pool_t *pool);
+
+int nm_encrypt_file(const char *in_fname, const char *out_fname,
+  const char *pub_key_fname, size_t chunk_size, int nthreads, int debug_lvl);
+int nm_decrypt_file(const char *in_fname, const char *out_fname,
+  const char *prv_key_fname, int nthreads, int debug_lvl);
@@ -0,0 +1,184 @@
+// nm_encrypt.c
+// Purpose:
+//   1) Encrypt a file (via --in) of any size for the holder of an
+//      online encryption key (--key OnlinePUBEncKey.key), producing
+//      --out, which, if not specified, will be the name of the input
+//      file with a suffix of ".nmenc".
+//
+// The file is encrypted in chunks on all cores.  See nm_crypt.c for
+// the format.  Decrypt with nm_decrypt.
+//
+#include <stddef.h>
+#include <gcrypt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+// nm_keys requires some of the things above
+#include "nm_keys.h"
+#include "nm_crypt.h"
+#include "nm_timing.h"
+#include "nm_stats.h"
+
+#include <getopt.h>
+
+#define MAX_ENTRY_LEN 500
+
+int debug_lvl = 0;
+int verbose_flag;
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+int usage(){
+	fprintf(stderr, "usage:\n");
+	fprintf(stderr, "nm_encrypt --in <infile> --out <outfile> --key <public_enc_key>\n");
+	fprintf(stderr, "           [--threads <n>] [--timings[=<file>]] [--chunk-size <bytes>]\n");
+	return 99;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+int main (int argc, char **argv) {
+	char input_fname[MAX_ENTRY_LEN];
+	char output_fname[MAX_ENTRY_LEN + 8];
+	char key_fname[MAX_ENTRY_LEN];
+	int nthreads = 0;
+	long chunk_size = NM_CRYPT_CHUNK_SIZE;
+	int rslt;
+
+	input_fname[0] = 0x00;
+	output_fname[0] = 0x00;
+	key_fname[0] = 0x00;
+
+	nm_timing_start("nm_encrypt");
+	nm_stats_init("nm_encrypt");
+
+	/*
+	----------------------------------------------------------------------
+															LIBGCRYPT INITIALIZATION
+	----------------------------------------------------------------------
+	*/
+	if (!gcry_check_version (GCRYPT_VERSION))
+	{
+		fputs ("libgcrypt version mismatch\n", stderr);
+		exit (2);
+	}
+	gcry_control (GCRYCTL_SUSPEND_SECMEM_WARN);
+	gcry_control (GCRYCTL_USE_SECURE_RNDPOOL); //put random nbrs in secmem
+	gcry_control (GCRYCTL_SET_VERBOSITY, 0);
+	// The content key and one cipher handle per thread live in
+	// secure memory.
+	gcry_control (GCRYCTL_INIT_SECMEM, 262144, 0);
+	gcry_control (GCRYCTL_RESUME_SECMEM_WARN);
+	gcry_control (GCRYCTL_INITIALIZATION_FINISHED, 0);
+	/*
+	----------------------------------------------------------------------
+													END LIBGCRYPT INITIALIZATION
+	----------------------------------------------------------------------
+	*/
+
+	nm_timing_phase("args");
+	int opt_code; //encoded value from command-line args
+
+	while (1){
+		static struct option long_options[] = {
+					/* These options set a flag. */
+					{"verbose", no_argument,       &verbose_flag, 1},
+							 {"in",         required_argument, 0, 'i'},
+							 {"out",        required_argument, 0, 'o'},
+							 {"key",        required_argument, 0, 'k'},
+							 {"threads",    required_argument, 0, 'T'},
+							 {"timings",    optional_argument, 0, 'M'},
+							 {"chunk-size", required_argument, 0, 'C'},
+							 {"help",        no_argument, 0, '?'},
+							 {0, 0, 0, 0}
+		};
+		/* 'getopt_long' stores the option index here. */
+		int option_index = 0;
+		opt_code = getopt_long (argc, argv, "i:o:k:",
+										 long_options, &option_index);
+
+		/* Detect the end of the options. */
+		if (opt_code == -1)
+			break;
+
+		switch (opt_code){
+			case 0:
+				break;
+
+			case 'i':
+				strncpy(input_fname, optarg, MAX_ENTRY_LEN - 1);
+				input_fname[MAX_ENTRY_LEN - 1] = 0x00;
+				break;
+
+			case 'o':
+				strncpy(output_fname, optarg, MAX_ENTRY_LEN - 1);
+				output_fname[MAX_ENTRY_LEN - 1] = 0x00;
+				break;
+
+			case 'k':
+				// public encryption key filename
+				strncpy(key_fname, optarg, MAX_ENTRY_LEN - 1);
+				key_fname[MAX_ENTRY_LEN - 1] = 0x00;
+				break;
+
+			case 'T':
+				// worker threads (0 = all CPUs)
+				nthreads = atoi(optarg);
+				break;
+
+			case 'M':
+				// JSON phase timings at exit (to stderr or a file)
+				nm_timing_enable(optarg);
+				break;
+
+			case 'C':
+				chunk_size = atol(optarg);
+				break;
+
+			case '?':
+				/* 'getopt_long' already printed an error message. */
+				usage();
+				return 738;
+
+			default:
+				abort ();
+		}
+	}
+
+	if (optind < argc){
+		fprintf (stderr, "Error.  Unexpected option: ");
+		while (optind < argc)
+			fprintf (stderr, "%s ", argv[optind++]);
+		fputc ('\n', stderr);
+		return 290;
+	}
+	if (input_fname[0] == 0x00){
+		fprintf (stderr, "Error. Input filename is missing.\n");
+		usage();
+		return 321;
+	}
+	if (key_fname[0] == 0x00){
+		fprintf (stderr, "Error. Public encryption key filename is missing.\n");
+		usage();
+		return 322;
+	}
+	if (chunk_size <= 0 || chunk_size > NM_CRYPT_MAX_CHUNK_SIZE){
+		fprintf (stderr, "Error. --chunk-size must be 1 to %d.\n",
+			NM_CRYPT_MAX_CHUNK_SIZE);
+		return 322;
+	}
+	if (output_fname[0] == 0x00){
+		strcpy(output_fname, input_fname);
+		strcat(output_fname, ".nmenc");
+	}
+
+	rslt = nm_encrypt_file(input_fname, output_fname, key_fname, chunk_size,
+		nthreads, verbose_flag ? 1 : debug_lvl);
+	if (rslt){
+		fprintf(stderr, "Error. Encryption failed (code %d).\n", rslt);
+		return rslt;
+	}
+	return 0;
+}
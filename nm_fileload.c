@@ -0,0 +1,449 @@
+// nm_fileload.c
+// Purpose:
+//   1) Read a list of small files (key files, signatures, nonces) for
+//      a bulk job with many reads in flight at once, so that the
+//      device queue stays full and the job is not one open, read and
+//      close after another.  Each file is handed to a ready function
+//      as soon as it is in memory, so the crypto work on the first
+//      files overlaps the reads of the later ones.
+//   2) On Linux, use io_uring: the open, the read and the close of up
+//      to depth files are queued in one ring, and one system call
+//      submits a batch of them and collects what has finished.  The
+//      ring is driven with the raw system calls, so no liburing is
+//      needed.  Where io_uring is missing or not allowed (an old
+//      kernel, a seccomp filter, FreeBSD), depth threads (at most
+//      NM_FILELOAD_MAX_THREADS) do blocking reads instead.
+//
+// The ready function is called once per file, one call at a time,
+// in the order the files finish (not the order of items[]).  With
+// io_uring it runs in the calling thread; with threads it runs in
+// one of them.  It owns item->buf (free() it), which is NULL if
+// item->rc is not 0.  A file longer than max_len gets 932.
+//
+// NM_FILELOAD=threads (or uring) in the environment overrides
+// NM_FILELOAD_AUTO, for comparing the two.
+//
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "nm_fileload.h"
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define NM_HAVE_URING 1
+#endif
+#endif
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+int nm_fileload_mode(const char *name){
+	// "auto", "uring" or "threads" to an NM_FILELOAD_* value, or -1.
+	if(!strcmp(name, "auto"))
+		return NM_FILELOAD_AUTO;
+	if(!strcmp(name, "uring"))
+		return NM_FILELOAD_URING;
+	if(!strcmp(name, "threads"))
+		return NM_FILELOAD_THREADS;
+	return -1;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+#ifdef NM_HAVE_URING
+struct uring_t
+{
+	int fd;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	unsigned int sq_entries;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len, sqes_len;
+	unsigned int to_submit;
+};
+
+// A file being read.  The user_data of its operations is the slot
+// number times two, plus one for the close.
+struct uring_slot_t
+{
+	int item;
+	int fd;
+	size_t have;
+};
+
+static int uring_open(struct uring_t *r, unsigned int entries){
+	// Returns 0, or -1 if io_uring cannot be used.
+	struct io_uring_params p;
+	unsigned char *sq;
+
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+	r->fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+	if(r->fd < 0)
+		return -1;
+	r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP){
+		if(r->cq_len > r->sq_len)
+			r->sq_len = r->cq_len;
+		r->cq_len = 0;
+	}
+	r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		r->fd, IORING_OFF_SQ_RING);
+	r->cq_ptr = r->sq_ptr;
+	if(r->sq_ptr != MAP_FAILED && r->cq_len)
+		r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			r->fd, IORING_OFF_CQ_RING);
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		r->fd, IORING_OFF_SQES);
+	if(r->sq_ptr == MAP_FAILED || r->cq_ptr == MAP_FAILED || r->sqes == MAP_FAILED){
+		if(r->sqes != MAP_FAILED)
+			munmap(r->sqes, r->sqes_len);
+		if(r->cq_len && r->cq_ptr != MAP_FAILED)
+			munmap(r->cq_ptr, r->cq_len);
+		if(r->sq_ptr != MAP_FAILED)
+			munmap(r->sq_ptr, r->sq_len);
+		close(r->fd);
+		return -1;
+	}
+	sq = r->sq_ptr;
+	r->sq_head = (unsigned int *) (sq + p.sq_off.head);
+	r->sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+	r->sq_mask = (unsigned int *) (sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned int *) (sq + p.sq_off.array);
+	r->sq_entries = p.sq_entries;
+	r->cq_head = (unsigned int *) ((unsigned char *) r->cq_ptr + p.cq_off.head);
+	r->cq_tail = (unsigned int *) ((unsigned char *) r->cq_ptr + p.cq_off.tail);
+	r->cq_mask = (unsigned int *) ((unsigned char *) r->cq_ptr + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *) ((unsigned char *) r->cq_ptr + p.cq_off.cqes);
+	return 0;
+}
+
+static void uring_close(struct uring_t *r){
+	munmap(r->sqes, r->sqes_len);
+	if(r->cq_len)
+		munmap(r->cq_ptr, r->cq_len);
+	munmap(r->sq_ptr, r->sq_len);
+	close(r->fd);
+}
+
+static void uring_prep(struct uring_t *r, int op, int fd, const void *addr,
+  unsigned int len, unsigned long long off, unsigned long long user_data){
+	// Queue one operation.  The caller never has more in flight
+	// than the ring holds, so there is always room.
+	unsigned int tail = *r->sq_tail;
+	unsigned int idx = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long long) (uintptr_t) addr;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->user_data = user_data;
+	if(op == IORING_OP_OPENAT)
+		sqe->open_flags = O_RDONLY | O_CLOEXEC;
+	r->sq_array[idx] = idx;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->to_submit++;
+}
+
+static int uring_enter(struct uring_t *r, unsigned int min_complete){
+	// Submit what is queued and wait for min_complete completions.
+	// Returns 0 or -1.
+	int n;
+
+	do{
+		n = (int) syscall(__NR_io_uring_enter, r->fd, r->to_submit, min_complete,
+			min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	}while(n < 0 && errno == EINTR);
+	if(n < 0)
+		return -1;
+	r->to_submit -= n;
+	return 0;
+}
+
+static void uring_done(struct nm_fileload_item_t *item, struct uring_slot_t *slots,
+  int *free_slots, int *nfree, int s, void (*ready)(struct nm_fileload_item_t *, void *),
+  void *arg){
+	// Hand a file to the ready function and free its slot.
+	if(item->rc){
+		free(item->buf);
+		item->buf = NULL;
+	}else{
+		item->len = slots[s].have;
+		item->buf[item->len] = 0x00;
+	}
+	slots[s].item = -1;
+	free_slots[(*nfree)++] = s;
+	ready(item, arg);
+}
+
+static int load_uring(struct nm_fileload_item_t *items, int n, size_t max_len,
+  int depth, void (*ready)(struct nm_fileload_item_t *, void *), void *arg){
+	// Returns 0, 843, or -1 if io_uring cannot be used (nothing has
+	// been read then).
+	struct uring_t r;
+	struct uring_slot_t *slots;
+	struct nm_fileload_item_t *item;
+	struct uring_slot_t *slot;
+	struct io_uring_cqe *cqe;
+	int *free_slots;
+	int nfree, next, inflight, s, res, more;
+	int started = 0, rc = 0;
+	unsigned int head;
+	unsigned long long ud;
+
+	// A slot can have its close in flight while it is reused, so
+	// the ring needs two entries per slot.
+	if(uring_open(&r, 2 * depth))
+		return -1;
+	slots = calloc(depth, sizeof(*slots));
+	free_slots = calloc(depth, sizeof(int));
+	if(!slots || !free_slots){
+		free(slots);
+		free(free_slots);
+		uring_close(&r);
+		return 843;
+	}
+	for(nfree = 0; nfree < depth; nfree++){
+		slots[nfree].item = -1;
+		free_slots[nfree] = depth - 1 - nfree;
+	}
+	next = 0;
+	inflight = 0;
+	while(next < n || inflight > 0){
+		while(nfree > 0 && next < n){
+			item = &items[next];
+			item->len = 0;
+			item->rc = 0;
+			item->buf = malloc(max_len + 1);
+			if(!item->buf){
+				// Handed over, so there is no going back to threads.
+				item->rc = 843;
+				ready(item, arg);
+				started = 1;
+				next++;
+				continue;
+			}
+			s = free_slots[--nfree];
+			slots[s].item = next++;
+			slots[s].fd = -1;
+			slots[s].have = 0;
+			uring_prep(&r, IORING_OP_OPENAT, AT_FDCWD, item->fname, 0, 0, 2ULL * s);
+			inflight++;
+		}
+		if(uring_enter(&r, inflight > 0 ? 1 : 0)){
+			if(!started){
+				// Nothing was accepted (for example, a seccomp filter
+				// that allows io_uring_setup but not io_uring_enter):
+				// let the caller use threads.
+				for(s = 0; s < next; s++){
+					free(items[s].buf);
+					items[s].buf = NULL;
+				}
+				rc = -1;
+			}else{
+				// The kernel may still fill the buffers of the files
+				// in flight, so they are given up as failed but not
+				// freed.
+				for(s = 0; s < depth; s++)
+					if(slots[s].item >= 0){
+						item = &items[slots[s].item];
+						item->buf = NULL;
+						item->rc = 932;
+						ready(item, arg);
+					}
+				for(s = next; s < n; s++){
+					items[s].buf = NULL;
+					items[s].rc = 932;
+					ready(&items[s], arg);
+				}
+			}
+			break;
+		}
+		started = 1;
+
+		head = *r.cq_head;
+		while(head != __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE)){
+			cqe = &r.cqes[head & *r.cq_mask];
+			ud = cqe->user_data;
+			res = cqe->res;
+			head++;
+			inflight--;
+			if(ud & 1)
+				continue;     // a close
+			s = (int) (ud / 2);
+			slot = &slots[s];
+			item = &items[slot->item];
+			more = 0;
+			if(slot->fd < 0){
+				// The open finished.
+				if(res < 0){
+					item->rc = 439;
+					uring_done(item, slots, free_slots, &nfree, s, ready, arg);
+					continue;
+				}
+				slot->fd = res;
+				more = 1;
+			}else if(res < 0 || slot->have + res > max_len){
+				item->rc = 932;
+			}else{
+				slot->have += res;
+				more = res > 0;
+			}
+			// Read until end of file, or one byte more than max_len.
+			if(more){
+				uring_prep(&r, IORING_OP_READ, slot->fd, item->buf + slot->have,
+					max_len + 1 - slot->have, slot->have, 2ULL * s);
+				inflight++;
+				continue;
+			}
+			uring_prep(&r, IORING_OP_CLOSE, slot->fd, NULL, 0, 0, 2ULL * s + 1);
+			inflight++;
+			uring_done(item, slots, free_slots, &nfree, s, ready, arg);
+		}
+		__atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+	}
+	free(slots);
+	free(free_slots);
+	uring_close(&r);
+	return rc;
+}
+#endif
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+struct thread_load_t
+{
+	pthread_mutex_t lock;
+	struct nm_fileload_item_t *items;
+	int n;
+	int next;
+	size_t max_len;
+	void (*ready)(struct nm_fileload_item_t *, void *);
+	void *arg;
+};
+
+static void load_one(struct nm_fileload_item_t *item, size_t max_len){
+	ssize_t got;
+	int fd;
+
+	item->len = 0;
+	item->rc = 0;
+	item->buf = malloc(max_len + 1);
+	if(!item->buf){
+		item->rc = 843;
+		return;
+	}
+	fd = open(item->fname, O_RDONLY | O_CLOEXEC);
+	if(fd < 0){
+		item->rc = 439;
+	}else{
+		while((got = read(fd, item->buf + item->len, max_len + 1 - item->len)) > 0
+		  && item->len + got <= max_len)
+			item->len += got;
+		if(got != 0)
+			item->rc = 932;
+		close(fd);
+	}
+	if(item->rc){
+		free(item->buf);
+		item->buf = NULL;
+	}else{
+		item->buf[item->len] = 0x00;
+	}
+}
+
+static void *load_worker(void *arg){
+	struct thread_load_t *t = arg;
+	struct nm_fileload_item_t *item;
+
+	pthread_mutex_lock(&t->lock);
+	while(t->next < t->n){
+		item = &t->items[t->next++];
+		pthread_mutex_unlock(&t->lock);
+		load_one(item, t->max_len);
+		pthread_mutex_lock(&t->lock);
+		t->ready(item, t->arg);
+	}
+	pthread_mutex_unlock(&t->lock);
+	return NULL;
+}
+
+static void load_threads(struct nm_fileload_item_t *items, int n, size_t max_len,
+  int depth, void (*ready)(struct nm_fileload_item_t *, void *), void *arg){
+	struct thread_load_t t;
+	pthread_t threads[NM_FILELOAD_MAX_THREADS];
+	int j, nthreads = 0;
+
+	memset(&t, 0, sizeof(t));
+	pthread_mutex_init(&t.lock, NULL);
+	t.items = items;
+	t.n = n;
+	t.max_len = max_len;
+	t.ready = ready;
+	t.arg = arg;
+	if(depth > NM_FILELOAD_MAX_THREADS)
+		depth = NM_FILELOAD_MAX_THREADS;
+	if(depth > n)
+		depth = n;
+	for(j = 0; j < depth - 1; j++)
+		if(!pthread_create(&threads[nthreads], NULL, load_worker, &t))
+			nthreads++;
+	// This thread is one of them.
+	load_worker(&t);
+	for(j = 0; j < nthreads; j++)
+		pthread_join(threads[j], NULL);
+	pthread_mutex_destroy(&t.lock);
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+int nm_fileload(struct nm_fileload_item_t *items, int n, size_t max_len, int depth,
+  int *mode, void (*ready)(struct nm_fileload_item_t *item, void *arg), void *arg){
+	// Read the n files of items[], with up to depth (0 for
+	// NM_FILELOAD_DEPTH) in flight, and call ready(item, arg) for
+	// each.  *mode is NM_FILELOAD_AUTO, _URING or _THREADS, and is
+	// set to the one that was used.  Returns 0, or 843 if the
+	// arguments are out of range or memory ran out before any file
+	// was read.
+	const char *env;
+	int rc = -1;
+
+	if(n < 0 || depth < 0 || depth > NM_FILELOAD_MAX_DEPTH || max_len == 0)
+		return 843;
+	if(depth == 0)
+		depth = NM_FILELOAD_DEPTH;
+	if(*mode == NM_FILELOAD_AUTO && (env = getenv("NM_FILELOAD"))
+	  && nm_fileload_mode(env) > 0)
+		*mode = nm_fileload_mode(env);
+	if(n == 0)
+		return 0;
+#ifdef NM_HAVE_URING
+	if(*mode != NM_FILELOAD_THREADS)
+		rc = load_uring(items, n, max_len, depth, ready, arg);
+	if(rc >= 0){
+		*mode = NM_FILELOAD_URING;
+		return rc;
+	}
+#endif
+	(void) rc;
+	*mode = NM_FILELOAD_THREADS;
+	load_threads(items, n, max_len, depth, ready, arg);
+	return 0;
+}
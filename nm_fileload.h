@@ -0,0 +1,28 @@
+// nm_fileload.h
+//
+// Read many small files (keys, signatures, nonces) with many reads in
+// flight at once: io_uring on Linux, a pool of threads elsewhere.  See
+// nm_fileload.c.
+
+#define NM_FILELOAD_AUTO 0
+#define NM_FILELOAD_URING 1
+#define NM_FILELOAD_THREADS 2
+
+#define NM_FILELOAD_DEPTH 64
+#define NM_FILELOAD_MAX_DEPTH 1024
+#define NM_FILELOAD_MAX_THREADS 64
+
+// One file.  fname is set by the caller; the rest is filled in
+// before the file is handed to the ready function.
+struct nm_fileload_item_t
+{
+	const char *fname;
+	void *user;          // for the caller
+	char *buf;           // malloc'ed, null-terminated; the ready function owns it
+	size_t len;
+	int rc;              // 0, 439 (cannot open), 843, or 932 (read error or too big)
+};
+
+int nm_fileload_mode(const char *name);
+int nm_fileload(struct nm_fileload_item_t *items, int n, size_t max_len, int depth,
+  int *mode, void (*ready)(struct nm_fileload_item_t *item, void *arg), void *arg);
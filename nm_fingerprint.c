@@ -0,0 +1,248 @@
+// nm_fingerprint.c
+// Purpose:
+//   1) Print the fingerprint of one or more key files.  The
+//      fingerprint of a Natural Message key is the SHA-384 of the
+//      entire key file (this replaces shatest, which hashed a
+//      command-line string and printed the digest incorrectly).
+//   2) With --string, print the SHA-384 of a string entered on the
+//      command line (the old shatest job, done correctly).
+//
+// Many small files are hashed several at a time with the
+// multi-buffer kernels in nm_hash.c.  If no file names are given
+// on the command line, they are read from stdin, one per line, so
+// that thousands of key files can be fingerprinted with one process:
+//    find keys -name '*PUB*.key' | nm_fingerprint
+//
+#include <stddef.h>
+#include <gcrypt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+// nm_keys requires some of the things above
+#include "nm_keys.h"
+#include "nm_hash.h"
+#include "nm_timing.h"
+#include "nm_stats.h"
+
+#include <getopt.h>
+
+#define MAX_ENTRY_LEN 500
+// File names read from stdin are processed in groups of this size.
+#define MAX_NAMES 4096
+
+int verbose_flag;
+int sha512_flag;
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+int usage(){
+	fprintf(stderr, "usage:\n");
+	fprintf(stderr, "nm_fingerprint [--sha512] <keyfile> [<keyfile> ...]\n");
+	fprintf(stderr, "nm_fingerprint [--sha512] --string <value>\n");
+	fprintf(stderr, "nm_fingerprint [--sha512] < list_of_filenames\n");
+	fprintf(stderr, "  --timings[=<file>] writes the time of each phase as JSON at exit\n");
+	return 99;
+}
+
+static int print_files(const char **fnames, size_t n){
+	// Hash and print one group of files.  Returns the number of
+	// files that could not be read.
+	unsigned char *fps;
+	int *rslts;
+	char hex[2 * NM_SHA512_LEN + 1];
+	size_t j;
+	int failed = 0;
+	struct nm_hash_job_t job;
+	unsigned char digest[NM_SHA512_LEN];
+	FILE *fp;
+	long len;
+	unsigned char *buff;
+
+	if(!sha512_flag){
+		fps = malloc(n * NM_SHA384_LEN);
+		rslts = malloc(n * sizeof(int));
+		if(!fps || !rslts){
+			fprintf(stderr, "Error. Out of memory.\n");
+			exit(843);
+		}
+		failed = nm_fingerprint_files(fnames, n, fps, rslts);
+		for(j = 0; j < n; j++){
+			if(rslts[j]){
+				fprintf(stderr, "Error. Could not read %s (code %d)\n", fnames[j], rslts[j]);
+				continue;
+			}
+			nm_hex_encode(fps + j * NM_SHA384_LEN, NM_SHA384_LEN, hex);
+			printf("%s  %s\n", hex, fnames[j]);
+		}
+		free(fps);
+		free(rslts);
+		return failed;
+	}
+
+	// SHA-512 is not a fingerprint, so it is done one file at a time.
+	for(j = 0; j < n; j++){
+		fp = fopen(fnames[j], "rb");
+		if(!fp){
+			fprintf(stderr, "Error. Could not read %s\n", fnames[j]);
+			failed++;
+			continue;
+		}
+		fseek(fp, 0, SEEK_END);
+		len = ftell(fp);
+		fseek(fp, 0, SEEK_SET);
+		buff = malloc(len + 1);
+		if(!buff || fread(buff, 1, len, fp) != (size_t) len){
+			fprintf(stderr, "Error. Could not read %s\n", fnames[j]);
+			free(buff);
+			fclose(fp);
+			failed++;
+			continue;
+		}
+		fclose(fp);
+		job.msg = buff;
+		job.len = len;
+		job.digest = digest;
+		nm_sha512_many(&job, 1);
+		nm_hex_encode(digest, NM_SHA512_LEN, hex);
+		printf("%s  %s\n", hex, fnames[j]);
+		free(buff);
+	}
+	return failed;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+int main (int argc, char **argv) {
+	char *input_string = NULL;
+	char hex[2 * NM_SHA512_LEN + 1];
+	unsigned char digest[NM_SHA512_LEN];
+	struct nm_hash_job_t job;
+	const char **names;
+	char *line;
+	size_t n;
+	int failed = 0;
+
+	nm_timing_start("nm_fingerprint");
+	nm_stats_init("nm_fingerprint");
+
+	/*
+	----------------------------------------------------------------------
+															LIBGCRYPT INITIALIZATION
+	----------------------------------------------------------------------
+	*/
+	// libgcrypt is only used to stream big files.  Fingerprints
+	// are public, so no secure memory is needed.
+	if (!gcry_check_version (GCRYPT_VERSION))
+	{
+		fputs ("libgcrypt version mismatch\n", stderr);
+		exit (2);
+	}
+	gcry_control (GCRYCTL_DISABLE_SECMEM, 0);
+	gcry_control (GCRYCTL_INITIALIZATION_FINISHED, 0);
+	/*
+	----------------------------------------------------------------------
+													END LIBGCRYPT INITIALIZATION
+	----------------------------------------------------------------------
+	*/
+
+	nm_timing_phase("args");
+	int opt_code; //encoded value from command-line args
+
+	while (1){
+		static struct option long_options[] = {
+					/* These options set a flag. */
+					{"verbose", no_argument,       &verbose_flag, 1},
+					{"sha512",  no_argument,       &sha512_flag, 1},
+							 {"string",  required_argument, 0, 't'},
+							 {"timings", optional_argument, 0, 'M'},
+							 {"help",        no_argument, 0, '?'},
+							 {0, 0, 0, 0}
+		};
+		/* 'getopt_long' stores the option index here. */
+		int option_index = 0;
+		opt_code = getopt_long (argc, argv, "t:",
+										 long_options, &option_index);
+
+		/* Detect the end of the options. */
+		if (opt_code == -1)
+			break;
+
+		switch (opt_code){
+			case 0:
+				break;
+
+			case 't':
+				input_string = optarg;
+				break;
+
+			case 'M':
+				// JSON phase timings at exit (to stderr or a file)
+				nm_timing_enable(optarg);
+				break;
+
+			case '?':
+				/* 'getopt_long' already printed an error message. */
+				usage();
+				return 738;
+
+			default:
+				abort ();
+		}
+	}
+
+	if (verbose_flag)
+		fprintf(stderr, "Hashing with %d SIMD lane(s).\n", nm_hash_lanes());
+
+	nm_timing_phase("hash");
+
+	if (input_string){
+		// Do NOT include the trailing null in the hash.
+		job.msg = (const unsigned char *) input_string;
+		job.len = strlen(input_string);
+		job.digest = digest;
+		if(sha512_flag)
+			nm_sha512_many(&job, 1);
+		else
+			nm_sha384_many(&job, 1);
+		nm_hex_encode(digest, sha512_flag ? NM_SHA512_LEN : NM_SHA384_LEN, hex);
+		printf("%s\n", hex);
+		return 0;
+	}
+
+	if (optind < argc)
+		return print_files((const char **) argv + optind, argc - optind) ? 438 : 0;
+
+	// No names on the command line: read them from stdin.
+	names = malloc(MAX_NAMES * sizeof(char *));
+	if(!names){
+		fprintf(stderr, "Error. Out of memory.\n");
+		return 843;
+	}
+	n = 0;
+	while (1){
+		line = malloc(MAX_ENTRY_LEN);
+		if(!line || !get_line(line, MAX_ENTRY_LEN, stdin)){
+			free(line);
+			break;
+		}
+		if(line[0] == 0x00){
+			free(line);
+			continue;
+		}
+		names[n++] = line;
+		if(n == MAX_NAMES){
+			failed += print_files(names, n);
+			while(n > 0)
+				free((char *) names[--n]);
+		}
+	}
+	if(n > 0)
+		failed += print_files(names, n);
+	while(n > 0)
+		free((char *) names[--n]);
+	free(names);
+
+	return failed ? 438 : 0;
+}
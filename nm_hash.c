@@ -0,0 +1,481 @@
+// nm_hash.c
+// Purpose:
+//   1) Hash many small, independent inputs (key files, nonces,
+//      manifest entries) with SHA-384 or SHA-512 several at a time.
+//      Each SIMD lane of the CPU runs its own SHA-512 stream:
+//      8 lanes with AVX-512, 4 lanes with AVX2, and a plain C
+//      version with 1 lane everywhere else.
+//   2) Compute key fingerprints (the SHA-384 of the entire key file).
+//
+// Notes:
+//   SHA-384 is SHA-512 with a different starting state and a
+//   digest cut to 48 bytes (FIPS 180-4), so both share the kernels.
+//
+//   The scheduler keeps every lane busy: as soon as a lane finishes
+//   its message, the next message is loaded into that lane, so a mix
+//   of short and long inputs does not leave lanes idle.
+//
+//   For one big file, gcry_md_* is still the right tool (it has its
+//   own assembly), so nm_fingerprint_files() streams large files
+//   through libgcrypt and batches only the small ones.
+//
+#include <stddef.h>
+#include <gcrypt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "nm_hash.h"
+#include "nm_stats.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define NM_HASH_X86 1
+#include <immintrin.h>
+#endif
+
+#define NM_MB_LANES 8
+#define SHA512_BLOCK 128
+// Files bigger than this are streamed through libgcrypt instead
+// of being read whole and batched.
+#define NM_HASH_SMALL_FILE (1024 * 1024)
+// Number of files read into memory for one multi-buffer batch.
+#define NM_HASH_FILE_BATCH 64
+
+static const uint64_t sha512_k[80] = {
+	0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+	0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+	0xd807aa98a3030242ULL, 0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+	0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+	0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+	0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+	0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+	0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL, 0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+	0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+	0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+	0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+	0xd192e819d6ef5218ULL, 0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+	0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+	0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+	0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+	0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+	0xca273eceea26619cULL, 0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+	0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+	0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+	0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL
+};
+
+static const uint64_t sha384_iv[8] = {
+	0xcbbb9d5dc1059ed8ULL, 0x629a292a367cd507ULL, 0x9159015a3070dd17ULL, 0x152fecd8f70e5939ULL,
+	0x67332667ffc00b31ULL, 0x8eb44a8768581511ULL, 0xdb0c2e0d64f98fa7ULL, 0x47b5481dbefa4fa4ULL
+};
+
+static const uint64_t sha512_iv[8] = {
+	0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+	0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+// The state of all lanes, one row per SHA-512 state word
+// ("structure of arrays") so a row loads straight into a register.
+typedef uint64_t nm_mb_state_t[8][NM_MB_LANES];
+typedef void (*nm_mb_compress_t)(nm_mb_state_t st,
+	const unsigned char *blk[NM_MB_LANES]);
+
+static int nm_hash_forced_lanes = 0;
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+static uint64_t load_be64(const unsigned char *p){
+	return ((uint64_t) p[0] << 56) | ((uint64_t) p[1] << 48)
+		| ((uint64_t) p[2] << 40) | ((uint64_t) p[3] << 32)
+		| ((uint64_t) p[4] << 24) | ((uint64_t) p[5] << 16)
+		| ((uint64_t) p[6] << 8) | (uint64_t) p[7];
+}
+
+static void store_be64(unsigned char *p, uint64_t v){
+	int j;
+	for(j = 7; j >= 0; j--){
+		p[j] = v & 0xff;
+		v >>= 8;
+	}
+}
+
+#define ROR64(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+
+static void sha512_compress_c(nm_mb_state_t st,
+  const unsigned char *blk[NM_MB_LANES]){
+	// Plain C, one lane (lane 0).
+	uint64_t w[80];
+	uint64_t a, b, c, d, e, f, g, h, t1, t2;
+	int t;
+
+	for(t = 0; t < 16; t++)
+		w[t] = load_be64(blk[0] + 8 * t);
+	for(t = 16; t < 80; t++)
+		w[t] = (ROR64(w[t-2], 19) ^ ROR64(w[t-2], 61) ^ (w[t-2] >> 6))
+			+ w[t-7]
+			+ (ROR64(w[t-15], 1) ^ ROR64(w[t-15], 8) ^ (w[t-15] >> 7))
+			+ w[t-16];
+
+	a = st[0][0]; b = st[1][0]; c = st[2][0]; d = st[3][0];
+	e = st[4][0]; f = st[5][0]; g = st[6][0]; h = st[7][0];
+	for(t = 0; t < 80; t++){
+		t1 = h + (ROR64(e, 14) ^ ROR64(e, 18) ^ ROR64(e, 41))
+			+ ((e & f) ^ (~e & g)) + sha512_k[t] + w[t];
+		t2 = (ROR64(a, 28) ^ ROR64(a, 34) ^ ROR64(a, 39))
+			+ ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	st[0][0] += a; st[1][0] += b; st[2][0] += c; st[3][0] += d;
+	st[4][0] += e; st[5][0] += f; st[6][0] += g; st[7][0] += h;
+}
+
+#ifdef NM_HASH_X86
+//-------------------------------------------------------------------------------
+//    AVX2: 4 lanes of 64-bit words in a 256-bit register
+//-------------------------------------------------------------------------------
+#define V4_ROR(x, n) _mm256_or_si256(_mm256_srli_epi64((x), (n)), \
+	_mm256_slli_epi64((x), 64 - (n)))
+#define V4_XOR3(x, y, z) _mm256_xor_si256(_mm256_xor_si256((x), (y)), (z))
+
+__attribute__((target("avx2")))
+static void sha512_compress_avx2(nm_mb_state_t st,
+  const unsigned char *blk[NM_MB_LANES]){
+	__m256i w[16];
+	__m256i a, b, c, d, e, f, g, h, t1, t2, s0, s1;
+	int t;
+
+	a = _mm256_loadu_si256((const __m256i *) st[0]);
+	b = _mm256_loadu_si256((const __m256i *) st[1]);
+	c = _mm256_loadu_si256((const __m256i *) st[2]);
+	d = _mm256_loadu_si256((const __m256i *) st[3]);
+	e = _mm256_loadu_si256((const __m256i *) st[4]);
+	f = _mm256_loadu_si256((const __m256i *) st[5]);
+	g = _mm256_loadu_si256((const __m256i *) st[6]);
+	h = _mm256_loadu_si256((const __m256i *) st[7]);
+
+	for(t = 0; t < 80; t++){
+		if(t < 16){
+			w[t] = _mm256_set_epi64x(
+				(long long) load_be64(blk[3] + 8 * t),
+				(long long) load_be64(blk[2] + 8 * t),
+				(long long) load_be64(blk[1] + 8 * t),
+				(long long) load_be64(blk[0] + 8 * t));
+		}else{
+			s0 = w[(t - 15) & 15];
+			s1 = w[(t - 2) & 15];
+			s0 = V4_XOR3(V4_ROR(s0, 1), V4_ROR(s0, 8), _mm256_srli_epi64(s0, 7));
+			s1 = V4_XOR3(V4_ROR(s1, 19), V4_ROR(s1, 61), _mm256_srli_epi64(s1, 6));
+			w[t & 15] = _mm256_add_epi64(_mm256_add_epi64(w[t & 15], s0),
+				_mm256_add_epi64(w[(t - 7) & 15], s1));
+		}
+		t1 = _mm256_add_epi64(h, V4_XOR3(V4_ROR(e, 14), V4_ROR(e, 18), V4_ROR(e, 41)));
+		t1 = _mm256_add_epi64(t1, _mm256_xor_si256(_mm256_and_si256(e, f),
+			_mm256_andnot_si256(e, g)));
+		t1 = _mm256_add_epi64(t1, _mm256_add_epi64(w[t & 15],
+			_mm256_set1_epi64x((long long) sha512_k[t])));
+		t2 = _mm256_add_epi64(V4_XOR3(V4_ROR(a, 28), V4_ROR(a, 34), V4_ROR(a, 39)),
+			V4_XOR3(_mm256_and_si256(a, b), _mm256_and_si256(a, c),
+				_mm256_and_si256(b, c)));
+		h = g; g = f; f = e; e = _mm256_add_epi64(d, t1);
+		d = c; c = b; b = a; a = _mm256_add_epi64(t1, t2);
+	}
+
+#define V4_ADD_STORE(row, v) _mm256_storeu_si256((__m256i *) st[row], \
+	_mm256_add_epi64(_mm256_loadu_si256((const __m256i *) st[row]), (v)))
+	V4_ADD_STORE(0, a); V4_ADD_STORE(1, b); V4_ADD_STORE(2, c); V4_ADD_STORE(3, d);
+	V4_ADD_STORE(4, e); V4_ADD_STORE(5, f); V4_ADD_STORE(6, g); V4_ADD_STORE(7, h);
+}
+
+//-------------------------------------------------------------------------------
+//    AVX-512: 8 lanes, with a native rotate and 3-input logic ops
+//-------------------------------------------------------------------------------
+__attribute__((target("avx512f")))
+static void sha512_compress_avx512(nm_mb_state_t st,
+  const unsigned char *blk[NM_MB_LANES]){
+	__m512i w[16];
+	__m512i a, b, c, d, e, f, g, h, t1, t2, s0, s1;
+	int t;
+
+	a = _mm512_loadu_si512(st[0]);
+	b = _mm512_loadu_si512(st[1]);
+	c = _mm512_loadu_si512(st[2]);
+	d = _mm512_loadu_si512(st[3]);
+	e = _mm512_loadu_si512(st[4]);
+	f = _mm512_loadu_si512(st[5]);
+	g = _mm512_loadu_si512(st[6]);
+	h = _mm512_loadu_si512(st[7]);
+
+	for(t = 0; t < 80; t++){
+		if(t < 16){
+			w[t] = _mm512_set_epi64(
+				(long long) load_be64(blk[7] + 8 * t),
+				(long long) load_be64(blk[6] + 8 * t),
+				(long long) load_be64(blk[5] + 8 * t),
+				(long long) load_be64(blk[4] + 8 * t),
+				(long long) load_be64(blk[3] + 8 * t),
+				(long long) load_be64(blk[2] + 8 * t),
+				(long long) load_be64(blk[1] + 8 * t),
+				(long long) load_be64(blk[0] + 8 * t));
+		}else{
+			// 0x96 is the truth table for x ^ y ^ z.
+			s0 = w[(t - 15) & 15];
+			s1 = w[(t - 2) & 15];
+			s0 = _mm512_ternarylogic_epi64(_mm512_ror_epi64(s0, 1),
+				_mm512_ror_epi64(s0, 8), _mm512_srli_epi64(s0, 7), 0x96);
+			s1 = _mm512_ternarylogic_epi64(_mm512_ror_epi64(s1, 19),
+				_mm512_ror_epi64(s1, 61), _mm512_srli_epi64(s1, 6), 0x96);
+			w[t & 15] = _mm512_add_epi64(_mm512_add_epi64(w[t & 15], s0),
+				_mm512_add_epi64(w[(t - 7) & 15], s1));
+		}
+		// 0xca is Ch (e ? f : g), 0xe8 is Maj(a, b, c).
+		t1 = _mm512_add_epi64(h, _mm512_ternarylogic_epi64(_mm512_ror_epi64(e, 14),
+			_mm512_ror_epi64(e, 18), _mm512_ror_epi64(e, 41), 0x96));
+		t1 = _mm512_add_epi64(t1, _mm512_ternarylogic_epi64(e, f, g, 0xca));
+		t1 = _mm512_add_epi64(t1, _mm512_add_epi64(w[t & 15],
+			_mm512_set1_epi64((long long) sha512_k[t])));
+		t2 = _mm512_add_epi64(_mm512_ternarylogic_epi64(_mm512_ror_epi64(a, 28),
+			_mm512_ror_epi64(a, 34), _mm512_ror_epi64(a, 39), 0x96),
+			_mm512_ternarylogic_epi64(a, b, c, 0xe8));
+		h = g; g = f; f = e; e = _mm512_add_epi64(d, t1);
+		d = c; c = b; b = a; a = _mm512_add_epi64(t1, t2);
+	}
+
+#define V8_ADD_STORE(row, v) _mm512_storeu_si512(st[row], \
+	_mm512_add_epi64(_mm512_loadu_si512(st[row]), (v)))
+	V8_ADD_STORE(0, a); V8_ADD_STORE(1, b); V8_ADD_STORE(2, c); V8_ADD_STORE(3, d);
+	V8_ADD_STORE(4, e); V8_ADD_STORE(5, f); V8_ADD_STORE(6, g); V8_ADD_STORE(7, h);
+}
+#endif
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+static int cpu_lanes(void){
+#ifdef NM_HASH_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		return 8;
+	if (__builtin_cpu_supports("avx2"))
+		return 4;
+#endif
+	return 1;
+}
+
+int nm_hash_lanes(void){
+	int lanes = cpu_lanes();
+	if (nm_hash_forced_lanes > 0 && nm_hash_forced_lanes < lanes)
+		lanes = nm_hash_forced_lanes < 4 ? 1 : 4;
+	return lanes;
+}
+
+void nm_hash_set_lanes(int lanes){
+	nm_hash_forced_lanes = lanes;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+struct nm_mb_lane_t
+{
+	struct nm_hash_job_t *job;
+	size_t block;    // next block to compress
+	size_t nblocks;  // total blocks including padding
+	size_t full;     // blocks that come straight from the message
+	// The last one or two blocks: the message tail, the 0x80 byte,
+	// zeros, and the 128-bit message length in bits.
+	unsigned char tail[2 * SHA512_BLOCK];
+};
+
+static void lane_load(struct nm_mb_lane_t *lane, struct nm_hash_job_t *job,
+  nm_mb_state_t st, int lane_nbr, const uint64_t *iv){
+	size_t rest;
+	size_t tail_len;
+	int j;
+
+	lane->job = job;
+	lane->block = 0;
+	lane->full = job->len / SHA512_BLOCK;
+	rest = job->len % SHA512_BLOCK;
+	// 1 byte for 0x80 and 16 for the length must fit after the tail.
+	tail_len = (rest + 17 <= SHA512_BLOCK) ? SHA512_BLOCK : 2 * SHA512_BLOCK;
+	lane->nblocks = lane->full + tail_len / SHA512_BLOCK;
+
+	memset(lane->tail, 0, tail_len);
+	if(rest)
+		memcpy(lane->tail, job->msg + lane->full * SHA512_BLOCK, rest);
+	lane->tail[rest] = 0x80;
+	store_be64(lane->tail + tail_len - 16, (uint64_t) job->len >> 61);
+	store_be64(lane->tail + tail_len - 8, (uint64_t) job->len << 3);
+
+	for(j = 0; j < 8; j++)
+		st[j][lane_nbr] = iv[j];
+}
+
+static void sha512_mb(struct nm_hash_job_t *jobs, size_t n,
+  const uint64_t *iv, size_t digest_len){
+	// Run the jobs through the widest kernel this CPU has.
+	static const unsigned char idle_block[SHA512_BLOCK];
+	struct nm_mb_lane_t *lanes;
+	const unsigned char *blk[NM_MB_LANES];
+	nm_mb_compress_t compress = sha512_compress_c;
+	nm_mb_state_t st;
+	unsigned char word[8];
+	size_t next_job = 0;
+	size_t i;
+	unsigned long long total = 0;
+	int nlanes, active, j, k;
+
+	for(i = 0; i < n; i++)
+		total += jobs[i].len;
+	nm_stats_add(NM_STAT_BYTES_HASHED, total);
+	nlanes = nm_hash_lanes();
+#ifdef NM_HASH_X86
+	if (nlanes == 8)
+		compress = sha512_compress_avx512;
+	else if (nlanes == 4)
+		compress = sha512_compress_avx2;
+#endif
+
+	lanes = malloc(NM_MB_LANES * sizeof(*lanes));
+	if(!lanes){
+		fprintf(stderr, "Error. Out of memory in sha512_mb.\n");
+		exit(EXIT_FAILURE);
+	}
+	memset(st, 0, sizeof(st));
+
+	active = 0;
+	for(j = 0; j < NM_MB_LANES; j++){
+		lanes[j].job = NULL;
+		if(j < nlanes && next_job < n){
+			lane_load(&lanes[j], &jobs[next_job++], st, j, iv);
+			active++;
+		}
+	}
+
+	while(active > 0){
+		for(j = 0; j < NM_MB_LANES; j++){
+			if(!lanes[j].job)
+				blk[j] = idle_block;
+			else if(lanes[j].block < lanes[j].full)
+				blk[j] = lanes[j].job->msg + lanes[j].block * SHA512_BLOCK;
+			else
+				blk[j] = lanes[j].tail + (lanes[j].block - lanes[j].full) * SHA512_BLOCK;
+		}
+		compress(st, blk);
+
+		for(j = 0; j < nlanes; j++){
+			if(!lanes[j].job || ++lanes[j].block < lanes[j].nblocks)
+				continue;
+			// This lane is done: write its digest and refill it.
+			for(k = 0; k < (int) (digest_len / 8); k++){
+				store_be64(word, st[k][j]);
+				memcpy(lanes[j].job->digest + 8 * k, word, 8);
+			}
+			if(next_job < n){
+				lane_load(&lanes[j], &jobs[next_job++], st, j, iv);
+			}else{
+				lanes[j].job = NULL;
+				active--;
+			}
+		}
+	}
+	free(lanes);
+}
+
+void nm_sha384_many(struct nm_hash_job_t *jobs, size_t n){
+	sha512_mb(jobs, n, sha384_iv, NM_SHA384_LEN);
+}
+
+void nm_sha512_many(struct nm_hash_job_t *jobs, size_t n){
+	sha512_mb(jobs, n, sha512_iv, NM_SHA512_LEN);
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+static int fingerprint_stream(FILE *fp, unsigned char *digest){
+	// Large files: stream through libgcrypt in 64k pieces.
+	gcry_md_hd_t hd;
+	unsigned char *buff;
+	size_t got;
+
+	if (gcry_md_open(&hd, GCRY_MD_SHA384, 0))
+		return 123;
+	buff = malloc(65536);
+	if(!buff){
+		gcry_md_close(hd);
+		return 843;
+	}
+	while((got = fread(buff, 1, 65536, fp)) > 0){
+		gcry_md_write(hd, buff, got);
+		nm_stats_add(NM_STAT_BYTES_HASHED, got);
+	}
+	free(buff);
+	if(ferror(fp)){
+		gcry_md_close(hd);
+		return 932;
+	}
+	memcpy(digest, gcry_md_read(hd, GCRY_MD_SHA384), NM_SHA384_LEN);
+	gcry_md_close(hd);
+	return 0;
+}
+
+int nm_fingerprint_files(const char **fnames, size_t n, unsigned char *fps,
+  int *rslts){
+	// Fingerprint n files.  The SHA-384 of fnames[j] goes to
+	// fps + j * NM_SHA384_LEN and rslts[j] is 0 on success or an
+	// error code (438 = could not open, 932 = read error).
+	// Returns the number of files that failed.
+	struct nm_hash_job_t jobs[NM_HASH_FILE_BATCH];
+	unsigned char *bufs[NM_HASH_FILE_BATCH];
+	size_t j, start;
+	int njobs, k;
+	int failed = 0;
+	long len;
+	FILE *fp;
+
+	for(start = 0; start < n; start += NM_HASH_FILE_BATCH){
+		njobs = 0;
+		for(j = start; j < n && j < start + NM_HASH_FILE_BATCH; j++){
+			rslts[j] = 0;
+			fp = fopen(fnames[j], "rb");
+			if(!fp){
+				rslts[j] = 438;
+				failed++;
+				continue;
+			}
+			fseek(fp, 0, SEEK_END);
+			len = ftell(fp);
+			fseek(fp, 0, SEEK_SET);
+			if(len < 0 || len > NM_HASH_SMALL_FILE){
+				rslts[j] = fingerprint_stream(fp, fps + j * NM_SHA384_LEN);
+				if(rslts[j])
+					failed++;
+				fclose(fp);
+				continue;
+			}
+			bufs[njobs] = malloc(len + 1);
+			if(!bufs[njobs] || fread(bufs[njobs], 1, len, fp) != (size_t) len){
+				free(bufs[njobs]);
+				rslts[j] = 932;
+				failed++;
+				fclose(fp);
+				continue;
+			}
+			fclose(fp);
+			jobs[njobs].msg = bufs[njobs];
+			jobs[njobs].len = len;
+			jobs[njobs].digest = fps + j * NM_SHA384_LEN;
+			njobs++;
+		}
+		nm_sha384_many(jobs, njobs);
+		for(k = 0; k < njobs; k++)
+			free(bufs[k]);
+	}
+	return failed;
+}
+
+int nm_fingerprint_file(const char *fname, unsigned char *fp){
+	int rslt;
+	nm_fingerprint_files(&fname, 1, fp, &rslt);
+	return rslt;
+}
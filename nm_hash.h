@@ -0,0 +1,34 @@
+// nm_hash.h
+//
+// Multi-buffer SHA-384/SHA-512 for many small inputs, plus the
+// fingerprint helpers built on it.  See nm_hash.c.
+//
+// These are for public data (key files, nonces, manifests), so
+// they do not use libgcrypt secure memory.  Do not hash private
+// key material with them.
+
+#define NM_SHA384_LEN 48
+#define NM_SHA512_LEN 64
+
+// One message to hash.  The caller owns msg and digest; digest
+// must have room for NM_SHA384_LEN or NM_SHA512_LEN bytes.
+struct nm_hash_job_t
+{
+	const unsigned char *msg;
+	size_t len;
+	unsigned char *digest;
+};
+
+void nm_sha384_many(struct nm_hash_job_t *jobs, size_t n);
+void nm_sha512_many(struct nm_hash_job_t *jobs, size_t n);
+
+// Number of SIMD lanes that nm_sha384_many() uses on this CPU
+// (1, 4 or 8).  nm_hash_set_lanes() is for the benchmark: it picks a
+// narrower kernel, and a request that the CPU cannot do is ignored.
+int nm_hash_lanes(void);
+void nm_hash_set_lanes(int lanes);
+
+// The fingerprint of a key is the SHA-384 of the entire key file.
+int nm_fingerprint_file(const char *fname, unsigned char *fp);
+int nm_fingerprint_files(const char **fnames, size_t n, unsigned char *fps,
+  int *rslts);
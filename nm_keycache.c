@@ -0,0 +1,546 @@
+// nm_keycache.c
+// Purpose:
+//   1) Keep the parsed keys of a key directory in memory for a
+//      process that stays up (a resident verifier or signer), so that
+//      the monthly rotation of online keys needs no restart: the
+//      directory is watched with inotify (or, where there is none,
+//      checked every NM_KEYCACHE_POLL_MS), and only files that
+//      changed are parsed again.
+//   2) Let verify threads look keys up without a lock.  Each reload
+//      publishes a new snapshot of the keys, which is never changed
+//      after that.  A reader marks the generation it entered with in
+//      its own slot, uses the snapshot it found, and clears the slot
+//      when done.  A replaced snapshot is freed by the watcher thread
+//      once no slot holds a generation older than its replacement
+//      (read-copy-update with per-reader epochs).  A key that did not
+//      change is shared by the snapshots, so a rotation costs one
+//      parse per new file and no reader ever waits.
+//
+// Key files are the regular files of the directory whose names do
+// not start with '.'.  Files that are not key files are left out.  A
+// changed file that does not parse (for example one still being
+// written) keeps its previous version until it does.  Private keys
+// are parsed from secure memory, as nm_read_key_file() does.
+//
+// Usage:
+//    kc = nm_keycache_open(dir, &rc);
+//    reader = nm_keycache_reader(kc);          // once per thread
+//    snap = nm_keycache_enter(kc, reader);
+//    key = nm_keycache_find(snap, "TOnlinePUBSignKey.key");
+//    ... gcry_pk_verify(sig, data, key->sexp_key) ...
+//    nm_keycache_leave(kc, reader);             // key is gone after this
+//
+#include <stddef.h>
+#include <gcrypt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "nm_keycache.h"
+#include "nm_keys.h"
+#include "nm_chain.h"
+
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+// Key files are small; anything bigger is not a key.
+#define NM_KEYCACHE_MAX_FILE 65536
+// Without inotify, how often the directory is checked.
+#define NM_KEYCACHE_POLL_MS 2000
+// Changes that arrive this close together are one reload.
+#define NM_KEYCACHE_SETTLE_MS 20
+// How often replaced snapshots are retried while readers hold them.
+#define NM_KEYCACHE_RECLAIM_MS 10
+
+// One slot per reader, on its own cache line so that readers do not
+// slow each other down.
+struct reader_slot_t
+{
+	unsigned long long gen;     // 0 when not reading
+	int used;
+	char pad[64 - sizeof(unsigned long long) - sizeof(int)];
+};
+
+struct nm_keycache_t
+{
+	struct reader_slot_t slot[NM_KEYCACHE_MAX_READERS];
+	struct nm_keycache_snap_t *cur;          // atomic
+	unsigned long long gen;                  // atomic
+	char dir[4096];
+	// The reloader's state, under lock.
+	pthread_mutex_t lock;
+	struct nm_keycache_snap_t *retired;
+	int nretired;
+	unsigned long long reloads;
+	unsigned long long parsed;
+	// The watcher thread.
+	pthread_t watcher;
+	int watching;
+	int notify_fd;                           // -1 without inotify
+	int stop_pipe[2];
+};
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+static int cmp_name(const void *a, const void *b){
+	return strcmp((*(struct nm_keycache_key_t * const *) a)->name,
+		(*(struct nm_keycache_key_t * const *) b)->name);
+}
+
+static int cmp_fp(const void *a, const void *b){
+	return memcmp((*(struct nm_keycache_key_t * const *) a)->fp,
+		(*(struct nm_keycache_key_t * const *) b)->fp, NM_KEYCACHE_FP_LEN);
+}
+
+static void free_key(struct nm_keycache_key_t *key){
+	gcry_sexp_release(key->sexp_key);
+	gcry_sexp_release(key->sexp_file);
+	free(key);
+}
+
+static void free_snap(struct nm_keycache_snap_t *snap){
+	// Drop the snapshot's hold on its keys; a key that no snapshot
+	// holds any more is freed.
+	int j;
+
+	for(j = 0; j < snap->n; j++)
+		if(--snap->keys[j]->refs == 0)
+			free_key(snap->keys[j]);
+	free(snap->keys);
+	free(snap->by_fp);
+	free(snap);
+}
+
+static char key_function(gcry_sexp_t sexp_file){
+	gcry_sexp_t sexp_field;
+	const char *data;
+	size_t len;
+	char kf = 0;
+
+	sexp_field = gcry_sexp_find_token(sexp_file, "Key-Function", 0);
+	data = sexp_field ? gcry_sexp_nth_data(sexp_field, 1, &len) : NULL;
+	if(data && len == 1 && (data[0] == 's' || data[0] == 'e'))
+		kf = data[0];
+	gcry_sexp_release(sexp_field);
+	return kf;
+}
+
+static struct nm_keycache_key_t *parse_key(const char *fname, const char *name,
+  const struct stat *st){
+	// A key file, or NULL if it is not one (or cannot be read now).
+	// The text is read into secure memory, and only a private key is
+	// parsed from there, so that public keys do not use up the pool.
+	struct nm_keycache_key_t *key;
+	char *txt, *pub_txt = NULL;
+	FILE *fp;
+	size_t len;
+	int is_private;
+
+	if(st->st_size <= 0 || st->st_size > NM_KEYCACHE_MAX_FILE
+	  || strlen(name) >= NM_KEYCACHE_MAX_NAME)
+		return NULL;
+	fp = fopen(fname, "rb");
+	if(!fp)
+		return NULL;
+	txt = gcry_calloc_secure(st->st_size + 1, 1);
+	if(!txt){
+		fclose(fp);
+		return NULL;
+	}
+	len = fread(txt, 1, st->st_size, fp);
+	fclose(fp);
+	key = calloc(1, sizeof(*key));
+	is_private = strstr(txt, "private-key") != NULL;
+	if(key && !is_private)
+		pub_txt = malloc(len + 1);
+	if(!key || len != (size_t) st->st_size || (!is_private && !pub_txt)){
+		nm_wipe(txt, st->st_size + 1);
+		gcry_free(txt);
+		free(pub_txt);
+		free(key);
+		return NULL;
+	}
+	gcry_md_hash_buffer(GCRY_MD_SHA384, key->fp, txt, len);
+	if(pub_txt)
+		memcpy(pub_txt, txt, len + 1);
+	if(gcry_sexp_new(&key->sexp_file, pub_txt ? pub_txt : txt, len, 1))
+		key->sexp_file = NULL;
+	nm_wipe(txt, st->st_size + 1);
+	gcry_free(txt);
+	free(pub_txt);
+
+	if(key->sexp_file)
+		key->sexp_key = gcry_sexp_find_token(key->sexp_file,
+			is_private ? "private-key" : "public-key", 0);
+	if(!key->sexp_key){
+		gcry_sexp_release(key->sexp_file);
+		free(key);
+		return NULL;
+	}
+	strcpy(key->name, name);
+	key->is_private = is_private;
+	key->expire = nm_chain_key_expire(key->sexp_file);
+	key->key_function = key_function(key->sexp_file);
+	key->mtime_ns = (long long) st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+	key->size = st->st_size;
+	key->ino = st->st_ino;
+	return key;
+}
+
+static int same_file(const struct nm_keycache_key_t *key, const struct stat *st){
+	return key->size == st->st_size && key->ino == (unsigned long long) st->st_ino
+		&& key->mtime_ns == (long long) st->st_mtim.tv_sec * 1000000000LL
+			+ st->st_mtim.tv_nsec;
+}
+
+static void reclaim(struct nm_keycache_t *kc){
+	// Free the replaced snapshots that no reader can still be using.
+	// Called with kc->lock held.
+	struct nm_keycache_snap_t **pp, *snap;
+	unsigned long long g, oldest = 0;
+	int j;
+
+	for(j = 0; j < NM_KEYCACHE_MAX_READERS; j++){
+		g = __atomic_load_n(&kc->slot[j].gen, __ATOMIC_SEQ_CST);
+		if(g && (!oldest || g < oldest))
+			oldest = g;
+	}
+	pp = &kc->retired;
+	while((snap = *pp)){
+		if(!oldest || oldest >= snap->retired_at){
+			*pp = snap->next_retired;
+			free_snap(snap);
+			kc->nretired--;
+		}else{
+			pp = &snap->next_retired;
+		}
+	}
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+int nm_keycache_reload(struct nm_keycache_t *kc){
+	// Look at the directory again and, if anything changed, publish a
+	// new snapshot.  The watcher thread calls this; a caller may too
+	// (after it has written a key itself, say).  Returns 0, 438
+	// (cannot read the directory) or 843.
+	struct nm_keycache_snap_t *old, *snap;
+	struct nm_keycache_key_t **keys, **p, *key, *prev, probe, *probe_p = &probe, **found;
+	char fname[4096 + NM_KEYCACHE_MAX_NAME + 2];
+	struct dirent *de;
+	struct stat st;
+	DIR *d;
+	int n = 0, cap = 64, changed, j;
+
+	pthread_mutex_lock(&kc->lock);
+	old = kc->cur;
+	d = opendir(kc->dir);
+	keys = malloc(cap * sizeof(*keys));
+	if(!d || !keys){
+		if(d)
+			closedir(d);
+		free(keys);
+		pthread_mutex_unlock(&kc->lock);
+		return d ? 843 : 438;
+	}
+	changed = 0;
+	while((de = readdir(d))){
+		if(de->d_name[0] == '.' || strlen(de->d_name) >= NM_KEYCACHE_MAX_NAME)
+			continue;
+		snprintf(fname, sizeof(fname), "%s/%s", kc->dir, de->d_name);
+		if(stat(fname, &st) || !S_ISREG(st.st_mode))
+			continue;
+		prev = NULL;
+		if(old){
+			strcpy(probe.name, de->d_name);
+			found = bsearch(&probe_p, old->keys, old->n, sizeof(*old->keys), cmp_name);
+			prev = found ? *found : NULL;
+		}
+		if(prev && same_file(prev, &st)){
+			key = prev;
+		}else{
+			key = parse_key(fname, de->d_name, &st);
+			if(key)
+				kc->parsed++;
+			else
+				key = prev;      // keep the old version until the new one parses
+			if(key != prev)
+				changed = 1;
+		}
+		if(!key)
+			continue;
+		if(n == cap){
+			cap *= 2;
+			p = realloc(keys, cap * sizeof(*keys));
+			if(!p){
+				if(key != prev)
+					free_key(key);
+				changed = -1;
+				break;
+			}
+			keys = p;
+		}
+		keys[n++] = key;
+	}
+	closedir(d);
+	if(!changed && (!old || n != old->n))
+		changed = 1;
+	if(changed <= 0 && old){
+		// Nothing to publish: drop the keys parsed for nothing.
+		for(j = 0; j < n; j++)
+			if(keys[j]->refs == 0)
+				free_key(keys[j]);
+		free(keys);
+		reclaim(kc);
+		pthread_mutex_unlock(&kc->lock);
+		return changed < 0 ? 843 : 0;
+	}
+
+	snap = calloc(1, sizeof(*snap));
+	if(snap)
+		snap->by_fp = malloc((n ? n : 1) * sizeof(*keys));
+	if(!snap || !snap->by_fp){
+		for(j = 0; j < n; j++)
+			if(keys[j]->refs == 0)
+				free_key(keys[j]);
+		free(keys);
+		free(snap);
+		pthread_mutex_unlock(&kc->lock);
+		return 843;
+	}
+	qsort(keys, n, sizeof(*keys), cmp_name);
+	memcpy(snap->by_fp, keys, n * sizeof(*keys));
+	qsort(snap->by_fp, n, sizeof(*keys), cmp_fp);
+	for(j = 0; j < n; j++)
+		keys[j]->refs++;
+	snap->n = n;
+	snap->keys = keys;
+	snap->gen = kc->gen + 1;
+
+	//  Publish, then retire the old snapshot: readers that enter from
+	//  now on find the new one.
+	__atomic_store_n(&kc->cur, snap, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&kc->gen, snap->gen, __ATOMIC_SEQ_CST);
+	kc->reloads++;
+	if(old){
+		old->retired_at = snap->gen;
+		old->next_retired = kc->retired;
+		kc->retired = old;
+		kc->nretired++;
+	}
+	reclaim(kc);
+	pthread_mutex_unlock(&kc->lock);
+	return 0;
+}
+
+static long long now_ms(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void *watch_dir(void *arg){
+	// Reload when the directory changes, and free replaced snapshots
+	// once their readers have left.
+	struct nm_keycache_t *kc = arg;
+	struct pollfd pfd[2];
+	char buf[4096];
+	long long since = 0;
+	int timeout, pending, nretired;
+
+	pfd[0].fd = kc->stop_pipe[0];
+	pfd[0].events = POLLIN;
+	pfd[1].fd = kc->notify_fd;
+	pfd[1].events = POLLIN;
+	pending = 0;
+	for(;;){
+		pthread_mutex_lock(&kc->lock);
+		nretired = kc->nretired;
+		pthread_mutex_unlock(&kc->lock);
+		if(pending)
+			timeout = (int) (since + NM_KEYCACHE_SETTLE_MS - now_ms());
+		else if(nretired)
+			timeout = NM_KEYCACHE_RECLAIM_MS;
+		else
+			timeout = kc->notify_fd >= 0 ? -1 : NM_KEYCACHE_POLL_MS;
+		if(timeout < 0 && (pending || nretired))
+			timeout = 0;
+		if(poll(pfd, kc->notify_fd >= 0 ? 2 : 1, timeout) < 0)
+			continue;
+		if(pfd[0].revents)
+			break;
+		if(kc->notify_fd >= 0 && (pfd[1].revents & POLLIN)){
+			// Changes that arrive within NM_KEYCACHE_SETTLE_MS of the
+			// first are taken in one reload.
+			while(read(kc->notify_fd, buf, sizeof(buf)) > 0)
+				;
+			if(!pending)
+				since = now_ms();
+			pending = 1;
+		}
+		if(pending ? now_ms() - since >= NM_KEYCACHE_SETTLE_MS : kc->notify_fd < 0){
+			pending = 0;
+			nm_keycache_reload(kc);
+		}else if(nretired){
+			pthread_mutex_lock(&kc->lock);
+			reclaim(kc);
+			pthread_mutex_unlock(&kc->lock);
+		}
+	}
+	return NULL;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+struct nm_keycache_t *nm_keycache_open(const char *dir, int *err_r){
+	// Parse every key file in dir and start watching it.  Returns
+	// NULL with *err_r 438 (cannot read dir) or 843.
+	struct nm_keycache_t *kc;
+	int rc, flags;
+
+	if(strlen(dir) >= sizeof(kc->dir)){
+		*err_r = 438;
+		return NULL;
+	}
+	kc = calloc(1, sizeof(*kc));
+	if(!kc){
+		*err_r = 843;
+		return NULL;
+	}
+	strcpy(kc->dir, dir);
+	pthread_mutex_init(&kc->lock, NULL);
+	kc->notify_fd = -1;
+	kc->stop_pipe[0] = kc->stop_pipe[1] = -1;
+	kc->gen = 1;
+	rc = nm_keycache_reload(kc);
+	if(rc){
+		nm_keycache_close(kc);
+		*err_r = rc;
+		return NULL;
+	}
+
+#ifdef __linux__
+	kc->notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(kc->notify_fd >= 0 && inotify_add_watch(kc->notify_fd, dir,
+	  IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ATTRIB) < 0){
+		close(kc->notify_fd);
+		kc->notify_fd = -1;
+	}
+#endif
+	if(pipe(kc->stop_pipe)){
+		nm_keycache_close(kc);
+		*err_r = 843;
+		return NULL;
+	}
+	flags = fcntl(kc->stop_pipe[0], F_GETFL);
+	fcntl(kc->stop_pipe[0], F_SETFL, flags | O_NONBLOCK);
+	// Without the watcher the cache still works; it is reloaded only
+	// by nm_keycache_reload().
+	kc->watching = !pthread_create(&kc->watcher, NULL, watch_dir, kc);
+	return kc;
+}
+
+void nm_keycache_close(struct nm_keycache_t *kc){
+	// Stop watching and free everything.  No reader may be inside.
+	struct nm_keycache_snap_t *snap;
+
+	if(!kc)
+		return;
+	if(kc->watching){
+		if(write(kc->stop_pipe[1], "x", 1) == 1)
+			pthread_join(kc->watcher, NULL);
+	}
+	if(kc->notify_fd >= 0)
+		close(kc->notify_fd);
+	if(kc->stop_pipe[0] >= 0){
+		close(kc->stop_pipe[0]);
+		close(kc->stop_pipe[1]);
+	}
+	while((snap = kc->retired)){
+		kc->retired = snap->next_retired;
+		free_snap(snap);
+	}
+	if(kc->cur)
+		free_snap(kc->cur);
+	pthread_mutex_destroy(&kc->lock);
+	free(kc);
+}
+
+void nm_keycache_stats(struct nm_keycache_t *kc, unsigned long long *reloads_r,
+  unsigned long long *parsed_r, int *retired_r){
+	// Snapshots published, key files parsed, and replaced snapshots
+	// not yet freed.
+	pthread_mutex_lock(&kc->lock);
+	*reloads_r = kc->reloads;
+	*parsed_r = kc->parsed;
+	*retired_r = kc->nretired;
+	pthread_mutex_unlock(&kc->lock);
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+int nm_keycache_reader(struct nm_keycache_t *kc){
+	// A reader slot for one thread, or -1 if all
+	// NM_KEYCACHE_MAX_READERS are taken.
+	int j, expected;
+
+	for(j = 0; j < NM_KEYCACHE_MAX_READERS; j++){
+		expected = 0;
+		if(__atomic_compare_exchange_n(&kc->slot[j].used, &expected, 1, 0,
+		  __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			return j;
+	}
+	return -1;
+}
+
+void nm_keycache_reader_done(struct nm_keycache_t *kc, int reader){
+	__atomic_store_n(&kc->slot[reader].gen, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&kc->slot[reader].used, 0, __ATOMIC_RELEASE);
+}
+
+const struct nm_keycache_snap_t *nm_keycache_enter(struct nm_keycache_t *kc, int reader){
+	// The current snapshot, valid until nm_keycache_leave().  Takes no
+	// lock and never waits.
+	//
+	// The slot is set before the snapshot pointer is read, and the
+	// reloader publishes the pointer before it reads the slots (all
+	// sequentially consistent), so either the reloader sees this
+	// reader or this reader sees the new snapshot.
+	__atomic_store_n(&kc->slot[reader].gen, __atomic_load_n(&kc->gen, __ATOMIC_SEQ_CST),
+		__ATOMIC_SEQ_CST);
+	return __atomic_load_n(&kc->cur, __ATOMIC_SEQ_CST);
+}
+
+void nm_keycache_leave(struct nm_keycache_t *kc, int reader){
+	__atomic_store_n(&kc->slot[reader].gen, 0, __ATOMIC_RELEASE);
+}
+
+const struct nm_keycache_key_t *nm_keycache_find(const struct nm_keycache_snap_t *snap,
+  const char *name){
+	// A key by file name, or NULL.
+	struct nm_keycache_key_t probe, *probe_p = &probe, **found;
+
+	if(strlen(name) >= NM_KEYCACHE_MAX_NAME)
+		return NULL;
+	strcpy(probe.name, name);
+	found = bsearch(&probe_p, snap->keys, snap->n, sizeof(*snap->keys), cmp_name);
+	return found ? *found : NULL;
+}
+
+const struct nm_keycache_key_t *nm_keycache_find_fp(const struct nm_keycache_snap_t *snap,
+  const unsigned char *fp){
+	// A key by the SHA-384 of its file, or NULL.
+	struct nm_keycache_key_t probe, *probe_p = &probe, **found;
+
+	memcpy(probe.fp, fp, NM_KEYCACHE_FP_LEN);
+	found = bsearch(&probe_p, snap->by_fp, snap->n, sizeof(*snap->by_fp), cmp_fp);
+	return found ? *found : NULL;
+}
@@ -0,0 +1,54 @@
+// nm_keycache.h
+//
+// Parsed keys of a key directory, reloaded when the directory
+// changes, for processes that stay up.  See nm_keycache.c.
+
+#define NM_KEYCACHE_FP_LEN 48            // SHA-384 of the key file
+#define NM_KEYCACHE_MAX_NAME 256
+#define NM_KEYCACHE_MAX_READERS 64
+
+// One key file, parsed.  Never changed once it is in a snapshot.
+struct nm_keycache_key_t
+{
+	char name[NM_KEYCACHE_MAX_NAME];     // the file name, without the directory
+	unsigned char fp[NM_KEYCACHE_FP_LEN];
+	gcry_sexp_t sexp_file;               // the whole key file
+	gcry_sexp_t sexp_key;                // its (public-key ...) or (private-key ...)
+	int is_private;
+	unsigned int expire;                 // YYYYMMDD, 0 if none (see nm_chain_key_expire())
+	char key_function;                   // 's', 'e', or 0
+	// How the file looked when it was parsed.
+	long long mtime_ns;
+	long long size;
+	unsigned long long ino;
+	int refs;                            // snapshots that hold it (reloader only)
+};
+
+// Every key of the directory at one moment, sorted by name.
+struct nm_keycache_snap_t
+{
+	int n;
+	struct nm_keycache_key_t **keys;
+	struct nm_keycache_key_t **by_fp;    // the same keys sorted by fingerprint
+	unsigned long long gen;
+	struct nm_keycache_snap_t *next_retired;
+	unsigned long long retired_at;
+};
+
+struct nm_keycache_t;
+
+struct nm_keycache_t *nm_keycache_open(const char *dir, int *err_r);
+void nm_keycache_close(struct nm_keycache_t *kc);
+int nm_keycache_reload(struct nm_keycache_t *kc);
+
+int nm_keycache_reader(struct nm_keycache_t *kc);
+void nm_keycache_reader_done(struct nm_keycache_t *kc, int reader);
+const struct nm_keycache_snap_t *nm_keycache_enter(struct nm_keycache_t *kc, int reader);
+void nm_keycache_leave(struct nm_keycache_t *kc, int reader);
+
+const struct nm_keycache_key_t *nm_keycache_find(const struct nm_keycache_snap_t *snap,
+  const char *name);
+const struct nm_keycache_key_t *nm_keycache_find_fp(const struct nm_keycache_snap_t *snap,
+  const unsigned char *fp);
+void nm_keycache_stats(struct nm_keycache_t *kc, unsigned long long *reloads_r,
+  unsigned long long *parsed_r, int *retired_r);
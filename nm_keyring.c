@@ -0,0 +1,760 @@
+// nm_keyring.c
+// Purpose:
+//   1) Compile a directory of Natural Message public key files (the
+//      ones nm_create_server_keys and nm_create_online_key write)
+//      into one binary keyring file (nm_keyring --build).
+//   2) Map a keyring read-only and find a key by Natural-Message-ID,
+//      by SHA-384 fingerprint (or a prefix of it) or by IP address
+//      without opening or parsing any key files (nm_verify --keyring,
+//      NMVerifyServer --keyring=<file>).
+//
+// The file (see struct nm_keyring_hdr_t):
+//   header   128 bytes
+//   records  one per key, sorted by fingerprint, holding the
+//            Owner-Info fields, the expiry date, and the offsets of
+//            the key's data in the blob
+//   by ID    record numbers sorted by Natural-Message-ID, then
+//            newest expiry first
+//   by IP    (address, record number) pairs sorted by address; a key
+//            has an entry for each of IPV4, IPV6 and Alternative-IPV4
+//   blob     for each key, the (public-key ...) s-expression in
+//            canonical form and the text of the key file.
+// All lookups are binary searches in the mapped file.  The fingerprint
+// is the SHA-384 of the whole key file, as printed by nm_fingerprint.
+//
+// Private key files in the directory are skipped, so a keyring never
+// holds secret material.  The keyring is written to a temporary file
+// and renamed into place, so a process that maps the old one keeps a
+// consistent view.
+//
+#include <stddef.h>
+#include <gcrypt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "nm_keyring.h"
+#include "nm_fileload.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Key files are small; anything bigger is not a key.
+#define NM_KEYRING_MAX_FILE 65536
+
+struct nm_keyring_t
+{
+	const unsigned char *base;
+	const struct nm_keyring_hdr_t *hdr;
+	const struct nm_keyring_rec_t *recs;
+	const unsigned int *by_id;
+	const struct nm_keyring_ip_t *by_ip;
+	size_t map_len;
+};
+
+// Records being sorted by nm_keyring_build() (qsort has no context
+// argument).
+static const struct nm_keyring_rec_t *sort_recs;
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+static int get_field(gcry_sexp_t sexp, const char *token, char *out,
+  size_t out_len){
+	// Copy the value of (token value) into out.  A missing field or
+	// NA gives an empty string.  Returns 1 if the value does not fit.
+	gcry_sexp_t s;
+	const char *data;
+	size_t len;
+
+	out[0] = 0x00;
+	s = gcry_sexp_find_token(sexp, token, 0);
+	if(!s)
+		return 0;
+	data = gcry_sexp_nth_data(s, 1, &len);
+	if(data && !(len == 2 && !memcmp(data, "NA", 2))){
+		if(len >= out_len){
+			gcry_sexp_release(s);
+			return 1;
+		}
+		memcpy(out, data, len);
+		out[len] = 0x00;
+	}
+	gcry_sexp_release(s);
+	return 0;
+}
+
+static unsigned int get_expire(gcry_sexp_t sexp){
+	// Expire-Date-YYYYMMDD as a number, read from the token itself
+	// as nm_chain_key_expire() does: 0 if missing or NA, and 1 (so
+	// the key has expired) if it is there but not eight digits,
+	// empty and list values included.
+	gcry_sexp_t s;
+	const char *data;
+	size_t len;
+	unsigned int expire = 0;
+	int j = 0;
+
+	s = gcry_sexp_find_token(sexp, "Expire-Date-YYYYMMDD", 0);
+	if(!s)
+		return 0;
+	data = gcry_sexp_nth_data(s, 1, &len);
+	if(data && len == 2 && !memcmp(data, "NA", 2)){
+		gcry_sexp_release(s);
+		return 0;
+	}
+	if(data && len == 8){
+		for(j = 0; j < 8 && data[j] >= '0' && data[j] <= '9'; j++)
+			expire = expire * 10 + data[j] - '0';
+	}
+	if(!data || len != 8 || j < 8 || expire == 0)
+		expire = 1;
+	gcry_sexp_release(s);
+	return expire;
+}
+
+static long blob_add(unsigned char **blob, size_t *blob_len, size_t *blob_cap,
+  const void *data, size_t len){
+	// Append len bytes and a null to the blob.  Returns the offset
+	// (from the start of the blob) or -1 if out of memory.
+	unsigned char *p;
+	size_t off = *blob_len;
+
+	while(*blob_len + len + 1 > *blob_cap){
+		p = realloc(*blob, *blob_cap * 2);
+		if(!p)
+			return -1;
+		*blob = p;
+		*blob_cap *= 2;
+	}
+	memcpy(*blob + off, data, len);
+	(*blob)[off + len] = 0x00;
+	*blob_len += len + 1;
+	return off;
+}
+
+static int add_key_file(const char *fname, char *txt, size_t len,
+  struct nm_keyring_rec_t *rec, unsigned char **blob, size_t *blob_len,
+  size_t *blob_cap, int verbose){
+	// Add one key file, read into txt, to rec and the blob.  Returns
+	// 0 if it was added, 1 if the file is not a public key file
+	// (skipped), or 843 if out of memory.
+	char *canon;
+	size_t canon_len;
+	char function[8];
+	gcry_sexp_t sexp_file, sexp_pub, sexp_algo;
+	const char *algo;
+	size_t algo_len;
+	long off;
+	int too_long;
+
+	if(len == 0 || gcry_sexp_new(&sexp_file, txt, len, 1)){
+		if(verbose)
+			fprintf(stderr, "Skipping %s: not a key file.\n", fname);
+		return 1;
+	}
+	if((sexp_pub = gcry_sexp_find_token(sexp_file, "NaturalMessage-Offline-Key-Set", 0))){
+		if(verbose)
+			fprintf(stderr, "Skipping %s: it is an offline key set.\n", fname);
+		gcry_sexp_release(sexp_pub);
+		gcry_sexp_release(sexp_file);
+		return 1;
+	}
+	if((sexp_pub = gcry_sexp_find_token(sexp_file, "private-key", 0))){
+		fprintf(stderr, "Skipping %s: it holds a private key.\n", fname);
+		gcry_sexp_release(sexp_pub);
+		gcry_sexp_release(sexp_file);
+		return 1;
+	}
+	sexp_pub = gcry_sexp_find_token(sexp_file, "public-key", 0);
+	if(!sexp_pub){
+		if(verbose)
+			fprintf(stderr, "Skipping %s: no public key.\n", fname);
+		gcry_sexp_release(sexp_file);
+		return 1;
+	}
+
+	memset(rec, 0, sizeof(*rec));
+	gcry_md_hash_buffer(GCRY_MD_SHA384, rec->fingerprint, txt, len);
+	too_long = get_field(sexp_file, "Natural-Message-ID", rec->id, sizeof(rec->id));
+	too_long |= get_field(sexp_file, "IPV4", rec->ipv4, sizeof(rec->ipv4));
+	too_long |= get_field(sexp_file, "IPV6", rec->ipv6, sizeof(rec->ipv6));
+	too_long |= get_field(sexp_file, "Alternative-IPV4", rec->alt_ipv4,
+		sizeof(rec->alt_ipv4));
+	too_long |= get_field(sexp_file, "Key-Function", function, sizeof(function));
+	rec->key_function = function[0];
+	rec->expire = get_expire(sexp_file);
+	sexp_algo = gcry_sexp_nth(sexp_pub, 1);
+	algo = sexp_algo ? gcry_sexp_nth_data(sexp_algo, 0, &algo_len) : NULL;
+	if(algo && algo_len < sizeof(rec->algo))
+		memcpy(rec->algo, algo, algo_len);
+	gcry_sexp_release(sexp_algo);
+	if(too_long){
+		fprintf(stderr, "Skipping %s: an Owner-Info field is too long.\n", fname);
+		gcry_sexp_release(sexp_pub);
+		gcry_sexp_release(sexp_file);
+		return 1;
+	}
+
+	// The public key in canonical form, then the file text.
+	off = -1;
+	canon_len = gcry_sexp_sprint(sexp_pub, GCRYSEXP_FMT_CANON, NULL, 0);
+	canon = malloc(canon_len + 1);
+	if(canon){
+		canon_len = gcry_sexp_sprint(sexp_pub, GCRYSEXP_FMT_CANON, canon, canon_len + 1);
+		off = blob_add(blob, blob_len, blob_cap, canon, canon_len);
+		rec->pubkey_off = off;
+		rec->pubkey_len = canon_len;
+		free(canon);
+	}
+	if(off >= 0){
+		off = blob_add(blob, blob_len, blob_cap, txt, len);
+		rec->text_off = off;
+		rec->text_len = len;
+	}
+	gcry_sexp_release(sexp_pub);
+	gcry_sexp_release(sexp_file);
+	return off < 0 ? 843 : 0;
+}
+
+static int cmp_fp(const void *a, const void *b){
+	return memcmp(((const struct nm_keyring_rec_t *) a)->fingerprint,
+		((const struct nm_keyring_rec_t *) b)->fingerprint, NM_KEYRING_FP_LEN);
+}
+
+static unsigned int expire_key(unsigned int expire){
+	// No expiry date sorts as the newest.
+	return expire ? expire : 0xffffffff;
+}
+
+static int cmp_newest(const struct nm_keyring_rec_t *ra,
+  const struct nm_keyring_rec_t *rb){
+	// Newest first, then by fingerprint so the order is fixed.
+	if(expire_key(ra->expire) != expire_key(rb->expire))
+		return expire_key(ra->expire) > expire_key(rb->expire) ? -1 : 1;
+	return memcmp(ra->fingerprint, rb->fingerprint, NM_KEYRING_FP_LEN);
+}
+
+static int cmp_id(const void *a, const void *b){
+	const struct nm_keyring_rec_t *ra = &sort_recs[*(const unsigned int *) a];
+	const struct nm_keyring_rec_t *rb = &sort_recs[*(const unsigned int *) b];
+	int c = strcmp(ra->id, rb->id);
+	if(c)
+		return c;
+	return cmp_newest(ra, rb);
+}
+
+static int cmp_ip(const void *a, const void *b){
+	// By address, then newest first whatever the ID, so that
+	// nm_keyring_find_ip() takes the newest key for an address.
+	const struct nm_keyring_ip_t *ia = a, *ib = b;
+	int c = strcmp(ia->ip, ib->ip);
+	if(c)
+		return c;
+	return cmp_newest(&sort_recs[ia->rec], &sort_recs[ib->rec]);
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+// The keyring being built, for build_ready().
+struct build_t
+{
+	struct nm_keyring_rec_t *recs;
+	size_t nrecs, cap;
+	unsigned char *blob;
+	size_t blob_len, blob_cap;
+	int verbose;
+	int rc;
+};
+
+static void build_ready(struct nm_fileload_item_t *item, void *arg){
+	// nm_fileload() has read one file of the directory.
+	struct build_t *b = arg;
+	struct nm_keyring_rec_t *p;
+	int k;
+
+	if(item->rc == 843 || b->rc){
+		b->rc = 843;
+	}else if(item->rc == 439){
+		if(b->verbose)
+			fprintf(stderr, "Skipping %s: could not open it.\n", item->fname);
+	}else if(item->rc){
+		if(b->verbose)
+			fprintf(stderr, "Skipping %s: not a key file.\n", item->fname);
+	}else{
+		if(b->nrecs == b->cap){
+			b->cap = b->cap ? 2 * b->cap : 256;
+			p = realloc(b->recs, b->cap * sizeof(*b->recs));
+			if(!p){
+				b->rc = 843;
+				free(item->buf);
+				return;
+			}
+			b->recs = p;
+		}
+		k = add_key_file(item->fname, item->buf, item->len, &b->recs[b->nrecs],
+			&b->blob, &b->blob_len, &b->blob_cap, b->verbose);
+		if(k == 843)
+			b->rc = 843;
+		if(k == 0)
+			b->nrecs++;
+	}
+	free(item->buf);
+}
+
+int nm_keyring_build(const char *dir, const char *out_fname,
+  unsigned int *nkeys_r, int verbose){
+	// Compile every public key file in dir (not subdirectories) into
+	// the keyring out_fname, replacing it.  *nkeys_r gets the number
+	// of keys.  The files are read with nm_fileload(), many at once.
+	//
+	// Returns 0, 438 (cannot read dir), 843 (out of memory), or 974
+	// (cannot write the keyring).
+	struct nm_keyring_hdr_t hdr;
+	struct nm_keyring_rec_t *recs = NULL;
+	struct nm_keyring_ip_t *ips = NULL;
+	struct nm_fileload_item_t *items = NULL, *pi;
+	struct build_t b;
+	unsigned int *by_id = NULL;
+	unsigned char *blob;
+	size_t blob_len;
+	size_t nrecs = 0, nfiles = 0, files_cap = 0, nips = 0, j, k;
+	char fname[4096];
+	char tmp_fname[4096];
+	char *name;
+	struct dirent *de;
+	struct stat st;
+	DIR *d;
+	FILE *fp;
+	int rc = 0, mode = NM_FILELOAD_AUTO;
+	const char *ip;
+
+	*nkeys_r = 0;
+	memset(&b, 0, sizeof(b));
+	b.verbose = verbose;
+	b.blob_cap = 65536;
+	d = opendir(dir);
+	if(!d)
+		return 438;
+	b.blob = malloc(b.blob_cap);
+	if(!b.blob){
+		closedir(d);
+		return 843;
+	}
+	while((de = readdir(d))){
+		if(de->d_name[0] == '.')
+			continue;
+		if(snprintf(fname, sizeof(fname), "%s/%s", dir, de->d_name)
+		  >= (int) sizeof(fname))
+			continue;
+		// Most file systems give the type, which saves a stat().  A
+		// symbolic link counts as what it points to.
+		if(de->d_type != DT_REG
+		  && ((de->d_type != DT_UNKNOWN && de->d_type != DT_LNK)
+		    || stat(fname, &st) || !S_ISREG(st.st_mode)))
+			continue;
+		if(nfiles == files_cap){
+			files_cap = files_cap ? 2 * files_cap : 256;
+			pi = realloc(items, files_cap * sizeof(*items));
+			if(!pi){
+				rc = 843;
+				break;
+			}
+			items = pi;
+		}
+		name = strdup(fname);
+		if(!name){
+			rc = 843;
+			break;
+		}
+		memset(&items[nfiles], 0, sizeof(*items));
+		items[nfiles++].fname = name;
+	}
+	closedir(d);
+	if(!rc && nfiles > 0x7fffffff)
+		rc = 843;
+	if(!rc)
+		rc = nm_fileload(items, (int) nfiles, NM_KEYRING_MAX_FILE, 0, &mode,
+			build_ready, &b);
+	if(!rc)
+		rc = b.rc;
+	for(j = 0; j < nfiles; j++)
+		free((char *) items[j].fname);
+	free(items);
+	recs = b.recs;
+	nrecs = b.nrecs;
+	blob = b.blob;
+	blob_len = b.blob_len;
+	if(rc)
+		goto done;
+
+	// Sort by fingerprint and drop copies of the same file.
+	qsort(recs, nrecs, sizeof(*recs), cmp_fp);
+	for(j = k = 0; j < nrecs; j++)
+		if(k == 0 || cmp_fp(&recs[k - 1], &recs[j]))
+			recs[k++] = recs[j];
+	nrecs = k;
+
+	by_id = malloc((nrecs + 1) * sizeof(unsigned int));
+	ips = malloc((3 * nrecs + 1) * sizeof(*ips));
+	if(!by_id || !ips){
+		rc = 843;
+		goto done;
+	}
+	memset(ips, 0, (3 * nrecs + 1) * sizeof(*ips));
+	for(j = 0; j < nrecs; j++){
+		by_id[j] = j;
+		for(k = 0; k < 3; k++){
+			ip = k == 0 ? recs[j].ipv4 : k == 1 ? recs[j].ipv6 : recs[j].alt_ipv4;
+			if(ip[0] == 0x00)
+				continue;
+			strcpy(ips[nips].ip, ip);
+			ips[nips++].rec = j;
+		}
+	}
+	sort_recs = recs;
+	qsort(by_id, nrecs, sizeof(unsigned int), cmp_id);
+	qsort(ips, nips, sizeof(*ips), cmp_ip);
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = NM_KEYRING_MAGIC;
+	hdr.rec_size = sizeof(struct nm_keyring_rec_t);
+	hdr.nkeys = nrecs;
+	hdr.nips = nips;
+	hdr.created = time(NULL);
+	hdr.rec_off = sizeof(hdr);
+	hdr.id_off = hdr.rec_off + nrecs * sizeof(*recs);
+	// Keep the IP entries 8-byte aligned.
+	hdr.ip_off = (hdr.id_off + nrecs * sizeof(unsigned int) + 7) & ~7ULL;
+	hdr.blob_off = hdr.ip_off + nips * sizeof(*ips);
+	hdr.blob_len = blob_len;
+	hdr.file_len = hdr.blob_off + blob_len;
+	for(j = 0; j < nrecs; j++){
+		recs[j].pubkey_off += hdr.blob_off;
+		recs[j].text_off += hdr.blob_off;
+	}
+
+	snprintf(tmp_fname, sizeof(tmp_fname), "%s.tmp.%d", out_fname, (int) getpid());
+	fp = fopen(tmp_fname, "wb");
+	if(!fp){
+		rc = 974;
+		goto done;
+	}
+	k = fwrite(&hdr, sizeof(hdr), 1, fp) != 1;
+	k |= nrecs && fwrite(recs, sizeof(*recs), nrecs, fp) != nrecs;
+	k |= nrecs && fwrite(by_id, sizeof(unsigned int), nrecs, fp) != nrecs;
+	for(j = hdr.id_off + nrecs * sizeof(unsigned int); j < hdr.ip_off; j++)
+		k |= fputc(0, fp) == EOF;
+	k |= nips && fwrite(ips, sizeof(*ips), nips, fp) != nips;
+	k |= blob_len && fwrite(blob, 1, blob_len, fp) != blob_len;
+	k |= fflush(fp) != 0 || fsync(fileno(fp)) != 0;
+	k |= fclose(fp) != 0;
+	if(k || rename(tmp_fname, out_fname)){
+		unlink(tmp_fname);
+		rc = 974;
+		goto done;
+	}
+	*nkeys_r = nrecs;
+
+done:
+	free(recs);
+	free(by_id);
+	free(ips);
+	free(blob);
+	return rc;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+static int rec_ok(const struct nm_keyring_hdr_t *hdr,
+  const struct nm_keyring_rec_t *rec, const unsigned char *base){
+	unsigned long long blob_end = hdr->blob_off + hdr->blob_len;
+
+	return rec->id[NM_KEYRING_ID_LEN - 1] == 0x00
+		&& rec->ipv4[NM_KEYRING_IP_LEN - 1] == 0x00
+		&& rec->ipv6[NM_KEYRING_IP_LEN - 1] == 0x00
+		&& rec->alt_ipv4[NM_KEYRING_IP_LEN - 1] == 0x00
+		&& rec->algo[NM_KEYRING_ALGO_LEN - 1] == 0x00
+		&& rec->pubkey_off >= hdr->blob_off && rec->pubkey_off <= blob_end
+		&& rec->pubkey_len <= blob_end - rec->pubkey_off
+		&& rec->text_off >= hdr->blob_off && rec->text_off < blob_end
+		&& rec->text_len < blob_end - rec->text_off
+		&& base[rec->text_off + rec->text_len] == 0x00;
+}
+
+struct nm_keyring_t *nm_keyring_open(const char *fname, int *err_r){
+	// Map a keyring read-only and check it.  Returns NULL and sets
+	// *err_r to 970 (cannot open), 971 (not a keyring, from another
+	// version, or damaged) or 843 (out of memory).
+	struct nm_keyring_t *kr;
+	const struct nm_keyring_hdr_t *hdr;
+	struct stat st;
+	void *p;
+	int fd;
+	unsigned int j;
+
+	*err_r = 0;
+	fd = open(fname, O_RDONLY);
+	if(fd < 0){
+		*err_r = 970;
+		return NULL;
+	}
+	if(fstat(fd, &st)){
+		close(fd);
+		*err_r = 970;
+		return NULL;
+	}
+	if(st.st_size < (off_t) sizeof(struct nm_keyring_hdr_t)){
+		close(fd);
+		*err_r = 971;
+		return NULL;
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(p == MAP_FAILED){
+		*err_r = 970;
+		return NULL;
+	}
+	kr = calloc(1, sizeof(struct nm_keyring_t));
+	if(!kr){
+		munmap(p, st.st_size);
+		*err_r = 843;
+		return NULL;
+	}
+	kr->base = p;
+	kr->hdr = hdr = p;
+	kr->map_len = st.st_size;
+	kr->recs = (const struct nm_keyring_rec_t *) (kr->base + hdr->rec_off);
+	kr->by_id = (const unsigned int *) (kr->base + hdr->id_off);
+	kr->by_ip = (const struct nm_keyring_ip_t *) (kr->base + hdr->ip_off);
+
+	if(hdr->magic != NM_KEYRING_MAGIC
+	  || hdr->rec_size != sizeof(struct nm_keyring_rec_t)
+	  || hdr->file_len != (unsigned long long) st.st_size
+	  || hdr->rec_off != sizeof(struct nm_keyring_hdr_t)
+	  || hdr->id_off != hdr->rec_off + hdr->nkeys * sizeof(struct nm_keyring_rec_t)
+	  || hdr->ip_off < hdr->id_off + hdr->nkeys * sizeof(unsigned int)
+	  || hdr->ip_off % 8
+	  || hdr->blob_off != hdr->ip_off + hdr->nips * sizeof(struct nm_keyring_ip_t)
+	  || hdr->blob_off + hdr->blob_len != hdr->file_len){
+		nm_keyring_close(kr);
+		*err_r = 971;
+		return NULL;
+	}
+	for(j = 0; j < hdr->nkeys; j++)
+		if(!rec_ok(hdr, &kr->recs[j], kr->base) || kr->by_id[j] >= hdr->nkeys){
+			nm_keyring_close(kr);
+			*err_r = 971;
+			return NULL;
+		}
+	for(j = 0; j < hdr->nips; j++)
+		if(kr->by_ip[j].rec >= hdr->nkeys
+		  || kr->by_ip[j].ip[NM_KEYRING_IP_LEN - 1] != 0x00){
+			nm_keyring_close(kr);
+			*err_r = 971;
+			return NULL;
+		}
+	return kr;
+}
+
+void nm_keyring_close(struct nm_keyring_t *kr){
+	if(!kr)
+		return;
+	munmap((void *) kr->base, kr->map_len);
+	free(kr);
+}
+
+unsigned int nm_keyring_count(const struct nm_keyring_t *kr){
+	return kr->hdr->nkeys;
+}
+
+const struct nm_keyring_rec_t *nm_keyring_rec(const struct nm_keyring_t *kr,
+  unsigned int j){
+	// Records in fingerprint order.
+	return j < kr->hdr->nkeys ? &kr->recs[j] : NULL;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+int nm_keyring_find_fp(const struct nm_keyring_t *kr, const unsigned char *fp,
+  size_t fp_len, const struct nm_keyring_rec_t **rec_r){
+	// Find the keys whose fingerprint starts with the fp_len bytes at
+	// fp (fp_len 48 for a whole fingerprint).  *rec_r gets the first
+	// one.  Returns the number of matches, so a short prefix that is
+	// not unique can be refused.
+	unsigned int lo = 0, hi = kr->hdr->nkeys, mid, n;
+
+	*rec_r = NULL;
+	if(fp_len == 0 || fp_len > NM_KEYRING_FP_LEN)
+		return 0;
+	while(lo < hi){
+		mid = lo + (hi - lo) / 2;
+		if(memcmp(kr->recs[mid].fingerprint, fp, fp_len) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for(n = 0; lo + n < kr->hdr->nkeys
+	  && !memcmp(kr->recs[lo + n].fingerprint, fp, fp_len); n++)
+		;
+	if(n)
+		*rec_r = &kr->recs[lo];
+	return n;
+}
+
+static int live(const struct nm_keyring_rec_t *rec, char key_function,
+  unsigned int today){
+	return (key_function == 0 || rec->key_function == key_function)
+		&& (rec->expire == 0 || rec->expire >= today);
+}
+
+int nm_keyring_find_id(const struct nm_keyring_t *kr, const char *id,
+  char key_function, unsigned int today, const struct nm_keyring_rec_t **rec_r){
+	// The newest key for a Natural-Message-ID that has not expired by
+	// today (YYYYMMDD, 0 to take expired keys too) and has the given
+	// Key-Function ('s', 'e', or 0 for either).  Returns 1 if found.
+	unsigned int lo = 0, hi = kr->hdr->nkeys, mid;
+	const struct nm_keyring_rec_t *rec;
+
+	*rec_r = NULL;
+	while(lo < hi){
+		mid = lo + (hi - lo) / 2;
+		if(strcmp(kr->recs[kr->by_id[mid]].id, id) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	// Newest first within an ID.
+	for(; lo < kr->hdr->nkeys; lo++){
+		rec = &kr->recs[kr->by_id[lo]];
+		if(strcmp(rec->id, id))
+			break;
+		if(live(rec, key_function, today)){
+			*rec_r = rec;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int nm_keyring_find_ip(const struct nm_keyring_t *kr, const char *ip,
+  char key_function, unsigned int today, const struct nm_keyring_rec_t **rec_r){
+	// As nm_keyring_find_id(), for a key that lists ip as its IPV4,
+	// IPV6 or Alternative-IPV4 address, whichever ID it has.
+	unsigned int lo = 0, hi = kr->hdr->nips, mid;
+	const struct nm_keyring_rec_t *rec;
+
+	*rec_r = NULL;
+	while(lo < hi){
+		mid = lo + (hi - lo) / 2;
+		if(strcmp(kr->by_ip[mid].ip, ip) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for(; lo < kr->hdr->nips && !strcmp(kr->by_ip[lo].ip, ip); lo++){
+		rec = &kr->recs[kr->by_ip[lo].rec];
+		if(live(rec, key_function, today)){
+			*rec_r = rec;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int nm_keyring_lookup(const struct nm_keyring_t *kr, const char *spec,
+  char key_function, const struct nm_keyring_rec_t **rec_r){
+	// Resolve a key named on a command line:
+	//   id:<Natural-Message-ID>   newest unexpired key for the ID
+	//   ip:<address>              newest unexpired key for the address
+	//   fp:<hex>                  the key whose fingerprint starts
+	//                             with hex (at least 8 digits)
+	// key_function is as for nm_keyring_find_id() and does not apply
+	// to fp:.
+	//
+	// Returns 0, 972 (no such key), 973 (the fingerprint prefix is
+	// not unique) or 975 (bad spec).
+	unsigned char fp[NM_KEYRING_FP_LEN];
+	size_t len;
+	size_t j;
+	int c, n;
+
+	*rec_r = NULL;
+	if(!strncmp(spec, "id:", 3))
+		return nm_keyring_find_id(kr, spec + 3, key_function,
+			nm_keyring_today(), rec_r) ? 0 : 972;
+	if(!strncmp(spec, "ip:", 3))
+		return nm_keyring_find_ip(kr, spec + 3, key_function,
+			nm_keyring_today(), rec_r) ? 0 : 972;
+	if(strncmp(spec, "fp:", 3))
+		return 975;
+	spec += 3;
+	len = strlen(spec);
+	if(len < 8 || len % 2 || len > 2 * NM_KEYRING_FP_LEN)
+		return 975;
+	for(j = 0; j < len; j++){
+		c = spec[j];
+		c = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10
+			: c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+		if(c < 0)
+			return 975;
+		if(j % 2)
+			fp[j / 2] |= c;
+		else
+			fp[j / 2] = c << 4;
+	}
+	n = nm_keyring_find_fp(kr, fp, len / 2, rec_r);
+	if(n > 1){
+		*rec_r = NULL;
+		return 973;
+	}
+	return n ? 0 : 972;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+int nm_keyring_pubkey(const struct nm_keyring_t *kr,
+  const struct nm_keyring_rec_t *rec, gcry_sexp_t *sexp_r){
+	// The (public-key ...) s-expression of a key, ready for
+	// gcry_pk_verify() or gcry_pk_encrypt().  Returns 0 or 902.
+	if(gcry_sexp_new(sexp_r, kr->base + rec->pubkey_off, rec->pubkey_len, 0))
+		return 902;
+	return 0;
+}
+
+const char *nm_keyring_text(const struct nm_keyring_t *kr,
+  const struct nm_keyring_rec_t *rec){
+	// The key file exactly as it was compiled (null-terminated).
+	return (const char *) kr->base + rec->text_off;
+}
+
+unsigned int nm_keyring_today(void){
+	// Today (UTC) as YYYYMMDD, for comparing with Expire-Date-YYYYMMDD.
+	time_t now = time(NULL);
+	struct tm tm;
+
+	gmtime_r(&now, &tm);
+	return (tm.tm_year + 1900) * 10000 + (tm.tm_mon + 1) * 100 + tm.tm_mday;
+}
+
+int nm_keyring_args(int *argc, char **argv, const char **fname_r){
+	// For tools with positional arguments: take --keyring=<file> out
+	// of argv (updating *argc).  Returns 1 if it was given.
+	int j, k;
+
+	*fname_r = NULL;
+	for(j = 1; j < *argc; ){
+		if(strncmp(argv[j], "--keyring=", 10)){
+			j++;
+			continue;
+		}
+		*fname_r = argv[j] + 10;
+		for(k = j; k < *argc - 1; k++)
+			argv[k] = argv[k + 1];
+		argv[--(*argc)] = NULL;
+	}
+	return *fname_r != NULL;
+}
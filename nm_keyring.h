@@ -0,0 +1,84 @@
+// nm_keyring.h
+//
+// Binary keyring: a directory of Natural Message public key files
+// compiled into one mmap-able, sorted index.  See nm_keyring.c, and
+// nm_keyring_main.c for the nm_keyring tool.
+
+#define NM_KEYRING_MAGIC 0x4e4d4b52494e4732ULL   // "NMKRING2"
+#define NM_KEYRING_FP_LEN 48                     // SHA-384 of the key file
+#define NM_KEYRING_ID_LEN 128
+#define NM_KEYRING_IP_LEN 48
+#define NM_KEYRING_ALGO_LEN 16
+
+// Header, at offset 0.  All offsets are from the start of the file.
+struct nm_keyring_hdr_t
+{
+	unsigned long long magic;
+	unsigned int rec_size;        // sizeof(struct nm_keyring_rec_t)
+	unsigned int nkeys;
+	unsigned int nips;
+	unsigned int pad;
+	unsigned long long created;   // unix time
+	unsigned long long rec_off;   // nkeys records, sorted by fingerprint
+	unsigned long long id_off;    // nkeys record numbers, sorted by ID
+	unsigned long long ip_off;    // nips struct nm_keyring_ip_t, sorted by IP, newest first
+	unsigned long long blob_off;  // public keys and key file text
+	unsigned long long blob_len;
+	unsigned long long file_len;
+	unsigned char pad2[48];
+};
+
+// One key.  The strings are null-terminated; a field that the key
+// file does not have, or has as NA, is empty.
+struct nm_keyring_rec_t
+{
+	unsigned char fingerprint[NM_KEYRING_FP_LEN];
+	char id[NM_KEYRING_ID_LEN];           // Natural-Message-ID
+	char ipv4[NM_KEYRING_IP_LEN];
+	char ipv6[NM_KEYRING_IP_LEN];
+	char alt_ipv4[NM_KEYRING_IP_LEN];     // Alternative-IPV4
+	char algo[NM_KEYRING_ALGO_LEN];       // "ecc" or "rsa"
+	unsigned int expire;                  // YYYYMMDD, 0 if none
+	char key_function;                    // 's', 'e', or 0
+	char pad[3];
+	// The (public-key ...) part in canonical form, ready for
+	// gcry_sexp_new(), and the whole key file (null-terminated; the
+	// key signature made by the offline key covers this text).
+	unsigned long long pubkey_off;
+	unsigned long long text_off;
+	unsigned int pubkey_len;
+	unsigned int text_len;
+};
+
+struct nm_keyring_ip_t
+{
+	char ip[NM_KEYRING_IP_LEN];
+	unsigned int rec;
+	unsigned int pad;
+};
+
+struct nm_keyring_t;
+
+int nm_keyring_build(const char *dir, const char *out_fname,
+  unsigned int *nkeys_r, int verbose);
+struct nm_keyring_t *nm_keyring_open(const char *fname, int *err_r);
+void nm_keyring_close(struct nm_keyring_t *kr);
+
+unsigned int nm_keyring_count(const struct nm_keyring_t *kr);
+const struct nm_keyring_rec_t *nm_keyring_rec(const struct nm_keyring_t *kr,
+  unsigned int j);
+int nm_keyring_find_fp(const struct nm_keyring_t *kr, const unsigned char *fp,
+  size_t fp_len, const struct nm_keyring_rec_t **rec_r);
+int nm_keyring_find_id(const struct nm_keyring_t *kr, const char *id,
+  char key_function, unsigned int today, const struct nm_keyring_rec_t **rec_r);
+int nm_keyring_find_ip(const struct nm_keyring_t *kr, const char *ip,
+  char key_function, unsigned int today, const struct nm_keyring_rec_t **rec_r);
+int nm_keyring_lookup(const struct nm_keyring_t *kr, const char *spec,
+  char key_function, const struct nm_keyring_rec_t **rec_r);
+
+int nm_keyring_pubkey(const struct nm_keyring_t *kr,
+  const struct nm_keyring_rec_t *rec, gcry_sexp_t *sexp_r);
+const char *nm_keyring_text(const struct nm_keyring_t *kr,
+  const struct nm_keyring_rec_t *rec);
+unsigned int nm_keyring_today(void);
+int nm_keyring_args(int *argc, char **argv, const char **fname_r);
@@ -0,0 +1,201 @@
+// nm_keyring_main.c
+// Purpose:
+//   1) nm_keyring --build <dir> --keyring <file>: compile the public
+//      key files in a directory into a binary keyring (see
+//      nm_keyring.c).  Private key files are skipped.
+//   2) nm_keyring --keyring <file> --list: one line per key.
+//   3) nm_keyring --keyring <file> --find <spec>: look up one key,
+//      where spec is id:<Natural-Message-ID>, fp:<hex fingerprint or
+//      prefix> or ip:<address>.  With --export, print the key file
+//      instead of the summary line, so that
+//          nm_keyring --keyring k.bin --find id:X --export > X.key
+//      gives back the original file.
+//
+#include <stddef.h>
+#include <gcrypt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+// nm_keys requires some of the things above
+#include "nm_keys.h"
+#include "nm_keyring.h"
+#include "nm_timing.h"
+#include "nm_stats.h"
+
+#include <getopt.h>
+
+int verbose_flag;
+int list_flag;
+int export_flag;
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+int usage(){
+	fprintf(stderr, "usage:\n");
+	fprintf(stderr, "nm_keyring --build <key_dir> --keyring <file> [--verbose]\n");
+	fprintf(stderr, "nm_keyring --keyring <file> --list\n");
+	fprintf(stderr, "nm_keyring --keyring <file> --find id:<ID>|fp:<hex>|ip:<addr>\n");
+	fprintf(stderr, "           [--function s|e] [--export]\n");
+	fprintf(stderr, "  --find takes the newest key that has not expired (fp: excepted)\n");
+	fprintf(stderr, "  --timings[=<file>] writes the time of each phase as JSON at exit\n");
+	return 99;
+}
+
+static void print_rec(const struct nm_keyring_rec_t *rec){
+	char hex[2 * NM_KEYRING_FP_LEN + 1];
+
+	nm_hex_encode(rec->fingerprint, NM_KEYRING_FP_LEN, hex);
+	printf("%s %c %-4s %8u %s %s %s %s\n", hex,
+		rec->key_function ? rec->key_function : '-',
+		rec->algo[0] ? rec->algo : "-", rec->expire,
+		rec->id[0] ? rec->id : "-", rec->ipv4[0] ? rec->ipv4 : "-",
+		rec->ipv6[0] ? rec->ipv6 : "-", rec->alt_ipv4[0] ? rec->alt_ipv4 : "-");
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+int main (int argc, char **argv) {
+	const char *build_dir = NULL;
+	const char *keyring_fname = NULL;
+	const char *find_spec = NULL;
+	char key_function = 0;
+	struct nm_keyring_t *kr;
+	const struct nm_keyring_rec_t *rec;
+	unsigned int nkeys, j;
+	int err_int;
+	int opt_code; //encoded value from command-line args
+
+	nm_timing_start("nm_keyring");
+	nm_stats_init("nm_keyring");
+
+	/*
+	----------------------------------------------------------------------
+															LIBGCRYPT INITIALIZATION
+	----------------------------------------------------------------------
+	*/
+	// Only public keys are handled here, so no secure memory is needed.
+	if (!gcry_check_version (GCRYPT_VERSION))
+	{
+		fputs ("libgcrypt version mismatch\n", stderr);
+		exit (2);
+	}
+	gcry_control (GCRYCTL_DISABLE_SECMEM, 0);
+	gcry_control (GCRYCTL_INITIALIZATION_FINISHED, 0);
+	/*
+	----------------------------------------------------------------------
+													END LIBGCRYPT INITIALIZATION
+	----------------------------------------------------------------------
+	*/
+
+	nm_timing_phase("args");
+	while (1){
+		static struct option long_options[] = {
+					/* These options set a flag. */
+					{"verbose", no_argument,       &verbose_flag, 1},
+					{"list",    no_argument,       &list_flag, 1},
+					{"export",  no_argument,       &export_flag, 1},
+							 {"build",    required_argument, 0, 'b'},
+							 {"keyring",  required_argument, 0, 'k'},
+							 {"find",     required_argument, 0, 'f'},
+							 {"function", required_argument, 0, 'F'},
+							 {"timings",  optional_argument, 0, 'M'},
+							 {"help",        no_argument, 0, '?'},
+							 {0, 0, 0, 0}
+		};
+		/* 'getopt_long' stores the option index here. */
+		int option_index = 0;
+		opt_code = getopt_long (argc, argv, "b:k:f:",
+										 long_options, &option_index);
+
+		/* Detect the end of the options. */
+		if (opt_code == -1)
+			break;
+
+		switch (opt_code){
+			case 0:
+				break;
+
+			case 'b':
+				// directory of key files to compile
+				build_dir = optarg;
+				break;
+
+			case 'k':
+				// the keyring file
+				keyring_fname = optarg;
+				break;
+
+			case 'f':
+				// id:, fp: or ip: lookup
+				find_spec = optarg;
+				break;
+
+			case 'F':
+				// Key-Function: s (signing) or e (encryption)
+				key_function = optarg[0];
+				break;
+
+			case 'M':
+				// JSON phase timings at exit (to stderr or a file)
+				nm_timing_enable(optarg);
+				break;
+
+			case '?':
+				/* 'getopt_long' already printed an error message. */
+				usage();
+				return 738;
+
+			default:
+				abort ();
+		}
+	}
+	if (optind < argc || !keyring_fname
+	  || (build_dir != NULL) + list_flag + (find_spec != NULL) != 1){
+		usage();
+		return 290;
+	}
+
+	if (build_dir){
+		nm_timing_phase("build");
+		err_int = nm_keyring_build(build_dir, keyring_fname, &nkeys, verbose_flag);
+		if(err_int){
+			fprintf(stderr, "Error. Could not build %s from %s (code %d).\n",
+				keyring_fname, build_dir, err_int);
+			return err_int;
+		}
+		printf("%u keys written to %s\n", nkeys, keyring_fname);
+		return 0;
+	}
+
+	nm_timing_phase("open");
+	kr = nm_keyring_open(keyring_fname, &err_int);
+	if(!kr){
+		fprintf(stderr, "Error. Could not open the keyring %s (code %d).\n",
+			keyring_fname, err_int);
+		return err_int;
+	}
+
+	nm_timing_phase("lookup");
+	if (list_flag){
+		for(j = 0; j < nm_keyring_count(kr); j++)
+			print_rec(nm_keyring_rec(kr, j));
+	}else{
+		err_int = nm_keyring_lookup(kr, find_spec, key_function, &rec);
+		if(err_int){
+			fprintf(stderr, "Error. %s: %s\n", find_spec,
+				err_int == 972 ? "no such key" : err_int == 973
+				? "more than one key has that fingerprint prefix"
+				: "use id:<ID>, fp:<hex, 8 digits or more> or ip:<address>");
+			nm_keyring_close(kr);
+			return err_int;
+		}
+		if(export_flag)
+			fputs(nm_keyring_text(kr, rec), stdout);
+		else
+			print_rec(rec);
+	}
+	nm_keyring_close(kr);
+	return 0;
+}
@@ -54,8 +54,27 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <strings.h>
 //
 #include "nm_keys.h"
+#include "nm_probes.h"
+#include "nm_stats.h"
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+// Key files are small; anything bigger is not a key.
+#define NM_KEY_FILE_MAX 65536
+
+// The canonical form of (data (flags raw) (hash sha384 <data>)) up to
+// the length of the data, for data of up to NM_SIGN_DATA_MAX bytes.
+#define NM_SIGN_DATA_HEAD "(4:data(5:flags3:raw)(4:hash6:sha384"
+#define NM_SIGN_DATA_MAX 1024
+// The canonical form of the Key-ID wrapper up to the Key-ID.
+#define NM_SIGN_KEY_ID_HEAD "(24:NaturalMessage-Signature(6:Key-ID8:"
+// Canonical signatures (and the text of nm_sign_ctx_sign_txt) that
+// are bigger than this are left to gcry_sexp_sprint().
+#define NM_SIG_CANON_MAX 4096
 
 char *get_line (char *str_ptr, size_t n, FILE *f)
 {
@@ -69,9 +88,9 @@ char *get_line (char *str_ptr, size_t n, FILE *f)
 
   if (p != NULL) {
 		// Remove all trailing whitespace.
-    size_t last = strlen (str_ptr) - 1;
-		while(isspace(str_ptr[last]))
-			str_ptr[last--] = '\0';
+    size_t last = strlen (str_ptr);
+		while(last > 0 && isspace(str_ptr[last - 1]))
+			str_ptr[--last] = '\0';
   }
   return p;
 }
@@ -96,6 +115,7 @@ int read_sexp_file(FILE *fp, gcry_sexp_t *sexp_r, char *txt,
 	int ch;
 	//int txt_len;
 
+	NM_PROBE1(read_sexp_file__entry, ascii_only);
 	idx = 0;
 	if(ascii_only){
 		while ((ch=fgetc(fp)) != EOF){  /* read/print characters including newline */
@@ -132,6 +152,7 @@ int read_sexp_file(FILE *fp, gcry_sexp_t *sexp_r, char *txt,
 		fprintf (stderr, "Error. In read_sexp_file, could not create the new s-exp : %s/%s\n",
 			gcry_strsource (err),
 			gcry_strerror (err));
+		NM_PROBE2(read_sexp_file__return, idx, 999);
 		return 999;
 	}else{
 		if(debug_lvl > 5){
@@ -144,6 +165,7 @@ int read_sexp_file(FILE *fp, gcry_sexp_t *sexp_r, char *txt,
 		gcry_sexp_dump(*(sexp_r));
 	}	
 
+	NM_PROBE2(read_sexp_file__return, idx, 0);
 	return 0;
 }
 //-------------------------------------------------------------------------------
@@ -151,3 +173,610 @@ int read_sexp_file(FILE *fp, gcry_sexp_t *sexp_r, char *txt,
 //-------------------------------------------------------------------------------
 //-------------------------------------------------------------------------------
 //-------------------------------------------------------------------------------
+void nm_wipe(void *ptr, size_t len){
+	// Overwrite a buffer that held key material.  The volatile
+	// pointer keeps the compiler from dropping the stores the
+	// way it may drop a memset() right before a free().
+	volatile unsigned char *p = ptr;
+	while (len--)
+		*p++ = 0;
+}
+
+void nm_hex_encode(const unsigned char *bin, size_t len, char *hex){
+	// Upper-case hex, the same style as the #...# blocks in the
+	// key files.  hex must have room for 2 * len + 1 chars.
+	static const char digits[] = "0123456789ABCDEF";
+	size_t j;
+	for(j = 0; j < len; j++){
+		hex[2 * j] = digits[bin[j] >> 4];
+		hex[2 * j + 1] = digits[bin[j] & 0x0f];
+	}
+	hex[2 * len] = 0x00;
+}
+
+int nm_hex_decode(const char *hex, unsigned char *bin, size_t max_len){
+	// Decode upper- or lower-case hex.  Returns the number of bytes
+	// written to bin, or -1 for an odd length, a non-hex character
+	// or more than max_len bytes.
+	size_t len = strlen(hex);
+	size_t j;
+	int hi, lo;
+
+	if(len % 2 || len / 2 > max_len)
+		return -1;
+	for(j = 0; j < len / 2; j++){
+		if(!isxdigit((unsigned char) hex[2 * j]) || !isxdigit((unsigned char) hex[2 * j + 1]))
+			return -1;
+		hi = isdigit((unsigned char) hex[2 * j]) ? hex[2 * j] - '0' : toupper(hex[2 * j]) - 'A' + 10;
+		lo = isdigit((unsigned char) hex[2 * j + 1]) ? hex[2 * j + 1] - '0' : toupper(hex[2 * j + 1]) - 'A' + 10;
+		bin[j] = (hi << 4) | lo;
+	}
+	return (int) (len / 2);
+}
+
+static int read_key_file(const char *key_fname, const char *token,
+  gcry_sexp_t *key_r, int debug_lvl){
+	// The work of nm_read_key_file().
+	//
+	// The text of the key is read into secure memory, and libgcrypt
+	// keeps an s-expression that was parsed from secure memory in
+	// secure memory too, so a private key does not leave the secmem
+	// pool.  The text copy is wiped and freed before returning.
+	//
+	// Returns 0, or 443 (open), 444 (read/parse), 445 (secmem),
+	// 901 (no such token in the file) or 985 (a token asked of an
+	// offline key set, whose first key alone is not the set).
+	gcry_sexp_t sexp_nm_key, sexp_set;
+	FILE *fp;
+	long key_len;
+	char *nm_key_txt;
+	int rslt;
+
+	*key_r = NULL;
+
+	fp = fopen(key_fname, "r");
+	if(!fp){
+		fprintf(stderr, "Error. Failed open the key file %s.\n", key_fname);
+		return 443;
+	}
+	fseek(fp, 0, SEEK_END);
+	key_len = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	if(key_len <= 0){
+		fclose(fp);
+		fprintf(stderr, "Error. The key file %s is empty.\n", key_fname);
+		return 444;
+	}
+	// calloc so the text is null-terminated for gcry_sexp_new()
+	nm_key_txt = gcry_calloc_secure(key_len + 1, 1);
+	if(!nm_key_txt){
+		fclose(fp);
+		fprintf(stderr, "Error. Could not allocate secure memory for the key.\n");
+		return 445;
+	}
+
+	rslt = read_sexp_file(fp, &sexp_nm_key, nm_key_txt, 0, debug_lvl);
+	fclose(fp);
+	nm_wipe(nm_key_txt, key_len + 1);
+	gcry_free(nm_key_txt);
+	if(rslt){
+		fprintf(stderr, "Error. Failed to import a valid key from %s.\n", key_fname);
+		return 444;
+	}
+
+	//  Extract the libgcrypt key from the NaturalMessage key.
+	if(!token){
+		*key_r = sexp_nm_key;
+		return 0;
+	}
+	sexp_set = gcry_sexp_find_token(sexp_nm_key, "NaturalMessage-Offline-Key-Set", 0);
+	if(sexp_set){
+		gcry_sexp_release(sexp_set);
+		gcry_sexp_release(sexp_nm_key);
+		fprintf(stderr, "Error. %s is an offline key set, not one key.\n", key_fname);
+		return 985;
+	}
+	*key_r = gcry_sexp_find_token(sexp_nm_key, token, 0);
+	gcry_sexp_release(sexp_nm_key);
+	if(!*key_r){
+		fprintf (stderr, "Error. Could not get the %s from the input s-expression.\n", token);
+		return 901;
+	}
+
+	if (debug_lvl > 2){
+		fprintf(stderr, "Here is the dump of the %s:\n", token);
+		gcry_sexp_dump(*key_r);
+	}
+	return 0;
+}
+
+int nm_read_key_file(const char *key_fname, const char *token,
+  gcry_sexp_t *key_r, int debug_lvl){
+	// Read a NaturalMessage key file and return only the libgcrypt
+	// part named by token ("public-key" or "private-key"), or with a
+	// NULL token the whole file (an offline key set, say).  See
+	// read_key_file() for the return codes.
+	int rslt;
+
+	NM_PROBE1(key_load__entry, key_fname);
+	rslt = read_key_file(key_fname, token, key_r, debug_lvl);
+	NM_PROBE2(key_load__return, key_fname, rslt);
+	nm_stats_secmem_sample();
+	return rslt;
+}
+
+const char *nm_enc_genkey_sexp(const char *enc_type){
+	// Return the genkey s-expression for the online encryption key
+	// type named by enc_type ("rsa" or "x25519"), or NULL if the name
+	// is not known.  A NULL or empty enc_type means the value of the
+	// NM_ENC_KEY_TYPE environment variable, and if that is not set,
+	// RSA-2048 (the original key type).
+	if(!enc_type || enc_type[0] == 0x00)
+		enc_type = getenv("NM_ENC_KEY_TYPE");
+	if(!enc_type || enc_type[0] == 0x00 || !strcasecmp(enc_type, "rsa"))
+		return NM_ENC_KEY_RSA_SEXP;
+	if(!strcasecmp(enc_type, "x25519") || !strcasecmp(enc_type, "curve25519"))
+		return NM_ENC_KEY_X25519_SEXP;
+	fprintf(stderr, "Error. Unknown encryption key type: %s "
+		"(use rsa or x25519).\n", enc_type);
+	return NULL;
+}
+
+int nm_sign_ctx_open(struct nm_sign_ctx_t *ctx, const char *prv_key_fname,
+  int debug_lvl){
+	// Read a NaturalMessage private key file and keep only the
+	// libgcrypt private-key s-expression so that the caller can
+	// sign many buffers without parsing the key file again.
+	//
+	//ctx:
+	//  The handle to fill in.  Release it with nm_sign_ctx_close().
+	//
+	//prv_key_fname:
+	//  The NaturalMessage private key file (e.g., OnlinePRVSignKey.key).
+	//
+	// The key stays in secure memory (see nm_read_key_file).  A
+	// certifying key (Key-Function c) only signs keys in a key chain,
+	// so it is refused (993): a nonce signed with it could be passed
+	// off as a link (see nm_chain.c).
+	gcry_sexp_t sexp_file, sexp_field;
+	const char *data;
+	size_t len;
+	int rslt;
+
+	ctx->has_key_id = 0;
+	ctx->sexp_prv_key = NULL;
+	rslt = nm_read_key_file(prv_key_fname, NULL, &sexp_file, debug_lvl);
+	if(rslt)
+		return rslt;
+	sexp_field = gcry_sexp_find_token(sexp_file, "Key-Function", 0);
+	data = sexp_field ? gcry_sexp_nth_data(sexp_field, 1, &len) : NULL;
+	if(data && len == 1 && data[0] == 'c'){
+		fprintf(stderr, "Error. %s is a certifying key; it only signs key chain links.\n",
+			prv_key_fname);
+		rslt = 993;
+	}
+	gcry_sexp_release(sexp_field);
+	if(!rslt){
+		ctx->sexp_prv_key = gcry_sexp_find_token(sexp_file, "private-key", 0);
+		if(!ctx->sexp_prv_key){
+			fprintf (stderr, "Error. Could not get the private-key from %s.\n",
+				prv_key_fname);
+			rslt = 901;
+		}
+	}
+	gcry_sexp_release(sexp_file);
+	return rslt;
+}
+
+int nm_sign_ctx_set_key_id(struct nm_sign_ctx_t *ctx, const char *pub_key_fname,
+  int debug_lvl){
+	// Make every signature from the handle carry the Key-ID of
+	// pub_key_fname, the public key file that goes with the private
+	// key.  A public key that does not match the private key is
+	// refused (976), so a signature can never name the wrong key.
+	gcry_sexp_t sexp_pub_key;
+	unsigned char grip_prv[20], grip_pub[20];
+	int rslt;
+
+	rslt = nm_read_key_file(pub_key_fname, "public-key", &sexp_pub_key, debug_lvl);
+	if(rslt)
+		return rslt;
+	rslt = 0;
+	if(!gcry_pk_get_keygrip(sexp_pub_key, grip_pub)
+	  || !gcry_pk_get_keygrip(ctx->sexp_prv_key, grip_prv)
+	  || memcmp(grip_pub, grip_prv, sizeof(grip_pub))){
+		fprintf(stderr, "Error. %s is not the public key of the signing key.\n",
+			pub_key_fname);
+		rslt = 976;
+	}
+	gcry_sexp_release(sexp_pub_key);
+	if(!rslt)
+		rslt = nm_key_id_file(pub_key_fname, ctx->key_id);
+	ctx->has_key_id = rslt == 0;
+	return rslt;
+}
+
+static size_t nm_canon_len(size_t n, char *out){
+	// Write "<n>:", the length prefix of canonical data, and return
+	// its length.
+	char digits[24];
+	size_t k = 0, len = 0;
+
+	do{
+		digits[k++] = '0' + n % 10;
+		n /= 10;
+	}while(n);
+	while(k)
+		out[len++] = digits[--k];
+	out[len++] = ':';
+	return len;
+}
+
+static int sig_is_token(const unsigned char *d, size_t n){
+	// A letter and then letters, digits or '-': libgcrypt prints
+	// these bare (sig-val, ecdsa, r, Key-ID).
+	size_t j;
+
+	if(n == 0 || !isalpha(d[0]))
+		return 0;
+	for(j = 1; j < n; j++)
+		if(!isalnum(d[j]) && d[j] != '-')
+			return 0;
+	return 1;
+}
+
+static int sig_is_binary(const unsigned char *d, size_t n){
+	// Data that libgcrypt prints as #hex#: it starts with a zero
+	// byte or a byte with the high bit set, or it holds a control
+	// byte that a quoted string would not escape.  Anything else
+	// might be printed as a token or a string.
+	size_t j;
+
+	if(n == 0)
+		return 0;
+	if(d[0] == 0x00 || d[0] & 0x80)
+		return 1;
+	for(j = 0; j < n; j++){
+		if(d[j] == 0x00 || strchr("\b\t\v\n\f\r", d[j]))
+			continue;
+		if(d[j] < 0x20 || (d[j] >= 0x7f && d[j] <= 0xa0))
+			return 1;
+	}
+	return 0;
+}
+
+static size_t sig_advanced(const unsigned char *canon, size_t canon_len,
+  char *txt, size_t max){
+	// Write canonical s-expression text as gcry_sexp_sprint() with
+	// GCRYSEXP_FMT_ADVANCED would: each list after the first on a new
+	// line, indented one space per level, closing parentheses on
+	// their own lines, and a newline at the end.  Returns the length,
+	// not counting the null, or 0 if txt is too small or if some data
+	// is neither a token nor plainly binary (the caller then asks
+	// libgcrypt).
+	static const char hex[] = "0123456789ABCDEF";
+	size_t i = 0, len = 0, n, j;
+	int indent = 0;
+
+	while(i < canon_len){
+		if(canon[i] == '('){
+			if(len + indent + 2 > max)
+				return 0;
+			if(indent){
+				txt[len++] = '\n';
+				memset(txt + len, ' ', indent);
+				len += indent;
+			}
+			txt[len++] = '(';
+			indent++;
+			i++;
+		}else if(canon[i] == ')'){
+			if(indent == 0 || len + indent + 2 > max)
+				return 0;
+			txt[len++] = ')';
+			indent--;
+			i++;
+			if(i < canon_len && canon[i] != '('){
+				txt[len++] = '\n';
+				memset(txt + len, ' ', indent);
+				len += indent;
+			}
+		}else{
+			for(n = 0; i < canon_len && isdigit(canon[i]) && n < canon_len; i++)
+				n = n * 10 + (canon[i] - '0');
+			if(i >= canon_len || canon[i] != ':' || n > canon_len - i - 1)
+				return 0;
+			i++;
+			if(sig_is_token(canon + i, n)){
+				if(len + n + 2 > max)
+					return 0;
+				memcpy(txt + len, canon + i, n);
+				len += n;
+			}else if(sig_is_binary(canon + i, n)){
+				if(len + 2 * n + 4 > max)
+					return 0;
+				txt[len++] = '#';
+				for(j = 0; j < n; j++){
+					txt[len++] = hex[canon[i + j] >> 4];
+					txt[len++] = hex[canon[i + j] & 0x0f];
+				}
+				txt[len++] = '#';
+			}else{
+				return 0;
+			}
+			i += n;
+			if(i < canon_len && canon[i] != ')')
+				txt[len++] = ' ';
+		}
+	}
+	if(indent != 0 || len + 2 > max)
+		return 0;
+	txt[len++] = '\n';
+	txt[len] = 0x00;
+	return len;
+}
+
+static int sign_raw(struct nm_sign_ctx_t *ctx, const char *data,
+  size_t data_len, gcry_sexp_t *sexp_sig_r){
+	// The signature without the Key-ID.  Short data (nonces) is put
+	// into the canonical form of the data layout directly, so there is
+	// no format string for gcry_sexp_build() to parse.
+	char canon[sizeof(NM_SIGN_DATA_HEAD) + 24 + NM_SIGN_DATA_MAX];
+	gcry_error_t err;
+	gcry_sexp_t sexp_input_data;
+	size_t err_offset, len;
+	unsigned long long t0;
+
+	if(data_len <= NM_SIGN_DATA_MAX){
+		len = sizeof(NM_SIGN_DATA_HEAD) - 1;
+		memcpy(canon, NM_SIGN_DATA_HEAD, len);
+		len += nm_canon_len(data_len, canon + len);
+		memcpy(canon + len, data, data_len);
+		len += data_len;
+		canon[len++] = ')';
+		canon[len++] = ')';
+		err = gcry_sexp_new(&sexp_input_data, canon, len, 0);
+	}else{
+		// %b takes the length from the caller instead of running
+		// strlen() over the data again.
+		err = gcry_sexp_build(&sexp_input_data, &err_offset,
+			"(data (flags raw) (hash sha384 %b))", (int) data_len, data);
+	}
+	if(err){
+		fprintf (stderr, "Error. formatting the input data/nonce: %s/%s\n",
+			gcry_strsource (err),
+			gcry_strerror (err));
+		return 902;
+	}
+
+	NM_PROBE1(sign__entry, data_len);
+	t0 = nm_stats_now_us();
+	err = gcry_pk_sign(sexp_sig_r, sexp_input_data, ctx->sexp_prv_key);
+	NM_PROBE2(sign__return, data_len, err);
+	nm_stats_latency(NM_HIST_SIGN, nm_stats_now_us() - t0);
+	nm_stats_add(err ? NM_STAT_SIGN_FAILS : NM_STAT_SIGNS, 1);
+	gcry_sexp_release(sexp_input_data);
+	if(err){
+		fprintf (stderr, "Error. Could not sign the data. %s/%s\n",
+			gcry_strsource (err),
+			gcry_strerror (err));
+		return 903;
+	}
+	return 0;
+}
+
+int nm_sign_ctx_sign(struct nm_sign_ctx_t *ctx, const char *data,
+  size_t data_len, gcry_sexp_t *sexp_sig_r, int debug_lvl){
+	// Sign data_len bytes at data with a handle from nm_sign_ctx_open().
+	// The data goes into the same (data (flags raw) (hash sha384 ...))
+	// layout that nm_sign has always used, so nm_verify and
+	// NMVerifyServer accept the result.  The caller releases
+	// *sexp_sig_r.
+	gcry_error_t err;
+	gcry_sexp_t sexp_wrapped;
+	size_t err_offset;
+	int rslt;
+
+	rslt = sign_raw(ctx, data, data_len, sexp_sig_r);
+	if(rslt)
+		return rslt;
+	if(ctx->has_key_id){
+		err = gcry_sexp_build(&sexp_wrapped, &err_offset,
+			"(NaturalMessage-Signature (Key-ID %b) %S)", NM_KEY_ID_LEN,
+			ctx->key_id, *sexp_sig_r);
+		gcry_sexp_release(*sexp_sig_r);
+		*sexp_sig_r = sexp_wrapped;
+		if(err){
+			fprintf (stderr, "Error. Could not add the Key-ID to the signature.\n");
+			return 902;
+		}
+	}
+	if (debug_lvl > 3){
+		fprintf(stderr, "Here is the dump of the signature:\n");
+		gcry_sexp_dump(*sexp_sig_r);
+	}
+	return 0;
+}
+
+static size_t sig_txt(const unsigned char *canon, size_t canon_len, char *txt,
+  size_t max){
+	// sig_advanced(), or libgcrypt for data that it might print as a
+	// string.
+	gcry_sexp_t sexp_tmp;
+	size_t len;
+
+	len = sig_advanced(canon, canon_len, txt, max);
+	if(len == 0 && !gcry_sexp_new(&sexp_tmp, canon, canon_len, 0)){
+		len = gcry_sexp_sprint(sexp_tmp, GCRYSEXP_FMT_ADVANCED, txt, max);
+		gcry_sexp_release(sexp_tmp);
+	}
+	return len;
+}
+
+size_t nm_sig_sprint(gcry_sexp_t sexp_sig, char *txt, size_t max){
+	// The same text as gcry_sexp_sprint(sexp_sig,
+	// GCRYSEXP_FMT_ADVANCED, txt, max), and the same length (ending
+	// with a newline, not counting the null; 0 if txt is too small),
+	// from one copy of the canonical form instead of formatting the
+	// tree.
+	unsigned char canon[NM_SIG_CANON_MAX];
+	size_t len;
+
+	len = gcry_sexp_sprint(sexp_sig, GCRYSEXP_FMT_CANON, (char *) canon, sizeof(canon));
+	if(len == 0)
+		return gcry_sexp_sprint(sexp_sig, GCRYSEXP_FMT_ADVANCED, txt, max);
+	return sig_txt(canon, len, txt, max);
+}
+
+int nm_sign_ctx_sign_txt(struct nm_sign_ctx_t *ctx, const char *data,
+  size_t data_len, char *sig_txt_r, size_t max, size_t *sig_len_r, int debug_lvl){
+	// Sign like nm_sign_ctx_sign(), but write the text of the
+	// signature into sig_txt_r (max bytes), exactly as nm_sign has
+	// always written it, without building the Key-ID wrapper: the
+	// canonical form of the signature is copied once after the
+	// canonical Key-ID wrapper and written out as in nm_sig_sprint().
+	//
+	//sig_len_r:
+	//  The length of the text, which ends with a newline, not
+	//  counting the null.
+	//
+	// Returns 0, 902 (sig_txt_r too small) or a code from signing.
+	unsigned char canon[NM_SIG_CANON_MAX];
+	gcry_sexp_t sexp_sig;
+	size_t len = 0, n;
+	int rslt;
+
+	rslt = sign_raw(ctx, data, data_len, &sexp_sig);
+	if(rslt)
+		return rslt;
+	if(ctx->has_key_id){
+		len = sizeof(NM_SIGN_KEY_ID_HEAD) - 1;
+		memcpy(canon, NM_SIGN_KEY_ID_HEAD, len);
+		memcpy(canon + len, ctx->key_id, NM_KEY_ID_LEN);
+		len += NM_KEY_ID_LEN;
+		canon[len++] = ')';
+	}
+	n = gcry_sexp_sprint(sexp_sig, GCRYSEXP_FMT_CANON, (char *) canon + len,
+		sizeof(canon) - len - 1);
+	gcry_sexp_release(sexp_sig);
+	*sig_len_r = 0;
+	if(n > 0){
+		len += n;
+		if(ctx->has_key_id)
+			canon[len++] = ')';
+		*sig_len_r = sig_txt(canon, len, sig_txt_r, max);
+	}
+	if(*sig_len_r == 0){
+		fprintf (stderr, "Error. The signature does not fit in its buffer.\n");
+		return 902;
+	}
+	if (debug_lvl > 3)
+		fprintf(stderr, "Here is the signature:\n%s", sig_txt_r);
+	return 0;
+}
+
+void nm_sign_ctx_close(struct nm_sign_ctx_t *ctx){
+	// Releasing the s-expression lets libgcrypt wipe the secure memory.
+	gcry_sexp_release(ctx->sexp_prv_key);
+	ctx->sexp_prv_key = NULL;
+}
+
+int nm_key_fingerprint_file(const char *key_fname, unsigned char *fp_bin){
+	// The 48-byte SHA-384 fingerprint of a key file, as nm_fingerprint
+	// prints it.  Returns 0, 438 (cannot open), 843 (out of memory) or
+	// 932 (not a key file: empty or too big).
+	char *txt;
+	size_t len;
+	FILE *fp;
+
+	fp = fopen(key_fname, "rb");
+	if(!fp)
+		return 438;
+	txt = malloc(NM_KEY_FILE_MAX + 1);
+	if(!txt){
+		fclose(fp);
+		return 843;
+	}
+	len = fread(txt, 1, NM_KEY_FILE_MAX + 1, fp);
+	fclose(fp);
+	if(len == 0 || len > NM_KEY_FILE_MAX){
+		free(txt);
+		return 932;
+	}
+	gcry_md_hash_buffer(GCRY_MD_SHA384, fp_bin, txt, len);
+	free(txt);
+	return 0;
+}
+
+int nm_key_id_file(const char *key_fname, unsigned char *key_id){
+	// The Key-ID of a key file: the first NM_KEY_ID_LEN bytes of its
+	// fingerprint.  Returns as nm_key_fingerprint_file().
+	unsigned char fp_bin[48];
+	int rslt;
+
+	rslt = nm_key_fingerprint_file(key_fname, fp_bin);
+	if(rslt == 0)
+		memcpy(key_id, fp_bin, NM_KEY_ID_LEN);
+	return rslt;
+}
+
+int nm_sig_key_id(gcry_sexp_t sexp_sig, unsigned char *key_id){
+	// Copy the Key-ID of a signature from nm_sign --key-id.  Returns 1,
+	// or 0 if the signature does not name its key.
+	gcry_sexp_t sexp_id;
+	const char *data;
+	size_t len;
+	int found = 0;
+
+	sexp_id = gcry_sexp_find_token(sexp_sig, "Key-ID", 0);
+	if(!sexp_id)
+		return 0;
+	data = gcry_sexp_nth_data(sexp_id, 1, &len);
+	if(data && len == NM_KEY_ID_LEN){
+		memcpy(key_id, data, NM_KEY_ID_LEN);
+		found = 1;
+	}
+	gcry_sexp_release(sexp_id);
+	return found;
+}
+
+int nm_find_key_by_id(const char *dir, const unsigned char *key_id,
+  char *fname_r, size_t fname_len){
+	// Find the key file in dir whose Key-ID is key_id, and put its
+	// path in fname_r.  Every file in dir is fingerprinted, so a big
+	// directory is better compiled with nm_keyring --build.
+	//
+	// Returns 0, 438 (cannot read dir), 972 (no such key) or 973 (two
+	// files have the Key-ID).
+	unsigned char id[NM_KEY_ID_LEN];
+	char fname[4096];
+	struct dirent *de;
+	struct stat st;
+	DIR *d;
+	int found = 0;
+
+	d = opendir(dir);
+	if(!d)
+		return 438;
+	while((de = readdir(d))){
+		if(de->d_name[0] == '.')
+			continue;
+		if(snprintf(fname, sizeof(fname), "%s/%s", dir, de->d_name)
+		  >= (int) sizeof(fname) || stat(fname, &st) || !S_ISREG(st.st_mode)
+		  || st.st_size > NM_KEY_FILE_MAX)
+			continue;
+		if(nm_key_id_file(fname, id) || memcmp(id, key_id, NM_KEY_ID_LEN))
+			continue;
+		if(found++){
+			closedir(d);
+			return 973;
+		}
+		if(strlen(fname) >= fname_len){
+			closedir(d);
+			return 438;
+		}
+		strcpy(fname_r, fname);
+	}
+	closedir(d);
+	return found ? 0 : 972;
+}
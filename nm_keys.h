@@ -20,3 +20,57 @@
 char *get_line (char *s, size_t n, FILE *f);
 int read_sexp_file(FILE *fp, gcry_sexp_t *sexp_r, char *txt, 
   int ascii_only, int debug_lvl);
+void nm_wipe(void *ptr, size_t len);
+void nm_hex_encode(const unsigned char *bin, size_t len, char *hex);
+int nm_hex_decode(const char *hex, unsigned char *bin, size_t max_len);
+int nm_read_key_file(const char *key_fname, const char *token,
+  gcry_sexp_t *key_r, int debug_lvl);
+
+// The genkey s-expressions for the online encryption key.  RSA is
+// the default; X25519 is much faster to generate and to decrypt
+// with.  nm_enc_genkey_sexp() maps "rsa" or "x25519" (or, if enc_type
+// is NULL, the NM_ENC_KEY_TYPE environment variable) to one of them.
+#define NM_ENC_KEY_RSA_SEXP "(genkey (rsa (nbits 4:2048)))"
+#define NM_ENC_KEY_X25519_SEXP \
+	"(genkey (ecc (curve Curve25519) (flags djb-tweak comp)))"
+const char *nm_enc_genkey_sexp(const char *enc_type);
+
+// Signatures can name the key that made them (nm_sign --key-id):
+//   (NaturalMessage-Signature (Key-ID #<8 bytes>#) (sig-val ...))
+// The Key-ID is the start of the fingerprint (the SHA-384 of the
+// public key file, as nm_fingerprint and nm_keyring use).  libgcrypt
+// finds the sig-val inside, so verifiers that do not know about the
+// Key-ID accept these signatures unchanged.
+#define NM_KEY_ID_LEN 8
+
+// A prepared signing handle.  The NaturalMessage private key file
+// is read, parsed and reduced to its libgcrypt "private-key" part
+// once, and then the handle can sign any number of buffers.
+// The key s-expression lives in secure memory.
+struct nm_sign_ctx_t
+{
+	gcry_sexp_t sexp_prv_key;
+	int has_key_id;               // wrap signatures with key_id
+	unsigned char key_id[NM_KEY_ID_LEN];
+};
+
+int nm_sign_ctx_open(struct nm_sign_ctx_t *ctx, const char *prv_key_fname,
+  int debug_lvl);
+int nm_sign_ctx_sign(struct nm_sign_ctx_t *ctx, const char *data,
+  size_t data_len, gcry_sexp_t *sexp_sig_r, int debug_lvl);
+// nm_sign_ctx_sign_txt() signs and writes the text of the signature
+// straight into the caller's buffer; nm_sig_sprint() writes the text
+// of a signature s-expression.  Both give the bytes that
+// gcry_sexp_sprint(GCRYSEXP_FMT_ADVANCED) gives.
+int nm_sign_ctx_sign_txt(struct nm_sign_ctx_t *ctx, const char *data,
+  size_t data_len, char *sig_txt, size_t max, size_t *sig_len_r, int debug_lvl);
+size_t nm_sig_sprint(gcry_sexp_t sexp_sig, char *txt, size_t max);
+void nm_sign_ctx_close(struct nm_sign_ctx_t *ctx);
+int nm_sign_ctx_set_key_id(struct nm_sign_ctx_t *ctx, const char *pub_key_fname,
+  int debug_lvl);
+
+int nm_key_fingerprint_file(const char *key_fname, unsigned char *fp_bin);
+int nm_key_id_file(const char *key_fname, unsigned char *key_id);
+int nm_sig_key_id(gcry_sexp_t sexp_sig, unsigned char *key_id);
+int nm_find_key_by_id(const char *dir, const unsigned char *key_id,
+  char *fname_r, size_t fname_len);
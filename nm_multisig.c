@@ -0,0 +1,377 @@
+// nm_multisig.c
+// Purpose:
+//   1) Let k of n offline keys co-sign an online key, so that one lost
+//      offline key does not compromise the servers.
+//   2) Check such a signature with the verifications spread over
+//      threads, stopping as soon as k signatures are valid or k can no
+//      longer be reached.
+//
+// The offline key set is a trusted file (its SHA-384 is what
+// NMVerifyServer's Fingerprint argument names), so the threshold is
+// the verifier's policy and not something a signature can lower:
+//   (NaturalMessage-Offline-Key-Set
+//     (Threshold "2")
+//     (NaturalMessage-Assymetric-Key ...)
+//     (NaturalMessage-Assymetric-Key ...) ...)
+//
+// Each offline key signs the online key file with nm_sign as before;
+// nm_multisig --combine collects the signatures into
+//   (NaturalMessage-Multi-Signature
+//     (Signer (Keygrip #<20 bytes>#) (sig-val ...)) ...)
+// The keygrip names the key in the set, so the verifier checks each
+// signature against one key only.  Signers that are not in the set,
+// and a second signature by the same key, do not count.
+//
+#include <stddef.h>
+#include <gcrypt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "nm_multisig.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+struct multisig_job_t
+{
+	gcry_sexp_t sig[NM_MULTISIG_MAX];
+	gcry_sexp_t pub[NM_MULTISIG_MAX];
+	gcry_sexp_t sexp_data;
+	int nwork;
+	int threshold;
+	// Taken and counted with atomics by the workers.
+	int next;
+	int nvalid;
+	int nfailed;
+	int nchecked;
+	int stop;
+};
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+static int append(char **txt, size_t *len, size_t *cap, const char *s,
+  size_t s_len){
+	// Append to a growing, null-terminated buffer.  Returns 843 if out
+	// of memory.
+	char *p;
+
+	while(*len + s_len + 1 > *cap){
+		p = realloc(*txt, *cap ? *cap * 2 : 4096);
+		if(!p)
+			return 843;
+		*txt = p;
+		*cap = *cap ? *cap * 2 : 4096;
+	}
+	memcpy(*txt + *len, s, s_len);
+	*len += s_len;
+	(*txt)[*len] = 0x00;
+	return 0;
+}
+
+static int append_sexp(char **txt, size_t *len, size_t *cap, gcry_sexp_t sexp){
+	size_t n = gcry_sexp_sprint(sexp, GCRYSEXP_FMT_ADVANCED, NULL, 0);
+	char *s = malloc(n);
+	int rc;
+
+	if(!s)
+		return 843;
+	n = gcry_sexp_sprint(sexp, GCRYSEXP_FMT_ADVANCED, s, n);
+	rc = append(txt, len, cap, s, n);
+	free(s);
+	return rc;
+}
+
+static int car_is(gcry_sexp_t sexp, const char *name){
+	size_t len;
+	const char *data = gcry_sexp_nth_data(sexp, 0, &len);
+	return data && len == strlen(name) && !memcmp(data, name, len);
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+int nm_keyset_is_set(gcry_sexp_t sexp){
+	// 1 if a key file is an offline key set rather than one key.
+	gcry_sexp_t s = gcry_sexp_find_token(sexp, "NaturalMessage-Offline-Key-Set", 0);
+	gcry_sexp_release(s);
+	return s != NULL;
+}
+
+int nm_keyset_load(gcry_sexp_t sexp_set, struct nm_keyset_t *set){
+	// Take the keys and the threshold out of a key set.  The caller
+	// releases set with nm_keyset_release().  Returns 0 or 985 (not a
+	// key set, a repeated key, or a threshold that is not 1..n).
+	gcry_sexp_t sexp_list, sexp_elem, sexp_t;
+	const char *data;
+	char num[16];
+	size_t len;
+	int j, k, n;
+
+	memset(set, 0, sizeof(*set));
+	sexp_list = gcry_sexp_find_token(sexp_set, "NaturalMessage-Offline-Key-Set", 0);
+	if(!sexp_list)
+		return 985;
+	sexp_t = gcry_sexp_find_token(sexp_list, "Threshold", 0);
+	data = sexp_t ? gcry_sexp_nth_data(sexp_t, 1, &len) : NULL;
+	if(data && len < sizeof(num)){
+		memcpy(num, data, len);
+		num[len] = 0x00;
+		set->threshold = atoi(num);
+	}
+	gcry_sexp_release(sexp_t);
+
+	n = gcry_sexp_length(sexp_list);
+	for(j = 1; j < n; j++){
+		sexp_elem = gcry_sexp_nth(sexp_list, j);
+		if(sexp_elem && car_is(sexp_elem, "NaturalMessage-Assymetric-Key")){
+			if(set->n == NM_MULTISIG_MAX){
+				// Too many keys.
+				set->n = NM_MULTISIG_MAX + 1;
+				gcry_sexp_release(sexp_elem);
+				break;
+			}
+			set->pub[set->n] = gcry_sexp_find_token(sexp_elem, "public-key", 0);
+			if(set->pub[set->n]
+			  && gcry_pk_get_keygrip(set->pub[set->n], set->grip[set->n]))
+				set->n++;
+			else
+				set->n = NM_MULTISIG_MAX + 1;
+		}
+		gcry_sexp_release(sexp_elem);
+		if(set->n > NM_MULTISIG_MAX)
+			break;
+	}
+	gcry_sexp_release(sexp_list);
+
+	for(j = 0; j < set->n && set->n <= NM_MULTISIG_MAX; j++)
+		for(k = 0; k < j; k++)
+			if(!memcmp(set->grip[j], set->grip[k], NM_MULTISIG_GRIP_LEN))
+				set->n = NM_MULTISIG_MAX + 1;
+	if(set->n > NM_MULTISIG_MAX || set->threshold < 1
+	  || set->threshold > set->n){
+		if(set->n > NM_MULTISIG_MAX)
+			set->n = NM_MULTISIG_MAX;
+		nm_keyset_release(set);
+		return 985;
+	}
+	return 0;
+}
+
+void nm_keyset_release(struct nm_keyset_t *set){
+	int j;
+	for(j = 0; j < set->n; j++)
+		gcry_sexp_release(set->pub[j]);
+	set->n = 0;
+}
+
+int nm_keyset_text(gcry_sexp_t *sexp_keys, int n, int threshold, char **txt_r){
+	// The text of a key set from n parsed public key files.  The
+	// caller frees *txt_r.  Returns 0, 843 (out of memory) or 985.
+	struct nm_keyset_t set;
+	gcry_sexp_t sexp_set;
+	char *txt = NULL;
+	size_t len = 0, cap = 0;
+	char line[64];
+	int j, rc;
+
+	*txt_r = NULL;
+	if(n < 1 || n > NM_MULTISIG_MAX || threshold < 1 || threshold > n)
+		return 985;
+	snprintf(line, sizeof(line), "(NaturalMessage-Offline-Key-Set\n (Threshold \"%d\")\n",
+		threshold);
+	rc = append(&txt, &len, &cap, line, strlen(line));
+	for(j = 0; j < n && !rc; j++){
+		sexp_set = NULL;
+		if(!car_is(sexp_keys[j], "NaturalMessage-Assymetric-Key")
+		  || (sexp_set = gcry_sexp_find_token(sexp_keys[j], "private-key", 0))){
+			gcry_sexp_release(sexp_set);
+			rc = 985;
+			break;
+		}
+		rc = append_sexp(&txt, &len, &cap, sexp_keys[j]);
+	}
+	if(!rc)
+		rc = append(&txt, &len, &cap, ")\n", 2);
+	// Read it back, so that a bad set is never written.
+	if(!rc){
+		if(gcry_sexp_new(&sexp_set, txt, 0, 1))
+			rc = 985;
+		else{
+			rc = nm_keyset_load(sexp_set, &set);
+			if(!rc && set.n != n)
+				rc = 985;
+			if(!rc)
+				nm_keyset_release(&set);
+			gcry_sexp_release(sexp_set);
+		}
+	}
+	if(rc){
+		free(txt);
+		return rc;
+	}
+	*txt_r = txt;
+	return 0;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+int nm_multisig_is_multi(gcry_sexp_t sexp){
+	// 1 if a signature is a multi-signature from nm_multisig --combine.
+	gcry_sexp_t s = gcry_sexp_find_token(sexp, "NaturalMessage-Multi-Signature", 0);
+	gcry_sexp_release(s);
+	return s != NULL;
+}
+
+int nm_multisig_combine(const struct nm_keyset_t *set, gcry_sexp_t sexp_data,
+  gcry_sexp_t *sexp_sigs, int nsigs, char **txt_r){
+	// Collect nsigs signatures of sexp_data (plain nm_sign output) by
+	// keys in set into the text of a multi-signature.  Each signature
+	// is matched to its key here, once, so that the verifier does not
+	// have to.  The caller frees *txt_r.  Returns 0, 843 (out of
+	// memory), 986 (a signature is not a signature) or 988 (a
+	// signature is not valid for any key in the set that has not
+	// already signed).
+	gcry_sexp_t sexp_sigval, sexp_signer;
+	int used[NM_MULTISIG_MAX] = {0};
+	char *txt = NULL;
+	size_t len = 0, cap = 0;
+	int j, k, rc;
+
+	*txt_r = NULL;
+	rc = append(&txt, &len, &cap, "(NaturalMessage-Multi-Signature\n", 32);
+	for(j = 0; j < nsigs && !rc; j++){
+		sexp_sigval = gcry_sexp_find_token(sexp_sigs[j], "sig-val", 0);
+		if(!sexp_sigval){
+			rc = 986;
+			break;
+		}
+		for(k = 0; k < set->n; k++)
+			if(!used[k] && !gcry_pk_verify(sexp_sigval, sexp_data, set->pub[k]))
+				break;
+		if(k == set->n){
+			gcry_sexp_release(sexp_sigval);
+			rc = 988;
+			break;
+		}
+		used[k] = 1;
+		if(gcry_sexp_build(&sexp_signer, NULL, "(Signer (Keygrip %b) %S)",
+		  NM_MULTISIG_GRIP_LEN, set->grip[k], sexp_sigval))
+			rc = 986;
+		else{
+			rc = append_sexp(&txt, &len, &cap, sexp_signer);
+			gcry_sexp_release(sexp_signer);
+		}
+		gcry_sexp_release(sexp_sigval);
+	}
+	if(!rc)
+		rc = append(&txt, &len, &cap, ")\n", 2);
+	if(rc){
+		free(txt);
+		return rc;
+	}
+	*txt_r = txt;
+	return 0;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+static void *multisig_worker(void *arg){
+	// Take signatures until there are enough valid ones, or too many
+	// bad ones for the threshold to be reached.  A verification that
+	// has started is not interrupted.
+	struct multisig_job_t *job = arg;
+	int j, ok;
+
+	while(!__atomic_load_n(&job->stop, __ATOMIC_ACQUIRE)){
+		j = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+		if(j >= job->nwork)
+			break;
+		__atomic_add_fetch(&job->nchecked, 1, __ATOMIC_RELAXED);
+		ok = !gcry_pk_verify(job->sig[j], job->sexp_data, job->pub[j]);
+		if(ok){
+			if(__atomic_add_fetch(&job->nvalid, 1, __ATOMIC_ACQ_REL) >= job->threshold)
+				__atomic_store_n(&job->stop, 1, __ATOMIC_RELEASE);
+		}else{
+			if(job->nwork - __atomic_add_fetch(&job->nfailed, 1, __ATOMIC_ACQ_REL)
+			  < job->threshold)
+				__atomic_store_n(&job->stop, 1, __ATOMIC_RELEASE);
+		}
+	}
+	return NULL;
+}
+
+int nm_multisig_verify(const struct nm_keyset_t *set, gcry_sexp_t sexp_msig,
+  gcry_sexp_t sexp_data, int nthreads, struct nm_multisig_result_t *res){
+	// Check that at least set->threshold keys of set signed
+	// sexp_data.  nthreads is the number of verifications run at once
+	// (0 for one per CPU, 1 to check one after another); it is
+	// capped at the number of signers.  res (may be NULL) gets the
+	// counts.
+	//
+	// Returns 0, 986 (not a multi-signature) or 987 (fewer than
+	// threshold valid signatures from keys in the set).
+	struct multisig_job_t job;
+	pthread_t threads[NM_MULTISIG_MAX];
+	gcry_sexp_t sexp_list, sexp_elem, sexp_grip;
+	int used[NM_MULTISIG_MAX] = {0};
+	const char *grip;
+	size_t grip_len;
+	int j, k, n, nstarted;
+
+	memset(&job, 0, sizeof(job));
+	if(res)
+		memset(res, 0, sizeof(*res));
+	sexp_list = gcry_sexp_find_token(sexp_msig, "NaturalMessage-Multi-Signature", 0);
+	if(!sexp_list)
+		return 986;
+	n = gcry_sexp_length(sexp_list);
+	for(j = 1; j < n && job.nwork < set->n; j++){
+		sexp_elem = gcry_sexp_nth(sexp_list, j);
+		if(!sexp_elem || !car_is(sexp_elem, "Signer")){
+			gcry_sexp_release(sexp_elem);
+			continue;
+		}
+		sexp_grip = gcry_sexp_find_token(sexp_elem, "Keygrip", 0);
+		grip = sexp_grip ? gcry_sexp_nth_data(sexp_grip, 1, &grip_len) : NULL;
+		for(k = 0; grip && grip_len == NM_MULTISIG_GRIP_LEN && k < set->n; k++)
+			if(!used[k] && !memcmp(grip, set->grip[k], NM_MULTISIG_GRIP_LEN))
+				break;
+		if(grip && grip_len == NM_MULTISIG_GRIP_LEN && k < set->n){
+			job.sig[job.nwork] = gcry_sexp_find_token(sexp_elem, "sig-val", 0);
+			if(job.sig[job.nwork]){
+				job.pub[job.nwork++] = set->pub[k];
+				used[k] = 1;
+			}
+		}
+		gcry_sexp_release(sexp_grip);
+		gcry_sexp_release(sexp_elem);
+	}
+	gcry_sexp_release(sexp_list);
+
+	job.sexp_data = sexp_data;
+	job.threshold = set->threshold;
+	if(job.nwork >= job.threshold){
+		if(nthreads <= 0)
+			nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+		if(nthreads > job.nwork)
+			nthreads = job.nwork;
+		if(nthreads < 1)
+			nthreads = 1;
+		// This thread is one of the workers.
+		nstarted = 0;
+		for(j = 1; j < nthreads; j++)
+			if(!pthread_create(&threads[nstarted], NULL, multisig_worker, &job))
+				nstarted++;
+		multisig_worker(&job);
+		for(j = 0; j < nstarted; j++)
+			pthread_join(threads[j], NULL);
+	}
+	for(j = 0; j < job.nwork; j++)
+		gcry_sexp_release(job.sig[j]);
+	if(res){
+		res->nvalid = job.nvalid;
+		res->nchecked = job.nchecked;
+		res->nsigners = job.nwork;
+	}
+	return job.nvalid >= job.threshold ? 0 : 987;
+}
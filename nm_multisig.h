@@ -0,0 +1,35 @@
+// nm_multisig.h
+//
+// k-of-n co-signing of online keys by offline keys.  See nm_multisig.c,
+// and nm_multisig_main.c for the nm_multisig tool.
+
+#define NM_MULTISIG_MAX 16
+#define NM_MULTISIG_GRIP_LEN 20     // gcry_pk_get_keygrip()
+
+// The offline keys and how many of them must sign, from a
+// (NaturalMessage-Offline-Key-Set ...) file.
+struct nm_keyset_t
+{
+	int threshold;
+	int n;
+	gcry_sexp_t pub[NM_MULTISIG_MAX];
+	unsigned char grip[NM_MULTISIG_MAX][NM_MULTISIG_GRIP_LEN];
+};
+
+struct nm_multisig_result_t
+{
+	int nvalid;      // signatures that verified
+	int nchecked;    // gcry_pk_verify() calls made
+	int nsigners;    // signers in the multi-signature that are in the set
+};
+
+int nm_keyset_is_set(gcry_sexp_t sexp);
+int nm_keyset_load(gcry_sexp_t sexp_set, struct nm_keyset_t *set);
+void nm_keyset_release(struct nm_keyset_t *set);
+int nm_keyset_text(gcry_sexp_t *sexp_keys, int n, int threshold, char **txt_r);
+
+int nm_multisig_is_multi(gcry_sexp_t sexp);
+int nm_multisig_combine(const struct nm_keyset_t *set, gcry_sexp_t sexp_data,
+  gcry_sexp_t *sexp_sigs, int nsigs, char **txt_r);
+int nm_multisig_verify(const struct nm_keyset_t *set, gcry_sexp_t sexp_msig,
+  gcry_sexp_t sexp_data, int nthreads, struct nm_multisig_result_t *res);
@@ -0,0 +1,328 @@
+// nm_multisig_main.c
+// Purpose:
+//   1) nm_multisig --make-set --threshold <k> --key <pub> --key <pub> ...
+//      --out <set>: write an offline key set that needs k of the keys
+//      (see nm_multisig.c).
+//   2) nm_multisig --combine --key-set <set> --in <online_key>
+//      --out <keysig> <sig> <sig> ...: collect the nm_sign signatures
+//      that the offline keys made of the online key file into one
+//      multi-signature, for NMVerifyServer.
+//   3) nm_multisig --verify --key-set <set> --in <online_key>
+//      --signature <keysig> [--threads <n>]: check a multi-signature
+//      the way NMVerifyServer does.
+//
+#include <stddef.h>
+#include <gcrypt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "nm_multisig.h"
+#include "nm_timing.h"
+#include "nm_stats.h"
+
+#include <getopt.h>
+
+// A key set of NM_MULTISIG_MAX RSA keys is still far below this.
+#define NM_MULTISIG_FILE_MAX (1024 * 1024)
+
+int make_set_flag;
+int combine_flag;
+int verify_flag;
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+int usage(){
+	fprintf(stderr, "usage:\n");
+	fprintf(stderr, "nm_multisig --make-set --threshold <k> --key <offline_public_key>\n");
+	fprintf(stderr, "            [--key <offline_public_key> ...] --out <key_set>\n");
+	fprintf(stderr, "nm_multisig --combine --key-set <key_set> --in <online_public_key>\n");
+	fprintf(stderr, "            --out <keysig> <sig> [<sig> ...]\n");
+	fprintf(stderr, "nm_multisig --verify --key-set <key_set> --in <online_public_key>\n");
+	fprintf(stderr, "            --signature <keysig> [--threads <n>]\n");
+	fprintf(stderr, "  each <sig> is nm_sign --in <online_public_key> by one offline key\n");
+	fprintf(stderr, "  --timings[=<file>] writes the time of each phase as JSON at exit\n");
+	return 99;
+}
+
+static char *read_file(const char *fname, size_t *len_r){
+	// The whole file, null-terminated, or NULL.
+	char *txt;
+	FILE *fp;
+
+	fp = fopen(fname, "rb");
+	if(!fp)
+		return NULL;
+	txt = malloc(NM_MULTISIG_FILE_MAX + 1);
+	if(txt){
+		*len_r = fread(txt, 1, NM_MULTISIG_FILE_MAX + 1, fp);
+		if(*len_r == 0 || *len_r > NM_MULTISIG_FILE_MAX){
+			free(txt);
+			txt = NULL;
+		}else{
+			txt[*len_r] = 0x00;
+		}
+	}
+	fclose(fp);
+	return txt;
+}
+
+static int read_sexp(const char *fname, gcry_sexp_t *sexp_r){
+	// Parse a key or signature file.  Returns 0, 438 or 902.
+	char *txt;
+	size_t len;
+	int rc;
+
+	txt = read_file(fname, &len);
+	if(!txt){
+		fprintf(stderr, "Error. Could not read %s.\n", fname);
+		return 438;
+	}
+	rc = gcry_sexp_new(sexp_r, txt, len, 1) ? 902 : 0;
+	if(rc)
+		fprintf(stderr, "Error. %s is not an s-expression.\n", fname);
+	free(txt);
+	return rc;
+}
+
+static int write_text(const char *fname, const char *txt){
+	FILE *fp = fopen(fname, "w");
+	if(!fp || fputs(txt, fp) == EOF || fclose(fp)){
+		fprintf(stderr, "Error. Could not write %s.\n", fname);
+		return 439;
+	}
+	return 0;
+}
+
+static int read_data(const char *fname, gcry_sexp_t *sexp_r){
+	// The signed data: the online key file, in the same layout as
+	// NMVerifyServer Part VI-B.
+	char *txt;
+	size_t len;
+	int rc;
+
+	txt = read_file(fname, &len);
+	if(!txt){
+		fprintf(stderr, "Error. Could not read %s.\n", fname);
+		return 438;
+	}
+	rc = gcry_sexp_build(sexp_r, NULL, "(data (flags raw) (hash sha384 %b))",
+		(int) len, txt) ? 902 : 0;
+	free(txt);
+	return rc;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+int main (int argc, char **argv) {
+	const char *key_fname[NM_MULTISIG_MAX];
+	const char *key_set_fname = NULL;
+	const char *in_fname = NULL;
+	const char *out_fname = NULL;
+	const char *sig_fname = NULL;
+	gcry_sexp_t sexp_keys[NM_MULTISIG_MAX];
+	gcry_sexp_t sexp_sigs[NM_MULTISIG_MAX];
+	gcry_sexp_t sexp_set, sexp_data, sexp_msig;
+	struct nm_keyset_t set;
+	struct nm_multisig_result_t res;
+	char *txt;
+	int nkeys = 0;
+	int threshold = 0;
+	int nthreads = 0;
+	int nsigs, j;
+	int err_int;
+	int opt_code; //encoded value from command-line args
+
+	nm_timing_start("nm_multisig");
+	nm_stats_init("nm_multisig");
+
+	/*
+	----------------------------------------------------------------------
+															LIBGCRYPT INITIALIZATION
+	----------------------------------------------------------------------
+	*/
+	// Only public keys are handled here, so no secure memory is needed.
+	if (!gcry_check_version (GCRYPT_VERSION))
+	{
+		fputs ("libgcrypt version mismatch\n", stderr);
+		exit (2);
+	}
+	gcry_control (GCRYCTL_DISABLE_SECMEM, 0);
+	gcry_control (GCRYCTL_INITIALIZATION_FINISHED, 0);
+	/*
+	----------------------------------------------------------------------
+													END LIBGCRYPT INITIALIZATION
+	----------------------------------------------------------------------
+	*/
+
+	nm_timing_phase("args");
+	while (1){
+		static struct option long_options[] = {
+					/* These options set a flag. */
+					{"make-set", no_argument,      &make_set_flag, 1},
+					{"combine",  no_argument,      &combine_flag, 1},
+					{"verify",   no_argument,      &verify_flag, 1},
+							 {"threshold", required_argument, 0, 't'},
+							 {"key",       required_argument, 0, 'k'},
+							 {"key-set",   required_argument, 0, 'K'},
+							 {"in",        required_argument, 0, 'i'},
+							 {"out",       required_argument, 0, 'o'},
+							 {"signature", required_argument, 0, 's'},
+							 {"threads",   required_argument, 0, 'T'},
+							 {"timings",   optional_argument, 0, 'M'},
+							 {"help",        no_argument, 0, '?'},
+							 {0, 0, 0, 0}
+		};
+		/* 'getopt_long' stores the option index here. */
+		int option_index = 0;
+		opt_code = getopt_long (argc, argv, "t:k:i:o:s:",
+										 long_options, &option_index);
+
+		/* Detect the end of the options. */
+		if (opt_code == -1)
+			break;
+
+		switch (opt_code){
+			case 0:
+				break;
+
+			case 't':
+				// how many of the keys must sign
+				threshold = atoi(optarg);
+				break;
+
+			case 'k':
+				// one offline public key for --make-set
+				if(nkeys == NM_MULTISIG_MAX){
+					fprintf(stderr, "Error. At most %d keys.\n", NM_MULTISIG_MAX);
+					return 985;
+				}
+				key_fname[nkeys++] = optarg;
+				break;
+
+			case 'K':
+				// key set from --make-set
+				key_set_fname = optarg;
+				break;
+
+			case 'i':
+				// the online key file that the offline keys signed
+				in_fname = optarg;
+				break;
+
+			case 'o':
+				// output file
+				out_fname = optarg;
+				break;
+
+			case 's':
+				// multi-signature for --verify
+				sig_fname = optarg;
+				break;
+
+			case 'T':
+				// verifications at once (0 = one per CPU)
+				nthreads = atoi(optarg);
+				break;
+
+			case 'M':
+				// JSON phase timings at exit (to stderr or a file)
+				nm_timing_enable(optarg);
+				break;
+
+			case '?':
+				/* 'getopt_long' already printed an error message. */
+				usage();
+				return 738;
+
+			default:
+				abort ();
+		}
+	}
+	nsigs = argc - optind;
+	if (make_set_flag + combine_flag + verify_flag != 1
+	  || (make_set_flag && (nkeys == 0 || !out_fname || nsigs))
+	  || (combine_flag && (!key_set_fname || !in_fname || !out_fname || nsigs < 1))
+	  || (verify_flag && (!key_set_fname || !in_fname || !sig_fname || nsigs))){
+		usage();
+		return 290;
+	}
+	if (nsigs > NM_MULTISIG_MAX){
+		fprintf(stderr, "Error. At most %d signatures.\n", NM_MULTISIG_MAX);
+		return 986;
+	}
+
+	if (make_set_flag){
+		nm_timing_phase("make_set");
+		for(j = 0; j < nkeys; j++){
+			err_int = read_sexp(key_fname[j], &sexp_keys[j]);
+			if(err_int)
+				return err_int;
+		}
+		err_int = nm_keyset_text(sexp_keys, nkeys, threshold, &txt);
+		for(j = 0; j < nkeys; j++)
+			gcry_sexp_release(sexp_keys[j]);
+		if(err_int){
+			fprintf(stderr, "Error. The keys do not make a key set: they must be\n"
+				"different public keys, and --threshold must be 1 to %d.\n", nkeys);
+			return err_int;
+		}
+		err_int = write_text(out_fname, txt);
+		free(txt);
+		if(!err_int)
+			printf("%d-of-%d key set written to %s\n", threshold, nkeys, out_fname);
+		return err_int;
+	}
+
+	nm_timing_phase("load");
+	err_int = read_sexp(key_set_fname, &sexp_set);
+	if(err_int)
+		return err_int;
+	err_int = nm_keyset_load(sexp_set, &set);
+	gcry_sexp_release(sexp_set);
+	if(err_int){
+		fprintf(stderr, "Error. %s is not a key set.\n", key_set_fname);
+		return err_int;
+	}
+	err_int = read_data(in_fname, &sexp_data);
+	if(err_int)
+		return err_int;
+
+	if (combine_flag){
+		nm_timing_phase("combine");
+		for(j = 0; j < nsigs; j++){
+			err_int = read_sexp(argv[optind + j], &sexp_sigs[j]);
+			if(err_int)
+				return err_int;
+		}
+		err_int = nm_multisig_combine(&set, sexp_data, sexp_sigs, nsigs, &txt);
+		for(j = 0; j < nsigs; j++)
+			gcry_sexp_release(sexp_sigs[j]);
+		if(err_int){
+			fprintf(stderr, "Error. A signature is not a valid signature of %s\n"
+				"by a key in %s (or two are by the same key).\n", in_fname,
+				key_set_fname);
+			return err_int;
+		}
+		if(nsigs < set.threshold)
+			fprintf(stderr, "Warning. %d signatures, but the key set needs %d.\n",
+				nsigs, set.threshold);
+		err_int = write_text(out_fname, txt);
+		free(txt);
+		return err_int;
+	}
+
+	nm_timing_phase("verify");
+	err_int = read_sexp(sig_fname, &sexp_msig);
+	if(err_int)
+		return err_int;
+	err_int = nm_multisig_verify(&set, sexp_msig, sexp_data, nthreads, &res);
+	nm_stats_add(err_int ? NM_STAT_VERIFY_FAILS : NM_STAT_VERIFY_OK, 1);
+	printf("%d of %d signatures valid (%d needed, %d checked): %s\n", res.nvalid,
+		res.nsigners, set.threshold, res.nchecked,
+		err_int ? "not confirmed" : "confirmed");
+	gcry_sexp_release(sexp_msig);
+	gcry_sexp_release(sexp_data);
+	nm_keyset_release(&set);
+	return err_int;
+}
@@ -0,0 +1,168 @@
+// nm_precheck.c
+// Purpose:
+//   1) Reject a request that cannot verify before spending a
+//      public-key operation on it.  Each stage costs a parse, a
+//      comparison or a hash:
+//        structure   the signature has a sig-val of the key's kind
+//        siglen      every value in the sig-val fits the key size
+//        expiry      the key's Expire-Date-YYYYMMDD is not past
+//        pin         the SHA-384 of the offline key file is the
+//                    Fingerprint the caller trusts (compared in
+//                    constant time)
+//        revocation  (nm_revoke_check, in the caller)
+//   2) Count the rejections of each stage in the shared statistics,
+//      so that nm_stat shows what is being turned away.
+//
+#include <stddef.h>
+#include <gcrypt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "nm_precheck.h"
+#include "nm_chain.h"
+#include "nm_stats.h"
+
+static const char *stage_names[NM_PRECHECK_NSTAGES] = {
+	"ok", "structure", "siglen", "expired", "pin", "revoked"};
+
+// The exit code of each stage, as the rest of NMVerifyServer uses.
+static const int stage_codes[NM_PRECHECK_NSTAGES] = {
+	0, 995, 996, 992, 997, 982};
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+static int car_is(gcry_sexp_t sexp, const char *name){
+	size_t len;
+	const char *data = sexp ? gcry_sexp_nth_data(sexp, 0, &len) : NULL;
+	return data && len == strlen(name) && !memcmp(data, name, len);
+}
+
+static gcry_sexp_t algo_list(gcry_sexp_t sexp){
+	// The (<algo> ...) inside (sig-val ...) or (public-key ...),
+	// skipping (flags ...) and (hash-algo ...).
+	gcry_sexp_t sexp_elem;
+	int j, n;
+
+	n = gcry_sexp_length(sexp);
+	for(j = 1; j < n; j++){
+		sexp_elem = gcry_sexp_nth(sexp, j);
+		if(sexp_elem && !car_is(sexp_elem, "flags") && !car_is(sexp_elem, "hash-algo"))
+			return sexp_elem;
+		gcry_sexp_release(sexp_elem);
+	}
+	return NULL;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+int nm_precheck_sig(gcry_sexp_t sexp_sig, gcry_sexp_t sexp_pub_key){
+	// Structure and size of a signature that sexp_pub_key (a
+	// (public-key ...) s-expression) is to check.  Returns
+	// NM_PRECHECK_OK, NM_PRECHECK_STRUCTURE or NM_PRECHECK_SIGLEN.
+	gcry_sexp_t sexp_sigval, sexp_algo = NULL, sexp_key_algo = NULL, sexp_elem;
+	const char *data;
+	size_t len, max_len;
+	unsigned int nbits;
+	int j, n, nvalues = 0, stage = NM_PRECHECK_OK;
+
+	sexp_sigval = gcry_sexp_find_token(sexp_sig, "sig-val", 0);
+	nbits = sexp_pub_key ? gcry_pk_get_nbits(sexp_pub_key) : 0;
+	if(sexp_sigval && nbits){
+		sexp_algo = algo_list(sexp_sigval);
+		sexp_key_algo = algo_list(sexp_pub_key);
+	}
+	// An RSA signature for an ECC key, or the other way round.
+	if(!sexp_algo || !sexp_key_algo
+	  || car_is(sexp_algo, "rsa") != car_is(sexp_key_algo, "rsa"))
+		stage = NM_PRECHECK_STRUCTURE;
+
+	// Every value is an integer mod something no larger than the key
+	// (an MPI may carry one leading zero byte).
+	max_len = (nbits + 7) / 8 + 1;
+	n = stage ? 0 : gcry_sexp_length(sexp_algo);
+	for(j = 1; j < n && !stage; j++){
+		sexp_elem = gcry_sexp_nth(sexp_algo, j);
+		data = sexp_elem ? gcry_sexp_nth_data(sexp_elem, 1, &len) : NULL;
+		if(!data)
+			stage = NM_PRECHECK_STRUCTURE;
+		else if(len == 0 || len > max_len)
+			stage = NM_PRECHECK_SIGLEN;
+		else
+			nvalues++;
+		gcry_sexp_release(sexp_elem);
+	}
+	if(!stage && nvalues == 0)
+		stage = NM_PRECHECK_STRUCTURE;
+
+	gcry_sexp_release(sexp_key_algo);
+	gcry_sexp_release(sexp_algo);
+	gcry_sexp_release(sexp_sigval);
+	return stage;
+}
+
+int nm_precheck_expiry(gcry_sexp_t sexp_key_file, unsigned int today){
+	// A NaturalMessage key file on day today (YYYYMMDD).  A key with
+	// no Expire-Date-YYYYMMDD does not expire; one whose date is not
+	// eight digits has expired (see nm_chain_key_expire()).  Returns
+	// NM_PRECHECK_OK or NM_PRECHECK_EXPIRED.
+	unsigned int expire = nm_chain_key_expire(sexp_key_file);
+	return expire && expire < today ? NM_PRECHECK_EXPIRED : NM_PRECHECK_OK;
+}
+
+int nm_precheck_ct_equal(const unsigned char *a, const unsigned char *b, size_t len){
+	// 1 if the len bytes at a and b are the same, in a time that
+	// does not depend on where they differ.
+	unsigned char diff = 0;
+	size_t j;
+
+	for(j = 0; j < len; j++)
+		diff |= a[j] ^ b[j];
+	return diff == 0;
+}
+
+int nm_precheck_pin_fp(const unsigned char *fp, const char *fp_hex){
+	// A fingerprint already computed (NM_PRECHECK_FP_LEN bytes)
+	// against fp_hex (96 hex digits, as nm_fingerprint prints them,
+	// in either case).  Returns NM_PRECHECK_OK or NM_PRECHECK_PIN.
+	unsigned char pin[NM_PRECHECK_FP_LEN];
+	int j, hi, lo, bad = 0;
+
+	if(!fp_hex || strlen(fp_hex) != 2 * NM_PRECHECK_FP_LEN)
+		return NM_PRECHECK_PIN;
+	for(j = 0; j < NM_PRECHECK_FP_LEN; j++){
+		hi = (unsigned char) fp_hex[2 * j];
+		lo = (unsigned char) fp_hex[2 * j + 1];
+		bad |= !isxdigit(hi) || !isxdigit(lo);
+		hi = isdigit(hi) ? hi - '0' : toupper(hi) - 'A' + 10;
+		lo = isdigit(lo) ? lo - '0' : toupper(lo) - 'A' + 10;
+		pin[j] = (hi << 4) | lo;
+	}
+	return !bad && nm_precheck_ct_equal(fp, pin, NM_PRECHECK_FP_LEN)
+		? NM_PRECHECK_OK : NM_PRECHECK_PIN;
+}
+
+int nm_precheck_pin(const char *key_txt, size_t key_len, const char *fp_hex){
+	// The SHA-384 of the key file text against fp_hex (see
+	// nm_precheck_pin_fp).  Returns NM_PRECHECK_OK or NM_PRECHECK_PIN.
+	unsigned char fp[NM_PRECHECK_FP_LEN];
+
+	gcry_md_hash_buffer(GCRY_MD_SHA384, fp, key_txt, key_len);
+	return nm_precheck_pin_fp(fp, fp_hex);
+}
+
+int nm_precheck_reject(int stage){
+	// Count a rejection by stage.  Returns the exit code for it (0
+	// for NM_PRECHECK_OK).
+	if(stage <= NM_PRECHECK_OK || stage >= NM_PRECHECK_NSTAGES)
+		return 0;
+	nm_stats_add(NM_STAT_REJECT_STRUCTURE + stage - NM_PRECHECK_STRUCTURE, 1);
+	return stage_codes[stage];
+}
+
+const char *nm_precheck_stage_name(int stage){
+	if(stage < 0 || stage >= NM_PRECHECK_NSTAGES)
+		return "?";
+	return stage_names[stage];
+}
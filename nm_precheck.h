@@ -0,0 +1,27 @@
+// nm_precheck.h
+//
+// The checks that cost no public-key operation, run before any
+// gcry_pk_verify() so that a doomed request is rejected cheaply.  See
+// nm_precheck.c.
+
+// The stages, in the order NMVerifyServer runs them.
+enum nm_precheck_stage_t
+{
+	NM_PRECHECK_OK = 0,
+	NM_PRECHECK_STRUCTURE,    // an input is not the s-expression it should be
+	NM_PRECHECK_SIGLEN,       // a signature value cannot come from the key
+	NM_PRECHECK_EXPIRED,      // a key is past its Expire-Date-YYYYMMDD
+	NM_PRECHECK_PIN,          // the offline key is not the one pinned
+	NM_PRECHECK_REVOKED,      // a key is on the revocation list
+	NM_PRECHECK_NSTAGES
+};
+
+#define NM_PRECHECK_FP_LEN 48     // SHA-384
+
+int nm_precheck_sig(gcry_sexp_t sexp_sig, gcry_sexp_t sexp_pub_key);
+int nm_precheck_expiry(gcry_sexp_t sexp_key_file, unsigned int today);
+int nm_precheck_pin(const char *key_txt, size_t key_len, const char *fp_hex);
+int nm_precheck_pin_fp(const unsigned char *fp, const char *fp_hex);
+int nm_precheck_ct_equal(const unsigned char *a, const unsigned char *b, size_t len);
+int nm_precheck_reject(int stage);
+const char *nm_precheck_stage_name(int stage);
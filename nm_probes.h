@@ -0,0 +1,56 @@
+// nm_probes.h
+//
+// USDT (SDT) static tracepoints for perf, bpftrace and systemtap.
+// The provider name is "natmsg".  List the probes in a binary with
+//    perf list sdt  (after: perf buildid-cache --add ./nm_sign)
+//    bpftrace -l 'usdt:./nm_sign:*'
+// and, for example, get a histogram of signing time with
+//    bpftrace -e 'usdt:./nm_sign:natmsg:sign__entry { @t[tid] = nsecs; }
+//      usdt:./nm_sign:natmsg:sign__return { @us = hist((nsecs - @t[tid]) / 1000); }'
+//
+// A probe that is not being traced is a single nop in the code and
+// a note in the ELF file; the arguments are only read by the tracer.
+// If <sys/sdt.h> (systemtap-sdt-dev, or devel/systemtap on FreeBSD
+// ports) is not installed, or NM_NO_PROBES is defined, the probes
+// compile to nothing.
+//
+// Probes and their arguments:
+//   read_sexp_file__entry   (ascii_only)
+//   read_sexp_file__return  (bytes_read, rslt)
+//   key_load__entry         (key_fname)
+//   key_load__return        (key_fname, rslt)
+//   file_load__entry        (fname)
+//   file_load__return       (fname, bytes, rslt)
+//   keygen__entry           (genkey_sexp_txt)
+//   keygen__return          (genkey_sexp_txt, rslt)
+//   sign__entry             (data_len)
+//   sign__return            (data_len, gcry_err)
+//   verify__entry           (site, data_len)
+//   verify__return          (site, data_len, gcry_err)
+// site is one of the NM_PROBE_SITE_* values below.
+
+#if !defined(NM_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define NM_HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef NM_HAVE_PROBES
+#define NM_PROBE1(name, a) DTRACE_PROBE1(natmsg, name, a)
+#define NM_PROBE2(name, a, b) DTRACE_PROBE2(natmsg, name, a, b)
+#define NM_PROBE3(name, a, b, c) DTRACE_PROBE3(natmsg, name, a, b, c)
+#else
+// sizeof() does not evaluate the arguments, but it keeps gcc from
+// warning about variables that are only set for a probe.
+#define NM_PROBE1(name, a) do { (void) sizeof(a); } while (0)
+#define NM_PROBE2(name, a, b) do { (void) sizeof(a); (void) sizeof(b); } while (0)
+#define NM_PROBE3(name, a, b, c) \
+	do { (void) sizeof(a); (void) sizeof(b); (void) sizeof(c); } while (0)
+#endif
+
+// The verify__* site argument
+#define NM_PROBE_SITE_NM_VERIFY 1
+#define NM_PROBE_SITE_SERVER_NONCE 2
+#define NM_PROBE_SITE_SERVER_KEYSIG 3
+#define NM_PROBE_SITE_ASYNC 4
@@ -0,0 +1,92 @@
+// nm_pverify.c
+// Purpose:
+//   1) Run the independent signature checks of one request (the
+//      nonce signature and the signature on the online key) at the
+//      same time on separate cores, so that the request takes about
+//      as long as the slower check instead of the sum of both.
+//   2) Let the caller give up as soon as one check fails.  A
+//      gcry_pk_verify() that has started cannot be interrupted, so
+//      the other checks run to the end in their threads; the caller
+//      must call nm_pverify_join() before it releases their inputs
+//      (a process that is about to exit need not).
+//
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "nm_pverify.h"
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+static void *pverify_worker(void *arg){
+	struct nm_pverify_task_t *task = arg;
+	struct nm_pverify_t *pv = task->pv;
+	int rc;
+
+	rc = task->fn(task->arg);
+	pthread_mutex_lock(&pv->lock);
+	task->rc = rc;
+	pv->ndone++;
+	if(rc && !pv->rc){
+		pv->rc = rc;
+		pv->failed = (int) (task - pv->tasks);
+	}
+	pthread_cond_broadcast(&pv->cond);
+	pthread_mutex_unlock(&pv->lock);
+	return NULL;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+int nm_pverify_start(struct nm_pverify_t *pv, struct nm_pverify_task_t *tasks,
+  int n){
+	// Start the n (1 to NM_PVERIFY_MAX) tasks, each on its own
+	// thread.  A task whose thread cannot be created runs here,
+	// before this returns.  Returns 0, or 843 if n is out of range.
+	int j;
+
+	if(n < 1 || n > NM_PVERIFY_MAX)
+		return 843;
+	memset(pv, 0, sizeof(*pv));
+	pthread_mutex_init(&pv->lock, NULL);
+	pthread_cond_init(&pv->cond, NULL);
+	pv->tasks = tasks;
+	pv->n = n;
+	pv->failed = -1;
+	for(j = 0; j < n; j++){
+		tasks[j].rc = 0;
+		tasks[j].pv = pv;
+	}
+	for(j = 0; j < n; j++){
+		if(!pthread_create(&pv->threads[pv->nstarted], NULL, pverify_worker, &tasks[j]))
+			pv->nstarted++;
+		else
+			pverify_worker(&tasks[j]);
+	}
+	return 0;
+}
+
+int nm_pverify_wait(struct nm_pverify_t *pv){
+	// Wait until one task has failed or all have passed.  Returns
+	// the code of the first task to fail, or 0.
+	int rc;
+
+	pthread_mutex_lock(&pv->lock);
+	while(!pv->rc && pv->ndone < pv->n)
+		pthread_cond_wait(&pv->cond, &pv->lock);
+	rc = pv->rc;
+	pthread_mutex_unlock(&pv->lock);
+	return rc;
+}
+
+void nm_pverify_join(struct nm_pverify_t *pv){
+	// Wait for every task to finish, and free the threads.
+	int j;
+
+	for(j = 0; j < pv->nstarted; j++)
+		pthread_join(pv->threads[j], NULL);
+	pv->nstarted = 0;
+	pthread_cond_destroy(&pv->cond);
+	pthread_mutex_destroy(&pv->lock);
+}
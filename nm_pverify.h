@@ -0,0 +1,35 @@
+// nm_pverify.h
+//
+// Independent signature checks run at the same time, with the first
+// failure reported as soon as it is known.  See nm_pverify.c.
+
+#define NM_PVERIFY_MAX 4
+
+struct nm_pverify_t;
+
+// One check: fn(arg) returns 0 if it passed, or an error code.
+struct nm_pverify_task_t
+{
+	int (*fn)(void *arg);
+	void *arg;
+	int rc;
+	struct nm_pverify_t *pv;     // set by nm_pverify_start()
+};
+
+struct nm_pverify_t
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t threads[NM_PVERIFY_MAX];
+	struct nm_pverify_task_t *tasks;
+	int n;
+	int nstarted;
+	int ndone;
+	int rc;      // first failure, 0 if none yet
+	int failed;  // index of the task that failed first, -1 if none
+};
+
+int nm_pverify_start(struct nm_pverify_t *pv, struct nm_pverify_task_t *tasks,
+  int n);
+int nm_pverify_wait(struct nm_pverify_t *pv);
+void nm_pverify_join(struct nm_pverify_t *pv);
@@ -0,0 +1,308 @@
+// nm_replay.c
+// Purpose:
+//   1) Remember the nonces whose signatures have been accepted, for a
+//      limited time and in a fixed amount of memory, so that a
+//      replayed server response is rejected (NMVerifyServer
+//      --replay-cache=<file>).
+//
+// The cache is a file that every process maps with MAP_SHARED, so
+// all of the verifiers on a host (and any threads in them) share it:
+//   header  64 bytes (struct nm_replay_hdr_t)
+//   sets    nsets * 64 bytes; each set is one cache line with a lock
+//           word and 7 entries.
+// An entry is one 64-bit word: 40 bits of the nonce digest, then 24
+// bits of expiry time in minutes since the header epoch (31 years).
+// The set index comes from other bits of the digest, so together
+// about 56 bits of the digest are compared, and the chance that a
+// new nonce is mistaken for an old one is negligible.
+//
+// Memory is fixed at 8 bytes per entry (4 MB for the default 512k
+// entries).  When every entry of a set is still live, the one that
+// expires first (or among equals, the oldest) is replaced, so under a flood of new nonces the
+// oldest ones can be forgotten early; size the cache for the number
+// of nonces that arrive within the TTL.
+//
+// Concurrency: nm_replay_seen() reads a set with plain atomic loads
+// and is only a fast hint.  nm_replay_insert() is the check that
+// counts: it takes the set's lock word (a compare-and-swap of the
+// pid, held for a scan of one cache line), so of two processes that
+// insert the same nonce at the same moment exactly one succeeds.  If
+// a process dies holding a set, the next process that waits on it
+// sees that the pid is gone and takes the lock over.
+//
+#include <stddef.h>
+#include <gcrypt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "nm_replay.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define NM_REPLAY_EXP_BITS 24
+#define NM_REPLAY_EXP_MASK ((1ULL << NM_REPLAY_EXP_BITS) - 1)
+#define NM_REPLAY_SPINS 4096
+
+struct nm_replay_t
+{
+	struct nm_replay_hdr_t *hdr;
+	struct nm_replay_set_t *sets;
+	unsigned int nsets;
+	unsigned int ttl;
+	size_t map_len;
+};
+
+struct nm_replay_t *nm_replay_open(const char *fname, unsigned long nentries,
+  unsigned int ttl, int *err_r){
+	// Open the cache file, creating it with room for nentries nonces
+	// if it does not exist (nentries 0 means NM_REPLAY_ENTRIES).  The
+	// size of an existing cache is kept.  ttl is how long (seconds)
+	// an accepted nonce is remembered; 0 means the value the file was
+	// created with.
+	//
+	// Returns NULL and sets *err_r to 960 (cannot open or create),
+	// 961 (not a replay cache, or damaged) or 843 (out of memory).
+	struct nm_replay_t *rc;
+	struct stat st;
+	void *p;
+	int fd;
+	unsigned long long nsets;
+
+	*err_r = 0;
+	fd = open(fname, O_RDWR | O_CREAT, 0600);
+	if(fd < 0){
+		*err_r = 960;
+		return NULL;
+	}
+	// flock() only while the file is set up: two processes that start
+	// at once must not both initialize it.
+	if(flock(fd, LOCK_EX) || fstat(fd, &st)){
+		close(fd);
+		*err_r = 960;
+		return NULL;
+	}
+	if(st.st_size == 0){
+		if(nentries == 0)
+			nentries = NM_REPLAY_ENTRIES;
+		nsets = (nentries + NM_REPLAY_WAYS - 1) / NM_REPLAY_WAYS;
+		if(nsets > 0xffffffffULL)
+			nsets = 0xffffffffULL;
+		st.st_size = sizeof(struct nm_replay_hdr_t)
+			+ nsets * sizeof(struct nm_replay_set_t);
+		if(ftruncate(fd, st.st_size)){
+			close(fd);
+			*err_r = 960;
+			return NULL;
+		}
+	}
+	if(st.st_size < (off_t) (sizeof(struct nm_replay_hdr_t)
+	  + sizeof(struct nm_replay_set_t))){
+		close(fd);
+		*err_r = 961;
+		return NULL;
+	}
+	p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(p == MAP_FAILED){
+		close(fd);
+		*err_r = 960;
+		return NULL;
+	}
+	rc = calloc(1, sizeof(struct nm_replay_t));
+	if(!rc){
+		munmap(p, st.st_size);
+		close(fd);
+		*err_r = 843;
+		return NULL;
+	}
+	rc->hdr = p;
+	rc->sets = (struct nm_replay_set_t *) ((char *) p + sizeof(struct nm_replay_hdr_t));
+	rc->map_len = st.st_size;
+	if(rc->hdr->magic == 0){
+		rc->hdr->epoch = time(NULL);
+		rc->hdr->nsets = (st.st_size - sizeof(struct nm_replay_hdr_t))
+			/ sizeof(struct nm_replay_set_t);
+		rc->hdr->ttl = ttl ? ttl : NM_REPLAY_TTL;
+		__atomic_store_n(&rc->hdr->magic, NM_REPLAY_MAGIC, __ATOMIC_RELEASE);
+	}
+	flock(fd, LOCK_UN);
+	close(fd);
+
+	if(rc->hdr->magic != NM_REPLAY_MAGIC || rc->hdr->nsets == 0
+	  || sizeof(struct nm_replay_hdr_t) + (unsigned long long) rc->hdr->nsets
+	  * sizeof(struct nm_replay_set_t) != (unsigned long long) st.st_size){
+		nm_replay_close(rc);
+		*err_r = 961;
+		return NULL;
+	}
+	rc->nsets = rc->hdr->nsets;
+	rc->ttl = ttl ? ttl : rc->hdr->ttl;
+	return rc;
+}
+
+void nm_replay_close(struct nm_replay_t *rc){
+	if(!rc)
+		return;
+	munmap(rc->hdr, rc->map_len);
+	free(rc);
+}
+
+void nm_replay_digest(const unsigned char *keygrip, const char *nonce,
+  size_t nonce_len, unsigned char *digest){
+	// The cache key: SHA-384 of the signer's keygrip (20 bytes, from
+	// gcry_pk_get_keygrip) and the nonce, so that the same nonce
+	// signed by two servers is not a replay.
+	gcry_md_hd_t hd;
+
+	if(gcry_md_open(&hd, GCRY_MD_SHA384, 0)){
+		memset(digest, 0, NM_REPLAY_DIGEST_LEN);
+		return;
+	}
+	gcry_md_write(hd, keygrip, 20);
+	gcry_md_write(hd, nonce, nonce_len);
+	memcpy(digest, gcry_md_read(hd, GCRY_MD_SHA384), NM_REPLAY_DIGEST_LEN);
+	gcry_md_close(hd);
+}
+
+static unsigned long long now_minutes(struct nm_replay_t *rc, unsigned int plus){
+	time_t now = time(NULL);
+	if(now < (time_t) rc->hdr->epoch)
+		now = rc->hdr->epoch;
+	// Round up so that an entry lives at least ttl seconds.
+	return ((now - rc->hdr->epoch + plus + 59) / 60) & NM_REPLAY_EXP_MASK;
+}
+
+static struct nm_replay_set_t *find_set(struct nm_replay_t *rc,
+  const unsigned char *digest, unsigned long long *tag_r){
+	unsigned long long h = 0, tag = 0;
+	int j;
+
+	for(j = 0; j < 8; j++)
+		h = (h << 8) | digest[j];
+	for(j = 8; j < 13; j++)
+		tag = (tag << 8) | digest[j];
+	if(tag == 0)
+		tag = 1;    // 0 is an empty entry
+	*tag_r = tag << NM_REPLAY_EXP_BITS;
+	return &rc->sets[h % rc->nsets];
+}
+
+static int live_match(unsigned long long e, unsigned long long tag,
+  unsigned long long now){
+	return e != 0 && (e & ~NM_REPLAY_EXP_MASK) == tag
+		&& (e & NM_REPLAY_EXP_MASK) >= now;
+}
+
+int nm_replay_seen(struct nm_replay_t *rc, const unsigned char *digest){
+	// 1 if the digest is in the cache and has not expired.  This does
+	// not lock; use it to reject a replay before the signature check,
+	// and still call nm_replay_insert() after the check.
+	struct nm_replay_set_t *set;
+	unsigned long long tag, now;
+	int j;
+
+	set = find_set(rc, digest, &tag);
+	now = now_minutes(rc, 0);
+	for(j = 0; j < NM_REPLAY_WAYS; j++)
+		if(live_match(__atomic_load_n(&set->entry[j], __ATOMIC_ACQUIRE), tag, now))
+			return 1;
+	return 0;
+}
+
+static void lock_set(struct nm_replay_set_t *set){
+	int me = getpid();
+	int owner;
+	int spins = 0;
+
+	while(1){
+		owner = 0;
+		if(__atomic_compare_exchange_n(&set->lock, &owner, me, 0,
+		  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return;
+		if(++spins < NM_REPLAY_SPINS)
+			continue;
+		// Held for a long time: take it over if the holder is gone.
+		spins = 0;
+		if(owner != me && kill(owner, 0) && errno == ESRCH
+		  && __atomic_compare_exchange_n(&set->lock, &owner, me, 0,
+		  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return;
+		sched_yield();
+	}
+}
+
+int nm_replay_insert(struct nm_replay_t *rc, const unsigned char *digest){
+	// Add a digest whose signature has been checked.  Returns 0 if it
+	// was new, or 1 if it is already in the cache (a replay: reject
+	// it).
+	struct nm_replay_set_t *set;
+	unsigned long long tag, now, e, best_exp;
+	int j, w, victim;
+
+	set = find_set(rc, digest, &tag);
+	now = now_minutes(rc, 0);
+	lock_set(set);
+	// Entries added in the same minute expire in the same minute, so
+	// start the scan after the last entry replaced: ties then go
+	// first-in first-out instead of churning one way.
+	w = set->next;
+	if(w < 0 || w >= NM_REPLAY_WAYS)
+		w = 0;
+	victim = w;
+	best_exp = NM_REPLAY_EXP_MASK + 1;
+	for(j = 0; j < NM_REPLAY_WAYS; j++, w = (w + 1) % NM_REPLAY_WAYS){
+		e = set->entry[w];
+		if(live_match(e, tag, now)){
+			__atomic_store_n(&set->lock, 0, __ATOMIC_RELEASE);
+			return 1;
+		}
+		// Prefer an empty or expired entry, then the oldest.
+		if(e == 0 || (e & NM_REPLAY_EXP_MASK) < now){
+			if(best_exp > 0){
+				victim = w;
+				best_exp = 0;
+			}
+		}else if((e & NM_REPLAY_EXP_MASK) < best_exp){
+			victim = w;
+			best_exp = e & NM_REPLAY_EXP_MASK;
+		}
+	}
+	set->next = (victim + 1) % NM_REPLAY_WAYS;
+	__atomic_store_n(&set->entry[victim], tag | now_minutes(rc, rc->ttl),
+		__ATOMIC_RELEASE);
+	__atomic_store_n(&set->lock, 0, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int nm_replay_args(int *argc, char **argv, const char **fname_r,
+  unsigned int *ttl_r){
+	// For tools with positional arguments: take --replay-cache=<file>
+	// and --replay-ttl=<seconds> out of argv (updating *argc).
+	// Returns 1 if the cache was asked for.
+	int j, k;
+
+	*fname_r = NULL;
+	*ttl_r = 0;
+	for(j = 1; j < *argc; ){
+		if(!strncmp(argv[j], "--replay-cache=", 15)){
+			*fname_r = argv[j] + 15;
+		}else if(!strncmp(argv[j], "--replay-ttl=", 13)){
+			*ttl_r = strtoul(argv[j] + 13, NULL, 10);
+		}else{
+			j++;
+			continue;
+		}
+		for(k = j; k < *argc - 1; k++)
+			argv[k] = argv[k + 1];
+		argv[--(*argc)] = NULL;
+	}
+	return *fname_r != NULL;
+}
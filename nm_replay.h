@@ -0,0 +1,38 @@
+// nm_replay.h
+//
+// Fixed-size, shared nonce replay cache.  See nm_replay.c.
+
+#define NM_REPLAY_MAGIC 0x4e4d52504c593031ULL   // "NMRPLY01"
+#define NM_REPLAY_WAYS 7
+#define NM_REPLAY_ENTRIES (512 * 1024)
+#define NM_REPLAY_TTL (24 * 60 * 60)
+#define NM_REPLAY_DIGEST_LEN 48
+
+// One set is one cache line: a lock word and 7 entries.
+struct nm_replay_set_t
+{
+	int lock;                 // 0, or the pid that holds the set
+	int next;                 // where the next eviction scan starts
+	unsigned long long entry[NM_REPLAY_WAYS];
+} __attribute__ ((aligned (64)));
+
+struct nm_replay_hdr_t
+{
+	unsigned long long magic;
+	unsigned long long epoch;     // unix time that expiry minutes count from
+	unsigned int nsets;
+	unsigned int ttl;             // seconds
+	unsigned char pad[40];
+};
+
+struct nm_replay_t;
+
+struct nm_replay_t *nm_replay_open(const char *fname, unsigned long nentries,
+  unsigned int ttl, int *err_r);
+void nm_replay_close(struct nm_replay_t *rc);
+void nm_replay_digest(const unsigned char *keygrip, const char *nonce,
+  size_t nonce_len, unsigned char *digest);
+int nm_replay_seen(struct nm_replay_t *rc, const unsigned char *digest);
+int nm_replay_insert(struct nm_replay_t *rc, const unsigned char *digest);
+int nm_replay_args(int *argc, char **argv, const char **fname_r,
+  unsigned int *ttl_r);
@@ -0,0 +1,414 @@
+// nm_revoke.c
+// Purpose:
+//   1) Build a revocation list: the SHA-384 fingerprints (as printed by
+//      nm_fingerprint) of keys that must no longer be accepted, signed
+//      by the offline key (nm_revoke --build).
+//   2) Map a list read-only and answer "is this key revoked?" without
+//      any public-key operation, so that nm_verify and NMVerifyServer
+//      can refuse a revoked key before they verify anything with it.
+//
+// The file (see struct nm_revoke_hdr_t):
+//   header     128 bytes
+//   bloom      bloom_bits bits (NM_REVOKE_BITS_PER_KEY or more per
+//              key, a power of two) with NM_REVOKE_HASHES bits set
+//              per fingerprint
+//   list       the fingerprints, 48 bytes each, sorted
+//   signature  gcry_pk_sign() by the offline key over the SHA-384 of
+//              everything above, in canonical form, null-padded to
+//              NM_REVOKE_SIG_MAX bytes.  For an offline key set it is
+//              a multi-signature (nm_multisig.c) that must reach the
+//              set's threshold, added one key at a time with nm_revoke
+//              --cosign; all zero until the first key signs.
+// Most keys are not revoked, and for them the Bloom filter answers
+// after reading NM_REVOKE_HASHES words; a hit (revoked, or a false
+// positive, under 1%) is confirmed by a binary search of the list.
+// The fingerprints are already hashes, so the Bloom filter indexes
+// come straight from their bytes.
+//
+// The list is written to a temporary file and renamed into place, so
+// a process that maps the old one keeps a consistent view.
+//
+#include <stddef.h>
+#include <gcrypt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "nm_revoke.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct nm_revoke_t
+{
+	const unsigned char *base;
+	const struct nm_revoke_hdr_t *hdr;
+	const unsigned long long *bloom;
+	const unsigned char *list;
+	unsigned long long mask;        // bloom_bits - 1
+	size_t map_len;
+};
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+static void bloom_hashes(const unsigned char *fp, unsigned long long *h1,
+  unsigned long long *h2){
+	// Double hashing: bit j of a fingerprint is h1 + j * h2.  h2 is
+	// odd so that the bits differ for any power-of-two filter size.
+	memcpy(h1, fp, sizeof(*h1));
+	memcpy(h2, fp + sizeof(*h1), sizeof(*h2));
+	*h2 |= 1;
+}
+
+static int cmp_fp(const void *a, const void *b){
+	return memcmp(a, b, NM_REVOKE_FP_LEN);
+}
+
+static int sign_digest(const unsigned char *digest, gcry_sexp_t sexp_key,
+  gcry_sexp_t *sexp_sig_r){
+	// The same (data (flags raw) (hash sha384 ...)) layout as
+	// nm_sign, over the binary digest of the list.
+	gcry_sexp_t sexp_data;
+	gcry_error_t err;
+
+	if(gcry_sexp_build(&sexp_data, NULL, "(data (flags raw) (hash sha384 %b))",
+	  48, digest))
+		return 902;
+	err = gcry_pk_sign(sexp_sig_r, sexp_data, sexp_key);
+	gcry_sexp_release(sexp_data);
+	return err ? 903 : 0;
+}
+
+static int write_list(const char *fname, const unsigned char *body, size_t len){
+	// Write a temporary file and rename it into place.  Returns 0 or
+	// 974.
+	char tmp_fname[4096];
+	FILE *fp;
+	int k;
+
+	snprintf(tmp_fname, sizeof(tmp_fname), "%s.tmp.%d", fname, (int) getpid());
+	fp = fopen(tmp_fname, "wb");
+	if(!fp)
+		return 974;
+	k = fwrite(body, 1, len, fp) != len;
+	k |= fflush(fp) != 0 || fsync(fileno(fp)) != 0;
+	k |= fclose(fp) != 0;
+	if(k || rename(tmp_fname, fname)){
+		unlink(tmp_fname);
+		return 974;
+	}
+	return 0;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+int nm_revoke_build(const unsigned char *fps, size_t n, gcry_sexp_t sexp_prv_key,
+  const char *out_fname){
+	// Write the revocation list out_fname (replacing it) from n
+	// fingerprints at fps, 48 bytes each, in any order and possibly
+	// repeated, and sign it with sexp_prv_key (the offline key).  With
+	// a NULL sexp_prv_key the list is written unsigned, for the keys
+	// of an offline key set to sign (see nm_revoke_set_sig()).
+	//
+	// Returns 0, 843 (out of memory), 902/903 (cannot sign) or 974
+	// (cannot write the list).
+	struct nm_revoke_hdr_t *hdr;
+	unsigned char *body;
+	unsigned char *list;
+	unsigned long long *bloom;
+	unsigned long long bits, h1, h2, b;
+	unsigned char digest[48];
+	gcry_sexp_t sexp_sig;
+	size_t body_len, sig_len, j, k;
+	int rc;
+
+	bits = 512;
+	while(bits < (unsigned long long) n * NM_REVOKE_BITS_PER_KEY)
+		bits *= 2;
+	body_len = sizeof(*hdr) + bits / 8 + n * NM_REVOKE_FP_LEN;
+	body = calloc(1, body_len + NM_REVOKE_SIG_MAX);
+	if(!body)
+		return 843;
+	hdr = (struct nm_revoke_hdr_t *) body;
+	bloom = (unsigned long long *) (body + sizeof(*hdr));
+	list = body + sizeof(*hdr) + bits / 8;
+
+	// Sort, then drop repeats.
+	if(n)
+		memcpy(list, fps, n * NM_REVOKE_FP_LEN);
+	qsort(list, n, NM_REVOKE_FP_LEN, cmp_fp);
+	for(j = k = 0; j < n; j++)
+		if(k == 0 || cmp_fp(list + (k - 1) * NM_REVOKE_FP_LEN,
+		  list + j * NM_REVOKE_FP_LEN)){
+			if(k != j)
+				memcpy(list + k * NM_REVOKE_FP_LEN, list + j * NM_REVOKE_FP_LEN,
+					NM_REVOKE_FP_LEN);
+			k++;
+		}
+	n = k;
+	body_len = sizeof(*hdr) + bits / 8 + n * NM_REVOKE_FP_LEN;
+
+	for(j = 0; j < n; j++){
+		bloom_hashes(list + j * NM_REVOKE_FP_LEN, &h1, &h2);
+		for(k = 0; k < NM_REVOKE_HASHES; k++){
+			b = (h1 + k * h2) & (bits - 1);
+			bloom[b / 64] |= 1ULL << (b % 64);
+		}
+	}
+
+	hdr->magic = NM_REVOKE_MAGIC;
+	hdr->nhashes = NM_REVOKE_HASHES;
+	hdr->nrevoked = n;
+	hdr->bloom_bits = bits;
+	hdr->created = time(NULL);
+	hdr->bloom_off = sizeof(*hdr);
+	hdr->list_off = hdr->bloom_off + bits / 8;
+	hdr->sig_off = body_len;
+	hdr->file_len = body_len + NM_REVOKE_SIG_MAX;
+
+	if(!sexp_prv_key){
+		// Left for the keys of an offline key set (nm_revoke_set_sig).
+		rc = write_list(out_fname, body, hdr->file_len);
+		free(body);
+		return rc;
+	}
+	gcry_md_hash_buffer(GCRY_MD_SHA384, digest, body, body_len);
+	rc = sign_digest(digest, sexp_prv_key, &sexp_sig);
+	if(rc){
+		free(body);
+		return rc;
+	}
+	sig_len = gcry_sexp_sprint(sexp_sig, GCRYSEXP_FMT_CANON, NULL, 0);
+	if(sig_len > NM_REVOKE_SIG_MAX){
+		gcry_sexp_release(sexp_sig);
+		free(body);
+		return 903;
+	}
+	gcry_sexp_sprint(sexp_sig, GCRYSEXP_FMT_CANON, (char *) body + body_len,
+		NM_REVOKE_SIG_MAX);
+	gcry_sexp_release(sexp_sig);
+
+	rc = write_list(out_fname, body, hdr->file_len);
+	free(body);
+	return rc;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+struct nm_revoke_t *nm_revoke_open(const char *fname, int *err_r){
+	// Map a revocation list read-only and check its layout.  This does
+	// not check the signature; see nm_revoke_verify().  Returns NULL
+	// and sets *err_r to 980 (cannot open), 981 (not a revocation
+	// list, from another version, or damaged) or 843 (out of memory).
+	struct nm_revoke_t *rl;
+	const struct nm_revoke_hdr_t *hdr;
+	struct stat st;
+	void *p;
+	int fd;
+
+	*err_r = 0;
+	fd = open(fname, O_RDONLY);
+	if(fd < 0){
+		*err_r = 980;
+		return NULL;
+	}
+	if(fstat(fd, &st)){
+		close(fd);
+		*err_r = 980;
+		return NULL;
+	}
+	if(st.st_size < (off_t) sizeof(struct nm_revoke_hdr_t)){
+		close(fd);
+		*err_r = 981;
+		return NULL;
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(p == MAP_FAILED){
+		*err_r = 980;
+		return NULL;
+	}
+	rl = calloc(1, sizeof(struct nm_revoke_t));
+	if(!rl){
+		munmap(p, st.st_size);
+		*err_r = 843;
+		return NULL;
+	}
+	rl->base = p;
+	rl->hdr = hdr = p;
+	rl->map_len = st.st_size;
+	rl->bloom = (const unsigned long long *) (rl->base + hdr->bloom_off);
+	rl->list = rl->base + hdr->list_off;
+	rl->mask = hdr->bloom_bits - 1;
+
+	if(hdr->magic != NM_REVOKE_MAGIC
+	  || hdr->nhashes == 0 || hdr->nhashes > 32
+	  || hdr->bloom_bits < 512 || (hdr->bloom_bits & (hdr->bloom_bits - 1))
+	  || hdr->bloom_bits > (unsigned long long) st.st_size * 8
+	  || hdr->nrevoked > (unsigned long long) st.st_size / NM_REVOKE_FP_LEN
+	  || hdr->file_len != (unsigned long long) st.st_size
+	  || hdr->bloom_off != sizeof(struct nm_revoke_hdr_t)
+	  || hdr->list_off != hdr->bloom_off + hdr->bloom_bits / 8
+	  || hdr->sig_off != hdr->list_off + hdr->nrevoked * NM_REVOKE_FP_LEN
+	  || hdr->file_len != hdr->sig_off + NM_REVOKE_SIG_MAX){
+		nm_revoke_close(rl);
+		*err_r = 981;
+		return NULL;
+	}
+	return rl;
+}
+
+void nm_revoke_close(struct nm_revoke_t *rl){
+	if(!rl)
+		return;
+	munmap((void *) rl->base, rl->map_len);
+	free(rl);
+}
+
+int nm_revoke_signed_data(const struct nm_revoke_t *rl, gcry_sexp_t *sexp_data_r,
+  gcry_sexp_t *sexp_sig_r){
+	// What the signature on the list covers, as a data s-expression,
+	// and the signature itself (NULL if the list is not signed yet):
+	// one signature, or the multi-signature of an offline key set
+	// (see nm_multisig.c).  The caller releases both.  Returns 0 or
+	// 983 (a damaged signature).
+	unsigned char digest[48];
+	size_t sig_len;
+
+	*sexp_data_r = *sexp_sig_r = NULL;
+	gcry_md_hash_buffer(GCRY_MD_SHA384, digest, rl->base, rl->hdr->sig_off);
+	if(gcry_sexp_build(sexp_data_r, NULL, "(data (flags raw) (hash sha384 %b))",
+	  48, digest))
+		return 983;
+	if(rl->base[rl->hdr->sig_off] == 0x00)
+		return 0;
+	sig_len = gcry_sexp_canon_len(rl->base + rl->hdr->sig_off,
+		NM_REVOKE_SIG_MAX, NULL, NULL);
+	if(sig_len == 0
+	  || gcry_sexp_new(sexp_sig_r, rl->base + rl->hdr->sig_off, sig_len, 0)){
+		*sexp_sig_r = NULL;
+		gcry_sexp_release(*sexp_data_r);
+		*sexp_data_r = NULL;
+		return 983;
+	}
+	return 0;
+}
+
+int nm_revoke_verify(const struct nm_revoke_t *rl, gcry_sexp_t sexp_pub_key){
+	// Check the signature on the list with the offline public key.
+	// This is one public-key operation, so a resident process does it
+	// once, when it maps the list.  Returns 0 or 983 (bad signature,
+	// or none).
+	gcry_sexp_t sexp_sig, sexp_data;
+	gcry_error_t err;
+
+	if(nm_revoke_signed_data(rl, &sexp_data, &sexp_sig))
+		return 983;
+	err = !sexp_sig || gcry_pk_verify(sexp_sig, sexp_data, sexp_pub_key);
+	gcry_sexp_release(sexp_data);
+	gcry_sexp_release(sexp_sig);
+	return err ? 983 : 0;
+}
+
+int nm_revoke_set_sig(const char *fname, const char *sig, size_t sig_len){
+	// Replace the signature on the list fname with sig, a canonical
+	// s-expression (nm_revoke --cosign puts the growing
+	// multi-signature of a key set here).  The list is rewritten the
+	// way nm_revoke_build() writes it.  Returns 0, a code from
+	// nm_revoke_open(), 843 (out of memory), 903 (sig is too big) or
+	// 974 (cannot write the list).
+	struct nm_revoke_t *rl;
+	unsigned char *body;
+	size_t len;
+	int rc;
+
+	rl = nm_revoke_open(fname, &rc);
+	if(!rl)
+		return rc;
+	if(sig_len > NM_REVOKE_SIG_MAX){
+		nm_revoke_close(rl);
+		return 903;
+	}
+	len = rl->hdr->file_len;
+	body = calloc(1, len);
+	if(!body){
+		nm_revoke_close(rl);
+		return 843;
+	}
+	memcpy(body, rl->base, rl->hdr->sig_off);
+	memcpy(body + rl->hdr->sig_off, sig, sig_len);
+	nm_revoke_close(rl);
+	rc = write_list(fname, body, len);
+	free(body);
+	return rc;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+int nm_revoke_maybe(const struct nm_revoke_t *rl, const unsigned char *fp){
+	// The Bloom filter alone: 0 means certainly not revoked, 1 means
+	// probably revoked.
+	unsigned long long h1, h2, b;
+	unsigned int j;
+
+	bloom_hashes(fp, &h1, &h2);
+	for(j = 0; j < rl->hdr->nhashes; j++){
+		b = (h1 + j * h2) & rl->mask;
+		if(!(rl->bloom[b / 64] & (1ULL << (b % 64))))
+			return 0;
+	}
+	return 1;
+}
+
+int nm_revoke_check(const struct nm_revoke_t *rl, const unsigned char *fp){
+	// Returns 1 if the key with the 48-byte SHA-384 fingerprint fp is
+	// on the list, otherwise 0.
+	unsigned long long lo = 0, hi = rl->hdr->nrevoked, mid;
+	int c;
+
+	if(!nm_revoke_maybe(rl, fp))
+		return 0;
+	while(lo < hi){
+		mid = lo + (hi - lo) / 2;
+		c = memcmp(rl->list + mid * NM_REVOKE_FP_LEN, fp, NM_REVOKE_FP_LEN);
+		if(c == 0)
+			return 1;
+		if(c < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return 0;
+}
+
+unsigned long long nm_revoke_count(const struct nm_revoke_t *rl){
+	return rl->hdr->nrevoked;
+}
+
+const unsigned char *nm_revoke_entry(const struct nm_revoke_t *rl,
+  unsigned long long j){
+	// Fingerprints in sorted order.
+	return j < rl->hdr->nrevoked ? rl->list + j * NM_REVOKE_FP_LEN : NULL;
+}
+
+int nm_revoke_args(int *argc, char **argv, const char **fname_r){
+	// For tools with positional arguments: take --revoked=<file> out
+	// of argv (updating *argc).  Returns 1 if it was given.
+	int j, k;
+
+	*fname_r = NULL;
+	for(j = 1; j < *argc; ){
+		if(strncmp(argv[j], "--revoked=", 10)){
+			j++;
+			continue;
+		}
+		*fname_r = argv[j] + 10;
+		for(k = j; k < *argc - 1; k++)
+			argv[k] = argv[k + 1];
+		argv[--(*argc)] = NULL;
+	}
+	return *fname_r != NULL;
+}
@@ -0,0 +1,47 @@
+// nm_revoke.h
+//
+// Signed key revocation list: a Bloom filter in front of a sorted
+// array of revoked key fingerprints.  See nm_revoke.c, and
+// nm_revoke_main.c for the nm_revoke tool.
+
+#define NM_REVOKE_MAGIC 0x4e4d5245564f4b31ULL   // "NMREVOK1"
+#define NM_REVOKE_FP_LEN 48                     // SHA-384 of the key file
+#define NM_REVOKE_HASHES 7
+#define NM_REVOKE_BITS_PER_KEY 10
+// Room for the signature (canonical s-expression) at the end.
+#define NM_REVOKE_SIG_MAX 2048
+
+// Header, at offset 0.  The signature covers everything before
+// sig_off: the header, the Bloom filter and the list.
+struct nm_revoke_hdr_t
+{
+	unsigned long long magic;
+	unsigned int nhashes;
+	unsigned int pad;
+	unsigned long long nrevoked;
+	unsigned long long bloom_bits;  // a power of two
+	unsigned long long created;     // unix time
+	unsigned long long bloom_off;
+	unsigned long long list_off;    // nrevoked fingerprints, sorted
+	unsigned long long sig_off;
+	unsigned long long file_len;
+	unsigned char pad2[48];
+};
+
+struct nm_revoke_t;
+
+int nm_revoke_build(const unsigned char *fps, size_t n, gcry_sexp_t sexp_prv_key,
+  const char *out_fname);
+struct nm_revoke_t *nm_revoke_open(const char *fname, int *err_r);
+void nm_revoke_close(struct nm_revoke_t *rl);
+int nm_revoke_verify(const struct nm_revoke_t *rl, gcry_sexp_t sexp_pub_key);
+int nm_revoke_signed_data(const struct nm_revoke_t *rl, gcry_sexp_t *sexp_data_r,
+  gcry_sexp_t *sexp_sig_r);
+int nm_revoke_set_sig(const char *fname, const char *sig, size_t sig_len);
+
+int nm_revoke_maybe(const struct nm_revoke_t *rl, const unsigned char *fp);
+int nm_revoke_check(const struct nm_revoke_t *rl, const unsigned char *fp);
+unsigned long long nm_revoke_count(const struct nm_revoke_t *rl);
+const unsigned char *nm_revoke_entry(const struct nm_revoke_t *rl,
+  unsigned long long j);
+int nm_revoke_args(int *argc, char **argv, const char **fname_r);
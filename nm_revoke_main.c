@@ -0,0 +1,452 @@
+// nm_revoke_main.c
+// Purpose:
+//   1) nm_revoke --build --in <fingerprints> --key <offline_private_key>
+//      --revoked <list>: write a signed revocation list (see
+//      nm_revoke.c).  The input has one SHA-384 key fingerprint in hex
+//      per line; anything after the fingerprint is ignored, so the
+//      output of nm_fingerprint can be used as it is.  --in - reads
+//      stdin.
+//   2) nm_revoke --revoked <list> --revoked-by <offline_public_key>
+//      --check <hex> | --check-key <key_file> | --list: check the
+//      signature on the list, then say whether a key is revoked (exit
+//      code 982 if it is), or print the revoked fingerprints.
+//   3) For an offline key set (nm_multisig --make-set), --build
+//      without --key writes the list unsigned, and each key holder
+//      adds a signature with nm_revoke --cosign --revoked <list>
+//      --key-set <set> --key <offline_private_key>.  The list is
+//      accepted (with --revoked-by <set>) once the set's threshold
+//      of keys have signed it, so one lost key can neither empty the
+//      list nor revoke every key.
+//
+#include <stddef.h>
+#include <gcrypt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+// nm_keys requires some of the things above
+#include "nm_keys.h"
+#include "nm_revoke.h"
+#include "nm_multisig.h"
+#include "nm_timing.h"
+#include "nm_stats.h"
+
+#include <getopt.h>
+
+#define debug_lvl 0
+int build_flag;
+int cosign_flag;
+int list_flag;
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+int usage(){
+	fprintf(stderr, "usage:\n");
+	fprintf(stderr, "nm_revoke --build --in <fingerprints|-> [--key <offline_private_key>]\n");
+	fprintf(stderr, "          --revoked <list>\n");
+	fprintf(stderr, "nm_revoke --cosign --revoked <list> --key-set <key_set>\n");
+	fprintf(stderr, "          --key <offline_private_key>\n");
+	fprintf(stderr, "nm_revoke --revoked <list> --revoked-by <offline_public_key|key_set>\n");
+	fprintf(stderr, "          --check <hex> | --check-key <key_file> | --list\n");
+	fprintf(stderr, "  without --key, --build leaves the list for the keys of a set to --cosign\n");
+	fprintf(stderr, "  --check exits with 982 if the key is revoked\n");
+	fprintf(stderr, "  --timings[=<file>] writes the time of each phase as JSON at exit\n");
+	return 99;
+}
+
+static int read_fingerprints(const char *fname, unsigned char **fps_r,
+  size_t *n_r){
+	// One hex fingerprint at the start of each line; blank lines and
+	// lines starting with # are skipped.  Returns 0, 439 (cannot
+	// open), 843 (out of memory) or 975 (not a fingerprint).
+	char line[4096];
+	unsigned char *fps = NULL, *p;
+	size_t n = 0, cap = 0, len;
+	unsigned long lineno = 0;
+	FILE *fp;
+	int rc = 0;
+
+	fp = strcmp(fname, "-") ? fopen(fname, "r") : stdin;
+	if(!fp)
+		return 439;
+	while(fgets(line, sizeof(line), fp)){
+		lineno++;
+		for(len = 0; line[len] && !isspace((unsigned char) line[len]); len++)
+			;
+		if(len == 0 || line[0] == '#')
+			continue;
+		line[len] = 0x00;
+		if(n == cap){
+			cap = cap ? 2 * cap : 1024;
+			p = realloc(fps, cap * NM_REVOKE_FP_LEN);
+			if(!p){
+				rc = 843;
+				break;
+			}
+			fps = p;
+		}
+		if(nm_hex_decode(line, fps + n * NM_REVOKE_FP_LEN, NM_REVOKE_FP_LEN)
+		  != NM_REVOKE_FP_LEN){
+			fprintf(stderr, "Error. %s line %lu is not a SHA-384 fingerprint.\n",
+				fname, lineno);
+			rc = 975;
+			break;
+		}
+		n++;
+	}
+	if(fp != stdin)
+		fclose(fp);
+	if(rc){
+		free(fps);
+		return rc;
+	}
+	*fps_r = fps;
+	*n_r = n;
+	return 0;
+}
+
+static int read_key_set(const char *fname, struct nm_keyset_t *set){
+	// An offline key set file.  Returns 0, 985 or a code from
+	// nm_read_key_file().
+	gcry_sexp_t sexp_file;
+	int rc;
+
+	rc = nm_read_key_file(fname, NULL, &sexp_file, debug_lvl);
+	if(rc)
+		return rc;
+	rc = nm_keyset_is_set(sexp_file) ? nm_keyset_load(sexp_file, set) : 985;
+	gcry_sexp_release(sexp_file);
+	return rc;
+}
+
+static int verify_list(const struct nm_revoke_t *rl, const char *fname){
+	// The signature on the list by the offline key, or by the
+	// threshold of an offline key set, as NMVerifyServer checks it.
+	// Returns 0, 983 or a code from reading fname.
+	struct nm_keyset_t set;
+	gcry_sexp_t sexp_file, sexp_key, sexp_data, sexp_sig;
+	int rc;
+
+	rc = nm_read_key_file(fname, NULL, &sexp_file, debug_lvl);
+	if(rc)
+		return rc;
+	if(!nm_keyset_is_set(sexp_file)){
+		sexp_key = gcry_sexp_find_token(sexp_file, "public-key", 0);
+		gcry_sexp_release(sexp_file);
+		if(!sexp_key)
+			return 901;
+		rc = nm_revoke_verify(rl, sexp_key);
+		gcry_sexp_release(sexp_key);
+		return rc;
+	}
+	rc = nm_keyset_load(sexp_file, &set);
+	gcry_sexp_release(sexp_file);
+	if(rc)
+		return rc;
+	rc = nm_revoke_signed_data(rl, &sexp_data, &sexp_sig);
+	if(!rc && (!sexp_sig || nm_multisig_verify(&set, sexp_sig, sexp_data, 0, NULL)))
+		rc = 983;
+	gcry_sexp_release(sexp_data);
+	gcry_sexp_release(sexp_sig);
+	nm_keyset_release(&set);
+	return rc;
+}
+
+static int cosign(const char *revoked_fname, const char *key_set_fname,
+  const char *key_fname){
+	// Add the signature of key_fname, one key of the set, to the
+	// multi-signature on the list.  nm_multisig_combine() checks every
+	// signature, the ones already there included.  Returns 0 or an error
+	// code (988 if this key has already signed).
+	struct nm_revoke_t *rl;
+	struct nm_keyset_t set;
+	gcry_sexp_t sexp_data, sexp_msig, sexp_prv, sexp_elem, sexp_new;
+	gcry_sexp_t sexp_sigs[NM_MULTISIG_MAX + 1];
+	char *txt = NULL, *canon = NULL;
+	size_t len;
+	int j, n, nsigs = 0, rc;
+
+	rc = read_key_set(key_set_fname, &set);
+	if(rc){
+		fprintf(stderr, "Error. %s is not an offline key set.\n", key_set_fname);
+		return rc;
+	}
+	rl = nm_revoke_open(revoked_fname, &rc);
+	if(!rl){
+		fprintf(stderr, "Error. Could not open the revocation list %s (code %d).\n",
+			revoked_fname, rc);
+		nm_keyset_release(&set);
+		return rc;
+	}
+	rc = nm_revoke_signed_data(rl, &sexp_data, &sexp_msig);
+	nm_revoke_close(rl);
+	if(!rc && sexp_msig && !nm_multisig_is_multi(sexp_msig))
+		rc = 986;
+	if(!rc && sexp_msig){
+		n = gcry_sexp_length(sexp_msig);
+		for(j = 1; j < n && nsigs < NM_MULTISIG_MAX; j++){
+			sexp_elem = gcry_sexp_nth(sexp_msig, j);
+			sexp_sigs[nsigs] = sexp_elem ? gcry_sexp_find_token(sexp_elem, "sig-val", 0) : NULL;
+			if(sexp_sigs[nsigs])
+				nsigs++;
+			gcry_sexp_release(sexp_elem);
+		}
+	}
+	if(!rc)
+		rc = nm_read_key_file(key_fname, "private-key", &sexp_prv, debug_lvl);
+	if(!rc){
+		rc = gcry_pk_sign(&sexp_sigs[nsigs], sexp_data, sexp_prv) ? 903 : 0;
+		gcry_sexp_release(sexp_prv);
+		if(!rc)
+			nsigs++;
+	}
+	if(!rc)
+		rc = nm_multisig_combine(&set, sexp_data, sexp_sigs, nsigs, &txt);
+	if(!rc)
+		rc = gcry_sexp_new(&sexp_new, txt, 0, 1) ? 902 : 0;
+	if(!rc){
+		len = gcry_sexp_sprint(sexp_new, GCRYSEXP_FMT_CANON, NULL, 0);
+		canon = malloc(len);
+		rc = canon ? 0 : 843;
+		if(!rc){
+			len = gcry_sexp_sprint(sexp_new, GCRYSEXP_FMT_CANON, canon, len);
+			rc = nm_revoke_set_sig(revoked_fname, canon, len);
+		}
+		if(!rc)
+			printf("%d of the %d signatures needed are on %s\n", nsigs,
+				set.threshold, revoked_fname);
+		gcry_sexp_release(sexp_new);
+	}
+	if(rc == 988)
+		fprintf(stderr, "Error. %s is not a key of the set, or it has already signed.\n",
+			key_fname);
+	else if(rc)
+		fprintf(stderr, "Error. Could not sign %s (code %d).\n", revoked_fname, rc);
+	for(j = 0; j < nsigs; j++)
+		gcry_sexp_release(sexp_sigs[j]);
+	gcry_sexp_release(sexp_msig);
+	gcry_sexp_release(sexp_data);
+	nm_keyset_release(&set);
+	free(canon);
+	free(txt);
+	return rc;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+int main (int argc, char **argv) {
+	const char *in_fname = NULL;
+	const char *key_fname = NULL;
+	const char *revoked_fname = NULL;
+	const char *revoked_by_fname = NULL;
+	const char *key_set_fname = NULL;
+	const char *check_hex = NULL;
+	const char *check_key_fname = NULL;
+	char hex[2 * NM_REVOKE_FP_LEN + 1];
+	unsigned char fp_bin[NM_REVOKE_FP_LEN];
+	unsigned char *fps = NULL;
+	size_t n = 0;
+	unsigned long long j;
+	struct nm_revoke_t *rl;
+	gcry_sexp_t sexp_key;
+	int err_int;
+	int opt_code; //encoded value from command-line args
+
+	nm_timing_start("nm_revoke");
+	nm_stats_init("nm_revoke");
+
+	/*
+	----------------------------------------------------------------------
+															LIBGCRYPT INITIALIZATION
+	----------------------------------------------------------------------
+	*/
+	// --build reads the offline private key, so set up secure memory
+	// as nm_sign does.
+	if (!gcry_check_version (GCRYPT_VERSION))
+	{
+		fputs ("libgcrypt version mismatch\n", stderr);
+		exit (2);
+	}
+	gcry_control (GCRYCTL_SUSPEND_SECMEM_WARN);
+	gcry_control (GCRYCTL_USE_SECURE_RNDPOOL);
+	gcry_control (GCRYCTL_INIT_SECMEM, 25600, 0);
+	gcry_control (GCRYCTL_RESUME_SECMEM_WARN);
+	gcry_control (GCRYCTL_INITIALIZATION_FINISHED, 0);
+	/*
+	----------------------------------------------------------------------
+													END LIBGCRYPT INITIALIZATION
+	----------------------------------------------------------------------
+	*/
+
+	nm_timing_phase("args");
+	while (1){
+		static struct option long_options[] = {
+					/* These options set a flag. */
+					{"build",   no_argument,       &build_flag, 1},
+					{"cosign",  no_argument,       &cosign_flag, 1},
+					{"list",    no_argument,       &list_flag, 1},
+							 {"in",         required_argument, 0, 'i'},
+							 {"key",        required_argument, 0, 'k'},
+							 {"revoked",    required_argument, 0, 'r'},
+							 {"revoked-by", required_argument, 0, 'B'},
+							 {"key-set",    required_argument, 0, 'S'},
+							 {"check",      required_argument, 0, 'c'},
+							 {"check-key",  required_argument, 0, 'C'},
+							 {"timings",    optional_argument, 0, 'M'},
+							 {"help",        no_argument, 0, '?'},
+							 {0, 0, 0, 0}
+		};
+		/* 'getopt_long' stores the option index here. */
+		int option_index = 0;
+		opt_code = getopt_long (argc, argv, "i:k:r:c:",
+										 long_options, &option_index);
+
+		/* Detect the end of the options. */
+		if (opt_code == -1)
+			break;
+
+		switch (opt_code){
+			case 0:
+				break;
+
+			case 'i':
+				// fingerprints to revoke
+				in_fname = optarg;
+				break;
+
+			case 'k':
+				// offline private key that signs the list
+				key_fname = optarg;
+				break;
+
+			case 'r':
+				// the revocation list
+				revoked_fname = optarg;
+				break;
+
+			case 'B':
+				// offline public key that signed the list
+				revoked_by_fname = optarg;
+				break;
+
+			case 'S':
+				// offline key set that co-signs the list
+				key_set_fname = optarg;
+				break;
+
+			case 'c':
+				// fingerprint to look up, in hex
+				check_hex = optarg;
+				break;
+
+			case 'C':
+				// key file to look up
+				check_key_fname = optarg;
+				break;
+
+			case 'M':
+				// JSON phase timings at exit (to stderr or a file)
+				nm_timing_enable(optarg);
+				break;
+
+			case '?':
+				/* 'getopt_long' already printed an error message. */
+				usage();
+				return 738;
+
+			default:
+				abort ();
+		}
+	}
+	if (optind < argc || !revoked_fname || build_flag + cosign_flag > 1
+	  || (build_flag && !in_fname)
+	  || (cosign_flag && (!key_set_fname || !key_fname))
+	  || (!build_flag && !cosign_flag && (!revoked_by_fname
+	    || (check_hex != NULL) + (check_key_fname != NULL) + list_flag != 1))){
+		usage();
+		return 290;
+	}
+
+	if (cosign_flag){
+		nm_timing_phase("cosign");
+		return cosign(revoked_fname, key_set_fname, key_fname);
+	}
+
+	if (build_flag){
+		nm_timing_phase("read");
+		err_int = read_fingerprints(in_fname, &fps, &n);
+		if(err_int){
+			if(err_int != 975)
+				fprintf(stderr, "Error. Could not read %s (code %d).\n", in_fname, err_int);
+			return err_int;
+		}
+		sexp_key = NULL;
+		err_int = key_fname ? nm_read_key_file(key_fname, "private-key", &sexp_key,
+			debug_lvl) : 0;
+		if(err_int){
+			fprintf(stderr, "Error. Could not read the private key %s.\n", key_fname);
+			free(fps);
+			return err_int;
+		}
+		nm_timing_phase("build");
+		err_int = nm_revoke_build(fps, n, sexp_key, revoked_fname);
+		gcry_sexp_release(sexp_key);
+		free(fps);
+		if(err_int){
+			fprintf(stderr, "Error. Could not write %s (code %d).\n",
+				revoked_fname, err_int);
+			return err_int;
+		}
+		rl = nm_revoke_open(revoked_fname, &err_int);
+		if(rl){
+			printf("%llu keys revoked in %s%s\n", nm_revoke_count(rl), revoked_fname,
+				key_fname ? "" : " (unsigned; add signatures with --cosign)");
+			nm_revoke_close(rl);
+		}
+		return err_int;
+	}
+
+	nm_timing_phase("open");
+	rl = nm_revoke_open(revoked_fname, &err_int);
+	if(!rl){
+		fprintf(stderr, "Error. Could not open the revocation list %s (code %d).\n",
+			revoked_fname, err_int);
+		return err_int;
+	}
+	err_int = verify_list(rl, revoked_by_fname);
+	if(err_int){
+		fprintf(stderr, "Error. The revocation list %s is not signed by %s.\n",
+			revoked_fname, revoked_by_fname);
+		nm_revoke_close(rl);
+		return err_int;
+	}
+
+	nm_timing_phase("lookup");
+	if (list_flag){
+		for(j = 0; j < nm_revoke_count(rl); j++){
+			nm_hex_encode(nm_revoke_entry(rl, j), NM_REVOKE_FP_LEN, hex);
+			printf("%s\n", hex);
+		}
+		nm_revoke_close(rl);
+		return 0;
+	}
+	if (check_hex){
+		if(nm_hex_decode(check_hex, fp_bin, NM_REVOKE_FP_LEN) != NM_REVOKE_FP_LEN){
+			fprintf(stderr, "Error. %s is not a SHA-384 fingerprint.\n", check_hex);
+			nm_revoke_close(rl);
+			return 975;
+		}
+	}else{
+		err_int = nm_key_fingerprint_file(check_key_fname, fp_bin);
+		if(err_int){
+			fprintf(stderr, "Error. Could not read the key file %s.\n", check_key_fname);
+			nm_revoke_close(rl);
+			return err_int;
+		}
+	}
+	err_int = nm_revoke_check(rl, fp_bin) ? 982 : 0;
+	printf("%s\n", err_int ? "revoked" : "not revoked");
+	nm_revoke_close(rl);
+	return err_int;
+}
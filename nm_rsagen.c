@@ -0,0 +1,384 @@
+// nm_rsagen.c
+// Purpose:
+//   1) Generate RSA keys (the online encryption key) faster on a
+//      machine with several cores.  gcry_pk_genkey() looks for the
+//      two primes one after the other on one thread, and nearly all
+//      of the keygen time is that search.  Here every thread runs its
+//      own search from its own random start, and the first two primes
+//      found become p and q; the other threads are told to stop.
+//
+// The result is a key-data s-expression with the same layout that
+// gcry_pk_genkey() returns for "(genkey (rsa (nbits 4:2048)))":
+//   (key-data (public-key (rsa (n)(e)))
+//             (private-key (rsa (n)(e)(d)(p)(q)(u))))
+// with e = 65537, p < q and u = p^-1 mod q, so natmsg_gen_key writes
+// OnlinePUBEncKey.key and OnlinePRVEncKey.key files that cannot be
+// told apart from the ones made before.
+//
+// Each candidate:
+//   - starts from a random nbits/2-bit value from the very strong
+//     generator with the top two bits set (so that n has exactly
+//     nbits bits) and is made odd;
+//   - steps by 2 through a window of NM_RSAGEN_WINDOW odd numbers;
+//     the window is sieved with the small odd primes below
+//     NM_RSAGEN_SIEVE_LIMIT first (one pass of remainders per window,
+//     as libgcrypt does), so only the survivors pay for
+//     a Fermat test and the Miller-Rabin rounds; p-1 must also be
+//     prime to e;
+//   - a new random start is taken after NM_RSAGEN_WINDOW steps, and
+//     after each prime, so that p and q come from unrelated starts.
+// The pair must also differ in the top 100 bits (FIPS 186-4 B.3.3).
+//
+#include <stddef.h>
+#include <gcrypt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "nm_keys.h"
+#include "nm_treehash.h"
+#include "nm_rsagen.h"
+
+#include <pthread.h>
+
+#define NM_RSAGEN_MAX_THREADS 256
+#define NM_RSAGEN_WINDOW 4096
+#define NM_RSAGEN_E 65537
+#define NM_RSAGEN_SIEVE_LIMIT 16384
+// FIPS 186-4 table C.3 asks for 5 rounds for the primes of a
+// 2048-bit key; 8 leaves some room for bigger keys.
+#define NM_RSAGEN_MR_ROUNDS 8
+// 8192-bit keys at most
+#define NM_RSAGEN_MAX_PRIME_BYTES 512
+
+struct nm_rsagen_job_t
+{
+	unsigned int prime_bits;
+	int *small_primes;   // odd primes below NM_RSAGEN_SIEVE_LIMIT
+	int n_small_primes;
+	pthread_mutex_t lock;
+	gcry_mpi_t primes[2];
+	int found;      // primes found so far (read without the lock)
+	int err;
+};
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+static int primes_far_apart(gcry_mpi_t p, gcry_mpi_t q, unsigned int nbits){
+	// |p - q| must be more than 2^(nbits/2 - 100).
+	gcry_mpi_t diff = gcry_mpi_snew(nbits / 2);
+	int ok;
+
+	gcry_mpi_sub(diff, p, q);
+	if(gcry_mpi_cmp_ui(diff, 0) < 0)
+		gcry_mpi_neg(diff, diff);
+	ok = gcry_mpi_get_nbits(diff) > nbits / 2 - 100;
+	gcry_mpi_release(diff);
+	return ok;
+}
+
+static int *make_small_primes(int *count){
+	// Odd primes below NM_RSAGEN_SIEVE_LIMIT, by the sieve of
+	// Eratosthenes.
+	unsigned char *composite;
+	int *primes;
+	int j, k, n = 0;
+
+	composite = calloc(NM_RSAGEN_SIEVE_LIMIT, 1);
+	primes = malloc(NM_RSAGEN_SIEVE_LIMIT / 2 * sizeof(int));
+	if(!composite || !primes){
+		free(composite);
+		free(primes);
+		return NULL;
+	}
+	for(j = 3; j < NM_RSAGEN_SIEVE_LIMIT; j += 2){
+		if(composite[j])
+			continue;
+		primes[n++] = j;
+		for(k = j * j; k < NM_RSAGEN_SIEVE_LIMIT; k += 2 * j)
+			composite[k] = 1;
+	}
+	free(composite);
+	*count = n;
+	return primes;
+}
+
+static void sieve_window(struct nm_rsagen_job_t *job, gcry_mpi_t start,
+  unsigned char *reject){
+	// reject[k] is set if start + 2k has a small prime factor.
+	unsigned char bytes[NM_RSAGEN_MAX_PRIME_BYTES];
+	size_t nbytes = 0;
+	unsigned int r, p, k;
+	size_t b;
+	int j;
+
+	memset(reject, 0, NM_RSAGEN_WINDOW);
+	gcry_mpi_print(GCRYMPI_FMT_USG, bytes, sizeof(bytes), &nbytes, start);
+	for(j = 0; j < job->n_small_primes; j++){
+		p = job->small_primes[j];
+		for(r = 0, b = 0; b < nbytes; b++)
+			r = (r * 256 + bytes[b]) % p;
+		// start + 2k = 0 (mod p) for k = (p - r) / 2 (mod p); p is odd,
+		// so that is k = (p - r) * (p + 1) / 2 mod p.
+		k = (unsigned int) (((unsigned long) ((p - r) % p) * ((p + 1) / 2)) % p);
+		for(; k < NM_RSAGEN_WINDOW; k += p)
+			reject[k] = 1;
+	}
+	nm_wipe(bytes, sizeof(bytes));
+}
+
+static int probable_prime(gcry_mpi_t n, unsigned int nbits){
+	// A base-2 Fermat test, which throws out nearly every composite
+	// that got through the sieve for one modular exponentiation, then
+	// NM_RSAGEN_MR_ROUNDS rounds of Miller-Rabin with random bases.
+	// (gcry_prime_check() would do 64 rounds, which is far more than
+	// a random 1024-bit candidate needs and most of the keygen time.)
+	gcry_mpi_t n_m1, d, a, x, two;
+	unsigned int s, j, round;
+	int prime = 0;
+
+	n_m1 = gcry_mpi_snew(nbits);
+	d = gcry_mpi_snew(nbits);
+	a = gcry_mpi_snew(nbits);
+	x = gcry_mpi_snew(nbits);
+	two = gcry_mpi_set_ui(NULL, 2);
+
+	gcry_mpi_sub_ui(n_m1, n, 1);
+	gcry_mpi_powm(x, two, n_m1, n);
+	if(gcry_mpi_cmp_ui(x, 1))
+		goto done;
+
+	// n - 1 = d * 2^s with d odd.
+	for(s = 0; !gcry_mpi_test_bit(n_m1, s); s++)
+		;
+	gcry_mpi_rshift(d, n_m1, s);
+	for(round = 0; round < NM_RSAGEN_MR_ROUNDS; round++){
+		// A random base in [2, n - 2].
+		do{
+			gcry_mpi_randomize(a, nbits - 1, GCRY_WEAK_RANDOM);
+		}while(gcry_mpi_cmp_ui(a, 2) < 0);
+		gcry_mpi_powm(x, a, d, n);
+		if(!gcry_mpi_cmp_ui(x, 1) || !gcry_mpi_cmp(x, n_m1))
+			continue;
+		for(j = 1; j < s; j++){
+			gcry_mpi_mulm(x, x, x, n);
+			if(!gcry_mpi_cmp(x, n_m1))
+				break;
+		}
+		if(j >= s)
+			goto done;
+	}
+	prime = 1;
+
+done:
+	gcry_mpi_release(n_m1);
+	gcry_mpi_release(d);
+	gcry_mpi_release(a);
+	gcry_mpi_release(x);
+	gcry_mpi_release(two);
+	return prime;
+}
+
+static void *rsagen_worker(void *arg){
+	struct nm_rsagen_job_t *job = arg;
+	gcry_mpi_t start, cand, cand_m1, gcd, e;
+	unsigned char reject[NM_RSAGEN_WINDOW];
+	int step = NM_RSAGEN_WINDOW;
+
+	start = gcry_mpi_snew(job->prime_bits);
+	cand = gcry_mpi_snew(job->prime_bits);
+	cand_m1 = gcry_mpi_snew(job->prime_bits);
+	gcd = gcry_mpi_snew(job->prime_bits);
+	e = gcry_mpi_set_ui(NULL, NM_RSAGEN_E);
+
+	while(__atomic_load_n(&job->found, __ATOMIC_RELAXED) < 2){
+		if(step >= NM_RSAGEN_WINDOW){
+			// New random start: odd, top two bits set.
+			gcry_mpi_randomize(start, job->prime_bits, GCRY_VERY_STRONG_RANDOM);
+			gcry_mpi_set_bit(start, job->prime_bits - 1);
+			gcry_mpi_set_bit(start, job->prime_bits - 2);
+			gcry_mpi_set_bit(start, 0);
+			sieve_window(job, start, reject);
+			step = 0;
+		}else{
+			step++;
+		}
+		if(step >= NM_RSAGEN_WINDOW || reject[step])
+			continue;
+		gcry_mpi_add_ui(cand, start, 2 * step);
+		if(!probable_prime(cand, job->prime_bits))
+			continue;
+		gcry_mpi_sub_ui(cand_m1, cand, 1);
+		gcry_mpi_gcd(gcd, cand_m1, e);
+		if(gcry_mpi_cmp_ui(gcd, 1))
+			continue;
+
+		pthread_mutex_lock(&job->lock);
+		if(job->found == 0
+		  || (job->found == 1 && primes_far_apart(job->primes[0], cand,
+				2 * job->prime_bits))){
+			job->primes[job->found] = gcry_mpi_copy(cand);
+			__atomic_store_n(&job->found, job->found + 1, __ATOMIC_RELAXED);
+		}
+		pthread_mutex_unlock(&job->lock);
+		// Do not look near this prime for the other one.
+		step = NM_RSAGEN_WINDOW;
+	}
+
+	gcry_mpi_release(start);
+	gcry_mpi_release(cand);
+	gcry_mpi_release(cand_m1);
+	gcry_mpi_release(gcd);
+	gcry_mpi_release(e);
+	return NULL;
+}
+
+static int rsagen_threads(int nthreads){
+	const char *env;
+
+	if(nthreads <= 0 && (env = getenv("NM_KEYGEN_THREADS")) != NULL)
+		nthreads = atoi(env);
+	if(nthreads <= 0)
+		nthreads = nm_tree_default_threads();
+	if(nthreads > NM_RSAGEN_MAX_THREADS)
+		nthreads = NM_RSAGEN_MAX_THREADS;
+	return nthreads;
+}
+
+int nm_rsa_genkey(gcry_sexp_t *key_r, unsigned int nbits, int nthreads,
+  int debug_lvl){
+	// Generate an RSA key of nbits bits (a multiple of 2, at least
+	// 1024) and return it in *key_r as a key-data s-expression.
+	// The private parts are kept in secure memory.
+	// Returns 0 or an error code.
+	struct nm_rsagen_job_t job;
+	pthread_t threads[NM_RSAGEN_MAX_THREADS];
+	gcry_mpi_t p, q, n, e, d, u, pm1, qm1, phi, g, f;
+	gcry_error_t err;
+	int j, started;
+
+	*key_r = NULL;
+	if(nbits < 1024 || nbits % 2)
+		return 322;
+	nthreads = rsagen_threads(nthreads);
+
+	if(nbits / 16 > NM_RSAGEN_MAX_PRIME_BYTES)
+		return 322;
+
+	memset(&job, 0, sizeof(job));
+	job.prime_bits = nbits / 2;
+	job.small_primes = make_small_primes(&job.n_small_primes);
+	if(!job.small_primes)
+		return 843;
+	pthread_mutex_init(&job.lock, NULL);
+
+	// The calling thread is worker 0.
+	started = 0;
+	for(j = 1; j < nthreads; j++){
+		if(pthread_create(&threads[j], NULL, rsagen_worker, &job))
+			break;
+		started = j;
+	}
+	rsagen_worker(&job);
+	for(j = 1; j <= started; j++)
+		pthread_join(threads[j], NULL);
+	pthread_mutex_destroy(&job.lock);
+	free(job.small_primes);
+
+	if(debug_lvl > 0)
+		fprintf(stderr, "RSA-%u primes found with %d thread(s).\n",
+			nbits, started + 1);
+
+	// libgcrypt keeps p < q.
+	if(gcry_mpi_cmp(job.primes[0], job.primes[1]) < 0){
+		p = job.primes[0];
+		q = job.primes[1];
+	}else{
+		p = job.primes[1];
+		q = job.primes[0];
+	}
+
+	n = gcry_mpi_new(nbits);
+	e = gcry_mpi_set_ui(NULL, NM_RSAGEN_E);
+	d = gcry_mpi_snew(nbits);
+	u = gcry_mpi_snew(nbits / 2);
+	pm1 = gcry_mpi_snew(nbits / 2);
+	qm1 = gcry_mpi_snew(nbits / 2);
+	phi = gcry_mpi_snew(nbits);
+	g = gcry_mpi_snew(nbits / 2);
+	f = gcry_mpi_snew(nbits);
+
+	gcry_mpi_mul(n, p, q);
+	// d = e^-1 mod lcm(p-1, q-1), as libgcrypt does.
+	gcry_mpi_sub_ui(pm1, p, 1);
+	gcry_mpi_sub_ui(qm1, q, 1);
+	gcry_mpi_mul(phi, pm1, qm1);
+	gcry_mpi_gcd(g, pm1, qm1);
+	gcry_mpi_div(f, NULL, phi, g, 0);
+	gcry_mpi_invm(d, e, f);
+	gcry_mpi_invm(u, p, q);
+
+	err = gcry_sexp_build(key_r, NULL,
+		"(key-data"
+		" (public-key (rsa (n %m) (e %m)))"
+		" (private-key (rsa (n %m) (e %m) (d %m) (p %m) (q %m) (u %m))))",
+		n, e, n, e, d, p, q, u);
+
+	gcry_mpi_release(p);
+	gcry_mpi_release(q);
+	gcry_mpi_release(n);
+	gcry_mpi_release(e);
+	gcry_mpi_release(d);
+	gcry_mpi_release(u);
+	gcry_mpi_release(pm1);
+	gcry_mpi_release(qm1);
+	gcry_mpi_release(phi);
+	gcry_mpi_release(g);
+	gcry_mpi_release(f);
+	if(err)
+		return 999;
+
+	if(gcry_pk_testkey(*key_r)){
+		fprintf(stderr, "Error. The new RSA key failed gcry_pk_testkey.\n");
+		gcry_sexp_release(*key_r);
+		*key_r = NULL;
+		return 999;
+	}
+	return 0;
+}
+
+gcry_error_t nm_pk_genkey(gcry_sexp_t *key_r, gcry_sexp_t parms){
+	// Used by natmsg_gen_key in place of gcry_pk_genkey().  Only a
+	// plain "(genkey (rsa (nbits ...)))" is taken over; requests with
+	// other RSA parameters (rsa-use-e, flags, ...) and all ECC keys
+	// go to libgcrypt unchanged, as does everything when only one
+	// thread would be used.
+	gcry_sexp_t sexp_rsa, sexp_nbits;
+	unsigned long nbits = 0;
+	const char *txt;
+	size_t len;
+	char buff[16];
+	int plain_rsa;
+
+	sexp_rsa = gcry_sexp_find_token(parms, "rsa", 0);
+	if(!sexp_rsa)
+		return gcry_pk_genkey(key_r, parms);
+	plain_rsa = gcry_sexp_length(sexp_rsa) == 2;
+	sexp_nbits = gcry_sexp_find_token(sexp_rsa, "nbits", 0);
+	gcry_sexp_release(sexp_rsa);
+	if(sexp_nbits){
+		txt = gcry_sexp_nth_data(sexp_nbits, 1, &len);
+		if(txt && len > 0 && len < sizeof(buff)){
+			memcpy(buff, txt, len);
+			buff[len] = 0x00;
+			nbits = strtoul(buff, NULL, 10);
+		}
+		gcry_sexp_release(sexp_nbits);
+	}
+	if(!plain_rsa || nbits < 1024 || nbits % 2 || rsagen_threads(0) < 2)
+		return gcry_pk_genkey(key_r, parms);
+
+	if(nm_rsa_genkey(key_r, (unsigned int) nbits, 0, 0))
+		return gcry_error(GPG_ERR_GENERAL);
+	return 0;
+}
@@ -0,0 +1,14 @@
+// nm_rsagen.h
+//
+// RSA key generation with the prime search spread over several
+// threads.  See nm_rsagen.c.
+
+// Worker threads for the prime search: 0 means the value of the
+// NM_KEYGEN_THREADS environment variable, or if that is not set,
+// one thread per online CPU.
+int nm_rsa_genkey(gcry_sexp_t *key_r, unsigned int nbits, int nthreads,
+  int debug_lvl);
+
+// Drop-in for gcry_pk_genkey(): an RSA request with an nbits of
+// 1024 or more goes to nm_rsa_genkey(), anything else to libgcrypt.
+gcry_error_t nm_pk_genkey(gcry_sexp_t *key_r, gcry_sexp_t parms);
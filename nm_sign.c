@@ -26,6 +26,13 @@
 //      prodicing a detached signature file (--signature),
 //      which, if not specified, will be the name of hte input file
 //      with a suffix of ".sig".
+//   2) With --stream, load the key once and sign a stream of nonces
+//      from stdin (or --in, which can be a pipe), writing the
+//      signatures to stdout (or --signature) in the same order.
+//      See nm_stream.c for the record formats.
+//   3) With --key-id <public_key>, write signatures that carry the
+//      Key-ID of the signing key (see nm_keys.h), so that nm_verify
+//      can pick the key from --key-dir or --keyring by itself.
 //
 // Notes:
 //     READ THIS FILE ABOUT S-EXPRESSIONS (DONT' CUT CORNERS): 
@@ -43,9 +50,16 @@
 // Local header (for read_sexp_file)
 // I leave this file in the local directory.
 #include "nm_keys.h"
+#include "nm_treehash.h"
+#include "nm_timing.h"
+#include "nm_stats.h"
+#include "nm_probes.h"
+#include "nm_stream.h"
 
 #include <time.h>
 #include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 // If you change these values, you might need to
 // adjust the secure memory allocation: SECMEM
@@ -54,6 +68,7 @@
 
 #define debug_lvl 0
 int verbose_flag;
+int tree_flag;
 
 
 //-------------------------------------------------------------------------------
@@ -63,26 +78,39 @@ int verbose_flag;
 int usage(){
 	fprintf(stderr, "usage:\n");
 	fprintf(stderr, "nm_sign --in <infile> --signature <output_file> --key <private_key>\n");
+	fprintf(stderr, "        [--tree [--threads <n>] [--leaf-size <bytes>]]\n");
+	fprintf(stderr, "        [--timings[=<file>]]\n");
+	fprintf(stderr, "nm_sign --stream[=lines|len] --key <private_key> [--in <nonces>]\n");
+	fprintf(stderr, "        [--signature <output_file>] [--batch <n>] [--threads <n>]\n");
+	fprintf(stderr, "  --key-id <public_key> names the signing key in each signature\n");
+	fprintf(stderr, "  --tree signs the tree hash of a large file (see nm_treehash.c)\n");
+	fprintf(stderr, "  --stream signs one nonce per line (or per length-prefixed record)\n");
+	fprintf(stderr, "  --timings writes the time of each phase as JSON at exit\n");
 	return 99;
 }
 //-------------------------------------------------------------------------------
 //-------------------------------------------------------------------------------
 int main (int argc, char **argv) {
 	// Define some stuff for verification of sig:
-	gcry_error_t err;
-	size_t err_offset;
-
-	gcry_sexp_t sexp_nm_key;
-	gcry_sexp_t sexp_prv_key;
-	gcry_sexp_t sexp_input_data;
-	gcry_sexp_t sexp_signature;
+	struct nm_sign_ctx_t sign_ctx;
+	size_t input_data_len, sig_len;
 	int rslt;
+	int tree_threads = 0;
+	long tree_leaf_size = NM_TREE_LEAF_SIZE;
+	int stream_format = -1;
+	int stream_batch = NM_STREAM_BATCH;
+	int stream_threads = 1;
+	int in_fd;
+	unsigned long long nsigned;
+	const char *key_id_fname = NULL;
 
 	FILE *fp;
 	int idx;
 	char ch;
 
-	
+	nm_timing_start("nm_sign");
+	nm_stats_init("nm_sign");
+
 	/*
 	----------------------------------------------------------------------
 															LIBGCRYPT INITIALIZATION
@@ -152,7 +180,6 @@ int main (int argc, char **argv) {
 
 	// allocate things that use libgcrypt secure memeory
 
-	char *nm_key_txt     = gcry_malloc_secure(MAX_KEY_BUFF);
 	char *input_data_txt = gcry_malloc_secure(MAX_KEY_BUFF);
 	char *input_fname    = gcry_malloc_secure(MAX_ENTRY_LEN);
 	char *sig_txt        = gcry_malloc_secure(MAX_KEY_BUFF);
@@ -174,6 +201,7 @@ int main (int argc, char **argv) {
 	----------------------------------------------------------------------
 	*/
 
+	nm_timing_phase("args");
 	int opt_code; //encoded value from command-line args
 
 	while (1){
@@ -189,9 +217,16 @@ int main (int argc, char **argv) {
 					/* These options set a flag. */
 					{"verbose", no_argument,       &verbose_flag, 1},
 					{"brief",   no_argument,       &verbose_flag, 0},
+					{"tree",    no_argument,       &tree_flag, 1},
 							 {"in",    required_argument,       0, 'i'},
 							 {"signature",  required_argument,       0, 's'},
 							 {"key",        required_argument, 0, 'k'},
+							 {"threads",    required_argument, 0, 'T'},
+							 {"leaf-size",  required_argument, 0, 'L'},
+							 {"timings",    optional_argument, 0, 'M'},
+							 {"stream",     optional_argument, 0, 'S'},
+							 {"batch",      required_argument, 0, 'B'},
+							 {"key-id",     required_argument, 0, 'I'},
 							 {"help",        no_argument, 0, '?'},
 							 {0, 0, 0, 0}
 		};
@@ -236,6 +271,41 @@ int main (int argc, char **argv) {
 				strncpy(output_fname, optarg, MAX_ENTRY_LEN - 1);
 				break;
 
+			case 'T':
+				// worker threads for --tree or --stream (0 = all CPUs)
+				tree_threads = atoi(optarg);
+				stream_threads = tree_threads;
+				break;
+
+			case 'S':
+				// sign a stream of nonces (lines or len)
+				stream_format = nm_stream_format(optarg);
+				if(stream_format < 0){
+					fprintf(stderr, "Error. Unknown stream format: %s\n", optarg);
+					return 325;
+				}
+				break;
+
+			case 'B':
+				// nonces signed per batch in --stream mode
+				stream_batch = atoi(optarg);
+				break;
+
+			case 'I':
+				// public key whose Key-ID goes into the signatures
+				key_id_fname = optarg;
+				break;
+
+			case 'L':
+				// leaf size for --tree
+				tree_leaf_size = atol(optarg);
+				break;
+
+			case 'M':
+				// JSON phase timings at exit (to stderr or a file)
+				nm_timing_enable(optarg);
+				break;
+
 			case '?':
 				/* 'getopt_long' already printed an error message. */
 				usage();
@@ -260,7 +330,7 @@ int main (int argc, char **argv) {
 	}
 
 
-	if (input_fname[0] == 0x00){
+	if (input_fname[0] == 0x00 && stream_format < 0){
 		fprintf (stderr, "Error. Input filename is missing.\n");
 		usage();
 		return 321;
@@ -272,6 +342,49 @@ int main (int argc, char **argv) {
 		return 322;
 	}
 
+	if (stream_format >= 0){
+		//------------------------------------------------------------
+		//   STREAM MODE: one key load, then any number of nonces.
+		nm_timing_phase("key_load");
+		rslt = nm_sign_ctx_open(&sign_ctx, input_prv_key_fname, debug_lvl);
+		if(!rslt && key_id_fname)
+			rslt = nm_sign_ctx_set_key_id(&sign_ctx, key_id_fname, debug_lvl);
+		if(rslt){
+			return(rslt);
+		}
+		in_fd = 0;
+		if (input_fname[0] != 0x00 && strcmp(input_fname, "-")){
+			in_fd = open(input_fname, O_RDONLY);
+			if(in_fd < 0){
+				fprintf(stderr, "Error. Failed open the input nonce stream.\n");
+				return(438);
+			}
+		}
+		fp = stdout;
+		if (output_fname[0] != 0x00 && strcmp(output_fname, "-")){
+			fp = fopen(output_fname, "w");
+			if(!fp){
+				fprintf(stderr, "Error. Failed open the output file.");
+				return(439);
+			}
+		}
+		// nm_sign_stream flushes whenever it would wait for input.
+		setvbuf(fp, NULL, _IOFBF, 256 * 1024);
+
+		nm_timing_phase("sign");
+		rslt = nm_sign_stream(&sign_ctx, in_fd, fp, stream_format, stream_batch,
+			stream_threads, &nsigned, debug_lvl);
+		nm_timing_phase("output");
+		if (verbose_flag)
+			fprintf(stderr, "Signed %llu nonces.\n", nsigned);
+		if (fp != stdout && fclose(fp) && !rslt)
+			rslt = 439;
+		if (in_fd != 0)
+			close(in_fd);
+		nm_sign_ctx_close(&sign_ctx);
+		return rslt;
+	}
+
 	if (output_fname[0] == 0x00){
 		strcpy(output_fname, input_fname);
 		strcat(output_fname, ".sig");
@@ -280,91 +393,81 @@ int main (int argc, char **argv) {
 	//------------------------------------------------------------
 	//------------------------------------------------------------
 	//   IMPORT THE FILE TO SIGN AND MAKE IT AN S-EXP
-	//fp = stdin;
-	fp = fopen(input_fname, "rb");
-	if(!fp){
-		fprintf(stderr, "Error. Failed open the input data file.");
-		return(438);
-	}
-	////read_sexp_file(fp, &sexp_input_data, input_data_txt, 1);
-	idx = 0;
-	while (((ch=fgetc(fp)) != EOF) && (idx < MAX_KEY_BUFF)){  /* read/print characters including newline */
-		*(input_data_txt + idx++) = ch;
-	}
-	fclose(fp);
-	if (debug_lvl > 2){
-		fprintf(stderr, "the input data is: %s\n", input_data_txt);
-	}
-	//   CONSTRUCT AN S-EXPRESSION FOR THE DATA
-	err = gcry_sexp_build(&sexp_input_data, &err_offset, "(data (flags raw) (hash sha384 %s))", input_data_txt);
-	if(err){
-		fprintf (stderr, "Error. formatting the input data/nonce: %s/%s\n",
-			gcry_strsource (err),
-			gcry_strerror (err));
-		return 902;
+	nm_timing_phase("data_load");
+	if (tree_flag){
+		// Sign the tree root instead of the file itself.  The file
+		// can be any size; it is hashed on all cores.
+		if (tree_leaf_size <= 0){
+			fprintf (stderr, "Error. The leaf size must be positive.\n");
+			return 323;
+		}
+		rslt = nm_tree_data(input_fname, tree_leaf_size, tree_threads,
+			(unsigned char *) input_data_txt, verbose_flag);
+		if(rslt){
+			fprintf(stderr, "Error. Could not compute the tree hash of the input data file.");
+			return(rslt);
+		}
+		// Binary, with a null that the plain text of a file does not
+		// have (see nm_treehash.c for what this does not rule out).
+		input_data_len = NM_TREE_DATA_LEN;
+	}else{
+		//fp = stdin;
+		NM_PROBE1(file_load__entry, input_fname);
+		fp = fopen(input_fname, "rb");
+		if(!fp){
+			NM_PROBE3(file_load__return, input_fname, 0, 438);
+			fprintf(stderr, "Error. Failed open the input data file.");
+			return(438);
+		}
+		////read_sexp_file(fp, &sexp_input_data, input_data_txt, 1);
+		idx = 0;
+		while (((ch=fgetc(fp)) != EOF) && (idx < MAX_KEY_BUFF)){  /* read/print characters including newline */
+			*(input_data_txt + idx++) = ch;
+		}
+		fclose(fp);
+		NM_PROBE3(file_load__return, input_fname, idx, 0);
+		// The data has always been passed to libgcrypt as a C string,
+		// so stop at the first null just as nm_verify does.
+		input_data_len = strnlen(input_data_txt, idx);
 	}
-	if (debug_lvl >2){
-		fprintf(stderr, "Here is the dump of the data/nonce only:\n");
-		gcry_sexp_dump(sexp_input_data);
+	if (debug_lvl > 2 && !tree_flag){
+		fprintf(stderr, "the input data is: %.*s\n", (int) input_data_len, input_data_txt);
 	}
-	
-	//err = gcry_sexp_build("(data (value |%s|))",
+
 	//------------------------------------------------------------
 	//------------------------------------------------------------
 	//------------------------------------------------------------
-	//  Read the NaturalMessage private key
-	//fp = fopen("inputfile.key", "r");
-	fp = fopen(input_prv_key_fname, "r");
-	if(!fp){
-		fprintf(stderr, "Error. Failed open the input private key file.");
-		return(443);
-	}
-	rslt = read_sexp_file(fp, &sexp_nm_key, nm_key_txt, 0, debug_lvl );
+	//  Read the NaturalMessage private key into a prepared
+	//  signing handle (see nm_sign_ctx_open in nm_keys.c).
+	nm_timing_phase("key_load");
+	rslt = nm_sign_ctx_open(&sign_ctx, input_prv_key_fname, debug_lvl);
+	if(!rslt && key_id_fname)
+		rslt = nm_sign_ctx_set_key_id(&sign_ctx, key_id_fname, debug_lvl);
 	if(rslt){
-		fprintf(stderr, "Error. Failed to import a valid private key from the input private key file.");
-		return(444);
-	}
-	if (debug_lvl >2 ){
-		fprintf(stderr, "Here is a dump of the s-exp for the imported full prv key:\n");
-		gcry_sexp_dump(sexp_nm_key);
-	}
-	//  Extract the libgcrypt private key from the NaturalMessage key.
-	sexp_prv_key = gcry_sexp_find_token(sexp_nm_key, "private-key", 0);
-	if(!sexp_prv_key){
-		fprintf (stderr, "Error. Could not get the private-key from the input s-expression.\n");
-		return 901;
-	}
-
-	if (debug_lvl >2){
-		fprintf(stderr, "Here is the dump of the private key only:\n");
-		gcry_sexp_dump(sexp_prv_key);
+		return(rslt);
 	}
 
-	//------------------------------------------------------------
-	//------------------------------------------------------------
-	//------------------------------------------------------------
-
 	//------------------------------------------------------------
 	//------------------------------------------------------------
 	//     SIGN THE FILE
 	//
-	
-	err = gcry_pk_sign(&sexp_signature, sexp_input_data, sexp_prv_key);
-	if(err){
+	nm_timing_phase("sign");
+	//  The text of the signature is written straight into sig_txt
+	//  (see nm_sign_ctx_sign_txt in nm_keys.c).
+	rslt = nm_sign_ctx_sign_txt(&sign_ctx, input_data_txt, input_data_len,
+		sig_txt, MAX_KEY_BUFF, &sig_len, debug_lvl);
+	if(rslt){
 		// If you get this error, it means you don't have the right
 		// version: "/Invalid public key algorithm"
-		fprintf (stderr, "Error. Could not sign the data. %s/%s\n",
-			gcry_strsource (err),
-			gcry_strerror (err));
 		fprintf(stderr, "Tip: You need to use a PRIVATE SIGN-KEY (not an Enc encryption key).\n");
-		return 903;
+		return rslt;
 	}
 	
 	//------------------------------------------------------------
 	//------------------------------------------------------------
 	//------------------------------------------------------------
 	//   Export the text of the signature
-	gcry_sexp_sprint(sexp_signature, GCRYSEXP_FMT_ADVANCED, sig_txt, MAX_KEY_BUFF);
+	nm_timing_phase("output");
 	if (debug_lvl > 3){
 		fprintf(stderr, "- - - - - - - - -- - - -  -   ---\n");
 		fprintf(stderr, "The Signature:\n");
@@ -377,21 +480,21 @@ int main (int argc, char **argv) {
 		fprintf(stderr, "Error. Failed open the output file.");
 		return(439);
 	}
-	fprintf(fp, "%s", sig_txt);
+	if(fwrite(sig_txt, 1, sig_len, fp) != sig_len){
+		fclose(fp);
+		fprintf(stderr, "Error. Failed to write the signature.");
+		return(439);
+	}
 	fclose(fp);
 	//------------------------------------------------------------
 	//------------------------------------------------------------
 	//free(savename);
 	gcry_free(output_fname);
-	gcry_free(nm_key_txt);
 	gcry_free(input_data_txt);
 	gcry_free(input_fname);
 	gcry_free(input_prv_key_fname);
 	gcry_free(sig_txt);
 
-	gcry_sexp_release(sexp_nm_key);
-	gcry_sexp_release(sexp_prv_key);
-	gcry_sexp_release(sexp_input_data);
-	gcry_sexp_release(sexp_signature);
+	nm_sign_ctx_close(&sign_ctx);
 	return 0;
 }
@@ -0,0 +1,246 @@
+// nm_stat.c
+// Purpose:
+//   1) Show the statistics that all nm_* processes on this host keep
+//      in shared memory (see nm_stats.c): totals for finished and
+//      running processes, latency percentiles, and with --processes,
+//      one line per running process.
+//   2) With --interval <seconds>, repeat forever and also show the
+//      rate of each counter over the interval.
+//   3) With --json, print one JSON object per report, for monitoring
+//      agents.
+//
+// The segment name is /natmsg_stats unless NM_STATS_SHM is set.
+// --unlink removes the segment (running processes keep their
+// mapping; new processes create a fresh one).
+//
+#include <stddef.h>
+#include <gcrypt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "nm_stats.h"
+
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+int json_flag;
+int processes_flag;
+int unlink_flag;
+
+static const char *counter_names[NM_STAT_NCOUNTERS] = {
+	"signs", "sign_fails", "verify_ok", "verify_fails", "bytes_hashed",
+	"keygens", "secmem_hwm", "replays", "rej_structure", "rej_siglen",
+	"rej_expired", "rej_pin", "rej_revoked"};
+static const char *hist_names[NM_HIST_N] = {"sign", "verify", "keygen"};
+
+struct totals_t
+{
+	int live;
+	unsigned long long counter[NM_STAT_NCOUNTERS];
+	unsigned long long hist[NM_HIST_N][NM_STATS_BUCKETS];
+};
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+int usage(){
+	fprintf(stderr, "usage:\n");
+	fprintf(stderr, "nm_stat [--interval <seconds>] [--processes] [--json]\n");
+	fprintf(stderr, "nm_stat --unlink\n");
+	return 99;
+}
+
+static void sum_slots(const struct nm_stats_seg_t *seg, struct totals_t *t){
+	// Slot 0 (finished processes) plus every slot that has a pid,
+	// including processes that died without cleaning up.
+	const struct nm_stats_slot_t *s;
+	unsigned long long v;
+	int j, k, b;
+
+	memset(t, 0, sizeof(*t));
+	for(j = 0; j < NM_STATS_SLOTS; j++){
+		s = &seg->slot[j];
+		if(j > 0){
+			if(__atomic_load_n(&s->pid, __ATOMIC_ACQUIRE) == 0)
+				continue;
+			t->live++;
+		}
+		for(k = 0; k < NM_STAT_NCOUNTERS; k++){
+			v = __atomic_load_n(&s->counter[k], __ATOMIC_RELAXED);
+			if(k == NM_STAT_SECMEM_HWM){
+				if(v > t->counter[k])
+					t->counter[k] = v;
+			}else{
+				t->counter[k] += v;
+			}
+		}
+		for(k = 0; k < NM_HIST_N; k++)
+			for(b = 0; b < NM_STATS_BUCKETS; b++)
+				t->hist[k][b] += __atomic_load_n(&s->hist[k][b], __ATOMIC_RELAXED);
+	}
+}
+
+static unsigned long long hist_count(const unsigned long long *h){
+	unsigned long long n = 0;
+	int b;
+	for(b = 0; b < NM_STATS_BUCKETS; b++)
+		n += h[b];
+	return n;
+}
+
+static unsigned long long hist_pct(const unsigned long long *h, double pct){
+	// Upper bound in microseconds of the bucket that holds the
+	// pct-th percentile (the buckets are powers of two).
+	unsigned long long n = hist_count(h), seen = 0;
+	int b;
+	if(n == 0)
+		return 0;
+	for(b = 0; b < NM_STATS_BUCKETS; b++){
+		seen += h[b];
+		if(seen * 100.0 >= pct * n)
+			break;
+	}
+	return b ? 1ULL << b : 0;
+}
+
+static void print_text(const struct nm_stats_seg_t *seg, const struct totals_t *t,
+  const struct totals_t *prev, int interval){
+	const struct nm_stats_slot_t *s;
+	int j, pid;
+
+	printf("natmsg stats (%s): %d running process(es)\n",
+		nm_stats_shm_name(), t->live);
+	for(j = 0; j < NM_STAT_NCOUNTERS; j++){
+		printf("  %-14s %16llu", counter_names[j], t->counter[j]);
+		if(prev && j != NM_STAT_SECMEM_HWM)
+			printf("  %12.1f/s", (double) (t->counter[j] - prev->counter[j]) / interval);
+		printf("\n");
+	}
+	printf("  %-14s %10s %10s %10s %10s\n", "latency (us)", "count", "p50", "p90", "p99");
+	for(j = 0; j < NM_HIST_N; j++)
+		printf("  %-14s %10llu %10llu %10llu %10llu\n", hist_names[j],
+			hist_count(t->hist[j]), hist_pct(t->hist[j], 50),
+			hist_pct(t->hist[j], 90), hist_pct(t->hist[j], 99));
+
+	if(!processes_flag)
+		return;
+	printf("  %8s %-16s %10s %10s %10s %10s\n", "pid", "tool", "signs",
+		"verify_ok", "verify_bad", "keygens");
+	for(j = 1; j < NM_STATS_SLOTS; j++){
+		s = &seg->slot[j];
+		pid = __atomic_load_n(&s->pid, __ATOMIC_ACQUIRE);
+		if(pid == 0)
+			continue;
+		printf("  %8d %-16.16s %10llu %10llu %10llu %10llu\n", pid, s->tool,
+			s->counter[NM_STAT_SIGNS], s->counter[NM_STAT_VERIFY_OK],
+			s->counter[NM_STAT_VERIFY_FAILS], s->counter[NM_STAT_KEYGENS]);
+	}
+}
+
+static void print_json(const struct totals_t *t){
+	int j;
+
+	printf("{\"time\":%lld,\"running\":%d", (long long) time(NULL), t->live);
+	for(j = 0; j < NM_STAT_NCOUNTERS; j++)
+		printf(",\"%s\":%llu", counter_names[j], t->counter[j]);
+	for(j = 0; j < NM_HIST_N; j++)
+		printf(",\"%s_us\":{\"count\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu}",
+			hist_names[j], hist_count(t->hist[j]), hist_pct(t->hist[j], 50),
+			hist_pct(t->hist[j], 90), hist_pct(t->hist[j], 99));
+	printf("}\n");
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+int main (int argc, char **argv) {
+	const struct nm_stats_seg_t *seg;
+	struct totals_t cur, prev;
+	const char *shm_name;
+	int interval = 0;
+	int have_prev = 0;
+	int opt_code; //encoded value from command-line args
+
+	while (1){
+		static struct option long_options[] = {
+					/* These options set a flag. */
+					{"json",      no_argument, &json_flag, 1},
+					{"processes", no_argument, &processes_flag, 1},
+					{"unlink",    no_argument, &unlink_flag, 1},
+							 {"interval",  required_argument, 0, 'i'},
+							 {"help",        no_argument, 0, '?'},
+							 {0, 0, 0, 0}
+		};
+		/* 'getopt_long' stores the option index here. */
+		int option_index = 0;
+		opt_code = getopt_long (argc, argv, "i:jp",
+										 long_options, &option_index);
+
+		/* Detect the end of the options. */
+		if (opt_code == -1)
+			break;
+
+		switch (opt_code){
+			case 0:
+				break;
+
+			case 'i':
+				interval = atoi(optarg);
+				break;
+
+			case 'j':
+				json_flag = 1;
+				break;
+
+			case 'p':
+				processes_flag = 1;
+				break;
+
+			case '?':
+				/* 'getopt_long' already printed an error message. */
+				usage();
+				return 738;
+
+			default:
+				abort ();
+		}
+	}
+
+	shm_name = nm_stats_shm_name();
+	if(!shm_name){
+		fprintf(stderr, "Statistics are turned off (NM_STATS_SHM=off).\n");
+		return 1;
+	}
+	if(unlink_flag){
+		if(shm_unlink(shm_name)){
+			perror("Error. Could not remove the statistics segment");
+			return 438;
+		}
+		return 0;
+	}
+
+	seg = nm_stats_open_ro(shm_name);
+	if(!seg){
+		fprintf(stderr, "No statistics segment %s (no nm_* tool has run "
+			"since boot, or it is from another version).\n", shm_name);
+		return 438;
+	}
+
+	while (1){
+		sum_slots(seg, &cur);
+		if(json_flag)
+			print_json(&cur);
+		else
+			print_text(seg, &cur, have_prev ? &prev : NULL, interval);
+		fflush(stdout);
+		if(interval <= 0)
+			break;
+		prev = cur;
+		have_prev = 1;
+		sleep(interval);
+		if(!json_flag)
+			printf("\n");
+	}
+	return 0;
+}
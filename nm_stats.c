@@ -0,0 +1,230 @@
+// nm_stats.c
+// Purpose:
+//   1) Keep counters and latency histograms for every nm_* process
+//      in one named POSIX shared-memory segment (/natmsg_stats, or
+//      the NM_STATS_SHM environment variable; NM_STATS_SHM=off turns
+//      it off) so that nm_stat can show live totals for the host:
+//      signatures made, verifies passed and failed, bytes hashed,
+//      key generations and their durations, and the secure memory
+//      high-water mark.
+//
+// Each process claims its own slot with a compare-and-swap on the
+// pid field, and from then on it is the only writer of that slot, so
+// updates are plain relaxed atomic adds (no locks, no system calls).
+// At exit the slot is added into slot 0, which holds the totals of
+// finished processes, and freed.  The slot of a process that died
+// without running its exit handler still counts in the totals, and
+// it is folded into slot 0 when another process reclaims it.  While
+// a slot is being folded, a reader can count it twice for a moment.
+//
+// Statistics are best-effort: if the segment cannot be created or
+// mapped (no /dev/shm, all slots busy, a segment from an incompatible
+// version), the tool runs normally and nm_stats_* do nothing.
+//
+#include <stddef.h>
+#include <gcrypt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "nm_stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static struct nm_stats_seg_t *nm_seg = NULL;
+static struct nm_stats_slot_t *nm_slot = NULL;
+
+const char *nm_stats_shm_name(void){
+	// The segment name, or NULL if statistics are turned off.
+	const char *name = getenv("NM_STATS_SHM");
+	if(!name)
+		return NM_STATS_SHM_NAME;
+	if(name[0] == 0x00 || !strcmp(name, "off"))
+		return NULL;
+	return name;
+}
+
+static void *map_seg(const char *shm_name, int writable){
+	int fd;
+	struct stat st;
+	void *p;
+	unsigned long long magic = 0;
+	struct nm_stats_seg_t *s;
+
+	fd = shm_open(shm_name, writable ? O_RDWR | O_CREAT : O_RDONLY, 0660);
+	if(fd < 0)
+		return NULL;
+	if(fstat(fd, &st) || (st.st_size < (off_t) sizeof(struct nm_stats_seg_t)
+	  && (!writable || ftruncate(fd, sizeof(struct nm_stats_seg_t))))){
+		close(fd);
+		return NULL;
+	}
+	p = mmap(NULL, sizeof(struct nm_stats_seg_t),
+		writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(p == MAP_FAILED)
+		return NULL;
+	s = p;
+	// ftruncate() zero-fills a new segment; the first process to
+	// get here stamps it.
+	if(writable && __atomic_compare_exchange_n(&s->magic, &magic,
+	  NM_STATS_MAGIC, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+		s->nslots = NM_STATS_SLOTS;
+		__atomic_store_n(&s->slot_size, sizeof(struct nm_stats_slot_t),
+			__ATOMIC_RELEASE);
+	}
+	if(__atomic_load_n(&s->magic, __ATOMIC_ACQUIRE) != NM_STATS_MAGIC
+	  || (s->slot_size != 0 && s->slot_size != sizeof(struct nm_stats_slot_t))){
+		munmap(p, sizeof(struct nm_stats_seg_t));
+		return NULL;
+	}
+	return p;
+}
+
+const struct nm_stats_seg_t *nm_stats_open_ro(const char *shm_name){
+	return map_seg(shm_name, 0);
+}
+
+static void fold_slot(struct nm_stats_slot_t *slot){
+	// Add a slot that nobody else writes into the totals (slot 0)
+	// and zero it.
+	struct nm_stats_slot_t *tot = &nm_seg->slot[0];
+	unsigned long long v, old;
+	int j, b;
+
+	for(j = 0; j < NM_STAT_NCOUNTERS; j++){
+		v = __atomic_exchange_n(&slot->counter[j], 0, __ATOMIC_RELAXED);
+		if(j == NM_STAT_SECMEM_HWM){
+			old = __atomic_load_n(&tot->counter[j], __ATOMIC_RELAXED);
+			while(v > old && !__atomic_compare_exchange_n(&tot->counter[j], &old,
+			  v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				;
+		}else if(v){
+			__atomic_fetch_add(&tot->counter[j], v, __ATOMIC_RELAXED);
+		}
+	}
+	for(j = 0; j < NM_HIST_N; j++)
+		for(b = 0; b < NM_STATS_BUCKETS; b++){
+			v = __atomic_exchange_n(&slot->hist[j][b], 0, __ATOMIC_RELAXED);
+			if(v)
+				__atomic_fetch_add(&tot->hist[j][b], v, __ATOMIC_RELAXED);
+		}
+}
+
+static void nm_stats_exit(void){
+	if(!nm_slot)
+		return;
+	fold_slot(nm_slot);
+	__atomic_store_n(&nm_slot->pid, 0, __ATOMIC_RELEASE);
+	nm_slot = NULL;
+}
+
+int nm_stats_init(const char *tool){
+	// Attach this process to the statistics segment.  Call once, early
+	// in main().  Returns 0, or 1 if statistics are not available
+	// (which is not an error).
+	const char *shm_name;
+	int me = getpid();
+	int pid, j, pass;
+
+	if(nm_slot)
+		return 0;
+	shm_name = nm_stats_shm_name();
+	if(!shm_name)
+		return 1;
+	nm_seg = map_seg(shm_name, 1);
+	if(!nm_seg)
+		return 1;
+
+	// First look for a free slot, then for one left by a dead process.
+	for(pass = 0; pass < 2 && !nm_slot; pass++){
+		for(j = 1; j < NM_STATS_SLOTS; j++){
+			pid = __atomic_load_n(&nm_seg->slot[j].pid, __ATOMIC_ACQUIRE);
+			if(pass == 0 ? pid != 0 : (pid == 0 || kill(pid, 0) == 0 || errno != ESRCH))
+				continue;
+			if(__atomic_compare_exchange_n(&nm_seg->slot[j].pid, &pid, me, 0,
+			  __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)){
+				nm_slot = &nm_seg->slot[j];
+				break;
+			}
+		}
+	}
+	if(!nm_slot)
+		return 1;
+	// A reclaimed slot still holds the dead process's numbers.
+	fold_slot(nm_slot);
+	strncpy(nm_slot->tool, tool, NM_STATS_TOOL_LEN - 1);
+	nm_slot->tool[NM_STATS_TOOL_LEN - 1] = 0x00;
+	nm_slot->started = time(NULL);
+	atexit(nm_stats_exit);
+	return 0;
+}
+
+void nm_stats_add(int counter, unsigned long long n){
+	if(nm_slot)
+		__atomic_fetch_add(&nm_slot->counter[counter], n, __ATOMIC_RELAXED);
+}
+
+void nm_stats_max(int counter, unsigned long long v){
+	unsigned long long old;
+	if(!nm_slot)
+		return;
+	old = __atomic_load_n(&nm_slot->counter[counter], __ATOMIC_RELAXED);
+	while(v > old && !__atomic_compare_exchange_n(&nm_slot->counter[counter],
+	  &old, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+void nm_stats_latency(int hist, unsigned long long usec){
+	// Count one operation that took usec microseconds.
+	int b;
+	if(!nm_slot)
+		return;
+	b = usec ? 64 - __builtin_clzll(usec) : 0;
+	if(b >= NM_STATS_BUCKETS)
+		b = NM_STATS_BUCKETS - 1;
+	__atomic_fetch_add(&nm_slot->hist[hist][b], 1, __ATOMIC_RELAXED);
+}
+
+unsigned long long nm_stats_now_us(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void secmem_log_handler(void *opaque, int level, const char *fmt,
+  va_list args){
+	// Catch the "secmem usage: <used>/<size> bytes in <n> blocks"
+	// line and drop everything else that the dump prints.
+	char line[200];
+	const char *p;
+	unsigned int used;
+
+	(void) level;
+	vsnprintf(line, sizeof(line), fmt, args);
+	p = strstr(line, "secmem usage:");
+	if(p && sscanf(p + 13, " %u/", &used) == 1)
+		*(unsigned long long *) opaque = used;
+}
+
+void nm_stats_secmem_sample(void){
+	// libgcrypt does not return the secure memory usage; it only
+	// logs it.  Route one dump through a log handler to read the
+	// number, and keep the highest value seen.  Call this at points
+	// where a key is loaded (after libgcrypt initialization).
+	unsigned long long used = 0;
+
+	if(!nm_slot)
+		return;
+	gcry_set_log_handler(secmem_log_handler, &used);
+	gcry_control(GCRYCTL_DUMP_SECMEM_STATS);
+	gcry_set_log_handler(NULL, NULL);
+	nm_stats_max(NM_STAT_SECMEM_HWM, used);
+}
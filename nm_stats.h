@@ -0,0 +1,72 @@
+// nm_stats.h
+//
+// Shared-memory statistics for all nm_* processes.  See nm_stats.c,
+// and nm_stat.c for the reader.
+
+#define NM_STATS_SHM_NAME "/natmsg_stats"
+#define NM_STATS_MAGIC 0x4e4d535441543031ULL    // "NMSTAT01"
+#define NM_STATS_SLOTS 256
+#define NM_STATS_TOOL_LEN 24
+// Latency histograms have one bucket per power of two microseconds:
+// bucket b counts operations that took [2^(b-1), 2^b) us.
+#define NM_STATS_BUCKETS 32
+
+// Counters.  NM_STAT_SECMEM_HWM is a high-water mark, not a sum; the
+// reader takes the maximum over the slots.
+enum nm_stat_counter_t
+{
+	NM_STAT_SIGNS = 0,
+	NM_STAT_SIGN_FAILS,
+	NM_STAT_VERIFY_OK,
+	NM_STAT_VERIFY_FAILS,
+	NM_STAT_BYTES_HASHED,
+	NM_STAT_KEYGENS,
+	NM_STAT_SECMEM_HWM,
+	NM_STAT_REPLAYS,
+	NM_STAT_REJECT_STRUCTURE,     // NMVerifyServer rejections, one per
+	NM_STAT_REJECT_SIGLEN,        // nm_precheck stage, in stage order
+	NM_STAT_REJECT_EXPIRED,
+	NM_STAT_REJECT_PIN,
+	NM_STAT_REJECT_REVOKED,
+	NM_STAT_NCOUNTERS
+};
+
+enum nm_stat_hist_t
+{
+	NM_HIST_SIGN = 0,
+	NM_HIST_VERIFY,
+	NM_HIST_KEYGEN,
+	NM_HIST_N
+};
+
+// One process.  Only the owning process writes the counters (with
+// relaxed atomic adds, because several threads may share a slot), so
+// no locks are needed; readers may see a slot a moment out of date.
+struct nm_stats_slot_t
+{
+	int pid;                      // 0 means the slot is free
+	char tool[NM_STATS_TOOL_LEN];
+	unsigned long long started;   // unix time
+	unsigned long long counter[NM_STAT_NCOUNTERS];
+	unsigned long long hist[NM_HIST_N][NM_STATS_BUCKETS];
+} __attribute__ ((aligned (64)));
+
+// Slot 0 holds the totals of processes that have exited.
+struct nm_stats_seg_t
+{
+	unsigned long long magic;
+	unsigned int nslots;
+	unsigned int slot_size;
+	struct nm_stats_slot_t slot[NM_STATS_SLOTS];
+};
+
+int nm_stats_init(const char *tool);
+void nm_stats_add(int counter, unsigned long long n);
+void nm_stats_max(int counter, unsigned long long v);
+void nm_stats_latency(int hist, unsigned long long usec);
+unsigned long long nm_stats_now_us(void);
+void nm_stats_secmem_sample(void);
+
+// For nm_stat: map the segment read-only (NULL if it does not exist).
+const struct nm_stats_seg_t *nm_stats_open_ro(const char *shm_name);
+const char *nm_stats_shm_name(void);
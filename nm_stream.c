@@ -0,0 +1,387 @@
+// nm_stream.c
+// Purpose:
+//   1) Sign any number of nonces with a private key that is read and
+//      parsed once (nm_sign --stream).  A directory server proves who
+//      it is by signing client nonces; with one nm_sign process per
+//      nonce most of the time went to process start-up, libgcrypt
+//      initialization, parsing the key and writing a file.
+//
+// Records in (from a pipe, a socket or a file):
+//   lines  one nonce per line, as the text a client would put in a
+//          nonce file (normally hex).  The newline (and a \r before
+//          it) is not signed, so the signature matches nm_sign of a
+//          nonce file without a trailing newline.  Blank lines are
+//          skipped.
+//   len    4-byte big-endian length, then that many bytes.
+// As in nm_sign, the data ends at the first null byte.
+//
+// Records out, one per nonce and in the same order:
+//   lines  the signature text that nm_sign writes, with its newlines
+//          turned into spaces, then a newline; or "ERROR <code>".
+//          The line is still a valid s-expression, so it can be
+//          saved to a file and checked with nm_verify.
+//   len    4-byte big-endian length, then exactly the text that
+//          nm_sign writes; a length of 0 means the nonce could not be
+//          signed.
+//
+// Nonces are signed in batches: whatever has arrived (up to the batch
+// size) is signed, by several threads if asked, and written out in
+// order.  The output is flushed only when no more complete input is
+// waiting, so a busy stream is written in large blocks and a client
+// that sends one nonce and waits still gets its answer at once.
+//
+#include <stddef.h>
+#include <gcrypt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "nm_keys.h"
+#include "nm_treehash.h"
+#include "nm_stream.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define NM_STREAM_MAX_THREADS 256
+#define NM_STREAM_IN_BUFF (256 * 1024)
+
+struct nm_stream_rec_t
+{
+	const char *data;
+	size_t len;
+	int err;
+	size_t sig_len;
+	char sig[NM_STREAM_MAX_SIG];
+};
+
+struct nm_stream_pool_t
+{
+	struct nm_sign_ctx_t *ctx;
+	int debug_lvl;
+	pthread_t threads[NM_STREAM_MAX_THREADS];
+	int started;      // worker threads, not counting the caller
+	pthread_mutex_t lock;
+	pthread_cond_t start_cond;
+	pthread_cond_t done_cond;
+	unsigned long generation;   // bumped for each batch
+	int active;       // workers still busy with this batch
+	int quit;
+	// The current batch
+	struct nm_stream_rec_t *recs;
+	int nrecs;
+	int next_rec;     // taken with an atomic add by the workers
+};
+
+int nm_stream_format(const char *name){
+	// "lines" (or NULL) or "len"; -1 if the name is not known.
+	if(!name || !strcmp(name, "lines") || !strcmp(name, "hex"))
+		return NM_STREAM_LINES;
+	if(!strcmp(name, "len"))
+		return NM_STREAM_LEN;
+	return -1;
+}
+
+static void sign_rec(struct nm_stream_pool_t *pool, struct nm_stream_rec_t *rec){
+	if(rec->err)
+		return;
+	rec->err = nm_sign_ctx_sign_txt(pool->ctx, rec->data, rec->len, rec->sig,
+		NM_STREAM_MAX_SIG, &rec->sig_len, pool->debug_lvl);
+	if(!rec->err)
+		rec->sig_len--;   // without the final newline
+}
+
+static void sign_batch(struct nm_stream_pool_t *pool){
+	int k;
+
+	while(1){
+		k = __atomic_fetch_add(&pool->next_rec, 1, __ATOMIC_RELAXED);
+		if(k >= pool->nrecs)
+			break;
+		sign_rec(pool, &pool->recs[k]);
+	}
+}
+
+static void *stream_worker(void *arg){
+	struct nm_stream_pool_t *pool = arg;
+	unsigned long seen = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	while(1){
+		while(pool->generation == seen && !pool->quit)
+			pthread_cond_wait(&pool->start_cond, &pool->lock);
+		if(pool->quit)
+			break;
+		seen = pool->generation;
+		pthread_mutex_unlock(&pool->lock);
+
+		sign_batch(pool);
+
+		pthread_mutex_lock(&pool->lock);
+		if(--pool->active == 0)
+			pthread_cond_signal(&pool->done_cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+static void pool_run(struct nm_stream_pool_t *pool,
+  struct nm_stream_rec_t *recs, int nrecs){
+	pthread_mutex_lock(&pool->lock);
+	pool->recs = recs;
+	pool->nrecs = nrecs;
+	pool->next_rec = 0;
+	pool->active = pool->started;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->start_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	sign_batch(pool);
+
+	pthread_mutex_lock(&pool->lock);
+	while(pool->active > 0)
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void put_u32(unsigned char *p, uint32_t v){
+	p[0] = (v >> 24) & 0xff;
+	p[1] = (v >> 16) & 0xff;
+	p[2] = (v >> 8) & 0xff;
+	p[3] = v & 0xff;
+}
+
+static int write_rec(FILE *out_fp, int format, struct nm_stream_rec_t *rec){
+	unsigned char len_buff[4];
+	size_t j;
+
+	if(format == NM_STREAM_LEN){
+		put_u32(len_buff, rec->err ? 0 : rec->sig_len);
+		if(fwrite(len_buff, 4, 1, out_fp) != 1)
+			return 439;
+		if(!rec->err && fwrite(rec->sig, rec->sig_len, 1, out_fp) != 1)
+			return 439;
+		return 0;
+	}
+	if(rec->err)
+		return fprintf(out_fp, "ERROR %d\n", rec->err) < 0 ? 439 : 0;
+	for(j = 0; j < rec->sig_len; j++)
+		if(rec->sig[j] == '\n' || rec->sig[j] == '\r')
+			rec->sig[j] = ' ';
+	// Drop the trailing blanks that used to be the last newline.
+	while(rec->sig_len > 0 && rec->sig[rec->sig_len - 1] == ' ')
+		rec->sig_len--;
+	rec->sig[rec->sig_len++] = '\n';
+	return fwrite(rec->sig, rec->sig_len, 1, out_fp) != 1 ? 439 : 0;
+}
+
+static int next_rec(const char *buff, size_t have, int format, int at_eof,
+  struct nm_stream_rec_t *rec, size_t *used, unsigned long long *skip){
+	// Find the next complete record in buff[0..have).  Returns 1 and
+	// sets *rec and *used (bytes consumed), or 0 if more input is
+	// needed (or, at EOF, if there is nothing left).  A blank line is
+	// consumed with rec->data == NULL, and the caller skips it.
+	//
+	// A record that is too big to sign gets error 324 at once, and
+	// *skip is set to the number of its bytes that are still to come
+	// (for a line, ~0 means up to the next newline).
+	const char *nl;
+	size_t len;
+
+	memset(rec, 0, offsetof(struct nm_stream_rec_t, sig));
+	if(have == 0)
+		return 0;
+	if(format == NM_STREAM_LEN){
+		if(have < 4)
+			return 0;
+		len = ((size_t) (unsigned char) buff[0] << 24)
+			| ((size_t) (unsigned char) buff[1] << 16)
+			| ((size_t) (unsigned char) buff[2] << 8) | (unsigned char) buff[3];
+		if(len > NM_STREAM_MAX_DATA){
+			rec->err = 324;
+			*used = have < 4 + len ? have : 4 + len;
+			*skip = 4 + len - *used;
+			return 1;
+		}
+		if(have < 4 + len)
+			return 0;
+		rec->data = buff + 4;
+		rec->len = strnlen(rec->data, len);
+		*used = 4 + len;
+		return 1;
+	}
+
+	nl = memchr(buff, '\n', have);
+	if(!nl && have > NM_STREAM_MAX_DATA + 1){
+		rec->err = 324;
+		*used = have;
+		*skip = ~0ULL;
+		return 1;
+	}
+	if(!nl && !at_eof)
+		return 0;
+	len = nl ? (size_t) (nl - buff) : have;
+	*used = nl ? len + 1 : have;
+	if(len > 0 && buff[len - 1] == '\r')
+		len--;
+	if(len > NM_STREAM_MAX_DATA){
+		rec->err = 324;
+		return 1;
+	}
+	if(len == 0)
+		return 1;
+	rec->data = buff;
+	rec->len = strnlen(buff, len);
+	return 1;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+int nm_sign_stream(struct nm_sign_ctx_t *ctx, int in_fd, FILE *out_fp,
+  int format, int batch, int nthreads, unsigned long long *nsigned,
+  int debug_lvl){
+	// Read nonces from in_fd until EOF and write their signatures to
+	// out_fp (see the top of this file for the formats).
+	//
+	//batch:
+	//  The most nonces to sign before writing (<= 0 means
+	//  NM_STREAM_BATCH).
+	//
+	//nthreads:
+	//  Signing threads, counting the caller.  0 means one per
+	//  online CPU.
+	//
+	//nsigned:
+	//  If not NULL, gets the number of signatures written.
+	//
+	// Returns 0, or 903 if any nonce could not be signed (its record
+	// says so and the stream goes on), or 932 (read error), 947 (the
+	// input ends inside a length-prefixed record), 439 (write error)
+	// or 843 (out of memory).
+	struct nm_stream_pool_t *pool;
+	struct nm_stream_rec_t *recs;
+	char *buff;
+	size_t have = 0, pos = 0, used;
+	unsigned long long skip = 0;
+	const char *nl;
+	ssize_t got;
+	int nrecs, k, j;
+	int at_eof = 0;
+	int rslt = 0;
+	unsigned long long done = 0;
+
+	if(batch <= 0)
+		batch = NM_STREAM_BATCH;
+	if(batch > NM_STREAM_MAX_BATCH)
+		batch = NM_STREAM_MAX_BATCH;
+	if(nthreads <= 0)
+		nthreads = nm_tree_default_threads();
+	if(nthreads > NM_STREAM_MAX_THREADS)
+		nthreads = NM_STREAM_MAX_THREADS;
+
+	buff = malloc(NM_STREAM_IN_BUFF);
+	recs = malloc(batch * sizeof(struct nm_stream_rec_t));
+	pool = calloc(1, sizeof(struct nm_stream_pool_t));
+	if(!buff || !recs || !pool){
+		free(buff);
+		free(recs);
+		free(pool);
+		return 843;
+	}
+	pool->ctx = ctx;
+	pool->debug_lvl = debug_lvl;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+	// If a thread cannot be started, run with the ones that were.
+	for(j = 1; j < nthreads; j++){
+		if(pthread_create(&pool->threads[j], NULL, stream_worker, pool))
+			break;
+		pool->started = j;
+	}
+
+	while(rslt == 0 || rslt == 903){
+		// Throw away the rest of a record that was too big.
+		if(skip == ~0ULL){
+			nl = memchr(buff + pos, '\n', have - pos);
+			pos = nl ? (size_t) (nl - buff) + 1 : have;
+			if(nl)
+				skip = 0;
+		}else if(skip > 0){
+			used = skip < have - pos ? skip : have - pos;
+			pos += used;
+			skip -= used;
+		}
+
+		// Take every complete record that is already here.
+		nrecs = 0;
+		while(nrecs < batch && skip == 0 && next_rec(buff + pos, have - pos,
+		  format, at_eof, &recs[nrecs], &used, &skip)){
+			pos += used;
+			if(recs[nrecs].data || recs[nrecs].err)
+				nrecs++;
+		}
+
+		if(nrecs > 0){
+			pool_run(pool, recs, nrecs);
+			for(k = 0; k < nrecs; k++){
+				if(recs[k].err)
+					rslt = 903;
+				else
+					done++;
+				if(write_rec(out_fp, format, &recs[k])){
+					rslt = 439;
+					break;
+				}
+			}
+			if(nrecs == batch)
+				continue;   // there may be more complete records
+		}
+
+		// Nothing complete is waiting: send what we have before
+		// blocking on the read.
+		if(fflush(out_fp)){
+			rslt = 439;
+			break;
+		}
+		if(at_eof){
+			if(pos < have || (skip > 0 && skip != ~0ULL))
+				rslt = 947;
+			break;
+		}
+		// Move the partial record to the front and read more.
+		if(pos > 0){
+			memmove(buff, buff + pos, have - pos);
+			have -= pos;
+			pos = 0;
+		}
+		got = read(in_fd, buff + have, NM_STREAM_IN_BUFF - have);
+		if(got < 0){
+			if(errno == EINTR)
+				continue;
+			rslt = 932;
+			break;
+		}
+		if(got == 0)
+			at_eof = 1;
+		have += got;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->start_cond);
+	pthread_mutex_unlock(&pool->lock);
+	for(j = 1; j <= pool->started; j++)
+		pthread_join(pool->threads[j], NULL);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->start_cond);
+	pthread_cond_destroy(&pool->done_cond);
+	free(pool);
+	free(recs);
+	free(buff);
+	if(nsigned)
+		*nsigned = done;
+	return rslt;
+}
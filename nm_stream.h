@@ -0,0 +1,18 @@
+// nm_stream.h
+//
+// Sign a stream of nonces with one loaded key (nm_sign --stream).
+// See nm_stream.c for the record formats.
+
+#define NM_STREAM_LINES 0
+#define NM_STREAM_LEN 1
+#define NM_STREAM_BATCH 64
+#define NM_STREAM_MAX_BATCH 4096
+// The same limits as a nonce file for nm_sign and the text of its
+// signature.
+#define NM_STREAM_MAX_DATA 3000
+#define NM_STREAM_MAX_SIG 3000
+
+int nm_stream_format(const char *name);
+int nm_sign_stream(struct nm_sign_ctx_t *ctx, int in_fd, FILE *out_fp,
+  int format, int batch, int nthreads, unsigned long long *nsigned,
+  int debug_lvl);
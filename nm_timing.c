@@ -0,0 +1,165 @@
+// nm_timing.c
+// Purpose:
+//   1) Record how long each phase of a tool takes (libgcrypt init,
+//      key load, data load, s-expression build, public-key operation,
+//      output, ...) with the monotonic clock, and with --timings,
+//      write one JSON object per run:
+//
+//   {"tool":"nm_sign","pid":1234,"time":1700000000,"total_us":812.4,
+//    "phases":{"init":301.2,"args":1.1,"key_load":95.0,"sign":402.8,
+//    "output":12.3}}
+//
+// The line goes to stderr, or with --timings=<file>, is appended to
+// the file with one write() so that lines from concurrent runs do
+// not mix.  Times are in microseconds.  A phase that is entered more
+// than once (for example, once per request in a loop) is the sum of
+// its runs.
+//
+// The cost of a phase is one clock_gettime() (a vDSO call, tens of
+// nanoseconds), and it is recorded whether or not --timings is set,
+// so the option does not change what is measured.  The JSON is built
+// once, at exit.
+//
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "nm_timing.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+struct nm_timing_t
+{
+	const char *tool;
+	struct timespec t_start;
+	struct timespec t_phase;      // start of the current phase
+	int cur;                      // index of the current phase or -1
+	int nphases;
+	const char *name[NM_TIMING_MAX_PHASES];
+	double us[NM_TIMING_MAX_PHASES];
+	int enabled;
+	char out_fname[500];
+};
+
+static struct nm_timing_t nm_timing = {NULL, {0, 0}, {0, 0}, -1, 0};
+
+static double elapsed_us(const struct timespec *a, const struct timespec *b){
+	return (b->tv_sec - a->tv_sec) * 1e6 + (b->tv_nsec - a->tv_nsec) / 1e3;
+}
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+void nm_timing_start(const char *tool){
+	nm_timing.tool = tool;
+	clock_gettime(CLOCK_MONOTONIC, &nm_timing.t_start);
+	nm_timing.t_phase = nm_timing.t_start;
+	nm_timing.cur = -1;
+	nm_timing.nphases = 0;
+	nm_timing_phase("init");
+}
+
+void nm_timing_phase(const char *name){
+	// Close the current phase and start the one called name.
+	// A NULL name just closes the current phase.
+	struct timespec now;
+	int j;
+
+	if(!nm_timing.tool)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if(nm_timing.cur >= 0)
+		nm_timing.us[nm_timing.cur] += elapsed_us(&nm_timing.t_phase, &now);
+	nm_timing.t_phase = now;
+	nm_timing.cur = -1;
+	if(!name)
+		return;
+
+	for(j = 0; j < nm_timing.nphases; j++){
+		if(nm_timing.name[j] == name || !strcmp(nm_timing.name[j], name)){
+			nm_timing.cur = j;
+			return;
+		}
+	}
+	if(nm_timing.nphases < NM_TIMING_MAX_PHASES){
+		j = nm_timing.nphases++;
+		nm_timing.name[j] = name;
+		nm_timing.us[j] = 0;
+		nm_timing.cur = j;
+	}
+}
+
+static void nm_timing_report(void){
+	// atexit handler: build the JSON line and write it once.
+	char line[4096];
+	struct timespec now;
+	size_t len;
+	int j, fd;
+
+	nm_timing_phase(NULL);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	len = snprintf(line, sizeof(line),
+		"{\"tool\":\"%s\",\"pid\":%ld,\"time\":%ld,\"total_us\":%.1f,\"phases\":{",
+		nm_timing.tool, (long) getpid(), (long) time(NULL),
+		elapsed_us(&nm_timing.t_start, &now));
+	for(j = 0; j < nm_timing.nphases && len < sizeof(line); j++)
+		len += snprintf(line + len, sizeof(line) - len, "%s\"%s\":%.1f",
+			j ? "," : "", nm_timing.name[j], nm_timing.us[j]);
+	if(len < sizeof(line))
+		len += snprintf(line + len, sizeof(line) - len, "}}\n");
+	if(len >= sizeof(line))
+		return;
+
+	if(nm_timing.out_fname[0] != 0x00){
+		fd = open(nm_timing.out_fname, O_WRONLY | O_APPEND | O_CREAT, 0644);
+		if(fd < 0)
+			return;
+		if(write(fd, line, len) < 0)
+			perror("Error. Could not write the timings");
+		close(fd);
+	}else{
+		// Anything else on stderr goes out first.
+		fflush(stderr);
+		if(write(STDERR_FILENO, line, len) < 0)
+			return;
+	}
+}
+
+int nm_timing_enable(const char *out_fname){
+	// Turn on the report at exit.  out_fname NULL or "" means stderr.
+	if(!nm_timing.tool)
+		nm_timing_start("nm");
+	if(out_fname){
+		strncpy(nm_timing.out_fname, out_fname, sizeof(nm_timing.out_fname) - 1);
+		nm_timing.out_fname[sizeof(nm_timing.out_fname) - 1] = 0x00;
+	}
+	if(!nm_timing.enabled){
+		nm_timing.enabled = 1;
+		if(atexit(nm_timing_report))
+			return 1;
+	}
+	return 0;
+}
+
+int nm_timing_args(int *argc, char **argv){
+	int j, k;
+	int found = 0;
+
+	for(j = 1; j < *argc; ){
+		if(!strcmp(argv[j], "--timings")){
+			nm_timing_enable(NULL);
+		}else if(!strncmp(argv[j], "--timings=", 10)){
+			nm_timing_enable(argv[j] + 10);
+		}else{
+			j++;
+			continue;
+		}
+		found = 1;
+		for(k = j; k < *argc - 1; k++)
+			argv[k] = argv[k + 1];
+		argv[--(*argc)] = NULL;
+	}
+	return found;
+}
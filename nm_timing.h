@@ -0,0 +1,20 @@
+// nm_timing.h
+//
+// Per-phase timings for the nm_* tools (--timings).  See nm_timing.c.
+//
+// A tool calls nm_timing_start() first thing in main(), then
+// nm_timing_phase("name") at the start of each phase.  Phase names
+// must be string literals (only the pointer is kept).  If --timings
+// was given, nm_timing_enable() arranges for one line of JSON to be
+// written when the process exits.
+
+#define NM_TIMING_MAX_PHASES 32
+
+void nm_timing_start(const char *tool);
+void nm_timing_phase(const char *name);
+int nm_timing_enable(const char *out_fname);
+
+// For tools that take positional arguments instead of getopt: remove
+// --timings or --timings=<file> from argv (updating *argc) and enable
+// the report.  Returns 1 if the option was found.
+int nm_timing_args(int *argc, char **argv);
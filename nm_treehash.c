@@ -0,0 +1,218 @@
+// nm_treehash.c
+// Purpose:
+//   1) Hash a very large file with all cores.  The file is cut
+//      into fixed-size leaves, the leaves are hashed with SHA-384
+//      in parallel, and the leaf digests are hashed into one root
+//      digest.  The root (not the file) is what nm_sign --tree signs
+//      and what nm_verify --tree recomputes.
+//
+// Layout of the tree (every hash is SHA-384):
+//   leaf[i] = H(0x00 || bytes i*leaf_size .. (i+1)*leaf_size-1)
+//   root    = H(0x01 || file length, 8 bytes big-endian
+//                    || leaf size, 4 bytes big-endian
+//                    || leaf[0] || leaf[1] || ... )
+// The 0x00/0x01 prefixes keep a leaf from ever being taken for a
+// root, and the lengths in the root stop one file from being passed
+// off as another with different leaf boundaries.  The leaf size is
+// part of the signed data, so both sides must use the same value
+// (the default is NM_TREE_LEAF_SIZE).
+//
+// What is signed (see nm_tree_data()) is
+//   'T' || 0x00 || H("nm-tree-sha384:<leaf size>:<root in hex>")
+// in place of the file contents, so a tree signature does not cover
+// the same value as a plain signature of a file that holds the root
+// string.  This is not a complete separation: with raw signing,
+// libgcrypt keeps only the leading bits of the value (the bit length
+// of the curve order), so a file of binary junk crafted from those
+// bits passes a plain nm_verify with a tree signature.  The other way
+// round needs a SHA-384 preimage.
+//
+// Each worker thread owns one leaf buffer, so the memory used is
+// nthreads * leaf_size no matter how big the file is.
+//
+#include <stddef.h>
+#include <gcrypt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "nm_keys.h"
+#include "nm_hash.h"
+#include "nm_treehash.h"
+#include "nm_stats.h"
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define NM_TREE_MAX_THREADS 256
+
+struct nm_tree_job_t
+{
+	int fd;
+	uint64_t file_len;
+	size_t leaf_size;
+	uint64_t nleaves;
+	unsigned char *leaf_digests;
+	uint64_t next_leaf;   // taken with an atomic add by the workers
+	int err;
+};
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+int nm_tree_default_threads(void){
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if(n < 1)
+		return 1;
+	if(n > NM_TREE_MAX_THREADS)
+		return NM_TREE_MAX_THREADS;
+	return (int) n;
+}
+
+static void *tree_worker(void *arg){
+	struct nm_tree_job_t *job = arg;
+	static const unsigned char leaf_prefix = 0x00;
+	unsigned char *buff;
+	gcry_md_hd_t hd;
+	uint64_t leaf;
+	off_t offset;
+	size_t want, got;
+	ssize_t rc;
+
+	buff = malloc(job->leaf_size);
+	if(!buff || gcry_md_open(&hd, GCRY_MD_SHA384, 0)){
+		free(buff);
+		job->err = 843;
+		return NULL;
+	}
+
+	while(!job->err){
+		leaf = __atomic_fetch_add(&job->next_leaf, 1, __ATOMIC_RELAXED);
+		if(leaf >= job->nleaves)
+			break;
+		offset = (off_t) (leaf * job->leaf_size);
+		want = job->leaf_size;
+		if(job->file_len - offset < want)
+			want = job->file_len - offset;
+		for(got = 0; got < want; got += rc){
+			rc = pread(job->fd, buff + got, want - got, offset + got);
+			if(rc <= 0){
+				job->err = 932;
+				break;
+			}
+		}
+		if(job->err)
+			break;
+		gcry_md_reset(hd);
+		gcry_md_write(hd, &leaf_prefix, 1);
+		gcry_md_write(hd, buff, want);
+		memcpy(job->leaf_digests + leaf * NM_SHA384_LEN,
+			gcry_md_read(hd, GCRY_MD_SHA384), NM_SHA384_LEN);
+	}
+	gcry_md_close(hd);
+	free(buff);
+	return NULL;
+}
+
+int nm_tree_hash_file(const char *fname, size_t leaf_size, int nthreads,
+  unsigned char *root, int debug_lvl){
+	// Compute the tree root of fname into root (NM_SHA384_LEN bytes).
+	// nthreads <= 0 means one thread per online CPU.
+	// Returns 0 or an error code.
+	struct nm_tree_job_t job;
+	pthread_t threads[NM_TREE_MAX_THREADS];
+	unsigned char header[1 + 8 + 4];
+	gcry_md_hd_t hd;
+	struct stat st;
+	int j, started;
+
+	if(leaf_size == 0 || leaf_size > 0xffffffffUL)
+		return 322;
+	if(nthreads <= 0)
+		nthreads = nm_tree_default_threads();
+	if(nthreads > NM_TREE_MAX_THREADS)
+		nthreads = NM_TREE_MAX_THREADS;
+
+	memset(&job, 0, sizeof(job));
+	job.fd = open(fname, O_RDONLY);
+	if(job.fd < 0){
+		perror("Error. Failed open the input data file");
+		return 439;
+	}
+	if(fstat(job.fd, &st)){
+		close(job.fd);
+		return 932;
+	}
+	job.file_len = st.st_size;
+	job.leaf_size = leaf_size;
+	job.nleaves = (job.file_len + leaf_size - 1) / leaf_size;
+	if(job.nleaves < (uint64_t) nthreads)
+		nthreads = job.nleaves > 0 ? (int) job.nleaves : 1;
+	job.leaf_digests = malloc((job.nleaves + 1) * NM_SHA384_LEN);
+	if(!job.leaf_digests){
+		close(job.fd);
+		return 843;
+	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(job.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	if(debug_lvl > 0)
+		fprintf(stderr, "Tree hash of %s: %llu bytes, %llu leaves, %d threads.\n",
+			fname, (unsigned long long) job.file_len,
+			(unsigned long long) job.nleaves, nthreads);
+
+	// The calling thread is worker 0.
+	started = 0;
+	for(j = 1; j < nthreads; j++){
+		if(pthread_create(&threads[j], NULL, tree_worker, &job))
+			break;
+		started = j;
+	}
+	tree_worker(&job);
+	for(j = 1; j <= started; j++)
+		pthread_join(threads[j], NULL);
+	close(job.fd);
+	if(job.err){
+		free(job.leaf_digests);
+		return job.err;
+	}
+
+	header[0] = 0x01;
+	for(j = 0; j < 8; j++)
+		header[1 + j] = (job.file_len >> (56 - 8 * j)) & 0xff;
+	for(j = 0; j < 4; j++)
+		header[9 + j] = ((uint64_t) leaf_size >> (24 - 8 * j)) & 0xff;
+	if(gcry_md_open(&hd, GCRY_MD_SHA384, 0)){
+		free(job.leaf_digests);
+		return 123;
+	}
+	gcry_md_write(hd, header, sizeof(header));
+	gcry_md_write(hd, job.leaf_digests, job.nleaves * NM_SHA384_LEN);
+	memcpy(root, gcry_md_read(hd, GCRY_MD_SHA384), NM_SHA384_LEN);
+	gcry_md_close(hd);
+	free(job.leaf_digests);
+	nm_stats_add(NM_STAT_BYTES_HASHED, job.file_len);
+	return 0;
+}
+
+int nm_tree_data(const char *fname, size_t leaf_size, int nthreads,
+  unsigned char *data, int debug_lvl){
+	// Build the NM_TREE_DATA_LEN bytes that nm_sign --tree signs in
+	// place of the file contents (binary, see the top of this file).
+	unsigned char root[NM_SHA384_LEN];
+	char hex[2 * NM_SHA384_LEN + 1];
+	char txt[128];
+	int rslt;
+
+	rslt = nm_tree_hash_file(fname, leaf_size, nthreads, root, debug_lvl);
+	if(rslt)
+		return rslt;
+	nm_hex_encode(root, NM_SHA384_LEN, hex);
+	snprintf(txt, sizeof(txt), "nm-tree-sha384:%lu:%s", (unsigned long) leaf_size, hex);
+	data[0] = 'T';
+	data[1] = 0x00;
+	gcry_md_hash_buffer(GCRY_MD_SHA384, data + 2, txt, strlen(txt));
+	return 0;
+}
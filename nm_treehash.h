@@ -0,0 +1,13 @@
+// nm_treehash.h
+//
+// Tree hashing of large files on all cores.  See nm_treehash.c.
+
+#define NM_TREE_LEAF_SIZE (4 * 1024 * 1024)
+// 'T', 0x00 and a SHA-384 digest (see nm_tree_data())
+#define NM_TREE_DATA_LEN 50
+
+int nm_tree_hash_file(const char *fname, size_t leaf_size, int nthreads,
+  unsigned char *root, int debug_lvl);
+int nm_tree_data(const char *fname, size_t leaf_size, int nthreads,
+  unsigned char *data, int debug_lvl);
+int nm_tree_default_threads(void);
@@ -3,6 +3,15 @@
 //   1) Read a detached signature in NaturalMessage-format 
 //      and a regular data file and use a public key
 //      in NM format to verify the signature.
+//   2) If the signature carries a Key-ID (nm_sign --key-id), the key
+//      can come from --key-dir <dir> or --keyring <file> instead of
+//      --key, and a --key that is not the signing key is rejected
+//      before any public-key work.
+//   3) With --revoked <list> --revoked-by <offline public key>, a key
+//      on the revocation list (nm_revoke --build) is refused before
+//      any public-key work (see nm_revoke.c).  --revoked-by can also
+//      name an offline key set; the list then needs the signatures of
+//      the set's threshold (nm_revoke --cosign).
 //
 //     READ THIS FILE ABOUT S-EXPRESSIONS (DONT' CUT CORNERS): 
 //        http://people.csail.mit.edu/rivest/Sexp.txt
@@ -20,6 +29,13 @@
 
 // nm_keys requires some of the things above
 #include "nm_keys.h"
+#include "nm_treehash.h"
+#include "nm_keyring.h"
+#include "nm_revoke.h"
+#include "nm_multisig.h"
+#include "nm_timing.h"
+#include "nm_stats.h"
+#include "nm_probes.h"
 
 #include <getopt.h>
 #define MAX_ENTRY_LEN 300
@@ -33,8 +49,54 @@
 //-------------------------------------------------------------------------------
 //-------------------------------------------------------------------------------
 int verbose_flag;
+int tree_flag;
+//-------------------------------------------------------------------------------
+static int verify_revoked_by(const struct nm_revoke_t *rl, const char *fname){
+	// The signature on the list by the offline key, or by the
+	// threshold of an offline key set, as NMVerifyServer checks it.
+	// Returns 0, 983 or a code from reading fname.
+	struct nm_keyset_t set;
+	gcry_sexp_t sexp_file, sexp_key, sexp_data, sexp_sig;
+	int rc;
+
+	rc = nm_read_key_file(fname, NULL, &sexp_file, debug_lvl);
+	if(rc)
+		return rc;
+	if(!nm_keyset_is_set(sexp_file)){
+		sexp_key = gcry_sexp_find_token(sexp_file, "public-key", 0);
+		gcry_sexp_release(sexp_file);
+		if(!sexp_key)
+			return 901;
+		rc = nm_revoke_verify(rl, sexp_key);
+		gcry_sexp_release(sexp_key);
+		return rc;
+	}
+	rc = nm_keyset_load(sexp_file, &set);
+	gcry_sexp_release(sexp_file);
+	if(rc)
+		return rc;
+	rc = nm_revoke_signed_data(rl, &sexp_data, &sexp_sig);
+	if(!rc && (!sexp_sig || nm_multisig_verify(&set, sexp_sig, sexp_data, 0, NULL)))
+		rc = 983;
+	gcry_sexp_release(sexp_data);
+	gcry_sexp_release(sexp_sig);
+	nm_keyset_release(&set);
+	return rc;
+}
+//-------------------------------------------------------------------------------
 int usage(){
 	printf("Usage: nm_verify --in <orig_data> --signature <sigfile.sig> --key <public.key>\n");
+	printf("       [--tree [--threads <n>] [--leaf-size <bytes>]] [--timings[=<file>]]\n");
+	printf("       nm_verify --keyring <file> [--key id:<ID>|fp:<hex>|ip:<addr>] ...\n");
+	printf("       nm_verify --key-dir <dir> ...\n");
+	printf("       nm_verify --revoked <list> --revoked-by <offline_public.key>|<key_set> ...\n");
+	printf("  --tree checks a signature made with nm_sign --tree (use the same leaf size)\n");
+	printf("  --timings writes the time of each phase as JSON at exit\n");
+	printf("  --keyring takes the key from a keyring built by nm_keyring --build\n");
+	printf("  Without --key, --keyring and --key-dir use the Key-ID in the signature\n");
+	printf("  (nm_sign --key-id).\n");
+	printf("  --revoked refuses keys on a revocation list signed by the offline key,\n");
+	printf("  or by the threshold of an offline key set\n");
 	return 0;
 }
 //-------------------------------------------------------------------------------
@@ -43,6 +105,8 @@ int main (int argc, char *argv[]) {
 	// Define some stuff for verication of sig:
 	gcry_error_t err;
 	size_t err_offset;
+	size_t input_data_len;
+	unsigned long long t0;
 
 
 	gcry_sexp_t sexp_nm_key; //, sexp_nm_offline_key, sexp_offline_pub_key;
@@ -51,9 +115,25 @@ int main (int argc, char *argv[]) {
 	gcry_sexp_t sexp_signature;
 
 	int err_int;
+	int tree_threads = 0;
+	long tree_leaf_size = NM_TREE_LEAF_SIZE;
+	char *input_data_txt;
+	const char *keyring_fname = NULL;
+	const char *key_dir = NULL;
+	unsigned char sig_key_id[NM_KEY_ID_LEN];
+	unsigned char key_id[NM_KEY_ID_LEN];
+	int has_key_id;
+	struct nm_keyring_t *kr;
+	const struct nm_keyring_rec_t *kr_rec;
+	const char *revoked_fname = NULL;
+	const char *revoked_by_fname = NULL;
+	unsigned char key_fp[NM_REVOKE_FP_LEN];
+	struct nm_revoke_t *rl;
 
 	FILE *fp;
 
+	nm_timing_start("nm_verify");
+	nm_stats_init("nm_verify");
 
 	/*
 	----------------------------------------------------------------------
@@ -140,6 +220,7 @@ int main (int argc, char *argv[]) {
 	----------------------------------------------------------------------
 	*/
 
+	nm_timing_phase("args");
 	int opt_code; //encoded value from command-line args
 
 	while (1){
@@ -155,9 +236,17 @@ int main (int argc, char *argv[]) {
 					/* These options set a flag. */
 					{"verbose", no_argument,       &verbose_flag, 1},
 					{"brief",   no_argument,       &verbose_flag, 0},
+					{"tree",    no_argument,       &tree_flag, 1},
 							 {"in",    required_argument,       0, 'i'},
 							 {"signature",  required_argument,       0, 's'},
 							 {"key",        required_argument, 0, 'k'},
+							 {"threads",    required_argument, 0, 'T'},
+							 {"leaf-size",  required_argument, 0, 'L'},
+							 {"timings",    optional_argument, 0, 'M'},
+							 {"keyring",    required_argument, 0, 'K'},
+							 {"key-dir",    required_argument, 0, 'D'},
+							 {"revoked",    required_argument, 0, 'R'},
+							 {"revoked-by", required_argument, 0, 'B'},
 							 {"help",        no_argument, 0, '?'},
 							 {0, 0, 0, 0}
 		};
@@ -202,6 +291,42 @@ int main (int argc, char *argv[]) {
 				strncpy(input_sig_fname, optarg, MAX_ENTRY_LEN - 1);
 				break;
 
+			case 'T':
+				// worker threads for --tree (0 = all CPUs)
+				tree_threads = atoi(optarg);
+				break;
+
+			case 'L':
+				// leaf size for --tree
+				tree_leaf_size = atol(optarg);
+				break;
+
+			case 'M':
+				// JSON phase timings at exit (to stderr or a file)
+				nm_timing_enable(optarg);
+				break;
+
+			case 'K':
+				// keyring file; --key is then id:, fp: or ip:
+				keyring_fname = optarg;
+				break;
+
+			case 'D':
+				// directory of public key files, for signatures
+				// that carry a Key-ID
+				key_dir = optarg;
+				break;
+
+			case 'R':
+				// revocation list from nm_revoke --build
+				revoked_fname = optarg;
+				break;
+
+			case 'B':
+				// offline public key that signed the revocation list
+				revoked_by_fname = optarg;
+				break;
+
 			case '?':
 				/* 'getopt_long' already printed an error message. */
 				usage();
@@ -233,7 +358,7 @@ int main (int argc, char *argv[]) {
 		return 321;
 	}
 
-	if (input_pub_key_fname[0] == 0x00){
+	if (input_pub_key_fname[0] == 0x00 && !key_dir && !keyring_fname){
 		fprintf (stderr, "Error. Input public key filename is missing.\n");
 		usage();
 		return 322;
@@ -245,34 +370,129 @@ int main (int argc, char *argv[]) {
 		return 327;
 	}
 
+	if (revoked_fname && !revoked_by_fname){
+		fprintf (stderr, "Error. --revoked needs --revoked-by, the key that signed the list.\n");
+		usage();
+		return 322;
+	}
+
 
-	/*
-	*/
-	//------------------------------------------------------------
-	//------------------------------------------------------------
 	//------------------------------------------------------------
-	//  Read the NaturalMessage public key
-	fp = fopen(input_pub_key_fname, "r");
+	//    IMPORT THE SIGNATURE AND CONVERT IT TO AN OFFICIAL S-EXP
+	//    (first, because its Key-ID can choose the key)
+	nm_timing_phase("sig_load");
+	fp = fopen(input_sig_fname, "r");
 	if(!fp){
-		perror("Error. Failed open the input public key file.");
-		return(438);
+		perror("Error. Failed open the input data file.");
+		return(440);
 	}
-	err_int = read_sexp_file(fp, &sexp_nm_key, nm_key_txt, 0, debug_lvl);
+	err_int = read_sexp_file(fp, &sexp_signature, input_sig_txt, 1, debug_lvl);
 	if(err_int){
-		printf("Could not get the public key into an sexp.\n");
+		printf("The signature was not read.\n");
 		exit(0);
 	}
-	
 	fclose(fp);
-	if (debug_lvl >2 ){
-		printf("Here is a dump of the s-exp for the imported full PUBLIC key:\n");
-		gcry_sexp_dump(sexp_nm_key);
+	if (debug_lvl > 2){
+		printf("the input signature is: %s\n", input_data_txt);
+	}
+	//   CONSTRUCT AN S-EXPRESSION FOR THE DATA
+	err = gcry_sexp_new(&sexp_signature,  input_sig_txt, 0 , 1);
+	if(err){
+		fprintf (stderr, "Error. formatting the input signature: %s/%s\n",
+			gcry_strsource (err),
+			gcry_strerror (err));
+		return 902;
 	}
-	//  Extract the libgcrypt public key from the NaturalMessage key.
-	sexp_pub_key = gcry_sexp_find_token(sexp_nm_key, "public-key", 0);
-	if(!sexp_pub_key){
-		fprintf (stderr, "Error. Could not get the public-key from the input s-expression.\n");
-		return 901;
+	if (debug_lvl >2){
+		printf("Here is the dump of the sig:\n");
+		gcry_sexp_dump(sexp_input_data);
+	}
+	
+	//------------------------------------------------------------
+	//------------------------------------------------------------
+	//------------------------------------------------------------
+	//  Read the NaturalMessage public key
+	nm_timing_phase("key_load");
+	has_key_id = nm_sig_key_id(sexp_signature, sig_key_id);
+	if (input_pub_key_fname[0] == 0x00){
+		// No --key: the signature names its key (nm_sign --key-id).
+		if(!has_key_id){
+			fprintf (stderr, "Error. The signature has no Key-ID, so --key is needed.\n");
+			return 978;
+		}
+		if(keyring_fname){
+			strcpy(input_pub_key_fname, "fp:");
+			nm_hex_encode(sig_key_id, NM_KEY_ID_LEN, input_pub_key_fname + 3);
+		}else{
+			err_int = nm_find_key_by_id(key_dir, sig_key_id, input_pub_key_fname,
+				MAX_CMDLINE_BUFF);
+			if(err_int){
+				fprintf (stderr, "Error. No single key in %s has the Key-ID of the signature.\n",
+					key_dir);
+				return err_int;
+			}
+		}
+	}
+	if (keyring_fname){
+		// The newest unexpired signing key for the name, already
+		// parsed (see nm_keyring.c).
+		kr = nm_keyring_open(keyring_fname, &err_int);
+		if(!kr){
+			fprintf (stderr, "Error. Could not open the keyring %s.\n", keyring_fname);
+			return err_int;
+		}
+		err_int = nm_keyring_lookup(kr, input_pub_key_fname, 's', &kr_rec);
+		if(!err_int && has_key_id
+		  && memcmp(kr_rec->fingerprint, sig_key_id, NM_KEY_ID_LEN))
+			err_int = 977;
+		if(!err_int){
+			memcpy(key_fp, kr_rec->fingerprint, NM_REVOKE_FP_LEN);
+			err_int = nm_keyring_pubkey(kr, kr_rec, &sexp_pub_key);
+		}
+		nm_keyring_close(kr);
+		if(err_int == 977){
+			fprintf (stderr, "Error. The signature was made by a different key.\n");
+			return err_int;
+		}
+		if(err_int){
+			fprintf (stderr, "Error. Could not find the key %s in the keyring.\n",
+				input_pub_key_fname);
+			return err_int;
+		}
+		sexp_nm_key = NULL;
+	}else{
+		// A signature that names another key cannot verify.
+		if(has_key_id && !nm_key_id_file(input_pub_key_fname, key_id)
+		  && memcmp(key_id, sig_key_id, NM_KEY_ID_LEN)){
+			fprintf (stderr, "Error. The signature was made by a different key.\n");
+			return 977;
+		}
+		if(revoked_fname && nm_key_fingerprint_file(input_pub_key_fname, key_fp)){
+			perror("Error. Failed open the input public key file.");
+			return(438);
+		}
+		fp = fopen(input_pub_key_fname, "r");
+		if(!fp){
+			perror("Error. Failed open the input public key file.");
+			return(438);
+		}
+		err_int = read_sexp_file(fp, &sexp_nm_key, nm_key_txt, 0, debug_lvl);
+		if(err_int){
+			printf("Could not get the public key into an sexp.\n");
+			exit(0);
+		}
+		
+		fclose(fp);
+		if (debug_lvl >2 ){
+			printf("Here is a dump of the s-exp for the imported full PUBLIC key:\n");
+			gcry_sexp_dump(sexp_nm_key);
+		}
+		//  Extract the libgcrypt public key from the NaturalMessage key.
+		sexp_pub_key = gcry_sexp_find_token(sexp_nm_key, "public-key", 0);
+		if(!sexp_pub_key){
+			fprintf (stderr, "Error. Could not get the public-key from the input s-expression.\n");
+			return 901;
+		}
 	}
 
 	if (debug_lvl >2){
@@ -281,8 +501,31 @@ int main (int argc, char *argv[]) {
 	}
 
 	//------------------------------------------------------------
-	//------------------------------------------------------------
-	//------------------------------------------------------------
+	//   REVOCATION: a lookup in the mapped list, so a revoked key is
+	//   refused before any public-key work.  Only then is the list's
+	//   own signature checked (one verify with the offline key).
+	if (revoked_fname){
+		nm_timing_phase("revoke");
+		rl = nm_revoke_open(revoked_fname, &err_int);
+		if(!rl){
+			fprintf (stderr, "Error. Could not open the revocation list %s.\n",
+				revoked_fname);
+			return err_int;
+		}
+		if(nm_revoke_check(rl, key_fp)){
+			nm_revoke_close(rl);
+			fprintf (stderr, "Error. The key has been revoked.\n");
+			nm_stats_add(NM_STAT_VERIFY_FAILS, 1);
+			return 982;
+		}
+		err_int = verify_revoked_by(rl, revoked_by_fname);
+		nm_revoke_close(rl);
+		if(err_int){
+			fprintf (stderr, "Error. The revocation list %s is not signed by %s.\n",
+				revoked_fname, revoked_by_fname);
+			return err_int;
+		}
+	}
 
 	//------------------------------------------------------------
 	//------------------------------------------------------------
@@ -290,38 +533,65 @@ int main (int argc, char *argv[]) {
 	//   IMPORT THE FILE that needs to be verified
 	//   (this goes to a regular buffer, not an SEXP)
 	//
-	fp = fopen(input_fname, "r");
+	nm_timing_phase("data_load");
+	if (tree_flag){
+		// The signature covers the tree root, so recompute it with
+		// the same leaf size on all cores (see nm_treehash.c).
+		if (tree_leaf_size <= 0){
+			fprintf (stderr, "Error. The leaf size must be positive.\n");
+			return 323;
+		}
+		input_data_txt = gcry_malloc_secure(NM_TREE_DATA_LEN);
+		err_int = nm_tree_data(input_fname, tree_leaf_size, tree_threads,
+			(unsigned char *) input_data_txt, verbose_flag);
+		if(err_int){
+			fprintf(stderr, "Error. Could not compute the tree hash of the input data file.\n");
+			return(err_int);
+		}
+		input_data_len = NM_TREE_DATA_LEN;
+	}else{
+		NM_PROBE1(file_load__entry, input_fname);
+		fp = fopen(input_fname, "r");
 
-	if(!fp){
-		perror("Error. Failed open the input data file.");
-		return(439);
-	}
-	//err_int = read_sexp_file(fp, &sexp_input_data, input_data_txt, 
-	//		1, debug_lvl);
+		if(!fp){
+			NM_PROBE3(file_load__return, input_fname, 0, 439);
+			perror("Error. Failed open the input data file.");
+			return(439);
+		}
+		//err_int = read_sexp_file(fp, &sexp_input_data, input_data_txt, 
+		//		1, debug_lvl);
 	
-	fseek(fp, 0, SEEK_END);
-	long pos = ftell(fp);
-	fseek(fp, 0, SEEK_SET);
-	char *input_data_txt = gcry_malloc_secure(pos+1);
-	if(!input_data_txt){
-		perror("Error.  Malloc for the input data file failed.\n");
-		exit(843);
-	}
-	// Read the data
-	size_t blocks_read;
-	blocks_read = fread(input_data_txt, pos, 1, fp);
-	if (blocks_read != 1){
-		perror("Error while reading the input file.\n");
-		exit(932);
-	}
+		fseek(fp, 0, SEEK_END);
+		long pos = ftell(fp);
+		fseek(fp, 0, SEEK_SET);
+		input_data_txt = gcry_malloc_secure(pos+1);
+		if(!input_data_txt){
+			perror("Error.  Malloc for the input data file failed.\n");
+			exit(843);
+		}
+		// Read the data
+		size_t blocks_read;
+		blocks_read = fread(input_data_txt, pos, 1, fp);
+		if (blocks_read != 1){
+			perror("Error while reading the input file.\n");
+			exit(932);
+		}
+		input_data_txt[pos] = 0x00;
 
-	fclose(fp);
-	if (debug_lvl > 2){
-		printf("the input data is: %s\n", input_data_txt);
+		fclose(fp);
+		NM_PROBE3(file_load__return, input_fname, pos, 0);
+		if (debug_lvl > 2){
+			printf("the input data is: %s\n", input_data_txt);
+		}
+		input_data_len = strlen(input_data_txt);
 	}
 	//   CONSTRUCT AN S-EXPRESSION FOR THE DATA
+	nm_timing_phase("sexp_build");
 	//err = gcry_sexp_build(&sexp_input_data, &err_offset, "(data (flags raw) (hash sha384 %s))", input_data_txt);
-	err = gcry_sexp_build(&sexp_input_data, &err_offset, "(data (flags raw) (hash sha384 %s))", input_data_txt);
+	//  %b with the length: the tree data is binary (see nm_treehash.c),
+	//  and for a file it is the same as %s.
+	err = gcry_sexp_build(&sexp_input_data, &err_offset, "(data (flags raw) (hash sha384 %b))",
+		(int) input_data_len, input_data_txt);
 	if(err){
 		fprintf (stderr, "Error. formatting the input data/nonce: %s/%s\n",
 			gcry_strsource (err),
@@ -334,45 +604,23 @@ int main (int argc, char *argv[]) {
 	}
 	
 	//err = gcry_sexp_build("(data (value |%s|))",
-	//------------------------------------------------------------
-	//    IMPORT THE SIGNATURE AND CONVERT IT TO AN OFFICIAL S-EXP
-	fp = fopen(input_sig_fname, "r");
-	if(!fp){
-		perror("Error. Failed open the input data file.");
-		return(440);
-	}
-	err_int = read_sexp_file(fp, &sexp_signature, input_sig_txt, 1, debug_lvl);
-	if(err_int){
-		printf("The signature was not read.\n");
-		exit(0);
-	}
-	fclose(fp);
-	if (debug_lvl > 2){
-		printf("the input signature is: %s\n", input_data_txt);
-	}
-	//   CONSTRUCT AN S-EXPRESSION FOR THE DATA
-	err = gcry_sexp_new(&sexp_signature,  input_sig_txt, 0 , 1);
-	if(err){
-		fprintf (stderr, "Error. formatting the input signature: %s/%s\n",
-			gcry_strsource (err),
-			gcry_strerror (err));
-		return 902;
-	}
-	if (debug_lvl >2){
-		printf("Here is the dump of the sig:\n");
-		gcry_sexp_dump(sexp_input_data);
-	}
-	
 	//------------------------------------------------------------
 	//     VERIFY THE FILE
 	//
+	nm_timing_phase("verify");
+	NM_PROBE2(verify__entry, NM_PROBE_SITE_NM_VERIFY, input_data_len);
+	t0 = nm_stats_now_us();
 	err = gcry_pk_verify(sexp_signature, sexp_input_data, sexp_pub_key);
+	NM_PROBE3(verify__return, NM_PROBE_SITE_NM_VERIFY, input_data_len, err);
+	nm_stats_latency(NM_HIST_VERIFY, nm_stats_now_us() - t0);
+	nm_stats_add(err ? NM_STAT_VERIFY_FAILS : NM_STAT_VERIFY_OK, 1);
 	if(err){
 		fprintf (stderr, "Error. Verification failed: %s/%s\n",
 			gcry_strsource (err),
 			gcry_strerror (err));
 		return 903;
 	}else{
+		nm_timing_phase("output");
 		printf("Signature is confirmed\n");
 	}
 	